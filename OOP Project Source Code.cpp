@@ -13,6 +13,40 @@
 #include <sstream>
 #include <limits>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <cstring>
+#include <cstdint>
+#include <csignal>
+#include <condition_variable>
+#include <string_view>
+#include <unordered_map>
+#include <list>
+#include <deque>
+#include <cfloat>
+#include <cmath>
+#include <unordered_set>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <functional>
+#include <future>
+#include <coroutine>
+#include <utility>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 using namespace std;
 
 class DeviceException : public exception {
@@ -22,11 +56,620 @@ public:
     const char* what() const noexcept override { return errorMessage.c_str(); }
 };
 
+// Memory accounting by subsystem. Containers opt in through TrackingAllocator;
+// devices count their own objects and string buffers (see Device).
+enum class MemoryTag : uint8_t { Devices, DeviceStrings, Scheduler, Energy, Notifications, Count };
+
+const size_t MemoryTags = size_t(MemoryTag::Count);
+
+// One thread's counts for every subsystem. Only the thread holding the shard
+// writes it, so an allocation costs plain adds rather than shared atomics;
+// a shard freed by an exiting thread is handed to the next new one, keeping
+// its counts in the totals. (A thread may free what another allocated, so a
+// shard's live count alone can go negative.) The shared shard takes the
+// counts of threads whose own shard is already gone, so it adds atomically.
+struct MemoryShard {
+    atomic<int64_t> live[MemoryTags] = {};
+    atomic<int64_t> peak[MemoryTags] = {};  // highest live, raised on charge
+    atomic<uint64_t> allocations[MemoryTags] = {};
+    atomic<uint64_t> allocatedBytes[MemoryTags] = {};
+    bool held = false;
+    const bool shared;
+
+    MemoryShard(bool isShared = false) : held(isShared), shared(isShared) {}
+
+    template <class T> void add(atomic<T>& counter, T n) {
+        if (shared) counter.fetch_add(n, memory_order_relaxed);
+        else counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    void raisePeak(size_t tag) {
+        int64_t now = live[tag].load(memory_order_relaxed), high = peak[tag].load(memory_order_relaxed);
+        if (!shared) {
+            if (now > high) peak[tag].store(now, memory_order_relaxed);
+            return;
+        }
+        while (now > high && !peak[tag].compare_exchange_weak(high, now, memory_order_relaxed)) {}
+    }
+};
+
+class MemoryShards {
+    mutex lock;
+    vector<unique_ptr<MemoryShard>> shards;
+
+public:
+    MemoryShards() { shards.push_back(make_unique<MemoryShard>(true)); }
+
+    // Never handed out by acquire(), since it is held from the start.
+    MemoryShard& shared() { return *shards.front(); }
+
+    MemoryShard* acquire() {
+        lock_guard<mutex> guard(lock);
+        for (auto& shard : shards) {
+            if (!shard->held) {
+                shard->held = true;
+                return shard.get();
+            }
+        }
+        shards.push_back(make_unique<MemoryShard>());
+        shards.back()->held = true;
+        return shards.back().get();
+    }
+
+    void release(MemoryShard* shard) {
+        lock_guard<mutex> guard(lock);
+        shard->held = false;
+    }
+
+    template <class T> T sum(atomic<T> (MemoryShard::*counters)[MemoryTags], size_t tag) {
+        lock_guard<mutex> guard(lock);
+        T total = 0;
+        for (auto& shard : shards) total += ((*shard).*counters)[tag].load(memory_order_relaxed);
+        return total;
+    }
+};
+
+inline MemoryShards memoryShards;
+
+// The shard pointer and the flag are trivially destructible, so they stay
+// readable after the holder is destroyed: allocations made or freed by
+// thread_local destructors that run later go to the shared shard.
+struct MemoryShardHolder {
+    inline static thread_local MemoryShard* shard = nullptr;
+    inline static thread_local bool gone = false;
+
+    MemoryShardHolder() { shard = memoryShards.acquire(); }
+    ~MemoryShardHolder() {
+        memoryShards.release(shard);
+        shard = nullptr;
+        gone = true;
+    }
+};
+
+inline MemoryShard& localMemoryShard() {
+    if (MemoryShard* shard = MemoryShardHolder::shard) return *shard;
+    if (MemoryShardHolder::gone) return memoryShards.shared();
+    thread_local MemoryShardHolder holder;
+    return *MemoryShardHolder::shard;
+}
+
+// A subsystem's totals, summed over the shards when read. The peak is the
+// sum of the shards' own high-water marks: an upper bound on the highest
+// live total, exact while one thread does all the allocating.
+struct MemoryAccount {
+    MemoryTag tag;
+    atomic<int64_t> limit{0};  // bytes; 0 = none
+
+    void charge(size_t n) {
+        MemoryShard& shard = localMemoryShard();
+        shard.add(shard.live[size_t(tag)], int64_t(n));
+        shard.raisePeak(size_t(tag));
+        shard.add(shard.allocations[size_t(tag)], uint64_t(1));
+        shard.add(shard.allocatedBytes[size_t(tag)], uint64_t(n));
+    }
+
+    void credit(size_t n) {
+        MemoryShard& shard = localMemoryShard();
+        shard.add(shard.live[size_t(tag)], -int64_t(n));
+    }
+
+    int64_t live() { return memoryShards.sum(&MemoryShard::live, size_t(tag)); }
+    int64_t peak() { return memoryShards.sum(&MemoryShard::peak, size_t(tag)); }
+
+    uint64_t allocations() { return memoryShards.sum(&MemoryShard::allocations, size_t(tag)); }
+    uint64_t allocatedBytes() { return memoryShards.sum(&MemoryShard::allocatedBytes, size_t(tag)); }
+};
+
+inline MemoryAccount memoryAccounts[] = {{MemoryTag::Devices}, {MemoryTag::DeviceStrings}, {MemoryTag::Scheduler},
+                                         {MemoryTag::Energy}, {MemoryTag::Notifications}};
+static_assert(size(memoryAccounts) == MemoryTags);
+
+inline MemoryAccount& memoryAccount(MemoryTag tag) { return memoryAccounts[size_t(tag)]; }
+
+// Also the suffix of the memory_limit_* configuration keys.
+inline const char* memoryTagName(MemoryTag tag) {
+    static const char* names[] = {"devices", "device_strings", "scheduler", "energy", "notifications"};
+    return names[size_t(tag)];
+}
+
+template <class T, MemoryTag Tag>
+struct TrackingAllocator {
+    using value_type = T;
+    template <class U> struct rebind { using other = TrackingAllocator<U, Tag>; };
+
+    TrackingAllocator() = default;
+    template <class U> TrackingAllocator(const TrackingAllocator<U, Tag>&) {}
+
+    T* allocate(size_t n) {
+        T* p = allocator<T>().allocate(n);
+        memoryAccount(Tag).charge(n * sizeof(T));
+        return p;
+    }
+
+    void deallocate(T* p, size_t n) {
+        memoryAccount(Tag).credit(n * sizeof(T));
+        allocator<T>().deallocate(p, n);
+    }
+
+    bool operator==(const TrackingAllocator&) const { return true; }
+    bool operator!=(const TrackingAllocator&) const { return false; }
+};
+
+template <MemoryTag Tag>
+using TrackedString = basic_string<char, char_traits<char>, TrackingAllocator<char, Tag>>;
+
+template <class K, class V, MemoryTag Tag>
+using TrackedMap = map<K, V, less<K>, TrackingAllocator<pair<const K, V>, Tag>>;
+
+template <class K, class V, MemoryTag Tag>
+using TrackedHashMap = unordered_map<K, V, hash<K>, equal_to<K>, TrackingAllocator<pair<const K, V>, Tag>>;
+
+// Live and peak bytes per subsystem, and the allocation rate since the
+// previous report.
+class MemoryReport {
+    static const size_t Tags = size_t(MemoryTag::Count);
+    uint64_t lastAllocations[Tags] = {};
+    uint64_t lastBytes[Tags] = {};
+    chrono::steady_clock::time_point last = chrono::steady_clock::now();
+
+public:
+    static bool parseTag(string_view name, MemoryTag& tag) {
+        for (size_t i = 0; i < Tags; i++) {
+            if (name == memoryTagName(MemoryTag(i))) {
+                tag = MemoryTag(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static int64_t liveTotal() {
+        int64_t total = 0;
+        for (MemoryAccount& a : memoryAccounts) total += a.live();
+        return total;
+    }
+
+    static vector<MemoryTag> overLimit() {
+        vector<MemoryTag> over;
+        for (size_t i = 0; i < Tags; i++) {
+            int64_t limit = memoryAccounts[i].limit.load(memory_order_relaxed);
+            if (limit > 0 && memoryAccounts[i].live() > limit) over.push_back(MemoryTag(i));
+        }
+        return over;
+    }
+
+    void print(ostream& os) {
+        auto now = chrono::steady_clock::now();
+        double seconds = max(1e-3, chrono::duration<double>(now - last).count());
+        last = now;
+        ios state(nullptr);
+        state.copyfmt(os);
+        os << "\n--- Memory by Subsystem ---\n" << left << setw(16) << "subsystem" << right << setw(12) << "live KB"
+           << setw(12) << "peak KB" << setw(12) << "allocs/s" << setw(12) << "KB/s" << setw(12) << "limit KB" << "\n"
+           << fixed << setprecision(1);
+        int64_t live = 0;
+        for (size_t i = 0; i < Tags; i++) {
+            MemoryAccount& a = memoryAccounts[i];
+            uint64_t allocations = a.allocations();
+            uint64_t bytes = a.allocatedBytes();
+            int64_t l = a.live(), p = a.peak();
+            int64_t limit = a.limit.load(memory_order_relaxed);
+            os << left << setw(16) << memoryTagName(MemoryTag(i)) << right << setw(12) << l / 1024.0 << setw(12)
+               << p / 1024.0 << setw(12) << (allocations - lastAllocations[i]) / seconds << setw(12)
+               << (bytes - lastBytes[i]) / 1024.0 / seconds << setw(12);
+            if (limit > 0) os << limit / 1024.0;
+            else os << "-";
+            os << (limit > 0 && l > limit ? "  OVER\n" : "\n");
+            lastAllocations[i] = allocations;
+            lastBytes[i] = bytes;
+            live += l;
+        }
+        os << left << setw(16) << "total" << right << setw(12) << live / 1024.0 << "\n";
+        os.copyfmt(state);
+    }
+};
+
 class Room;
 class Device;
 class SmartHome;
 class User;  
 
+enum class DeviceEventType : uint8_t {
+    TurnedOn, TurnedOff,
+    BrightnessChanged, LightDimming,
+    RecordingStarted, RecordingStopped, MotionDetected, CameraMonitoring,
+    DoorLocked, DoorUnlocked, DoorStatus,
+    TargetTemperatureSet, ThermostatRegulating, AcCooling,
+    PowerDenied, LoadShed
+};
+
+// Fixed-size so publishing never allocates; names longer than the buffers are truncated.
+struct DeviceEvent {
+    DeviceEventType type;
+    bool flag;
+    float value;
+    float value2;
+    int64_t at;
+    int64_t atNs;  // the same instant in nanoseconds
+    int64_t ref;
+    char deviceID[32];
+    char deviceName[32];
+};
+
+template <size_t N>
+void copyField(char (&dst)[N], const string& src) {
+    size_t n = min(src.size(), N - 1);
+    memcpy(dst, src.data(), n);
+    dst[n] = '\0';
+}
+
+class EventSubscriber {
+public:
+    virtual void onEvents(const DeviceEvent* events, size_t count) = 0;
+    virtual ~EventSubscriber() {}
+};
+
+// Bounded multi-producer queue (Vyukov); all storage is allocated up front.
+class EventQueue {
+    struct Cell {
+        atomic<size_t> sequence;
+        DeviceEvent event;
+    };
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+public:
+    EventQueue(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1), head(0), tail(0) {
+        for (size_t i = 0; i < capacity; i++) cells[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    bool push(const DeviceEvent& ev) {
+        size_t pos = tail.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    cell.event = ev;
+                    cell.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(DeviceEvent& ev) {
+        size_t pos = head.load(memory_order_relaxed);
+        Cell& cell = cells[pos & mask];
+        size_t seq = cell.sequence.load(memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) return false;
+        ev = cell.event;
+        cell.sequence.store(pos + mask + 1, memory_order_release);
+        head.store(pos + 1, memory_order_relaxed);
+        return true;
+    }
+
+    // Consumer side; an event still being pushed counts as queued.
+    bool empty() const { return head.load(memory_order_relaxed) == tail.load(memory_order_acquire); }
+};
+
+class EventBus {
+    static const size_t MaxSubscribers = 8;
+    static const size_t BatchSize = 64;
+
+    struct Subscription {
+        EventSubscriber* subscriber;
+        EventQueue queue;
+        atomic<uint32_t> signal;
+        atomic<bool> sleeping;
+        atomic<uint64_t> published;
+        atomic<uint64_t> consumed;
+        thread worker;
+
+        Subscription(EventSubscriber* s, size_t capacity)
+            : subscriber(s), queue(capacity), signal(0), sleeping(false), published(0), consumed(0) {}
+    };
+
+    Subscription* subscriptions[MaxSubscribers];
+    atomic<size_t> subscriberCount;
+    atomic<bool> running;
+    size_t queueCapacity;
+
+    void consume(Subscription* sub) {
+        DeviceEvent batch[BatchSize];
+        while (true) {
+            size_t n = 0;
+            while (n < BatchSize && sub->queue.pop(batch[n])) n++;
+            if (n > 0) {
+                sub->subscriber->onEvents(batch, n);
+                sub->consumed.fetch_add(n, memory_order_release);
+                continue;
+            }
+            if (!running.load(memory_order_acquire)) break;
+            uint32_t seen = sub->signal.load();
+            sub->sleeping.store(true);
+            if (sub->consumed.load() == sub->published.load() && running.load())
+                sub->signal.wait(seen);
+            sub->sleeping.store(false);
+        }
+    }
+
+public:
+    EventBus(size_t capacity = 4096) : subscriberCount(0), running(true), queueCapacity(capacity) {}
+
+    // Subscribers must be registered before devices start publishing.
+    void subscribe(EventSubscriber* subscriber) {
+        size_t index = subscriberCount.load();
+        if (index == MaxSubscribers) throw DeviceException("Too many event subscribers");
+        Subscription* sub = new Subscription(subscriber, queueCapacity);
+        sub->worker = thread(&EventBus::consume, this, sub);
+        subscriptions[index] = sub;
+        subscriberCount.store(index + 1, memory_order_release);
+    }
+
+    bool hasSubscribers() const { return subscriberCount.load(memory_order_acquire) > 0; }
+
+    void publish(const DeviceEvent& ev) {
+        size_t count = subscriberCount.load(memory_order_acquire);
+        for (size_t i = 0; i < count; i++) {
+            Subscription* sub = subscriptions[i];
+            while (!sub->queue.push(ev)) this_thread::yield();
+            sub->published.fetch_add(1);
+            sub->signal.fetch_add(1);
+            if (sub->sleeping.load()) sub->signal.notify_one();
+        }
+    }
+
+    // Blocks until every subscriber has processed everything published so far.
+    void flush() {
+        size_t count = subscriberCount.load(memory_order_acquire);
+        for (size_t i = 0; i < count; i++) {
+            Subscription* sub = subscriptions[i];
+            uint64_t target = sub->published.load();
+            while (sub->consumed.load(memory_order_acquire) < target) this_thread::yield();
+        }
+    }
+
+    ~EventBus() {
+        running.store(false, memory_order_release);
+        size_t count = subscriberCount.load();
+        for (size_t i = 0; i < count; i++) {
+            subscriptions[i]->signal.fetch_add(1);
+            subscriptions[i]->signal.notify_one();
+            subscriptions[i]->worker.join();
+            delete subscriptions[i];
+        }
+    }
+};
+
+// Bloom filter over 64-bit key hashes: no false negatives, under 1% false
+// positives up to its capacity. Bits are never cleared, so removed keys
+// linger as extra positives until the filter is reset.
+class BloomFilter {
+    static const int Probes = 7;
+    vector<uint64_t> bits;
+    uint64_t mask = 0;
+    size_t limit = 0, count = 0;
+
+public:
+    static uint64_t hash(string_view key) {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char ch : key) h = (h ^ ch) * 1099511628211ULL;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        return h ^ (h >> 33);
+    }
+
+    BloomFilter(size_t capacity = 1024) { reset(capacity); }
+
+    // At least 10 bits per key, rounded up to a power of two.
+    void reset(size_t capacity) {
+        size_t n = 64;
+        while (n < capacity * 10) n <<= 1;
+        bits.assign(n / 64, 0);
+        mask = n - 1;
+        limit = capacity;
+        count = 0;
+    }
+
+    void add(uint64_t h) {
+        uint64_t step = (h >> 32) | 1;
+        for (int i = 0; i < Probes; i++, h += step) bits[(h & mask) >> 6] |= uint64_t(1) << (h & 63);
+        count++;
+    }
+
+    bool mayContain(uint64_t h) const {
+        uint64_t step = (h >> 32) | 1;
+        for (int i = 0; i < Probes; i++, h += step)
+            if (!((bits[(h & mask) >> 6] >> (h & 63)) & 1)) return false;
+        return true;
+    }
+
+    bool full() const { return count >= limit; }
+};
+
+// Secondary indexes over every device attached to a room. Devices get a
+// dense handle; per-type, per-location and per-room posting lists plus
+// status/lock bitmaps over those handles are updated in O(1) on each
+// mutation, so filtered queries never visit unrelated devices.
+class DeviceIndex {
+public:
+    static const uint32_t NoHandle = 0xffffffff;
+
+    struct Slot {
+        Device* device;
+        Room* room;
+        uint32_t typeList, typePos;
+        uint32_t locationList, locationPos;
+        uint32_t roomList, roomPos;
+    };
+
+    void add(Device* device, Room* room);
+    void remove(Device* device);
+    void statusChanged(Device* device);
+    void lockChanged(Device* device);
+    void locationChanged(Device* device, const string& oldLocation);
+
+    Device* findByID(const string& id) const;
+    size_t size() const { return byID.size(); }
+
+    // False means no indexed device has an ID with this BloomFilter::hash,
+    // without touching the ID map.
+    bool mayContainID(uint64_t idHash) const { return idFilter.mayContain(idHash); }
+
+private:
+    friend class DeviceQuery;
+
+    vector<Slot> slots;
+    vector<uint32_t> freeHandles;
+    vector<vector<uint32_t>> lists;
+    vector<uint32_t> freeLists;
+    unordered_map<string, uint32_t> typeLists, locationLists;
+    unordered_map<Room*, uint32_t> roomLists;
+    unordered_map<string, uint32_t> byID;
+    BloomFilter idFilter;
+    vector<uint64_t> liveBits, onBits, lockedBits;
+    unordered_map<uint32_t, vector<uint64_t>> typeBits;
+
+    static void setBit(vector<uint64_t>& bits, uint32_t h, bool value) {
+        if (value) bits[h >> 6] |= uint64_t(1) << (h & 63);
+        else bits[h >> 6] &= ~(uint64_t(1) << (h & 63));
+    }
+    static bool testBit(const vector<uint64_t>& bits, uint32_t h) { return (bits[h >> 6] >> (h & 63)) & 1; }
+
+    uint32_t newList() {
+        if (!freeLists.empty()) {
+            uint32_t id = freeLists.back();
+            freeLists.pop_back();
+            return id;
+        }
+        lists.emplace_back();
+        return lists.size() - 1;
+    }
+
+    template <typename Key>
+    uint32_t listFor(unordered_map<Key, uint32_t>& names, const Key& key) {
+        auto it = names.find(key);
+        if (it != names.end()) return it->second;
+        uint32_t id = newList();
+        names.emplace(key, id);
+        return id;
+    }
+
+    uint32_t append(uint32_t list, uint32_t handle) {
+        lists[list].push_back(handle);
+        return lists[list].size() - 1;
+    }
+
+    // Swap-remove; the handle moved into the hole gets its position fixed.
+    void erase(uint32_t list, uint32_t pos, uint32_t Slot::*listField, uint32_t Slot::*posField) {
+        vector<uint32_t>& items = lists[list];
+        uint32_t moved = items.back();
+        items[pos] = moved;
+        items.pop_back();
+        if (slots[moved].*listField == list) slots[moved].*posField = pos;
+    }
+
+    template <typename Key>
+    void releaseIfEmpty(unordered_map<Key, uint32_t>& names, const Key& key) {
+        auto it = names.find(key);
+        if (it != names.end() && lists[it->second].empty()) {
+            freeLists.push_back(it->second);
+            names.erase(it);
+        }
+    }
+};
+
+// Power drawn and budgeted at one level of the home, in milliwatts. A
+// node's draw is the total of the switched-on devices below it, so
+// admitting a device only touches its chain of parents.
+struct PowerNode {
+    enum class Level : uint8_t { Device, Room, User, Home };
+    Level level;
+    void* owner;
+    PowerNode* parent = nullptr;
+    atomic<int64_t> drawMw{0};
+    atomic<int64_t> limitMw{0};  // 0 = no budget
+
+    PowerNode(Level l, void* o) : level(l), owner(o) {}
+
+    // Adds mw here and to every ancestor unless one would go over its
+    // limit; returns the node that refused, or nullptr. Lock-free: one CAS
+    // per level, undone on refusal.
+    PowerNode* reserve(int64_t mw) {
+        for (PowerNode* n = this; n; n = n->parent) {
+            int64_t draw = n->drawMw.load(memory_order_relaxed);
+            do {
+                int64_t limit = n->limitMw.load(memory_order_relaxed);
+                if (limit > 0 && draw + mw > limit) {
+                    for (PowerNode* m = this; m != n; m = m->parent) m->drawMw.fetch_sub(mw, memory_order_relaxed);
+                    return n;
+                }
+            } while (!n->drawMw.compare_exchange_weak(draw, draw + mw, memory_order_relaxed));
+        }
+        return nullptr;
+    }
+
+    void add(int64_t mw) {
+        for (PowerNode* n = this; n; n = n->parent) n->drawMw.fetch_add(mw, memory_order_relaxed);
+    }
+
+    // Moves the node under a new parent, carrying its draw along.
+    void attachTo(PowerNode* newParent) {
+        int64_t draw = drawMw.load(memory_order_relaxed);
+        if (parent) parent->add(-draw);
+        parent = newParent;
+        if (parent) parent->add(draw);
+    }
+};
+
+// Decides what happens when a device doesn't fit its budgets, and assigns
+// limits as rooms and users join the home (see PowerBudget).
+class PowerPolicy {
+public:
+    // Called when `over` refused mw for device; true if room was made.
+    virtual bool makeRoom(Device* device, PowerNode* over, int64_t mw) = 0;
+    virtual void deviceAdded(Device* device) = 0;
+    virtual void roomAdded(User* user, Room* room) = 0;
+    virtual void userAdded(User* user) = 0;
+    virtual ~PowerPolicy() {}
+};
+
+// Where devices report their changes. One set serves the whole process; a
+// thread that owns its devices outright (a ShardedHome shard) confines its
+// own, so its devices never touch another thread's index or bus.
+struct DeviceHooks {
+    EventBus* eventBus = nullptr;
+    DeviceIndex* index = nullptr;
+    PowerPolicy* budget = nullptr;
+};
+
 class Device {
 protected:
     string deviceID;
@@ -34,14 +677,134 @@ protected:
     bool status;
     string deviceType;
     string location;
+
+    friend class DeviceIndex;
+    uint32_t indexHandle = DeviceIndex::NoHandle;
+    uint64_t version;
+    int64_t reservedMw = 0;  // held against the budgets while on
+
+    // Stamps the device as changed. Each device counts its own changes in the
+    // low half, above a birth number in the high half, so a device allocated
+    // where a deleted one was never repeats one of its stamps.
+    void touch() { version++; }
+
+    void publish(DeviceEventType type, float value = 0.0f, float value2 = 0.0f, bool flag = false, int64_t ref = 0) {
+        touch();
+        EventBus* eventBus = hooks().eventBus;
+        if (!eventBus || !eventBus->hasSubscribers()) return;
+        DeviceEvent ev;
+        ev.type = type;
+        ev.flag = flag;
+        ev.value = value;
+        ev.value2 = value2;
+        ev.atNs = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        ev.at = ev.atNs / 1000000000;
+        ev.ref = ref;
+        copyField(ev.deviceID, deviceID);
+        copyField(ev.deviceName, deviceName);
+        eventBus->publish(ev);
+    }
+
+    // Short strings live inside the string object; only longer ones cost heap.
+    static size_t heapBytes(const string& s) {
+        const char* p = s.data();
+        bool inside = p >= (const char*)&s && p < (const char*)(&s + 1);
+        return inside ? 0 : s.capacity() + 1;
+    }
+
+    static void trackString(const string& s, bool add) {
+        if (size_t n = heapBytes(s)) {
+            if (add) memoryAccount(MemoryTag::DeviceStrings).charge(n);
+            else memoryAccount(MemoryTag::DeviceStrings).credit(n);
+        }
+    }
+
+    void trackStrings(bool add) {
+        for (const string* s : {&deviceID, &deviceName, &deviceType, &location}) trackString(*s, add);
+    }
+    inline static DeviceHooks sharedHooks;
+    inline static thread_local DeviceHooks* confinedHooks = nullptr;
+
 public:
+    inline static atomic<uint64_t> births{0};
     float powerConsumption;
+    PowerNode power{PowerNode::Level::Device, this};
 
     Device(string id, string name, string type, string loc)
-        : deviceID(id), deviceName(name), deviceType(type), location(loc), status(false) {}
+        : deviceID(id), deviceName(name), deviceType(type), location(loc), status(false), powerConsumption(0.0f) {
+        version = (births.fetch_add(1, memory_order_relaxed) + 1) << 32;
+        trackStrings(true);
+    }
+
+    // Devices are charged to their subsystem at their full (derived) size.
+    static void* operator new(size_t n) {
+        void* p = ::operator new(n);
+        memoryAccount(MemoryTag::Devices).charge(n);
+        return p;
+    }
+    static void operator delete(void* p, size_t n) {
+        memoryAccount(MemoryTag::Devices).credit(n);
+        ::operator delete(p, n);
+    }
+
+    static void attachEventBus(EventBus* bus) { sharedHooks.eventBus = bus; }
+    static void attachIndex(DeviceIndex* idx) { sharedHooks.index = idx; }
+    static void attachBudget(PowerPolicy* policy) { sharedHooks.budget = policy; }
+    // Devices used on this thread report to own instead; null goes back to the shared set.
+    static void confineHooks(DeviceHooks* own) { confinedHooks = own; }
+    static DeviceHooks& hooks() { return confinedHooks ? *confinedHooks : sharedHooks; }
+
+    // Switching on reserves the device's power against every budget above
+    // it; returns false (and leaves the device off) if one refuses.
+    bool turnOn() { return switchOn(true); }
+    // Saved state was within budget when it was saved, so restoring it isn't refused.
+    void restoreOn() { switchOn(false); }
+
+protected:
+    bool switchOn(bool admit) {
+        if (!status) {
+            int64_t mw = llround(double(powerConsumption) * 1e6);
+            PowerNode* over = nullptr;
+            if (admit) over = power.reserve(mw);
+            else power.add(mw);
+            // Shedding can free one level only for another to refuse; retry per level.
+            for (int tries = 0; over && tries < 4 && hooks().budget && hooks().budget->makeRoom(this, over, mw); tries++)
+                over = power.reserve(mw);
+            if (over) {
+                publish(DeviceEventType::PowerDenied, powerConsumption);
+                return false;
+            }
+            reservedMw = mw;
+        }
+        status = true;
+        if (indexHandle != DeviceIndex::NoHandle) hooks().index->statusChanged(this);
+        publish(DeviceEventType::TurnedOn, powerConsumption);
+        return true;
+    }
+
+public:
+    void turnOff() {
+        if (status) power.add(-reservedMw);
+        reservedMw = 0;
+        status = false;
+        if (indexHandle != DeviceIndex::NoHandle) hooks().index->statusChanged(this);
+        publish(DeviceEventType::TurnedOff, powerConsumption);
+    }
+    int64_t reservedPower() const { return reservedMw; }
 
-     void turnOn() { status = true; }
-     void turnOff() { status = false; }
+    // Switched off by demand response.
+    void shed() {
+        turnOff();
+        publish(DeviceEventType::LoadShed, powerConsumption);
+    }
+
+    // A scheduled action switches the device on first, so it is subject to
+    // the same budgets; false if it was refused.
+    bool runScheduledAction() {
+        if (!status && !turnOn()) return false;
+        performAction();
+        return true;
+    }
     virtual bool getStatus() { return status; }
 
     string getDeviceID() const { return deviceID; }
@@ -49,18 +812,35 @@ public:
     string getLocation() const { return location; }
     string getDeciceType() const { return deviceType; }
 
-    void setLocation(string loc) { location = loc; }
+    void setLocation(string loc) {
+        string old = location;
+        trackString(location, false);
+        location = loc;
+        trackString(location, true);
+        touch();
+        if (indexHandle != DeviceIndex::NoHandle) hooks().index->locationChanged(this, old);
+    }
+
+    uint64_t getVersion() const { return version; }
 
     virtual string getDeviceInfo() {
-        return "ID: " + deviceID + "\nName: " + deviceName + "\nType: " + deviceType +
-               "\nLocation: " + location + "\nStatus: " + (status ? "On" : "Off");
-               
+        string info;
+        appendDeviceInfo(info);
+        return info;
+    }
+    // The same text, appended in place for callers building a larger buffer.
+    void appendDeviceInfo(string& out) const {
+        out.append("ID: ").append(deviceID).append("\nName: ").append(deviceName).append("\nType: ").append(deviceType);
+        out.append("\nLocation: ").append(location).append("\nStatus: ").append(status ? "On" : "Off");
     }
     float getEnergyUsage(float hoursUsed) const {
     return powerConsumption * hoursUsed; 
 }
     virtual void performAction() = 0; 
     virtual ~Device(){
+        if (hooks().index && indexHandle != DeviceIndex::NoHandle) hooks().index->remove(this);
+        power.attachTo(nullptr);
+        trackStrings(false);
 	}
 };
 
@@ -72,11 +852,11 @@ public:
     Light(string id, string name, string loc)
         : Device(id, name, "Light", loc), brightnessLevel(0.0) {}
 
-    void setBrightness(float level) { brightnessLevel = level; }
+    void setBrightness(float level) { brightnessLevel = level; publish(DeviceEventType::BrightnessChanged, level); }
     float getBrightness() { return brightnessLevel; }
 
     void performAction() override {
-        cout << "Light (" << deviceName << ") dimming to " << brightnessLevel << "% brightness." << endl;
+        publish(DeviceEventType::LightDimming, brightnessLevel);
     }
 };
 
@@ -84,38 +864,42 @@ class Camera : public Device {
 private:
     bool isRecording;
     bool motionDetected;
-    string lastMotionTime;
+    int64_t lastMotionNs;
 
 public:
     Camera(string id, string name, string loc)
-        : Device(id, name, "Camera", loc), isRecording(false), motionDetected(false), lastMotionTime("") {}
+        : Device(id, name, "Camera", loc), isRecording(false), motionDetected(false), lastMotionNs(0) {}
 
     void startRecording() {
         isRecording = true;
-        cout << "Camera (" << deviceName << ") has started recording." << endl;
+        publish(DeviceEventType::RecordingStarted);
     }
 
     void stopRecording() {
         isRecording = false;
-        cout << "Camera (" << deviceName << ") has stopped recording." << endl;
+        publish(DeviceEventType::RecordingStopped);
     }
 
-    void detectMotion() {
+    // atNs is when the camera saw it, in ns since the epoch; 0 means now.
+    void detectMotion(int64_t atNs = 0) {
         motionDetected = true;
-        time_t now = time(0);
-        lastMotionTime = ctime(&now);
-        cout << "Motion detected by Camera (" << deviceName << ") at " << lastMotionTime;
+        lastMotionNs = atNs ? atNs : chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        publish(DeviceEventType::MotionDetected, 0.0f, 0.0f, true, lastMotionNs / 1000000000);
     }
 
-    string getLastMotionTime() { return lastMotionTime; }
+    bool recording() const { return isRecording; }
+    bool sawMotion() const { return motionDetected; }
+    int64_t lastMotionAt() const { return lastMotionNs; }
+
+    string getLastMotionTime() {
+        if (!motionDetected) return "";
+        char buf[32];
+        time_t at = lastMotionNs / 1000000000;
+        return ctime_r(&at, buf);
+    }
 
     void performAction() override {
-        cout << "Camera (" << deviceName << ") is monitoring the area." << endl;
-        if (motionDetected) {
-            cout << "Last motion: " << lastMotionTime;
-        } else {
-            cout << "No motion detected." << endl;
-        }
+        publish(DeviceEventType::CameraMonitoring, 0.0f, 0.0f, motionDetected, lastMotionNs / 1000000000);
     }
 };
 
@@ -127,13 +911,20 @@ public:
     DoorLock(string id, string name, string loc)
         : Device(id, name, "Door Lock", loc), isLocked(true) {}
 
-    void lockDoor() { isLocked = true; cout << "Door locked.\n"; }
-    void unlockDoor() { isLocked = false; cout << "Door unlocked.\n"; }
+    void lockDoor() { restoreLocked(true); publish(DeviceEventType::DoorLocked, 0.0f, 0.0f, true); }
+    void unlockDoor() { restoreLocked(false); publish(DeviceEventType::DoorUnlocked); }
+
+    // Sets the lock state without announcing it (used when loading saved state).
+    void restoreLocked(bool locked) {
+        isLocked = locked;
+        touch();
+        if (indexHandle != DeviceIndex::NoHandle) hooks().index->lockChanged(this);
+    }
 
-    bool checkLockStatus() { return isLocked ? "Locked" : "Unlocked"; }
+    bool checkLockStatus() { return isLocked; }
 
     void performAction() override {
-        cout << "DoorLock (" << deviceName << ") is " << (isLocked ? "Locked." : "Unlocked.") << endl;
+        publish(DeviceEventType::DoorStatus, 0.0f, 0.0f, isLocked);
     }
     ~DoorLock() {
 	}
@@ -148,12 +939,14 @@ public:
     TemperatureControlledDevices(string id, string name, string type, string loc)
         : Device(id, name, type, loc), currentTemperature(25.0f), targetTemperature(25.0f) {}
 
-    void setTemperature(float temp) { targetTemperature = temp; }
+    void setTemperature(float temp) { targetTemperature = temp; publish(DeviceEventType::TargetTemperatureSet, temp, currentTemperature); }
     float getCurrentTemperature() const { return currentTemperature; }
+    float getTargetTemperature() const { return targetTemperature; }
 
     virtual void adjustTemperature() {
         if (currentTemperature < targetTemperature) currentTemperature += 1.0f;
         else if (currentTemperature > targetTemperature) currentTemperature -= 1.0f;
+        touch();
     }
 
     void performAction() override {}
@@ -170,7 +963,7 @@ public:
         : TemperatureControlledDevices (id, name, "Thermostat", loc), currentTemperature(50.0), targetTemperature(50.0) {}
 
     void performAction() override {
-        cout << "Thermostat (" << deviceName << ") is regulating temperature." << endl;
+        publish(DeviceEventType::ThermostatRegulating, TemperatureControlledDevices::targetTemperature, TemperatureControlledDevices::currentTemperature);
         adjustTemperature();
     }
 };
@@ -182,76 +975,452 @@ public:
 
     void performAction() override {
         adjustTemperature();
-        cout << "AC (" << deviceName << ") cooling to " << targetTemperature << "°C. Current: " << currentTemperature << "°C\n";
+        publish(DeviceEventType::AcCooling, targetTemperature, currentTemperature);
     }
 };
 
-class Notification {
-    vector<string> notifications;
+enum class AlertSeverity : uint8_t { Info, Warning, Critical };
+
+uint64_t alertKey(string_view source, uint8_t severity, string_view message = {}) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char ch : source) h = (h ^ ch) * 1099511628211ULL;
+    h = (h ^ (0x100 | severity)) * 1099511628211ULL;
+    for (unsigned char ch : message) h = (h ^ ch) * 1099511628211ULL;
+    return h;
+}
+
+// Fixed-size, set-associative table of per-key alert state. Each key may sit
+// in any of the Ways slots of its set, identified by a tag; a full set reuses
+// its least recently touched slot. Under pressure the table forgets quiet
+// keys (which then start fresh) instead of growing.
+class AlertTable {
 public:
-    void sendAlert(string msg) { notifications.push_back(msg); }
-    void viewAlerts() {
-        for (string alert : notifications)
-            cout << "Alert: " << alert << endl;
+    struct Slot {
+        uint32_t tag;
+        float level;        // leaky-bucket fill
+        int64_t touchedMs;  // last update, for draining
+        int64_t admittedMs; // last alert let through, for dedup windows
+    };
+    static const size_t Sets = 4096;
+    static const size_t Ways = 4;
+
+    AlertTable() : slots(Sets * Ways, Slot{0, 0.0f, 0, 0}) {}
+
+    Slot& find(uint64_t key, int64_t now) {
+        uint32_t tag = uint32_t(key >> 32) | 1;
+        Slot* set = &slots[(key % Sets) * Ways];
+        Slot* oldest = set;
+        for (size_t w = 0; w < Ways; w++) {
+            if (set[w].tag == tag) return set[w];
+            if (set[w].touchedMs < oldest->touchedMs) oldest = &set[w];
+        }
+        *oldest = Slot{tag, 0.0f, now, INT64_MIN / 2};
+        return *oldest;
     }
-    ~Notification() {}
-};
 
-class Room {
 private:
-    string roomName;
-    vector<Device*> devices;
+    vector<Slot> slots;
+};
+
+// Count-min sketch of suppressed alerts per key. Counts can only be
+// overstated by collisions, and memory is fixed however many keys appear.
+class CountMinSketch {
+    static const size_t Depth = 4;
+    static const size_t Width = 2048;
+    vector<uint32_t> counts;
+
+    void locate(uint64_t key, uint32_t* out[Depth]) {
+        uint64_t step = (key >> 32) | 1;
+        for (size_t row = 0; row < Depth; row++)
+            out[row] = &counts[row * Width + (key + row * step) % Width];
+    }
 
 public:
-    Room(string name) : roomName(name) {}
-    
-    string getRoomName() {
-        return roomName;
+    CountMinSketch() : counts(Depth * Width, 0) {}
+
+    void add(uint64_t key, uint32_t n = 1) {
+        uint32_t* cells[Depth];
+        locate(key, cells);
+        for (uint32_t* c : cells) *c += n;
     }
-    
-    void addDevice(Device* device) {
-        devices.push_back(device);
+
+    uint32_t estimate(uint64_t key) {
+        uint32_t* cells[Depth];
+        locate(key, cells);
+        uint32_t n = UINT32_MAX;
+        for (uint32_t* c : cells) n = min(n, *c);
+        return n;
     }
 
-    void removeDevice(string ID) {
-        auto it = remove_if(devices.begin(), devices.end(), [&](Device* d) {
-            return d->getDeviceID() == ID;
-        });
-        if (it != devices.end()) {
-            devices.erase(it, devices.end());
-        }
+    void subtract(uint64_t key, uint32_t n) {
+        uint32_t* cells[Depth];
+        locate(key, cells);
+        for (uint32_t* c : cells) *c -= min(*c, n);
+    }
+};
+
+// Stores alerts for review, coalescing storms: a repeat of the same alert
+// from the same source inside its dedup window is dropped, and each source
+// and severity is rate limited by a leaky bucket. Dropped alerts are counted
+// and reported as "N similar alerts suppressed" summaries.
+class Notification : public EventSubscriber {
+    struct Policy {
+        double dedupSec;
+        float burst;
+        float perSec;
+    };
+    // A few of the noisiest sources, so their pending counts can be summarized
+    // even if they never get another alert through.
+    struct HeavyHitter {
+        string source;
+        uint64_t key = 0;
+    };
+    static const size_t MaxAlerts = 1000;
+    static const size_t HeavyHitters = 16;
+
+    using Message = TrackedString<MemoryTag::Notifications>;
+
+    deque<Message, TrackingAllocator<Message, MemoryTag::Notifications>> notifications;
+    AlertTable state;
+    CountMinSketch suppressed;
+    Policy policies[3] = {{60, 3, 1.0f / 60}, {10, 5, 0.1f}, {0, 20, 1}};
+    HeavyHitter hitters[HeavyHitters];
+    mutex lock;
+
+    static int64_t nowMs() {
+        // Wall clock, to match the timestamps carried by device events.
+        return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
     }
 
-    Device* getDevicesByName(string name) {
-        for (Device* d : devices) {
-            if (d->getDeviceName() == name) {
-                return d;
-            }
+    void store(Message msg) {
+        if (notifications.size() == MaxAlerts) notifications.pop_front();
+        notifications.push_back(move(msg));
+    }
+
+    void trackHitter(string_view source, uint64_t key) {
+        HeavyHitter* weakest = nullptr;
+        uint32_t weakestCount = UINT32_MAX;
+        for (HeavyHitter& h : hitters) {
+            if (h.key == key && !h.source.empty()) return;
+            uint32_t n = h.source.empty() ? 0 : suppressed.estimate(h.key);
+            if (n < weakestCount) { weakest = &h; weakestCount = n; }
         }
-        return nullptr;
+        if (weakestCount < suppressed.estimate(key)) *weakest = HeavyHitter{string(source), key};
     }
-    vector<Device*> getDevices() {
-    return devices;
-}
-    void displayDevices() const {
-        cout << "Devices in room '" << roomName << "':\n";
-        for (Device* d : devices) {
-            cout << d->getDeviceInfo() << "\n\n";
+
+    // Returns whether the alert goes through; `summarized` is how many earlier
+    // alerts from this source were dropped and are now being reported.
+    bool admit(string_view source, AlertSeverity severity, string_view message, int64_t now, uint32_t& summarized) {
+        const Policy& policy = policies[size_t(severity)];
+        summarized = 0;
+        AlertTable::Slot& seen = state.find(alertKey(source, uint8_t(severity), message), now);
+        seen.touchedMs = max(seen.touchedMs, now);
+        uint64_t key = alertKey(source, uint8_t(severity));
+        AlertTable::Slot& bucket = state.find(key, now);
+        bucket.level = max(0.0f, bucket.level - policy.perSec * float(now - bucket.touchedMs) / 1000.0f);
+        bucket.touchedMs = max(bucket.touchedMs, now);
+
+        bool duplicate = policy.dedupSec > 0 && now - seen.admittedMs < int64_t(policy.dedupSec * 1000);
+        if (duplicate || bucket.level + 1 > policy.burst) {
+            suppressed.add(key);
+            suppressedTotal++;
+            trackHitter(source, key);
+            return false;
         }
+        bucket.level += 1;
+        seen.admittedMs = now;
+        summarized = suppressed.estimate(key);
+        if (summarized) suppressed.subtract(key, summarized);
+        return true;
     }
 
-    ~Room() {
-        for (Device* d : devices) delete d;
+public:
+    uint64_t admittedTotal = 0;
+    uint64_t suppressedTotal = 0;
+
+    void setPolicy(AlertSeverity severity, double dedupSec, float burst, float perSec) {
+        lock_guard<mutex> guard(lock);
+        policies[size_t(severity)] = Policy{dedupSec, burst, perSec};
     }
-};
 
-    class User {
-        string UserID, UserName, Password;
-        map<string, Room*> rooms;
-    public:
-    User(string uname, string pwd) : UserName(uname), Password(pwd) {}
-    void registerAccount() { cout << "Account registered for " << UserName << endl; }
-    bool authenticate(const string& inputPassword) {        
+    // The message (`what` followed by `subject`) is only built once the alert
+    // is admitted. atMs defaults to the current time.
+    bool sendAlert(string_view source, AlertSeverity severity, string_view what, string_view subject = {},
+                   int64_t atMs = -1) {
+        lock_guard<mutex> guard(lock);
+        uint32_t summarized;
+        if (!admit(source, severity, what, atMs < 0 ? nowMs() : atMs, summarized)) return false;
+        admittedTotal++;
+        Message msg;
+        msg.reserve(what.size() + subject.size() + 40);
+        msg.append(what).append(subject);
+        if (summarized) msg += " (" + to_string(summarized) + " similar alerts suppressed)";
+        store(move(msg));
+        return true;
+    }
+
+    void sendAlert(string msg) { sendAlert(msg, AlertSeverity::Info, msg); }
+
+    // Reports sources still holding suppressed alerts that were never summarized.
+    void flushSummaries() {
+        lock_guard<mutex> guard(lock);
+        for (HeavyHitter& h : hitters) {
+            if (h.source.empty()) continue;
+            if (uint32_t n = suppressed.estimate(h.key)) {
+                store(Message(to_string(n) + " similar alerts from " + h.source + " suppressed"));
+                suppressed.subtract(h.key, n);
+            }
+            h = HeavyHitter{};
+        }
+    }
+
+    size_t size() {
+        lock_guard<mutex> guard(lock);
+        return notifications.size();
+    }
+
+    void viewAlerts() {
+        flushSummaries();
+        lock_guard<mutex> guard(lock);
+        for (const Message& alert : notifications)
+            cout << "Alert: " << alert << endl;
+    }
+
+    void onEvents(const DeviceEvent* events, size_t count) override {
+        for (size_t i = 0; i < count; i++) {
+            const DeviceEvent& ev = events[i];
+            if (ev.type == DeviceEventType::MotionDetected)
+                sendAlert(ev.deviceID, AlertSeverity::Warning, "Motion detected by ", ev.deviceName, ev.at * 1000);
+            else if (ev.type == DeviceEventType::LoadShed)
+                sendAlert(ev.deviceID, AlertSeverity::Warning, "Demand response switched off ", ev.deviceName, ev.at * 1000);
+        }
+    }
+    ~Notification() {}
+};
+
+// Prints device activity; only attached when someone is watching the console.
+class ConsoleRenderer : public EventSubscriber {
+    string buffer;
+
+    static void appendFloat(string& out, float v) {
+        char num[32];
+        snprintf(num, sizeof(num), "%g", v);
+        out += num;
+    }
+
+    void render(const DeviceEvent& ev) {
+        switch (ev.type) {
+            case DeviceEventType::LightDimming:
+                buffer += "Light ("; buffer += ev.deviceName; buffer += ") dimming to ";
+                appendFloat(buffer, ev.value); buffer += "% brightness.\n";
+                break;
+            case DeviceEventType::RecordingStarted:
+                buffer += "Camera ("; buffer += ev.deviceName; buffer += ") has started recording.\n";
+                break;
+            case DeviceEventType::RecordingStopped:
+                buffer += "Camera ("; buffer += ev.deviceName; buffer += ") has stopped recording.\n";
+                break;
+            case DeviceEventType::MotionDetected: {
+                char when[32];
+                time_t t = ev.ref;
+                buffer += "Motion detected by Camera ("; buffer += ev.deviceName; buffer += ") at ";
+                buffer += ctime_r(&t, when);
+                break;
+            }
+            case DeviceEventType::CameraMonitoring:
+                buffer += "Camera ("; buffer += ev.deviceName; buffer += ") is monitoring the area.\n";
+                if (ev.flag) {
+                    char when[32];
+                    time_t t = ev.ref;
+                    buffer += "Last motion: "; buffer += ctime_r(&t, when);
+                } else {
+                    buffer += "No motion detected.\n";
+                }
+                break;
+            case DeviceEventType::PowerDenied:
+                buffer += "Power budget refused "; buffer += ev.deviceName; buffer += " (";
+                appendFloat(buffer, ev.value); buffer += " kW).\n";
+                break;
+            case DeviceEventType::LoadShed:
+                buffer += ev.deviceName; buffer += " switched off to stay within the power budget.\n";
+                break;
+            case DeviceEventType::DoorLocked: buffer += "Door locked.\n"; break;
+            case DeviceEventType::DoorUnlocked: buffer += "Door unlocked.\n"; break;
+            case DeviceEventType::DoorStatus:
+                buffer += "DoorLock ("; buffer += ev.deviceName; buffer += ") is ";
+                buffer += ev.flag ? "Locked.\n" : "Unlocked.\n";
+                break;
+            case DeviceEventType::ThermostatRegulating:
+                buffer += "Thermostat ("; buffer += ev.deviceName; buffer += ") is regulating temperature.\n";
+                break;
+            case DeviceEventType::AcCooling:
+                buffer += "AC ("; buffer += ev.deviceName; buffer += ") cooling to ";
+                appendFloat(buffer, ev.value); buffer += "°C. Current: ";
+                appendFloat(buffer, ev.value2); buffer += "°C\n";
+                break;
+            default:
+                break;
+        }
+    }
+
+public:
+    void onEvents(const DeviceEvent* events, size_t count) override {
+        buffer.clear();
+        for (size_t i = 0; i < count; i++) render(events[i]);
+        if (!buffer.empty()) {
+            cout.write(buffer.data(), buffer.size());
+            cout.flush();
+        }
+    }
+};
+
+class Room {
+private:
+    string roomName;
+    vector<Device*> devices;
+
+public:
+    PowerNode power{PowerNode::Level::Room, this};
+
+    Room(string name) : roomName(name) {}
+    
+    string getRoomName() {
+        return roomName;
+    }
+    
+    void addDevice(Device* device) {
+        devices.push_back(device);
+        if (DeviceIndex* index = Device::hooks().index) index->add(device, this);
+        device->power.attachTo(&power);
+        if (PowerPolicy* budget = Device::hooks().budget) budget->deviceAdded(device);
+    }
+
+    // Device IDs are unique across the home, so at most one matches.
+    void removeDevice(string ID) {
+        auto it = find_if(devices.begin(), devices.end(), [&](Device* d) { return d->getDeviceID() == ID; });
+        if (it == devices.end()) return;
+        if (DeviceIndex* index = Device::hooks().index) index->remove(*it);
+        (*it)->power.attachTo(nullptr);
+        devices.erase(it);
+    }
+
+    Device* getDevicesByName(string name) {
+        for (Device* d : devices) {
+            if (d->getDeviceName() == name) {
+                return d;
+            }
+        }
+        return nullptr;
+    }
+    vector<Device*> getDevices() {
+    return devices;
+}
+    void displayDevices() const {
+        cout << "Devices in room '" << roomName << "':\n";
+        for (Device* d : devices) {
+            cout << d->getDeviceInfo() << "\n\n";
+        }
+    }
+
+    ~Room() {
+        for (Device* d : devices) delete d;
+    }
+};
+
+void DeviceIndex::add(Device* device, Room* room) {
+    if (device->indexHandle != NoHandle) remove(device);
+    uint32_t h;
+    if (!freeHandles.empty()) {
+        h = freeHandles.back();
+        freeHandles.pop_back();
+    } else {
+        h = slots.size();
+        slots.emplace_back();
+        if ((h >> 6) >= liveBits.size()) {
+            liveBits.push_back(0);
+            onBits.push_back(0);
+            lockedBits.push_back(0);
+        }
+    }
+    device->indexHandle = h;
+    Slot& slot = slots[h];
+    slot.device = device;
+    slot.room = room;
+    slot.typeList = listFor(typeLists, device->deviceType);
+    slot.typePos = append(slot.typeList, h);
+    vector<uint64_t>& ofType = typeBits[slot.typeList];
+    if (ofType.size() < liveBits.size()) ofType.resize(liveBits.size());
+    setBit(ofType, h, true);
+    slot.locationList = listFor(locationLists, device->location);
+    slot.locationPos = append(slot.locationList, h);
+    slot.roomList = listFor(roomLists, room);
+    slot.roomPos = append(slot.roomList, h);
+    byID[device->deviceID] = h;
+    if (idFilter.full()) {
+        idFilter.reset(byID.size() * 2);
+        for (const auto& [id, handle] : byID) idFilter.add(BloomFilter::hash(id));
+    } else {
+        idFilter.add(BloomFilter::hash(device->deviceID));
+    }
+    setBit(liveBits, h, true);
+    setBit(onBits, h, device->status);
+    auto lock = dynamic_cast<DoorLock*>(device);
+    setBit(lockedBits, h, lock && lock->checkLockStatus());
+}
+
+void DeviceIndex::remove(Device* device) {
+    uint32_t h = device->indexHandle;
+    if (h == NoHandle) return;
+    Slot slot = slots[h];
+    erase(slot.typeList, slot.typePos, &Slot::typeList, &Slot::typePos);
+    setBit(typeBits[slot.typeList], h, false);
+    if (lists[slot.typeList].empty()) typeBits.erase(slot.typeList);
+    erase(slot.locationList, slot.locationPos, &Slot::locationList, &Slot::locationPos);
+    erase(slot.roomList, slot.roomPos, &Slot::roomList, &Slot::roomPos);
+    releaseIfEmpty(typeLists, device->deviceType);
+    releaseIfEmpty(locationLists, device->location);
+    releaseIfEmpty(roomLists, slot.room);
+    auto it = byID.find(device->deviceID);
+    if (it != byID.end() && it->second == h) byID.erase(it);
+    setBit(liveBits, h, false);
+    setBit(onBits, h, false);
+    setBit(lockedBits, h, false);
+    slots[h] = Slot{nullptr, nullptr, NoHandle, 0, NoHandle, 0, NoHandle, 0};
+    freeHandles.push_back(h);
+    device->indexHandle = NoHandle;
+}
+
+void DeviceIndex::statusChanged(Device* device) {
+    setBit(onBits, device->indexHandle, device->status);
+}
+
+void DeviceIndex::lockChanged(Device* device) {
+    auto lock = dynamic_cast<DoorLock*>(device);
+    setBit(lockedBits, device->indexHandle, lock && lock->checkLockStatus());
+}
+
+void DeviceIndex::locationChanged(Device* device, const string& oldLocation) {
+    Slot& slot = slots[device->indexHandle];
+    erase(slot.locationList, slot.locationPos, &Slot::locationList, &Slot::locationPos);
+    releaseIfEmpty(locationLists, oldLocation);
+    slot.locationList = listFor(locationLists, device->location);
+    slot.locationPos = append(slot.locationList, device->indexHandle);
+}
+
+Device* DeviceIndex::findByID(const string& id) const {
+    auto it = byID.find(id);
+    return it != byID.end() ? slots[it->second].device : nullptr;
+}
+
+    class User {
+        string UserID, UserName, Password;
+        map<string, Room*> rooms;
+    public:
+    PowerNode power{PowerNode::Level::User, this};
+
+    User(string uname, string pwd) : UserName(uname), Password(pwd) {}
+    void registerAccount() { cout << "Account registered for " << UserName << endl; }
+    bool authenticate(const string& inputPassword) {        
     if (inputPassword.length() < 6)
         throw DeviceException("Error: Password must have 6 characters or more");
 
@@ -282,6 +1451,9 @@ public:
     string getPassword(){
 	return Password;
 }
+    // Only users loaded from data files written before the credential store have one.
+    bool hasLegacyPassword() const { return !Password.empty(); }
+    void clearPassword() { Password.clear(); }
 
 
     bool login(string name, string pass) const {
@@ -290,6 +1462,8 @@ public:
     bool addRoom(Room* room) {
     if (rooms.count(room->getRoomName()) == 0) {
         rooms[room->getRoomName()] = room;
+        room->power.attachTo(&power);
+        if (PowerPolicy* budget = Device::hooks().budget) budget->roomAdded(this, room);
         return true;
     }
     return false;
@@ -334,852 +1508,10660 @@ public:
     }
 };
 
+// Multi-predicate filter over a DeviceIndex. Posting-list predicates pick
+// the smallest candidate list; bitmap predicates are ANDed word by word.
+class DeviceQuery {
+    DeviceIndex& index;
+    const string* type = nullptr;
+    const string* location = nullptr;
+    Room* room = nullptr;
+    User* owner = nullptr;
+    int on = -1;
+    int locked = -1;
+
+    bool matchesBits(uint32_t h) const {
+        if (on >= 0 && DeviceIndex::testBit(index.onBits, h) != (on == 1)) return false;
+        if (locked >= 0 && DeviceIndex::testBit(index.lockedBits, h) != (locked == 1)) return false;
+        return true;
+    }
+
+    template <typename Key>
+    int listOf(const unordered_map<Key, uint32_t>& names, const Key& key) const {
+        auto it = names.find(key);
+        return it == names.end() ? -2 : (int)it->second;
+    }
 
-class SmartHome {
-    map<string, User*> Users;
 public:
-    SmartHome() {}  
-    
-    void addUser(string ID, User* user) { Users[ID] = user; }
-    
-    void removeUser(string ID) { Users.erase(ID); }
+    DeviceQuery(DeviceIndex& idx) : index(idx) {}
+
+    DeviceQuery& ofType(const string& t) { type = &t; return *this; }
+    DeviceQuery& inLocation(const string& loc) { location = &loc; return *this; }
+    DeviceQuery& inRoom(Room* r) { room = r; return *this; }
+    DeviceQuery& ownedBy(User* u) { owner = u; return *this; }
+    DeviceQuery& withStatus(bool isOn) { on = isOn; return *this; }
+    DeviceQuery& withLock(bool isLocked) { locked = isLocked; return *this; }
+
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        int typeList = type ? listOf(index.typeLists, *type) : -1;
+        int locationList = location ? listOf(index.locationLists, *location) : -1;
+        int roomList = room ? listOf(index.roomLists, room) : -1;
+        if (typeList == -2 || locationList == -2 || roomList == -2) return;
+
+        unordered_set<Room*> ownedRooms;
+        auto accept = [&](uint32_t h) {
+            const DeviceIndex::Slot& slot = index.slots[h];
+            if (owner && !ownedRooms.count(slot.room)) return;
+            if (typeList >= 0 && slot.typeList != (uint32_t)typeList) return;
+            if (locationList >= 0 && slot.locationList != (uint32_t)locationList) return;
+            if (roomList >= 0 && slot.roomList != (uint32_t)roomList) return;
+            if (!matchesBits(h)) return;
+            visit(slot.device);
+        };
+
+        if (typeList >= 0 && locationList < 0 && roomList < 0 && !owner && (on >= 0 || locked >= 0)) {
+            // Type plus bitmap predicates: AND the type's bitmap in as well.
+            scanBits(&index.typeBits.at(typeList), visit);
+            return;
+        }
 
-    User* getUser(string name) { 
-        auto it = Users.find(name);
-        return (it != Users.end()) ? it->second : nullptr;
+        const vector<uint32_t>* smallest = nullptr;
+        for (int list : {typeList, locationList, roomList}) {
+            if (list >= 0 && (!smallest || index.lists[list].size() < smallest->size())) smallest = &index.lists[list];
+        }
+        if (owner) {
+            // The owner's rooms bound the candidates when no smaller list exists.
+            vector<uint32_t> owned;
+            size_t ownedCount = 0;
+            for (const auto& [name, r] : owner->getAllRooms()) {
+                ownedRooms.insert(r);
+                int list = listOf(index.roomLists, r);
+                if (list >= 0) {
+                    owned.push_back(list);
+                    ownedCount += index.lists[list].size();
+                }
+            }
+            if (!smallest || ownedCount < smallest->size()) {
+                for (uint32_t list : owned) for (uint32_t h : index.lists[list]) accept(h);
+                return;
+            }
+        }
+        if (smallest) {
+            for (uint32_t h : *smallest) accept(h);
+            return;
+        }
+        scanBits(nullptr, visit);
     }
 
-    void viewAllRoomsAndDevices(const string& userName) {
-        User* user = getUser(userName);
-        if (user) user->viewAllRooms();
-        else cout << "User not found.\n";
-    }
-    
-    bool loginUser(string name, string pwd) {
-    if (Users.count(name)) {
-        try {
-            return Users[name]->authenticate(pwd);
-        } catch (const DeviceException& e) {
-            cout << e.what() << endl;
-            return false;
+    // ANDs the bitmaps word by word and visits the set bits.
+    template <typename Visit>
+    void scanBits(const vector<uint64_t>* typeBits, Visit& visit) const {
+        for (size_t w = 0; w < index.liveBits.size(); w++) {
+            uint64_t word = index.liveBits[w];
+            if (typeBits) word &= w < typeBits->size() ? (*typeBits)[w] : 0;
+            if (on == 1) word &= index.onBits[w];
+            else if (on == 0) word &= ~index.onBits[w];
+            if (locked == 1) word &= index.lockedBits[w];
+            else if (locked == 0) word &= ~index.lockedBits[w];
+            while (word) {
+                uint32_t h = w * 64 + __builtin_ctzll(word);
+                word &= word - 1;
+                visit(index.slots[h].device);
+            }
         }
     }
-    return false;
-}
-    
-    const map<string, User*> getAllUsers() const {
-        return Users;
-    }
-    
-    void notifyUser(string msg) { Notification n; n.sendAlert(msg); }
-    
-    void viewSystemStatus() {
-        cout << "Smart Home Users:\n";
-        for (const auto& pair : Users) {
-            cout << "- " << pair.first << endl;
-        }
+
+    vector<Device*> run() const {
+        vector<Device*> out;
+        forEach([&](Device* d) { out.push_back(d); });
+        return out;
     }
-    
-    ~SmartHome() {
-        for (auto& pair : Users) {
-            delete pair.second;
-        }
+
+    size_t count() const {
+        size_t n = 0;
+        forEach([&](Device*) { n++; });
+        return n;
     }
 };
 
-class ConsoleUI {
-    SmartHome* smartHome;
-    User* currentUser;
-public:
-    ConsoleUI(SmartHome* sh) : smartHome(sh), currentUser(nullptr) {}
-    
-    User* getCurrentUser() const { return currentUser; }
-    void displayMenu() {
-        cout << "\n===== Smart Home Menu =====\n";
-        cout << "1. Register\n";
-        cout << "2. Login\n";
-        cout << "3. Add Room\n";
-        cout << "4. Add Device\n";
-        cout << "5. View Devices in a Room\n";
-        cout << "6. Dashboard\n";
-        cout << "7. Device Control (Remote)\n";
-        cout << "8. Scheduling\n";
-        cout << "9. Energy Report\n";
-        cout << "10. Check Schedules\n";
-        cout << "0. Exit\n";
-        cout << "Choose an option: ";
+// Formats dashboards into one reusable buffer and writes each frame at once.
+// Every device's text is cached with the version it was rendered from, so a
+// frame only re-formats devices that changed since they were last shown.
+// A device's dashboard text is not stored on its own. It is a slice of the
+// last full dashboard, found by position, because devices come in the same
+// order every frame. A first frame formats straight into the buffer.
+class DashboardRenderer {
+    struct Block {
+        const Device* device;
+        uint64_t version;
+        size_t at, length;  // in lastDashboard
+    };
+    struct Cached {
+        uint64_t rowVersion = 0;
+        uint64_t frame = 0;
+        string row;  // one-line summary used by the live view
+    };
+    vector<Block> blocks;  // the last showUser() frame's devices, in order
+    unordered_map<const Device*, Cached> cache;
+    // Rough per-device sizes, so a first frame is laid out in one allocation.
+    static const size_t BlockBytes = 96, RowBytes = 80;
+    string frameBuffer;
+    string lastDashboard;  // the last showUser() frame
+    vector<string> shownRows;
+    uint64_t frame = 0;
+    size_t rendered = 0;
+
+    static void appendNumber(string& out, float v, const char* suffix) {
+        char num[32];
+        int n = snprintf(num, sizeof(num), "%.1f%s", v, suffix);
+        out.append(num, n);
     }
 
-    void promptRegistration() {
-        string username, password;
-        cout << "Enter username: "; cin >> username;
-        cout << "Enter password: "; cin >> password;
-        User* newUser = new User(username, password);
-        newUser->registerAccount();
-        smartHome->addUser(username, newUser);
+    static void describe(Device* device, string& row) {
+        char head[96];
+        int n = snprintf(head, sizeof(head), "%-16.16s %-10.10s %-14.14s %-3s ", device->getDeviceName().c_str(),
+                         device->getDeviceID().c_str(), device->getDeciceType().c_str(),
+                         device->getStatus() ? "On" : "Off");
+        row.assign(head, n);
+        if (auto light = dynamic_cast<Light*>(device)) {
+            appendNumber(row, light->getBrightness(), "% brightness");
+        } else if (auto tcd = dynamic_cast<TemperatureControlledDevices*>(device)) {
+            appendNumber(row, tcd->getCurrentTemperature(), "° -> ");
+            appendNumber(row, tcd->getTargetTemperature(), "°");
+        } else if (auto lock = dynamic_cast<DoorLock*>(device)) {
+            row += lock->checkLockStatus() ? "Locked" : "Unlocked";
+        } else if (auto camera = dynamic_cast<Camera*>(device)) {
+            row += camera->recording() ? "Recording" : "Idle";
+            if (camera->sawMotion()) row += ", motion seen";
+        }
     }
-    void promptLogin() {
-        string username, password;
-        cout << "Enter username: "; cin >> username;
-        cout << "Enter password: "; cin >> password;
-        if (smartHome->loginUser(username, password)) {
-            currentUser = smartHome->getUser(username);
-            cout << "Login successful!\n";
+
+    // Appends the device's getDeviceInfo() text as the position'th block of
+    // a full dashboard, reusing the last one's text when it still matches.
+    void appendBlock(Device* device, size_t position) {
+        size_t at = frameBuffer.size();
+        Block now{device, device->getVersion(), at, 0};
+        if (position < blocks.size() && blocks[position].device == device && blocks[position].version == now.version) {
+            frameBuffer.append(lastDashboard, blocks[position].at, blocks[position].length);
         } else {
-            cout << "Login failed!\n";
+            device->appendDeviceInfo(frameBuffer);
+            rendered++;
         }
+        now.length = frameBuffer.size() - at;
+        if (position < blocks.size()) blocks[position] = now;
+        else blocks.push_back(now);
     }
 
-    void userDashboard() {
-        if (!currentUser) {
-           cout << "Please login to access dashboard.\n";
-            return;
+    const string& summary(Device* device) {
+        Cached& c = cache[device];
+        c.frame = frame;
+        if (c.rowVersion != device->getVersion()) {
+            c.rowVersion = device->getVersion();
+            describe(device, c.row);
+            rendered++;
         }
-        cout << "\n===== User Dashboard =====\n";
-        currentUser->viewAllRooms();
+        return c.row;
     }
 
-    void handleUserCommands() {
-        int choice;
-        do {
-            displayMenu();
-           cin >> choice;
-            switch (choice) {
-                case 1: promptRegistration(); break;
-                case 2: promptLogin(); break;
-                case 3: {
-                    if (currentUser) {
-                        string roomName;
-                        cout << "Enter room name: "; cin >> roomName;
-                        Room* room = new Room(roomName);
-                        currentUser->addRoom(room);
-                        cout << "Room added.\n";
-                    } else cout << "Please login first.\n";
-                    break;
-                }
-                case 4: {
-    if (currentUser) {
-        string roomName, deviceType, id, name;
-        cout << "Enter room name to add device: ";
-        cin >> roomName;
-        cout << "Enter device ID: ";
-        cin >> id;
-        cout << "Enter device name: ";
-        cin >> name;
-        cout << "Enter device type (Light/Thermostat/Camera/DoorLock/AC): ";
-        cin >> deviceType;
+    // Drops entries for devices that weren't in the last frame once the
+    // cache has grown well past what is being shown.
+    void sweep(size_t shown) {
+        if (cache.size() <= 2 * shown + 64) return;
+        for (auto it = cache.begin(); it != cache.end();)
+            it = it->second.frame == frame ? next(it) : cache.erase(it);
+    }
 
-        Device* device = nullptr;
-        if (deviceType == "Light")
-            device = new Light(id, name, roomName);
-        else if (deviceType == "Thermostat")
-            device = new Thermostat(id, name, roomName);
-        else if (deviceType == "Camera")
-            device = new Camera(id, name, roomName);
-        else if (deviceType == "DoorLock")
-            device = new DoorLock(id, name, roomName);
-        else if (deviceType == "AC")
-            device = new AirConditioner(id, name, roomName);
-        else {
-            cout << "Invalid device type.\n";
-            break;
+    // position counts a full dashboard's devices; a single room (null) is
+    // formatted afresh.
+    void appendRoom(Room* room, size_t* position) {
+        frameBuffer += "Devices in room '";
+        frameBuffer += room->getRoomName();
+        frameBuffer += "':\n";
+        for (Device* d : room->getDevices()) {
+            if (position) appendBlock(d, (*position)++);
+            else {
+                d->appendDeviceInfo(frameBuffer);
+                rendered++;
+            }
+            frameBuffer += "\n\n";
         }
+    }
 
-        if (!currentUser->addDeviceToRoom(roomName, device)) {
-            cout << "Room not found. Device not added.\n";
-            delete device;
-        } else {
-            cout << "Device added successfully.\n";
+    void emit() {
+        cout.write(frameBuffer.data(), frameBuffer.size());
+        cout.flush();
+    }
+
+public:
+    // Devices re-formatted since construction; the rest came from the cache.
+    size_t renderedCount() const { return rendered; }
+
+    // Same text as User::viewAllRooms.
+    void showUser(User* user) {
+        frame++;
+        frameBuffer.clear();
+        frameBuffer += "Rooms of user ";
+        frameBuffer += user->getUsername();
+        frameBuffer += ":\n";
+        size_t shown = 0;
+        for (const auto& [name, room] : user->getAllRooms()) shown += room->getDevices().size();
+        frameBuffer.reserve(shown * BlockBytes);
+        blocks.reserve(shown);
+        size_t position = 0;
+        for (const auto& [name, room] : user->getAllRooms()) {
+            frameBuffer += "- ";
+            frameBuffer += name;
+            frameBuffer += "\n";
+            appendRoom(room, &position);
         }
-    } else {
-        cout << "Please login first.\n";
+        blocks.resize(position);
+        emit();
+        swap(frameBuffer, lastDashboard);
     }
-    break;
-}
 
-                case 5: {
-                    if (currentUser) {
-                        string roomName;
-                        cout << "Enter room name to view devices: "; cin >> roomName;
-                        currentUser->viewDevicesInRoom(roomName);
-                    } else cout << "Please login first.\n";
-                    break;
+    // Same text as User::viewDevicesInRoom.
+    void showRoom(User* user, const string& roomName) {
+        frame++;
+        frameBuffer.clear();
+        if (Room* room = user->getRoom(roomName)) appendRoom(room, nullptr);
+        else frameBuffer += "Room not found.\n";
+        emit();
+    }
+
+    // One frame of the live view: a table of every device, drawn over the
+    // previous frame. Only rows that differ from what is on screen are sent.
+    void showLive(User* user, const string& status) {
+        frame++;
+        frameBuffer.clear();
+        size_t rows = 2, shown = 0;
+        for (const auto& [name, room] : user->getAllRooms()) rows += 2 + room->getDevices().size();
+        frameBuffer.reserve(rows * RowBytes);
+        shownRows.reserve(rows);
+        cache.reserve(rows);
+        size_t row = 0;
+        // A row is drawn from up to three pieces, compared with what is on
+        // screen in place so unchanged rows cost no string building.
+        auto put = [&](string_view a, string_view b = {}, string_view c = {}) {
+            if (row < shownRows.size()) {
+                const string& old = shownRows[row];
+                if (old.size() == a.size() + b.size() + c.size() && old.compare(0, a.size(), a) == 0 &&
+                    old.compare(a.size(), b.size(), b) == 0 && old.compare(a.size() + b.size(), c.size(), c) == 0) {
+                    row++;
+                    return;
                 }
-                case 6: userDashboard(); break;
-                case 7: cout << "Exiting...\n"; break;
-                default: cout << "Invalid choice.\n";
+            } else {
+                shownRows.emplace_back();
             }
-        } while (choice != 7);
+            char move[24];
+            frameBuffer.append(move, snprintf(move, sizeof(move), "\x1b[%zu;1H", row + 1));
+            frameBuffer.append(a).append(b).append(c);
+            frameBuffer += "\x1b[K";
+            shownRows[row].assign(a).append(b).append(c);
+            row++;
+        };
+        if (shownRows.empty()) frameBuffer += "\x1b[2J";
+        put("Live dashboard for ", user->getUsername(), " (press Enter to return)");
+        put(status);
+        for (const auto& [name, room] : user->getAllRooms()) {
+            put("");
+            put("[", name, "]");
+            for (Device* d : room->getDevices()) put("  ", summary(d));
+            shown += room->getDevices().size();
+        }
+        if (row < shownRows.size()) {
+            char move[24];
+            frameBuffer.append(move, snprintf(move, sizeof(move), "\x1b[%zu;1H\x1b[J", row + 1));
+            shownRows.resize(row);
+        }
+        sweep(shown);
+        emit();
     }
 
-    ~ConsoleUI() {
-        cout << "ConsoleUI shutting down...\n";
-    }
+    // Forgets what the live view has on screen, so the next frame is drawn in full.
+    void resetLive() { shownRows.clear(); }
 };
 
+// Password hashing: SHA-256, HMAC/PBKDF2 and scrypt (RFC 7914), kept
+// in-tree so credentials never leave the process.
+class Sha256 {
+    uint32_t state[8];
+    uint8_t block[64];
+    uint64_t totalBytes;
+    size_t used;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t* p) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
 
-struct Time {
-    int hour;
-    int minute;
+public:
+    static const size_t DigestSize = 32;
 
-    Time() : hour(0), minute(0) {}
-    Time(int h, int m) : hour(h), minute(m) {}
+    Sha256() { reset(); }
 
-    bool operator==(const Time& other) const {
-        return hour == other.hour && minute == other.minute;
+    void reset() {
+        static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(state, init, sizeof(state));
+        totalBytes = 0;
+        used = 0;
     }
 
-    string toString() const {
-        stringstream ss;
-        ss << setw(2) << setfill('0') << hour << ":" << setw(2) << setfill('0') << minute;
-        return ss.str();
+    void update(const uint8_t* data, size_t len) {
+        totalBytes += len;
+        while (len > 0) {
+            size_t take = min(len, 64 - used);
+            memcpy(block + used, data, take);
+            used += take;
+            data += take;
+            len -= take;
+            if (used == 64) {
+                compress(block);
+                used = 0;
+            }
+        }
+    }
+
+    void finish(uint8_t out[DigestSize]) {
+        uint64_t bits = totalBytes * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (used != 56) update(&pad, 1);
+        uint8_t length[8];
+        for (int i = 0; i < 8; i++) length[i] = uint8_t(bits >> (56 - 8 * i));
+        update(length, 8);
+        for (int i = 0; i < 8; i++) {
+            out[4 * i] = uint8_t(state[i] >> 24);
+            out[4 * i + 1] = uint8_t(state[i] >> 16);
+            out[4 * i + 2] = uint8_t(state[i] >> 8);
+            out[4 * i + 3] = uint8_t(state[i]);
+        }
     }
 };
 
-class Scheduler {
-private:
-    map<Device*, Time> schedules;
+class HmacSha256 {
+    Sha256 inner, outer;
+public:
+    HmacSha256(const uint8_t* key, size_t keyLen) {
+        uint8_t k[64] = {0};
+        if (keyLen > 64) {
+            Sha256 h;
+            h.update(key, keyLen);
+            h.finish(k);
+        } else {
+            memcpy(k, key, keyLen);
+        }
+        uint8_t pad[64];
+        for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x36;
+        inner.update(pad, 64);
+        for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x5c;
+        outer.update(pad, 64);
+    }
 
-    Time getCurrentTime() const {
-        time_t now = time(0);
-        tm* localTime = localtime(&now);
-        return Time(localTime->tm_hour, localTime->tm_min);
+    void update(const uint8_t* data, size_t len) { inner.update(data, len); }
+
+    void finish(uint8_t out[Sha256::DigestSize]) {
+        uint8_t innerDigest[Sha256::DigestSize];
+        inner.finish(innerDigest);
+        outer.update(innerDigest, sizeof(innerDigest));
+        outer.finish(out);
     }
+};
 
-public:
-    void addSchedule(Device* device, Time time) {
-        schedules[device] = time;
-        cout << "Scheduled device at " << time.toString() << endl;
+void pbkdf2Sha256(const uint8_t* password, size_t passwordLen, const uint8_t* salt, size_t saltLen,
+                  uint32_t iterations, uint8_t* out, size_t outLen) {
+    HmacSha256 keyed(password, passwordLen);
+    for (uint32_t blockIndex = 1; outLen > 0; blockIndex++) {
+        uint8_t counter[4] = {uint8_t(blockIndex >> 24), uint8_t(blockIndex >> 16), uint8_t(blockIndex >> 8), uint8_t(blockIndex)};
+        uint8_t u[Sha256::DigestSize], t[Sha256::DigestSize];
+        HmacSha256 mac = keyed;
+        mac.update(salt, saltLen);
+        mac.update(counter, 4);
+        mac.finish(u);
+        memcpy(t, u, sizeof(t));
+        for (uint32_t i = 1; i < iterations; i++) {
+            HmacSha256 next = keyed;
+            next.update(u, sizeof(u));
+            next.finish(u);
+            for (size_t j = 0; j < sizeof(t); j++) t[j] ^= u[j];
+        }
+        size_t take = min(outLen, sizeof(t));
+        memcpy(out, t, take);
+        out += take;
+        outLen -= take;
     }
+}
 
-    void removeSchedule(Device* device) {
-        if (schedules.erase(device)) {
-            cout << "Schedule removed for device.\n";
-        } else {
-            cout << "No schedule found for device.\n";
+class Scrypt {
+    static uint32_t rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+    static void salsa20_8(uint32_t b[16]) {
+        uint32_t x[16];
+        memcpy(x, b, sizeof(x));
+        for (int i = 0; i < 8; i += 2) {
+            x[4] ^= rotl(x[0] + x[12], 7);   x[8] ^= rotl(x[4] + x[0], 9);
+            x[12] ^= rotl(x[8] + x[4], 13);  x[0] ^= rotl(x[12] + x[8], 18);
+            x[9] ^= rotl(x[5] + x[1], 7);    x[13] ^= rotl(x[9] + x[5], 9);
+            x[1] ^= rotl(x[13] + x[9], 13);  x[5] ^= rotl(x[1] + x[13], 18);
+            x[14] ^= rotl(x[10] + x[6], 7);  x[2] ^= rotl(x[14] + x[10], 9);
+            x[6] ^= rotl(x[2] + x[14], 13);  x[10] ^= rotl(x[6] + x[2], 18);
+            x[3] ^= rotl(x[15] + x[11], 7);  x[7] ^= rotl(x[3] + x[15], 9);
+            x[11] ^= rotl(x[7] + x[3], 13);  x[15] ^= rotl(x[11] + x[7], 18);
+            x[1] ^= rotl(x[0] + x[3], 7);    x[2] ^= rotl(x[1] + x[0], 9);
+            x[3] ^= rotl(x[2] + x[1], 13);   x[0] ^= rotl(x[3] + x[2], 18);
+            x[6] ^= rotl(x[5] + x[4], 7);    x[7] ^= rotl(x[6] + x[5], 9);
+            x[4] ^= rotl(x[7] + x[6], 13);   x[5] ^= rotl(x[4] + x[7], 18);
+            x[11] ^= rotl(x[10] + x[9], 7);  x[8] ^= rotl(x[11] + x[10], 9);
+            x[9] ^= rotl(x[8] + x[11], 13);  x[10] ^= rotl(x[9] + x[8], 18);
+            x[12] ^= rotl(x[15] + x[14], 7); x[13] ^= rotl(x[12] + x[15], 9);
+            x[14] ^= rotl(x[13] + x[12], 13); x[15] ^= rotl(x[14] + x[13], 18);
+        }
+        for (int i = 0; i < 16; i++) b[i] += x[i];
+    }
+
+    // in and out are 32*r words; out must not alias in.
+    static void blockMix(const uint32_t* in, uint32_t* out, uint32_t r) {
+        uint32_t x[16];
+        memcpy(x, in + (2 * r - 1) * 16, 64);
+        for (uint32_t i = 0; i < 2 * r; i++) {
+            for (int j = 0; j < 16; j++) x[j] ^= in[i * 16 + j];
+            salsa20_8(x);
+            uint32_t* dst = out + ((i & 1) ? (r + i / 2) : (i / 2)) * 16;
+            memcpy(dst, x, 64);
         }
     }
 
-    void checkAndRunSchedules() {
-        Time currentTime = getCurrentTime();
-        for (map<Device*, Time>::iterator it = schedules.begin(); it != schedules.end(); ++it) {
-            if (it->second == currentTime) {
-                cout << "Running scheduled action at " << currentTime.toString() << endl;
-                it->first->performAction();
+    static void roMix(uint8_t* block, uint32_t r, uint64_t n, uint32_t* v, uint32_t* x, uint32_t* y) {
+        size_t words = 32 * r;
+        for (size_t i = 0; i < words; i++)
+            x[i] = (uint32_t)block[4 * i] | (uint32_t)block[4 * i + 1] << 8 | (uint32_t)block[4 * i + 2] << 16 | (uint32_t)block[4 * i + 3] << 24;
+        for (uint64_t i = 0; i < n; i++) {
+            memcpy(v + i * words, x, words * 4);
+            blockMix(x, y, r);
+            swap(x, y);
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            uint64_t j = x[(2 * r - 1) * 16] & (n - 1);
+            const uint32_t* vj = v + j * words;
+            for (size_t k = 0; k < words; k++) x[k] ^= vj[k];
+            blockMix(x, y, r);
+            swap(x, y);
+        }
+        for (size_t i = 0; i < words; i++) {
+            block[4 * i] = uint8_t(x[i]);
+            block[4 * i + 1] = uint8_t(x[i] >> 8);
+            block[4 * i + 2] = uint8_t(x[i] >> 16);
+            block[4 * i + 3] = uint8_t(x[i] >> 24);
+        }
+    }
+
+public:
+    // Memory use is 128 * r * N bytes per call.
+    static void derive(const string& password, const uint8_t* salt, size_t saltLen,
+                       uint8_t logN, uint32_t r, uint32_t p, uint8_t* out, size_t outLen) {
+        uint64_t n = uint64_t(1) << logN;
+        size_t blockBytes = 128 * r;
+        vector<uint8_t> b(blockBytes * p);
+        const uint8_t* pw = (const uint8_t*)password.data();
+        pbkdf2Sha256(pw, password.size(), salt, saltLen, 1, b.data(), b.size());
+        vector<uint32_t> v(32 * r * n), x(32 * r), y(32 * r);
+        for (uint32_t i = 0; i < p; i++) roMix(b.data() + i * blockBytes, r, n, v.data(), x.data(), y.data());
+        pbkdf2Sha256(pw, password.size(), b.data(), b.size(), 1, out, outLen);
+    }
+};
+
+void fillRandom(uint8_t* out, size_t len) {
+    ifstream urandom("/dev/urandom", ios::binary);
+    if (!urandom.read((char*)out, len)) throw DeviceException("Cannot read /dev/urandom");
+}
+
+struct Credential {
+    static const size_t SaltSize = 16;
+    static const size_t HashSize = 32;
+    uint8_t logN, r, p;
+    uint8_t salt[SaltSize];
+    uint8_t hash[HashSize];
+
+    // Costs are read from files and from the primary, so bound what one
+    // verification may take: at most 256 MB (128 * r * N) and r * p <= 64.
+    static bool saneCost(uint8_t logN, uint8_t r, uint8_t p) {
+        return logN >= 1 && logN <= 20 && r >= 1 && p >= 1 && (uint64_t(128) * r << logN) <= (uint64_t(256) << 20) &&
+               uint32_t(r) * p <= 64;
+    }
+};
+
+// Hashed credentials kept apart from data.txt in a compact binary file:
+// "SHCR1" then per record: name length, name, logN, r, p, salt, hash.
+// Later records for the same user supersede earlier ones.
+class CredentialStore {
+    string filename;
+    unordered_map<string, Credential> credentials;
+    mutable mutex lock;
+    uint8_t logN;
+    uint8_t r;
+    uint8_t p;
+
+    static const char* magic() { return "SHCR1"; }
+
+    static void appendRecord(ostream& out, const string& name, const Credential& c) {
+        uint8_t len = uint8_t(name.size());
+        out.write((const char*)&len, 1);
+        out.write(name.data(), len);
+        out.write((const char*)&c.logN, 3);
+        out.write((const char*)c.salt, Credential::SaltSize);
+        out.write((const char*)c.hash, Credential::HashSize);
+    }
+
+    void load() {
+        ifstream in(filename, ios::binary);
+        char head[5];
+        if (!in.read(head, 5) || memcmp(head, magic(), 5) != 0) return;
+        uint8_t len;
+        while (in.read((char*)&len, 1)) {
+            string name(len, '\0');
+            Credential c;
+            if (!in.read(&name[0], len) || !in.read((char*)&c.logN, 3) ||
+                !in.read((char*)c.salt, Credential::SaltSize) || !in.read((char*)c.hash, Credential::HashSize))
+                break;
+            if (!Credential::saneCost(c.logN, c.r, c.p)) {
+                cerr << filename << ": ignoring credential for " << name << " with an out-of-range scrypt cost\n";
+                continue;
             }
+            credentials[name] = c;
         }
     }
 
-    void updateSchedule(Device* device, Time newTime) {
-        if (schedules.find(device) != schedules.end()) {
-            schedules[device] = newTime;
-            cout << "Schedule updated to " << newTime.toString() << endl;
-        } else {
-            cout << "Device not found in schedule.\n";
+public:
+    CredentialStore(const string& fname, uint8_t costLog2 = 14, uint8_t blockSize = 8, uint8_t parallelism = 1)
+        : filename(fname), logN(costLog2), r(blockSize), p(parallelism) {
+        if (!Credential::saneCost(logN, r, p)) throw DeviceException("Scrypt cost out of range");
+        load();
+    }
+
+    bool contains(const string& name) const {
+        lock_guard<mutex> guard(lock);
+        return credentials.count(name) > 0;
+    }
+
+    size_t size() const {
+        lock_guard<mutex> guard(lock);
+        return credentials.size();
+    }
+
+    void enroll(const string& name, const string& password) {
+        if (name.size() > 255) throw DeviceException("Username too long");
+        Credential c;
+        c.logN = logN;
+        c.r = r;
+        c.p = p;
+        fillRandom(c.salt, Credential::SaltSize);
+        Scrypt::derive(password, c.salt, Credential::SaltSize, c.logN, c.r, c.p, c.hash, Credential::HashSize);
+
+        lock_guard<mutex> guard(lock);
+        auto it = credentials.find(name);
+        if (it != credentials.end() && memcmp(&it->second.logN, &c.logN, 3) == 0 &&
+            memcmp(it->second.salt, c.salt, Credential::SaltSize) == 0 &&
+            memcmp(it->second.hash, c.hash, Credential::HashSize) == 0)
+            return;  // already known, e.g. from an earlier snapshot
+        bool fresh = !ifstream(filename).good();
+        ofstream out(filename, ios::app | ios::binary);
+        if (!out.is_open()) throw DeviceException("Cannot open credential store: " + filename);
+        if (fresh) out.write(magic(), 5);
+        appendRecord(out, name, c);
+        credentials[name] = c;
+    }
+
+    // One record in the file's format, for shipping to a standby.
+    bool exportRecord(const string& name, string& out) const {
+        lock_guard<mutex> guard(lock);
+        auto it = credentials.find(name);
+        if (it == credentials.end()) return false;
+        ostringstream record;
+        appendRecord(record, name, it->second);
+        out = record.str();
+        return true;
+    }
+
+    void importRecord(string_view record) {
+        if (record.empty() || record.size() != 1 + size_t(uint8_t(record[0])) + 3 + Credential::SaltSize + Credential::HashSize)
+            throw DeviceException("Malformed credential record");
+        string name(record.substr(1, uint8_t(record[0])));
+        Credential c;
+        const char* p = record.data() + 1 + name.size();
+        memcpy(&c.logN, p, 3);
+        memcpy(c.salt, p + 3, Credential::SaltSize);
+        memcpy(c.hash, p + 3 + Credential::SaltSize, Credential::HashSize);
+        if (!Credential::saneCost(c.logN, c.r, c.p)) throw DeviceException("Credential for " + name + " has an out-of-range scrypt cost");
+        lock_guard<mutex> guard(lock);
+        bool fresh = !ifstream(filename).good();
+        ofstream out(filename, ios::app | ios::binary);
+        if (!out.is_open()) throw DeviceException("Cannot open credential store: " + filename);
+        if (fresh) out.write(magic(), 5);
+        out.write(record.data(), record.size());
+        credentials[name] = c;
+    }
+
+    // The hash runs outside the lock so concurrent logins don't serialize.
+    bool verify(const string& name, const string& password) const {
+        Credential c;
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = credentials.find(name);
+            if (it == credentials.end()) return false;
+            c = it->second;
         }
+        uint8_t computed[Credential::HashSize];
+        Scrypt::derive(password, c.salt, Credential::SaltSize, c.logN, c.r, c.p, computed, sizeof(computed));
+        uint8_t diff = 0;
+        for (size_t i = 0; i < sizeof(computed); i++) diff |= computed[i] ^ c.hash[i];
+        return diff == 0;
     }
+};
 
-    void listSchedules() {
-        cout << "Scheduled Devices:\n";
-        for (map<Device*, Time>::iterator it = schedules.begin(); it != schedules.end(); ++it) {
-            cout << "- Device at " << it->second.toString() << endl;
+// Token bucket per login source and username, striped so attempts on
+// different users never contend on one lock. Guessing from one source
+// never locks the owner out of another, and a successful login clears its
+// bucket, so only failed attempts add up.
+class LoginRateLimiter {
+    struct Bucket {
+        double tokens;
+        chrono::steady_clock::time_point refilled;
+    };
+    struct Stripe {
+        mutex lock;
+        unordered_map<string, Bucket> buckets;
+    };
+    static const size_t StripeCount = 64;
+    Stripe stripes[StripeCount];
+    double capacity;
+    double refillPerSecond;
+
+public:
+    LoginRateLimiter(double burst = 5, double perSecond = 0.2) : capacity(burst), refillPerSecond(perSecond) {}
+
+    static string key(const string& source, const string& name) { return source + '\n' + name; }
+
+    bool allow(const string& source, const string& name) {
+        string k = key(source, name);
+        Stripe& stripe = stripes[hash<string>()(name) % StripeCount];
+        auto now = chrono::steady_clock::now();
+        lock_guard<mutex> guard(stripe.lock);
+        auto it = stripe.buckets.find(k);
+        if (it == stripe.buckets.end()) it = stripe.buckets.emplace(move(k), Bucket{capacity, now}).first;
+        Bucket& b = it->second;
+        double elapsed = chrono::duration<double>(now - b.refilled).count();
+        b.tokens = min(capacity, b.tokens + elapsed * refillPerSecond);
+        b.refilled = now;
+        if (b.tokens < 1.0) return false;
+        b.tokens -= 1.0;
+        return true;
+    }
+
+    void succeeded(const string& source, const string& name) {
+        Stripe& stripe = stripes[hash<string>()(name) % StripeCount];
+        lock_guard<mutex> guard(stripe.lock);
+        stripe.buckets.erase(key(source, name));
+    }
+};
+
+// Verified sessions: a random token maps to the username it was issued for,
+// so later commands skip the password hash entirely.
+class SessionCache {
+    struct Session {
+        string username;
+        chrono::steady_clock::time_point expires;
+    };
+    static const size_t StripeCount = 16;
+    struct Stripe {
+        mutex lock;
+        unordered_map<string, Session> sessions;
+    };
+    Stripe stripes[StripeCount];
+    chrono::seconds lifetime;
+
+    Stripe& stripeFor(const string& token) { return stripes[hash<string>()(token) % StripeCount]; }
+
+public:
+    SessionCache(chrono::seconds ttl = chrono::seconds(1800)) : lifetime(ttl) {}
+
+    string issue(const string& username) {
+        uint8_t raw[16];
+        fillRandom(raw, sizeof(raw));
+        static const char* hex = "0123456789abcdef";
+        string token;
+        for (uint8_t b : raw) {
+            token += hex[b >> 4];
+            token += hex[b & 15];
         }
+        Stripe& stripe = stripeFor(token);
+        lock_guard<mutex> guard(stripe.lock);
+        stripe.sessions[token] = Session{username, chrono::steady_clock::now() + lifetime};
+        return token;
     }
 
-    Time getSchedule(Device* device) {
-        if (schedules.find(device) != schedules.end()) {
-            return schedules[device];
+    // Returns the session's username (sliding expiry) or "" if invalid.
+    string validate(const string& token) {
+        Stripe& stripe = stripeFor(token);
+        lock_guard<mutex> guard(stripe.lock);
+        auto it = stripe.sessions.find(token);
+        if (it == stripe.sessions.end()) return "";
+        auto now = chrono::steady_clock::now();
+        if (it->second.expires < now) {
+            stripe.sessions.erase(it);
+            return "";
         }
-        return Time(-1, -1); // Indicates not found
+        it->second.expires = now + lifetime;
+        return it->second.username;
     }
 
-    void clearAllSchedules() {
-        schedules.clear();
-        cout << "All schedules cleared.\n";
+    void revoke(const string& token) {
+        Stripe& stripe = stripeFor(token);
+        lock_guard<mutex> guard(stripe.lock);
+        stripe.sessions.erase(token);
     }
+};
 
-    ~Scheduler() {
+// Ties the credential store, rate limiter and session cache together.
+// Users still carrying a plaintext password from an older data file are
+// migrated to a hash on their first successful login.
+class Authenticator {
+    CredentialStore& store;
+    LoginRateLimiter limiter;
+    SessionCache sessions;
+public:
+    Authenticator(CredentialStore& s, double burst = 5, double perSecond = 0.2) : store(s), limiter(burst, perSecond) {}
+
+    CredentialStore& credentials() { return store; }
+
+    // source names where the attempt came from (the console, a bench thread).
+    bool verify(User* user, const string& password, const string& source) {
+        const string& name = user->getUsername();
+        if (!limiter.allow(source, name)) throw DeviceException("Error: Too many login attempts, try again later");
+        if (store.contains(name)) {
+            if (!store.verify(name, password)) throw DeviceException("Error: Incorrect password");
+            limiter.succeeded(source, name);
+            return true;
+        }
+        if (!user->hasLegacyPassword()) throw DeviceException("Error: No credentials on record");
+        user->authenticate(password);
+        store.enroll(name, password);
+        user->clearPassword();
+        limiter.succeeded(source, name);
+        return true;
     }
+
+    string openSession(const string& username) { return sessions.issue(username); }
+    string sessionUser(const string& token) { return sessions.validate(token); }
+    void closeSession(const string& token) { sessions.revoke(token); }
 };
 
-class EnergyMonitor {
-private:
-    map<string, float> energyUsage;
-    float threshold;
+// Supplies users that are not resident in memory (see ResidentUserCache).
+class UserLoader {
+public:
+    virtual User* loadUser(const string& name) = 0;
+    virtual void touchUser(const string& name) = 0;
+    virtual ~UserLoader() {}
+};
 
+class SmartHome {
+    map<string, User*> Users;
+    UserLoader* loader = nullptr;
+    Authenticator* authenticator = nullptr;
 public:
-    EnergyMonitor() : threshold(30.0f) {}
+    PowerNode power{PowerNode::Level::Home, this};
 
-    void recordUsage(const string& deviceID, float amount) {
-        energyUsage[deviceID] += amount;
-        cout << "Recorded " << amount << " units for device: " << deviceID << endl;
+    SmartHome() {}  
+    
+    void attachLoader(UserLoader* l) { loader = l; }
+    void attachAuthenticator(Authenticator* a) { authenticator = a; }
+
+    void addUser(string ID, User* user) {
+        User*& slot = Users[ID];
+        if (slot && slot != user) slot->power.attachTo(nullptr);
+        slot = user;
+        user->power.attachTo(&power);
+        if (PowerPolicy* budget = Device::hooks().budget) budget->userAdded(user);
+    }
+    
+    void removeUser(string ID) {
+        auto it = Users.find(ID);
+        if (it == Users.end()) return;
+        it->second->power.attachTo(nullptr);
+        Users.erase(it);
     }
 
-    float getUsage(const string& deviceID) const {
-        auto it = energyUsage.find(deviceID);
-        if (it != energyUsage.end()) {
+    User* getUser(string name) { 
+        auto it = Users.find(name);
+        if (it != Users.end()) {
+            if (loader) loader->touchUser(name);
             return it->second;
         }
-        return 0.0f;
+        return loader ? loader->loadUser(name) : nullptr;
     }
 
-    float getTotalUsage() const {
-        float total = 0.0f;
-        for (auto& entry : energyUsage) {
-            total += entry.second;
+    void viewAllRoomsAndDevices(const string& userName) {
+        User* user = getUser(userName);
+        if (user) user->viewAllRooms();
+        else cout << "User not found.\n";
+    }
+    
+    bool loginUser(string name, string pwd, const string& source = "console") {
+    if (User* user = getUser(name)) {
+        try {
+            if (authenticator) return authenticator->verify(user, pwd, source);
+            return user->authenticate(pwd);
+        } catch (const DeviceException& e) {
+            cout << e.what() << endl;
+            return false;
+        }
+    }
+    return false;
+}
+    
+    const map<string, User*> getAllUsers() const {
+        return Users;
+    }
+    
+    void notifyUser(string msg) { Notification n; n.sendAlert(msg); }
+    
+    void viewSystemStatus() {
+        cout << "Smart Home Users:\n";
+        for (const auto& pair : Users) {
+            cout << "- " << pair.first << endl;
+        }
+    }
+    
+    ~SmartHome() {
+        for (auto& pair : Users) {
+            delete pair.second;
         }
-        return total;
     }
+};
 
-    void setThreshold(float value) {
-        threshold = value;
-        cout << "Energy threshold set to " << threshold << " units.\n";
+// Power budgets for the whole home, users, rooms and devices, one per line:
+//   home WATTS
+//   user NAME WATTS
+//   room USER ROOM WATTS
+//   device ID WATTS
+//   demand_response on|off
+// Limits are applied as users, rooms and devices join the home, so lazily
+// loaded and replicated users get theirs too. With demand response on, a
+// device that doesn't fit switches off lower-priority loads under the
+// budget it hit: air conditioners first, then lights, then thermostats.
+// Cameras and door locks are never shed.
+class PowerBudget : public PowerPolicy {
+    SmartHome& home;
+    int64_t homeMw = 0;
+    unordered_map<string, int64_t> userMw, deviceMw;
+    map<pair<string, string>, int64_t> roomMw;
+    bool demandResponse = false;
+    mutex shedLock;
+
+    static const int NeverShed = 3;
+
+    static int64_t milliwatts(double watts) { return llround(watts * 1000.0); }
+
+    static void collect(PowerNode* node, vector<Device*>& out) {
+        switch (node->level) {
+            case PowerNode::Level::Device: break;
+            case PowerNode::Level::Room:
+                for (Device* d : static_cast<Room*>(node->owner)->getDevices()) out.push_back(d);
+                break;
+            case PowerNode::Level::User:
+                for (const auto& [name, room] : static_cast<User*>(node->owner)->getAllRooms()) collect(&room->power, out);
+                break;
+            case PowerNode::Level::Home:
+                for (const auto& [name, user] : static_cast<SmartHome*>(node->owner)->getAllUsers()) collect(&user->power, out);
+                break;
+        }
     }
 
-    float getThreshold() const {
-        return threshold;
+    // Switches off switched-on devices under node that rank below `rank`,
+    // lowest priority and largest load first, until `need` mW are free.
+    // Sheds nothing when that isn't enough.
+    bool shedUnder(PowerNode* node, int64_t need, int rank) {
+        vector<Device*> candidates;
+        collect(node, candidates);
+        erase_if(candidates, [&](Device* d) { return !d->getStatus() || priority(d) >= rank; });
+        int64_t available = 0;
+        for (Device* d : candidates) available += d->reservedPower();
+        if (available < need) return false;
+        sort(candidates.begin(), candidates.end(), [](Device* a, Device* b) {
+            int pa = priority(a), pb = priority(b);
+            return pa != pb ? pa < pb : a->reservedPower() > b->reservedPower();
+        });
+        for (Device* d : candidates) {
+            if (need <= 0) break;
+            need -= d->reservedPower();
+            d->shed();
+            shed++;
+        }
+        return true;
     }
 
-    void checkThreshold() const {
-        float total = getTotalUsage();
-        if (total > threshold) {
-            cout << "️ Warning: Energy usage exceeded threshold! ("
-                 << total << " > " << threshold << ")\n";
-        } else {
-            cout << "✅ Energy usage within threshold. (" << total << " <= " << threshold << ")\n";
+public:
+    atomic<uint64_t> denied{0}, shed{0};
+
+    PowerBudget(SmartHome& h) : home(h) {}
+
+    static int priority(Device* device) {
+        if (dynamic_cast<AirConditioner*>(device)) return 0;
+        if (dynamic_cast<Light*>(device)) return 1;
+        if (dynamic_cast<Thermostat*>(device)) return 2;
+        return NeverShed;
+    }
+
+    void setHome(double watts) { homeMw = milliwatts(watts); }
+    void setUser(const string& name, double watts) { userMw[name] = milliwatts(watts); }
+    void setRoom(const string& user, const string& room, double watts) { roomMw[{user, room}] = milliwatts(watts); }
+    void setDevice(const string& id, double watts) { deviceMw[id] = milliwatts(watts); }
+    void setDemandResponse(bool on) { demandResponse = on; }
+
+    void load(const string& path) {
+        ifstream in(path);
+        if (!in.is_open()) throw DeviceException("Cannot open budget file: " + path);
+        string line;
+        for (int lineNo = 1; getline(in, line); lineNo++) {
+            istringstream words(line);
+            string directive, a, b;
+            double watts;
+            if (!(words >> directive) || directive[0] == '#') continue;
+            string where = path + ":" + to_string(lineNo) + ": ";
+            if (directive == "home") {
+                if (!(words >> watts)) throw DeviceException(where + "home needs WATTS");
+                setHome(watts);
+            } else if (directive == "user") {
+                if (!(words >> a >> watts)) throw DeviceException(where + "user needs NAME WATTS");
+                setUser(a, watts);
+            } else if (directive == "room") {
+                if (!(words >> a >> b >> watts)) throw DeviceException(where + "room needs USER ROOM WATTS");
+                setRoom(a, b, watts);
+            } else if (directive == "device") {
+                if (!(words >> a >> watts)) throw DeviceException(where + "device needs ID WATTS");
+                setDevice(a, watts);
+            } else if (directive == "demand_response") {
+                if (!(words >> a)) throw DeviceException(where + "demand_response needs on|off");
+                setDemandResponse(a == "on");
+            } else {
+                throw DeviceException(where + "unknown directive '" + directive + "'");
+            }
         }
     }
 
-    void displayUsageReport() const {
-        cout << "\n--- Energy Usage Report ---\n";
-        for (auto& entry : energyUsage) {
-            cout << "Device ID: " << entry.first
-                 << " | Usage: " << fixed << setprecision(2)
-                 << entry.second << " units\n";
+    // Sets every limit in the home; with demand response on, loads already
+    // over a budget are shed to fit.
+    void apply() {
+        home.power.limitMw.store(homeMw);
+        for (const auto& [name, user] : home.getAllUsers()) userAdded(user);
+        if (!demandResponse) return;
+        lock_guard<mutex> guard(shedLock);
+        auto enforce = [&](PowerNode& node) {
+            int64_t limit = node.limitMw.load(), draw = node.drawMw.load();
+            if (limit > 0 && draw > limit) shedUnder(&node, draw - limit, NeverShed);
+        };
+        for (const auto& [name, user] : home.getAllUsers())
+            for (const auto& [roomName, room] : user->getAllRooms()) enforce(room->power);
+        for (const auto& [name, user] : home.getAllUsers()) enforce(user->power);
+        enforce(home.power);
+    }
+
+    bool makeRoom(Device* device, PowerNode* over, int64_t mw) override {
+        if (demandResponse && over->level != PowerNode::Level::Device) {
+            lock_guard<mutex> guard(shedLock);
+            int64_t need = over->drawMw.load() + mw - over->limitMw.load();
+            if (shedUnder(over, need, priority(device))) return true;
         }
-        cout << "Total Usage: " << fixed << setprecision(2)
-             << getTotalUsage() << " units\n";
-        cout << "Threshold: " << fixed << setprecision(2)
-             << threshold << " units\n";
-        cout << "----------------------------\n";
+        denied++;
+        return false;
     }
-    ~ EnergyMonitor (){
-	}
-};
 
-class RemoteControl {
-private:
-    User* user;
+    void deviceAdded(Device* device) {
+        auto it = deviceMw.find(device->getDeviceID());
+        device->power.limitMw.store(it == deviceMw.end() ? 0 : it->second);
+    }
+
+    void roomAdded(User* user, Room* room) {
+        auto it = roomMw.find({user->getUsername(), room->getRoomName()});
+        room->power.limitMw.store(it == roomMw.end() ? 0 : it->second);
+        for (Device* d : room->getDevices()) deviceAdded(d);
+    }
+
+    void userAdded(User* user) {
+        auto it = userMw.find(user->getUsername());
+        user->power.limitMw.store(it == userMw.end() ? 0 : it->second);
+        for (const auto& [name, room] : user->getAllRooms()) roomAdded(user, room);
+    }
+
+    void report(ostream& out, User* user) const {
+        auto line = [&](const string& what, const PowerNode& node) {
+            int64_t limit = node.limitMw.load();
+            out << what << ": " << node.drawMw.load() / 1000.0 << " W";
+            if (limit > 0) out << " of " << limit / 1000.0 << " W";
+            out << "\n";
+        };
+        out << fixed << setprecision(1) << "\n--- Power Budgets ---\n";
+        line("Home", home.power);
+        line(user->getUsername(), user->power);
+        for (const auto& [name, room] : user->getAllRooms()) line("  " + name, room->power);
+        out << "Refused: " << denied.load() << ", shed: " << shed.load()
+            << (demandResponse ? " (demand response on)\n" : "\n");
+    }
+};
 
+class ConsoleUI {
+    SmartHome* smartHome;
+    User* currentUser;
 public:
-    RemoteControl(User* u) : user(u) {}
+    ConsoleUI(SmartHome* sh) : smartHome(sh), currentUser(nullptr) {}
+    
+    User* getCurrentUser() const { return currentUser; }
+    void displayMenu() {
+        cout << "\n===== Smart Home Menu =====\n";
+        cout << "1. Register\n";
+        cout << "2. Login\n";
+        cout << "3. Add Room\n";
+        cout << "4. Add Device\n";
+        cout << "5. View Devices in a Room\n";
+        cout << "6. Dashboard\n";
+        cout << "7. Device Control (Remote)\n";
+        cout << "8. Scheduling\n";
+        cout << "9. Energy Report\n";
+        cout << "10. Check Schedules\n";
+        cout << "11. Find Devices\n";
+        cout << "12. Live Dashboard\n";
+        cout << "13. Device History\n";
+        cout << "14. Memory Report\n";
+        cout << "15. Change Several Devices\n";
+        cout << "16. Camera Activity\n";
+        cout << "17. Command Latency\n";
+        cout << "0. Exit\n";
+        cout << "Choose an option: ";
+    }
 
-    bool turnDeviceOn(string roomName, string deviceName) {
-        Room* room = user->getRoom(roomName);
-        if (room) {
-            Device* device = room->getDevicesByName(deviceName);
-            if (device) {
-                device->turnOn();
-                cout << "Turned ON device: " << deviceName << " in " << roomName << endl;
-                return true;
+    void promptRegistration() {
+        string username, password;
+        cout << "Enter username: "; cin >> username;
+        cout << "Enter password: "; cin >> password;
+        User* newUser = new User(username, password);
+        newUser->registerAccount();
+        smartHome->addUser(username, newUser);
+    }
+    void promptLogin() {
+        string username, password;
+        cout << "Enter username: "; cin >> username;
+        cout << "Enter password: "; cin >> password;
+        if (smartHome->loginUser(username, password)) {
+            currentUser = smartHome->getUser(username);
+            cout << "Login successful!\n";
+        } else {
+            cout << "Login failed!\n";
+        }
+    }
+
+    void userDashboard() {
+        if (!currentUser) {
+           cout << "Please login to access dashboard.\n";
+            return;
+        }
+        cout << "\n===== User Dashboard =====\n";
+        currentUser->viewAllRooms();
+    }
+
+    void handleUserCommands() {
+        int choice;
+        do {
+            displayMenu();
+           cin >> choice;
+            switch (choice) {
+                case 1: promptRegistration(); break;
+                case 2: promptLogin(); break;
+                case 3: {
+                    if (currentUser) {
+                        string roomName;
+                        cout << "Enter room name: "; cin >> roomName;
+                        Room* room = new Room(roomName);
+                        currentUser->addRoom(room);
+                        cout << "Room added.\n";
+                    } else cout << "Please login first.\n";
+                    break;
+                }
+                case 4: {
+    if (currentUser) {
+        string roomName, deviceType, id, name;
+        cout << "Enter room name to add device: ";
+        cin >> roomName;
+        cout << "Enter device ID: ";
+        cin >> id;
+        cout << "Enter device name: ";
+        cin >> name;
+        cout << "Enter device type (Light/Thermostat/Camera/DoorLock/AC): ";
+        cin >> deviceType;
+
+        Device* device = nullptr;
+        if (deviceType == "Light")
+            device = new Light(id, name, roomName);
+        else if (deviceType == "Thermostat")
+            device = new Thermostat(id, name, roomName);
+        else if (deviceType == "Camera")
+            device = new Camera(id, name, roomName);
+        else if (deviceType == "DoorLock")
+            device = new DoorLock(id, name, roomName);
+        else if (deviceType == "AC")
+            device = new AirConditioner(id, name, roomName);
+        else {
+            cout << "Invalid device type.\n";
+            break;
+        }
+
+        if (!currentUser->addDeviceToRoom(roomName, device)) {
+            cout << "Room not found. Device not added.\n";
+            delete device;
+        } else {
+            cout << "Device added successfully.\n";
+        }
+    } else {
+        cout << "Please login first.\n";
+    }
+    break;
+}
+
+                case 5: {
+                    if (currentUser) {
+                        string roomName;
+                        cout << "Enter room name to view devices: "; cin >> roomName;
+                        currentUser->viewDevicesInRoom(roomName);
+                    } else cout << "Please login first.\n";
+                    break;
+                }
+                case 6: userDashboard(); break;
+                case 7: cout << "Exiting...\n"; break;
+                default: cout << "Invalid choice.\n";
+            }
+        } while (choice != 7);
+    }
+
+    ~ConsoleUI() {
+        cout << "ConsoleUI shutting down...\n";
+    }
+};
+
+
+struct Time {
+    int hour;
+    int minute;
+
+    Time() : hour(0), minute(0) {}
+    Time(int h, int m) : hour(h), minute(m) {}
+
+    bool operator==(const Time& other) const {
+        return hour == other.hour && minute == other.minute;
+    }
+
+    string toString() const {
+        stringstream ss;
+        ss << setw(2) << setfill('0') << hour << ":" << setw(2) << setfill('0') << minute;
+        return ss.str();
+    }
+};
+
+// What to do with triggers that fell due while the process was down.
+enum class CatchUpPolicy { Skip, RunOnce, RunAll };
+
+// Lets more urgent commands run in the middle of a long operation; see CommandQueue.
+void preemptionPoint();
+
+// A long-running device action, such as a fade or a ramp, written as a
+// coroutine that co_awaits Scheduler::until() between steps. It has no
+// thread; its frame is all the state it keeps, and it is charged to the
+// scheduler's memory. Scheduler::startSequence() runs it.
+class DeviceSequence {
+public:
+    struct promise_type {
+        uint32_t slot = 0;  // in the scheduler's sequence table
+
+        DeviceSequence get_return_object() { return DeviceSequence(coroutine_handle<promise_type>::from_promise(*this)); }
+        suspend_always initial_suspend() noexcept { return {}; }
+        suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {}  // a step that throws just ends the sequence
+
+        static void* operator new(size_t n) {
+            void* p = ::operator new(n);
+            memoryAccount(MemoryTag::Scheduler).charge(n);
+            return p;
+        }
+        static void operator delete(void* p, size_t n) {
+            memoryAccount(MemoryTag::Scheduler).credit(n);
+            ::operator delete(p, n);
+        }
+    };
+    using Handle = coroutine_handle<promise_type>;
+
+    DeviceSequence(DeviceSequence&& other) noexcept : handle(exchange(other.handle, nullptr)) {}
+    ~DeviceSequence() {
+        if (handle) handle.destroy();
+    }
+    Handle release() { return exchange(handle, nullptr); }
+
+private:
+    explicit DeviceSequence(Handle h) : handle(h) {}
+    Handle handle;
+};
+
+// Daily schedules keyed by device ID (resolved through Device::hooks().index when
+// they fire). The run queue is a binary min-heap on the next trigger time;
+// removed or rescheduled entries leave stale heap items that are skipped by
+// generation number. Device sequences wait on a second heap of the same kind
+// and are resumed by the same runDue().
+class Scheduler {
+private:
+    struct Entry {
+        string deviceID;
+        Time time;
+        int64_t nextRun;
+        int64_t lastRun;
+        uint32_t generation;
+        uint32_t pendingRuns;
+        bool live;
+    };
+    struct QueueItem {
+        int64_t due;
+        uint32_t slot;
+        uint32_t generation;
+        // Reversed so the std heap algorithms keep the earliest trigger on top.
+        bool operator<(const QueueItem& other) const { return due > other.due; }
+    };
+
+    vector<Entry, TrackingAllocator<Entry, MemoryTag::Scheduler>> entries;
+    vector<uint32_t, TrackingAllocator<uint32_t, MemoryTag::Scheduler>> freeSlots;
+    TrackedHashMap<string, uint32_t, MemoryTag::Scheduler> byID;
+    vector<QueueItem, TrackingAllocator<QueueItem, MemoryTag::Scheduler>> queue;
+
+    struct Sequence {
+        string deviceID;
+        DeviceSequence::Handle handle;
+        uint32_t generation;
+        bool live;
+    };
+    vector<Sequence, TrackingAllocator<Sequence, MemoryTag::Scheduler>> sequences;
+    vector<uint32_t, TrackingAllocator<uint32_t, MemoryTag::Scheduler>> freeSequences;
+    TrackedHashMap<string, uint32_t, MemoryTag::Scheduler> sequenceByDevice;
+    vector<QueueItem, TrackingAllocator<QueueItem, MemoryTag::Scheduler>> wakes;
+    int64_t sequenceClock = 0;  // the time sequences are being run for
+    uint64_t sequenceSteps = 0;
+    bool verbose = true;
+    CatchUpPolicy catchUp = CatchUpPolicy::RunOnce;
+    uint32_t maxCatchUpRuns = 7;
+
+    static const int64_t Day = 86400;
+
+    static int64_t localMidnight(int64_t at) {
+        time_t t = at;
+        tm local;
+        localtime_r(&t, &local);
+        local.tm_hour = local.tm_min = local.tm_sec = 0;
+        local.tm_isdst = -1;
+        return mktime(&local);
+    }
+
+    // First occurrence of t strictly after `after`, given that day's midnight.
+    static int64_t nextOccurrence(const Time& t, int64_t after, int64_t midnight) {
+        int64_t at = midnight + t.hour * 3600 + t.minute * 60;
+        while (at <= after) at += Day;
+        return at;
+    }
+
+    void enqueue(uint32_t slot) {
+        queue.push_back(QueueItem{entries[slot].nextRun, slot, entries[slot].generation});
+        push_heap(queue.begin(), queue.end());
+        if (queue.size() > 2 * byID.size() + 64) rebuildQueue();
+    }
+
+    void rebuildQueue() {
+        queue.clear();
+        queue.reserve(byID.size());
+        for (const auto& [id, slot] : byID)
+            queue.push_back(QueueItem{entries[slot].nextRun, slot, entries[slot].generation});
+        make_heap(queue.begin(), queue.end());
+    }
+
+    // A device that isn't in memory (its owner evicted in lazy mode) is
+    // skipped without recording a run, so lastRun still shows it as missed.
+    void runEntry(Entry& entry, int64_t now, vector<string>* firedIDs) {
+        DeviceIndex* index = Device::hooks().index;
+        Device* device = index ? index->findByID(entry.deviceID) : nullptr;
+        if (!device) {
+            if (verbose) cout << "Scheduled action for " << entry.deviceID << " skipped: device not loaded\n";
+            return;
+        }
+        uint32_t runs = 1 + entry.pendingRuns;
+        entry.pendingRuns = 0;
+        entry.lastRun = now;
+        for (uint32_t i = 0; i < runs; i++) {
+            if (verbose) cout << "Running scheduled action at " << entry.time.toString() << endl;
+            if (!device->runScheduledAction()) {
+                if (verbose) cout << "Scheduled action for " << entry.deviceID << " refused by the power budget\n";
+                continue;
+            }
+            if (firedIDs) firedIDs->push_back(entry.deviceID);
+        }
+    }
+
+    uint32_t allocate(const string& deviceID, Time time) {
+        uint32_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            entries[slot].generation++;
+        } else {
+            slot = entries.size();
+            entries.push_back(Entry{"", Time(), 0, 0, 0, 0, false});
+        }
+        Entry& entry = entries[slot];
+        entry.deviceID = deviceID;
+        entry.time = time;
+        entry.lastRun = 0;
+        entry.pendingRuns = 0;
+        entry.live = true;
+        byID[deviceID] = slot;
+        return slot;
+    }
+
+    void endSequence(uint32_t slot) {
+        Sequence& seq = sequences[slot];
+        seq.handle.destroy();
+        seq.live = false;
+        seq.generation++;
+        sequenceByDevice.erase(seq.deviceID);
+        seq.deviceID.clear();
+        freeSequences.push_back(slot);
+    }
+
+    void resumeSequence(uint32_t slot) {
+        DeviceSequence::Handle handle = sequences[slot].handle;
+        sequenceSteps++;
+        handle.resume();
+        if (handle.done()) endSequence(slot);
+    }
+
+public:
+    Scheduler() = default;
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+    ~Scheduler() {
+        for (Sequence& seq : sequences)
+            if (seq.live) seq.handle.destroy();
+    }
+
+    // co_await until(at) in a sequence resumes it once the scheduler runs
+    // at or after `at` (seconds), and yields the time it runs for.
+    struct Until {
+        Scheduler& scheduler;
+        int64_t at;
+
+        bool await_ready() const { return at <= scheduler.sequenceClock; }
+        void await_suspend(DeviceSequence::Handle handle) {
+            uint32_t slot = handle.promise().slot;
+            scheduler.wakes.push_back(QueueItem{at, slot, scheduler.sequences[slot].generation});
+            push_heap(scheduler.wakes.begin(), scheduler.wakes.end());
+        }
+        int64_t await_resume() const { return scheduler.sequenceClock; }
+    };
+    Until until(int64_t at) { return Until{*this, at}; }
+
+    // Runs seq on deviceID up to its first wait, replacing any sequence
+    // already running on that device.
+    void startSequence(const string& deviceID, DeviceSequence seq, int64_t now) {
+        cancelSequence(deviceID);
+        uint32_t slot;
+        if (!freeSequences.empty()) {
+            slot = freeSequences.back();
+            freeSequences.pop_back();
+        } else {
+            slot = sequences.size();
+            sequences.push_back(Sequence{"", nullptr, 0, false});
+        }
+        Sequence& entry = sequences[slot];
+        entry.deviceID = deviceID;
+        entry.handle = seq.release();
+        entry.live = true;
+        entry.handle.promise().slot = slot;
+        sequenceByDevice[deviceID] = slot;
+        sequenceClock = now;
+        resumeSequence(slot);
+    }
+
+    // Ends the device's sequence where it is, e.g. when the user takes over.
+    bool cancelSequence(const string& deviceID) {
+        auto it = sequenceByDevice.find(deviceID);
+        if (it == sequenceByDevice.end()) return false;
+        endSequence(it->second);
+        return true;
+    }
+
+    size_t sequenceCount() const { return sequenceByDevice.size(); }
+    uint64_t sequenceResumes() const { return sequenceSteps; }
+    bool hasSequence(const string& deviceID) const { return sequenceByDevice.count(deviceID) > 0; }
+    // When runDue() next has a sequence step to run; 0 if none is waiting.
+    int64_t nextSequenceWake() const { return wakes.empty() ? 0 : wakes.front().due; }
+
+    void setVerbose(bool v) { verbose = v; }
+    void setCatchUpPolicy(CatchUpPolicy policy, uint32_t maxRuns = 7) {
+        catchUp = policy;
+        maxCatchUpRuns = maxRuns;
+    }
+    size_t size() const { return byID.size(); }
+
+    template <typename F>
+    void forEachSchedule(F visit) const {
+        for (const auto& [id, slot] : byID) visit(id, entries[slot].time);
+    }
+
+    void addSchedule(const string& deviceID, Time time) {
+        auto it = byID.find(deviceID);
+        uint32_t slot;
+        if (it != byID.end()) {
+            slot = it->second;
+            entries[slot].time = time;
+            entries[slot].generation++;
+        } else {
+            slot = allocate(deviceID, time);
+        }
+        int64_t now = ::time(0);
+        entries[slot].nextRun = nextOccurrence(time, now, localMidnight(now));
+        enqueue(slot);
+    }
+
+    void addSchedule(Device* device, Time time) {
+        addSchedule(device->getDeviceID(), time);
+        cout << "Scheduled device at " << time.toString() << endl;
+    }
+
+    bool removeSchedule(const string& deviceID) {
+        auto it = byID.find(deviceID);
+        if (it == byID.end()) return false;
+        Entry& entry = entries[it->second];
+        entry.live = false;
+        entry.generation++;
+        freeSlots.push_back(it->second);
+        byID.erase(it);
+        return true;
+    }
+
+    void removeSchedule(Device* device) {
+        if (removeSchedule(device->getDeviceID())) {
+            cout << "Schedule removed for device.\n";
+        } else {
+            cout << "No schedule found for device.\n";
+        }
+    }
+
+    // Runs everything due at or before `now`; returns the number of entries fired.
+    // firedIDs, if given, receives one device ID per action performed.
+    size_t runDue(int64_t now, vector<string>* firedIDs = nullptr) {
+        size_t fired = 0;
+        int64_t midnight = 0;
+        while (!queue.empty() && queue.front().due <= now) {
+            pop_heap(queue.begin(), queue.end());
+            QueueItem item = queue.back();
+            queue.pop_back();
+            Entry& entry = entries[item.slot];
+            if (!entry.live || entry.generation != item.generation) continue;
+            runEntry(entry, now, firedIDs);
+            fired++;
+            if (!midnight) midnight = localMidnight(now);
+            entry.nextRun = nextOccurrence(entry.time, now, midnight);
+            enqueue(item.slot);
+            preemptionPoint();
+        }
+        sequenceClock = now;
+        while (!wakes.empty() && wakes.front().due <= now) {
+            pop_heap(wakes.begin(), wakes.end());
+            QueueItem item = wakes.back();
+            wakes.pop_back();
+            if (sequences[item.slot].live && sequences[item.slot].generation == item.generation) resumeSequence(item.slot);
+            preemptionPoint();
+        }
+        return fired;
+    }
+
+    void checkAndRunSchedules() { runDue(::time(0)); }
+
+    void updateSchedule(Device* device, Time newTime) {
+        if (byID.count(device->getDeviceID())) {
+            addSchedule(device->getDeviceID(), newTime);
+            cout << "Schedule updated to " << newTime.toString() << endl;
+        } else {
+            cout << "Device not found in schedule.\n";
+        }
+    }
+
+    void listSchedules() {
+        cout << "Scheduled Devices:\n";
+        for (const auto& [id, slot] : byID) {
+            cout << "- Device " << id << " at " << entries[slot].time.toString() << endl;
+        }
+    }
+
+    Time getSchedule(Device* device) {
+        auto it = byID.find(device->getDeviceID());
+        if (it != byID.end()) {
+            return entries[it->second].time;
+        }
+        return Time(-1, -1); // Indicates not found
+    }
+
+    void clearAllSchedules() {
+        entries.clear();
+        freeSlots.clear();
+        byID.clear();
+        queue.clear();
+        if (verbose) cout << "All schedules cleared.\n";
+    }
+
+    // Binary section: "SHSC1", u32 count, i64 savedAt, then per entry
+    // u8 id length, id, u8 hour, u8 minute, i64 lastRun.
+    void save(ostream& out, int64_t now) const {
+        uint32_t count = byID.size();
+        out.write("SHSC1", 5);
+        out.write((const char*)&count, 4);
+        out.write((const char*)&now, 8);
+        for (const auto& [id, slot] : byID) {
+            const Entry& entry = entries[slot];
+            uint8_t len = uint8_t(min<size_t>(id.size(), 255));
+            uint8_t hm[2] = {uint8_t(entry.time.hour), uint8_t(entry.time.minute)};
+            out.write((const char*)&len, 1);
+            out.write(id.data(), len);
+            out.write((const char*)hm, 2);
+            out.write((const char*)&entry.lastRun, 8);
+        }
+    }
+
+    // Replaces all schedules with the saved ones and rebuilds the run queue
+    // in O(n) with one heapify. Triggers that fell between the later of
+    // lastRun/savedAt and `now` are handled by the catch-up policy.
+    size_t load(istream& in, int64_t now) {
+        char magic[5];
+        uint32_t count;
+        int64_t savedAt;
+        if (!in.read(magic, 5) || memcmp(magic, "SHSC1", 5) != 0 ||
+            !in.read((char*)&count, 4) || !in.read((char*)&savedAt, 8))
+            return 0;
+
+        entries.clear();
+        freeSlots.clear();
+        byID.clear();
+        entries.reserve(count);
+        byID.reserve(count);
+        int64_t midnight = localMidnight(now);
+        string id;
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t len, hm[2];
+            int64_t lastRun;
+            if (!in.read((char*)&len, 1)) break;
+            id.resize(len);
+            if (!in.read(&id[0], len) || !in.read((char*)hm, 2) || !in.read((char*)&lastRun, 8)) break;
+
+            Entry entry{id, Time(hm[0], hm[1]), 0, lastRun, 0, 0, true};
+            int64_t since = max(lastRun, savedAt);
+            int64_t next = nextOccurrence(entry.time, now, midnight);
+            int64_t latest = next - Day;
+            uint32_t missed = latest > since ? uint32_t(min<int64_t>((latest - since - 1) / Day + 1, maxCatchUpRuns)) : 0;
+            if (missed > 0 && catchUp != CatchUpPolicy::Skip) {
+                entry.nextRun = now;
+                entry.pendingRuns = catchUp == CatchUpPolicy::RunAll ? missed - 1 : 0;
+            } else {
+                entry.nextRun = next;
+            }
+            byID[id] = entries.size();
+            entries.push_back(move(entry));
+        }
+        rebuildQueue();
+        return byID.size();
+    }
+};
+
+// Moves a device setting in a straight line from where it is to target,
+// arriving at `until`, and waking once per `step` of change; a late wake
+// catches up to where the line is by then. The device is looked up by ID
+// at every step, and the sequence ends early if it has gone or the setting
+// was changed by anything else since the last step.
+template <typename D, typename Get, typename Set>
+DeviceSequence rampSetting(Scheduler& scheduler, string deviceID, float target, int64_t from, int64_t until,
+                           float step, Get get, Set set) {
+    auto find = [&deviceID] {
+        DeviceIndex* index = Device::hooks().index;
+        return index ? dynamic_cast<D*>(index->findByID(deviceID)) : nullptr;
+    };
+    D* device = find();
+    if (!device) co_return;
+    float start = get(device), last = start;
+    int64_t steps = max<int64_t>(1, llround(ceil(fabs(target - start) / step)));
+    int64_t span = max<int64_t>(1, until - from);
+    for (int64_t i = 1; i <= steps;) {
+        int64_t now = co_await scheduler.until(from + span * i / steps);
+        device = find();
+        if (!device || get(device) != last) co_return;
+        i = max(i, min(steps, (now - from) * steps / span));
+        last = i == steps ? target : start + (target - start) * i / steps;
+        set(device, last);
+        i++;
+    }
+}
+
+// "Fade the bedroom lights to 0 over 20 minutes": a light fading up is
+// switched on first, and one faded to 0 is switched off at the end.
+DeviceSequence fadeLight(Scheduler& scheduler, Light* light, float level, int64_t from, int64_t until) {
+    if (level > 0) light->turnOn();
+    return rampSetting<Light>(scheduler, light->getDeviceID(), level, from, until, 1.0f,
+                              [](Light* l) { return l->getBrightness(); },
+                              [level](Light* l, float v) {
+                                  l->setBrightness(v);
+                                  if (v == 0 && level == 0) l->turnOff();
+                              });
+}
+
+// "Ramp the AC to 22° by 6pm", in half degrees of target temperature.
+DeviceSequence rampTemperature(Scheduler& scheduler, TemperatureControlledDevices* device, float temperature,
+                               int64_t from, int64_t until) {
+    device->turnOn();
+    return rampSetting<TemperatureControlledDevices>(
+        scheduler, device->getDeviceID(), temperature, from, until, 0.5f,
+        [](TemperatureControlledDevices* d) { return d->getTargetTemperature(); },
+        [](TemperatureControlledDevices* d, float v) { d->setTemperature(v); });
+}
+
+// Energy (kWh) per device in one-hour intervals over a calendar month, the
+// granularity tariffs are priced at. Series are dense and only allocated
+// for devices that used something during the period.
+class UsageLedger {
+public:
+    static const int IntervalSec = 3600;
+
+private:
+    int64_t periodStart = 0;  // local midnight on the 1st
+    uint32_t intervals = 0;
+    using Series = vector<float, TrackingAllocator<float, MemoryTag::Energy>>;
+    TrackedHashMap<string, Series, MemoryTag::Energy> series;
+
+    Series& seriesFor(const string& deviceID) {
+        Series& s = series[deviceID];
+        if (s.empty()) s.assign(intervals, 0.0f);
+        return s;
+    }
+
+public:
+    UsageLedger() { startPeriod(time(0)); }
+
+    static int64_t monthStart(int64_t at, int monthsAhead = 0) {
+        time_t t = at;
+        tm local;
+        localtime_r(&t, &local);
+        local.tm_mday = 1;
+        local.tm_hour = local.tm_min = local.tm_sec = 0;
+        local.tm_mon += monthsAhead;
+        local.tm_isdst = -1;
+        return mktime(&local);
+    }
+
+    void startPeriod(int64_t at) {
+        periodStart = monthStart(at);
+        intervals = uint32_t((monthStart(at, 1) - periodStart) / IntervalSec);
+        series.clear();
+    }
+
+    int64_t start() const { return periodStart; }
+    int64_t end() const { return periodStart + int64_t(intervals) * IntervalSec; }
+    uint32_t intervalCount() const { return intervals; }
+    size_t deviceCount() const { return series.size(); }
+
+    void add(const string& deviceID, int64_t at, float kWh) {
+        if (at < periodStart || at >= end()) return;
+        seriesFor(deviceID)[(at - periodStart) / IntervalSec] += kWh;
+    }
+
+    // Spreads kWh evenly over [from, to); anything outside the period is dropped.
+    void accrue(const string& deviceID, int64_t from, int64_t to, float kWh) {
+        if (to <= from) return add(deviceID, from, kWh);
+        double perSecond = kWh / double(to - from);
+        int64_t lo = max(from, periodStart), hi = min(to, end());
+        if (lo >= hi) return;
+        Series& s = seriesFor(deviceID);
+        for (int64_t t = lo; t < hi;) {
+            uint32_t i = uint32_t((t - periodStart) / IntervalSec);
+            int64_t next = min(hi, periodStart + int64_t(i + 1) * IntervalSec);
+            s[i] += float(perSecond * (next - t));
+            t = next;
+        }
+    }
+
+    // nullptr when the device used nothing this period.
+    const float* find(const string& deviceID) const {
+        auto it = series.find(deviceID);
+        return it == series.end() ? nullptr : it->second.data();
+    }
+
+    // "SHUL1", i64 period start, u32 intervals, u32 devices, then per device
+    // u8 ID length, ID and one f32 per interval.
+    void save(ostream& out) const {
+        out.write("SHUL1", 5);
+        uint32_t devices = series.size();
+        out.write((const char*)&periodStart, 8);
+        out.write((const char*)&intervals, 4);
+        out.write((const char*)&devices, 4);
+        for (const auto& [id, s] : series) {
+            uint8_t len = uint8_t(min<size_t>(id.size(), 255));
+            out.write((const char*)&len, 1);
+            out.write(id.data(), len);
+            out.write((const char*)s.data(), s.size() * sizeof(float));
+        }
+    }
+
+    bool load(istream& in) {
+        char magic[5];
+        uint32_t devices;
+        if (!in.read(magic, 5) || memcmp(magic, "SHUL1", 5) != 0) return false;
+        if (!in.read((char*)&periodStart, 8) || !in.read((char*)&intervals, 4) || !in.read((char*)&devices, 4))
+            return false;
+        series.clear();
+        for (uint32_t d = 0; d < devices; d++) {
+            uint8_t len;
+            string id;
+            if (!in.read((char*)&len, 1)) return false;
+            id.resize(len);
+            Series s(intervals);
+            if (!in.read(&id[0], len) || !in.read((char*)s.data(), intervals * sizeof(float))) return false;
+            series[id] = move(s);
+        }
+        return true;
+    }
+};
+
+class EnergyMonitor : public EventSubscriber {
+private:
+    TrackedMap<string, float, MemoryTag::Energy> energyUsage;
+    TrackedMap<string, int64_t, MemoryTag::Energy> onSince;
+    UsageLedger ledger;  // the same usage, in kWh per hour of this month
+    float threshold;
+    mutable mutex lock;
+
+public:
+    EnergyMonitor() : threshold(30.0f) {}
+
+    void addUsage(const string& deviceID, float amount) {
+        lock_guard<mutex> guard(lock);
+        energyUsage[deviceID] += amount;
+        ledger.add(deviceID, time(0), amount);
+    }
+
+    void recordUsage(const string& deviceID, float amount) {
+        addUsage(deviceID, amount);
+        cout << "Recorded " << amount << " units for device: " << deviceID << endl;
+    }
+
+    // Accrues power * on-time whenever a device is switched off.
+    void onEvents(const DeviceEvent* events, size_t count) override {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < count; i++) {
+            const DeviceEvent& ev = events[i];
+            if (ev.type == DeviceEventType::TurnedOn) {
+                onSince.emplace(ev.deviceID, ev.at);
+            } else if (ev.type == DeviceEventType::TurnedOff) {
+                auto it = onSince.find(ev.deviceID);
+                if (it == onSince.end()) continue;
+                float hours = (ev.at - it->second) / 3600.0f;
+                energyUsage[ev.deviceID] += ev.value * hours;
+                ledger.accrue(ev.deviceID, it->second, ev.at, ev.value * hours);
+                onSince.erase(it);
+            }
+        }
+    }
+
+    float getUsage(const string& deviceID) const {
+        lock_guard<mutex> guard(lock);
+        auto it = energyUsage.find(deviceID);
+        if (it != energyUsage.end()) {
+            return it->second;
+        }
+        return 0.0f;
+    }
+
+    float getTotalUsage() const {
+        lock_guard<mutex> guard(lock);
+        float total = 0.0f;
+        for (auto& entry : energyUsage) {
+            total += entry.second;
+        }
+        return total;
+    }
+
+    // Runs f on the ledger with the monitor locked.
+    template<class F>
+    auto withLedger(F f) {
+        lock_guard<mutex> guard(lock);
+        return f(ledger);
+    }
+
+    // Once the clock has left the ledger's month, hands the finished month
+    // over and starts the current one.
+    bool rollOver(int64_t now, UsageLedger& finished) {
+        lock_guard<mutex> guard(lock);
+        if (now < ledger.end()) return false;
+        finished = move(ledger);
+        ledger = UsageLedger();
+        ledger.startPeriod(now);
+        return true;
+    }
+
+    void setThresholdQuiet(float value) {
+        lock_guard<mutex> guard(lock);
+        threshold = value;
+    }
+
+    void setThreshold(float value) {
+        threshold = value;
+        cout << "Energy threshold set to " << threshold << " units.\n";
+    }
+
+    float getThreshold() const {
+        lock_guard<mutex> guard(lock);
+        return threshold;
+    }
+
+    void checkThreshold() const {
+        float total = getTotalUsage();
+        if (total > threshold) {
+            cout << "️ Warning: Energy usage exceeded threshold! ("
+                 << total << " > " << threshold << ")\n";
+        } else {
+            cout << "✅ Energy usage within threshold. (" << total << " <= " << threshold << ")\n";
+        }
+    }
+
+    void displayUsageReport() const {
+        cout << "\n--- Energy Usage Report ---\n";
+        map<string, float> usage;
+        {
+            lock_guard<mutex> guard(lock);
+            usage.insert(energyUsage.begin(), energyUsage.end());
+        }
+        for (auto& entry : usage) {
+            cout << "Device ID: " << entry.first
+                 << " | Usage: " << fixed << setprecision(2)
+                 << entry.second << " units\n";
+        }
+        cout << "Total Usage: " << fixed << setprecision(2)
+             << getTotalUsage() << " units\n";
+        cout << "Threshold: " << fixed << setprecision(2)
+             << threshold << " units\n";
+        cout << "----------------------------\n";
+    }
+    ~ EnergyMonitor (){
+	}
+};
+
+// Time-of-use prices by hour (weekdays and weekends separately), block
+// surcharges on a household's running monthly total, and a daily standing
+// charge. Prices are per kWh.
+struct Tariff {
+    string name;
+    float hourly[2][24] = {};  // [weekend][hour]
+    vector<pair<float, float>> blocks;  // (upper bound in kWh, surcharge), ascending
+    float standingPerDay = 0.0f;
+};
+
+// Tariff definitions, one directive per line:
+//   tariff NAME
+//   standing PRICE_PER_DAY
+//   band weekday|weekend|all FROM_HOUR TO_HOUR PRICE
+//   block UP_TO_KWH|inf SURCHARGE
+//   assign USERNAME TARIFF
+// Users without an assignment are billed on the first tariff.
+class TariffBook {
+    vector<Tariff> tariffs;
+    unordered_map<string, size_t> byName;
+    unordered_map<string, size_t> assigned;
+
+public:
+    Tariff& add(const string& name) {
+        byName[name] = tariffs.size();
+        tariffs.push_back(Tariff{});
+        tariffs.back().name = name;
+        return tariffs.back();
+    }
+
+    void assign(const string& username, const string& tariff) {
+        auto it = byName.find(tariff);
+        if (it == byName.end()) throw DeviceException("Unknown tariff: " + tariff);
+        assigned[username] = it->second;
+    }
+
+    void load(const string& path) {
+        ifstream in(path);
+        if (!in.is_open()) throw DeviceException("Cannot open tariff file: " + path);
+        string line;
+        for (int lineNo = 1; getline(in, line); lineNo++) {
+            istringstream words(line);
+            string directive;
+            if (!(words >> directive) || directive[0] == '#') continue;
+            auto fail = [&](const string& what) {
+                throw DeviceException(path + ":" + to_string(lineNo) + ": " + what);
+            };
+            if (directive == "tariff") {
+                string name;
+                if (!(words >> name)) fail("tariff needs a name");
+                add(name);
+                continue;
+            }
+            if (directive == "assign") {
+                string user, tariff;
+                if (!(words >> user >> tariff)) fail("assign needs a user and a tariff");
+                assign(user, tariff);
+                continue;
+            }
+            if (tariffs.empty()) fail(directive + " before any tariff");
+            Tariff& t = tariffs.back();
+            if (directive == "standing") {
+                if (!(words >> t.standingPerDay)) fail("standing needs a price");
+            } else if (directive == "band") {
+                string days;
+                int from, to;
+                float price;
+                if (!(words >> days >> from >> to >> price) || from < 0 || to > 24 || from >= to)
+                    fail("band needs weekday|weekend|all FROM TO PRICE with 0 <= FROM < TO <= 24");
+                for (int weekend = 0; weekend < 2; weekend++) {
+                    if ((days == "weekday" && weekend) || (days == "weekend" && !weekend)) continue;
+                    for (int h = from; h < to; h++) t.hourly[weekend][h] = price;
+                }
+            } else if (directive == "block") {
+                string bound;
+                float surcharge;
+                if (!(words >> bound >> surcharge)) fail("block needs UP_TO_KWH|inf SURCHARGE");
+                float upTo = bound == "inf" ? FLT_MAX : strtof(bound.c_str(), nullptr);
+                if (!t.blocks.empty() && upTo <= t.blocks.back().first) fail("blocks must be ascending");
+                t.blocks.emplace_back(upTo, surcharge);
+            } else {
+                fail("unknown directive '" + directive + "'");
+            }
+        }
+        if (tariffs.empty()) throw DeviceException(path + ": no tariffs defined");
+    }
+
+    size_t size() const { return tariffs.size(); }
+    const Tariff& at(size_t i) const { return tariffs[i]; }
+
+    size_t indexFor(const string& username) const {
+        auto it = assigned.find(username);
+        return it == assigned.end() ? 0 : it->second;
+    }
+};
+
+struct DeviceCharge {
+    Device* device;
+    double kWh;
+    double cost;
+};
+
+struct RoomCharge {
+    string room;
+    double kWh;
+    double cost;
+};
+
+// A household's charges for the ledger period. Device and room costs
+// include their share of the block surcharges.
+struct Bill {
+    string user;
+    string tariff;
+    double kWh = 0, energyCost = 0, blockCost = 0, standingCost = 0;
+    vector<RoomCharge> rooms;
+    vector<DeviceCharge> devices;
+
+    double total() const { return energyCost + blockCost + standingCost; }
+
+    void print(ostream& out) const {
+        out << fixed << setprecision(2) << "\n--- Bill for " << user << " (" << tariff << ") ---\n";
+        for (const RoomCharge& room : rooms) {
+            out << room.room << ": " << room.kWh << " kWh, " << room.cost << "\n";
+            for (const DeviceCharge& d : devices)
+                if (d.device->getLocation() == room.room)
+                    out << "  " << d.device->getDeviceName() << " (" << d.device->getDeviceID() << "): "
+                        << d.kWh << " kWh, " << d.cost << "\n";
+        }
+        out << "Energy " << energyCost << " + blocks " << blockCost << " + standing " << standingCost
+            << " = " << total() << " for " << kWh << " kWh\n";
+    }
+};
+
+// Prices a ledger period. Each tariff is expanded once into a price per
+// interval, so billing a household is a few dense passes: sum its devices
+// into a household series, fold the block surcharges for its running total
+// into an effective price per interval, then one dot product per device.
+class BillingEngine {
+    const TariffBook& book;
+    const UsageLedger& ledger;
+    vector<vector<float>> prices;  // per tariff, per interval
+    uint32_t n;
+
+    static double dot(const float* a, const float* b, size_t count) {
+        float lanes[8] = {};
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+            for (int k = 0; k < 8; k++) lanes[k] += a[i + k] * b[i + k];
+        double total = 0;
+        for (int k = 0; k < 8; k++) total += lanes[k];
+        for (; i < count; i++) total += double(a[i]) * b[i];
+        return total;
+    }
+
+    static double sum(const float* a, size_t count) {
+        float lanes[8] = {};
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+            for (int k = 0; k < 8; k++) lanes[k] += a[i + k];
+        double total = 0;
+        for (int k = 0; k < 8; k++) total += lanes[k];
+        for (; i < count; i++) total += a[i];
+        return total;
+    }
+
+    // household and effective are scratch buffers, reused across users.
+    Bill billUser(User* user, vector<float>& household, vector<float>& effective) const {
+        size_t index = book.indexFor(user->getUsername());
+        const Tariff& tariff = book.at(index);
+        const vector<float>& price = prices[index];
+        Bill bill;
+        bill.user = user->getUsername();
+        bill.tariff = tariff.name;
+
+        household.assign(n, 0.0f);
+        for (const auto& [roomName, room] : user->getAllRooms())
+            for (Device* device : room->getDevices()) {
+                const float* s = ledger.find(device->getDeviceID());
+                if (!s) continue;
+                bill.devices.push_back({device, 0.0, 0.0});
+                float* h = household.data();
+                for (uint32_t i = 0; i < n; i++) h[i] += s[i];
+            }
+
+        effective = price;
+        if (!tariff.blocks.empty()) {
+            double running = 0;
+            size_t b = 0;
+            for (uint32_t i = 0; i < n; i++) {
+                double left = household[i], charge = 0;
+                if (left <= 0) continue;
+                while (left > 0) {
+                    bool last = b + 1 == tariff.blocks.size();
+                    double room = last ? left : max(0.0, double(tariff.blocks[b].first) - running);
+                    double take = min(left, room);
+                    charge += take * tariff.blocks[b].second;
+                    running += take;
+                    left -= take;
+                    if (left > 0) b++;
+                }
+                bill.blockCost += charge;
+                effective[i] += float(charge / household[i]);
+            }
+        }
+
+        bill.kWh = sum(household.data(), n);
+        bill.energyCost = dot(household.data(), price.data(), n);
+        bill.standingCost = tariff.standingPerDay * (double(n) * UsageLedger::IntervalSec / 86400.0);
+        for (DeviceCharge& d : bill.devices) {
+            const float* s = ledger.find(d.device->getDeviceID());
+            d.kWh = sum(s, n);
+            d.cost = dot(s, effective.data(), n);
+            const string& location = d.device->getLocation();
+            auto room = find_if(bill.rooms.begin(), bill.rooms.end(), [&](const RoomCharge& r) { return r.room == location; });
+            if (room == bill.rooms.end()) room = bill.rooms.insert(bill.rooms.end(), {location, 0.0, 0.0});
+            room->kWh += d.kWh;
+            room->cost += d.cost;
+        }
+        return bill;
+    }
+
+public:
+    BillingEngine(const TariffBook& tariffs, const UsageLedger& usage)
+        : book(tariffs), ledger(usage), n(usage.intervalCount()) {
+        // Local hour and weekday for each interval, shared by every tariff.
+        vector<uint8_t> hour(n), weekend(n);
+        for (uint32_t i = 0; i < n; i++) {
+            time_t t = ledger.start() + int64_t(i) * UsageLedger::IntervalSec;
+            tm local;
+            localtime_r(&t, &local);
+            hour[i] = local.tm_hour;
+            weekend[i] = local.tm_wday == 0 || local.tm_wday == 6;
+        }
+        prices.resize(book.size());
+        for (size_t t = 0; t < book.size(); t++) {
+            prices[t].resize(n);
+            for (uint32_t i = 0; i < n; i++) prices[t][i] = book.at(t).hourly[weekend[i]][hour[i]];
+        }
+    }
+
+    Bill bill(User* user) const {
+        vector<float> household, effective;
+        return billUser(user, household, effective);
+    }
+
+    // Bills every user in the home, split across threads (0 = one per core).
+    vector<Bill> run(SmartHome& home, unsigned threads = 0) const {
+        vector<User*> users;
+        for (const auto& [name, user] : home.getAllUsers()) users.push_back(user);
+        vector<Bill> bills(users.size());
+        if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+        threads = max(1u, min<unsigned>(threads, users.size()));
+        atomic<size_t> next(0);
+        auto worker = [&] {
+            vector<float> household, effective;
+            for (size_t i; (i = next.fetch_add(64)) < users.size();)
+                for (size_t j = i; j < min(users.size(), i + 64); j++) bills[j] = billUser(users[j], household, effective);
+        };
+        vector<thread> pool;
+        for (unsigned t = 1; t < threads; t++) pool.emplace_back(worker);
+        worker();
+        for (thread& t : pool) t.join();
+        return bills;
+    }
+};
+
+class RemoteControl {
+private:
+    User* user;
+
+public:
+    RemoteControl(User* u) : user(u) {}
+
+    bool turnDeviceOn(string roomName, string deviceName) {
+        Room* room = user->getRoom(roomName);
+        if (room) {
+            Device* device = room->getDevicesByName(deviceName);
+            if (device) {
+                if (!device->turnOn()) {
+                    cout << "Power budget exceeded, " << deviceName << " stays off." << endl;
+                    return false;
+                }
+                cout << "Turned ON device: " << deviceName << " in " << roomName << endl;
+                return true;
+            }
+        }
+        cout << "Failed to turn ON device. Room or device not found." << endl;
+        return false;
+    }
+
+    bool turnDeviceOff(string roomName, string deviceName) {
+        Room* room = user->getRoom(roomName);
+        if (room) {
+            Device* device = room->getDevicesByName(deviceName);
+            if (device) {
+                device->turnOff();
+                cout << "Turned OFF device: " << deviceName << " in " << roomName << endl;
+                return true;
+            }
+        }
+        cout << "Failed to turn OFF device. Room or device not found." << endl;
+        return false;
+    }
+
+    bool performDeviceAction(string roomName, string deviceName) {
+        Room* room = user->getRoom(roomName);
+        if (room) {
+            Device* device = room->getDevicesByName(deviceName);
+            if (device) {
+                device->performAction();
+                return true;
+            }
+        }
+        cout << "Failed to perform action. Room or device not found." << endl;
+        return false;
+    }
+
+    void listAllDevices() {
+        map<string, Room*> rooms = user->getAllRooms();
+        for (auto& pair : rooms) {
+            cout << "Room: " << pair.first << endl;
+            pair.second->displayDevices();
+        }
+    }
+
+    ~RemoteControl() {
+        cout << "RemoteControl disconnected.\n";
+    }
+};
+
+// Changes to several devices that take effect together or not at all.
+// stage() records each change with the device's version; commit() checks
+// every change (what the device supports, that no one else changed it
+// since, and that the new load fits the power budgets) before touching
+// anything, then applies them in one go. The caller holds whatever lock
+// guards the devices for the whole commit.
+class DeviceTransaction {
+public:
+    enum class Op : uint8_t { TurnOn, TurnOff, SetLevel, Lock, Unlock, Record, StopRecording };
+    struct Change {
+        Device* device;
+        Op op;
+        float value;
+        uint64_t version;  // when staged
+    };
+
+private:
+    // Enough of a device's state to put it back if applying fails part-way.
+    struct Saved {
+        Device* device;
+        bool on, locked, recording;
+        float level;
+    };
+
+    vector<Change> changes;
+    string failure;
+
+    static bool supports(Device* device, Op op, float value, string& why) {
+        switch (op) {
+            case Op::TurnOn: case Op::TurnOff: return true;
+            case Op::Lock: case Op::Unlock:
+                if (dynamic_cast<DoorLock*>(device)) return true;
+                why = "only door locks can be locked";
+                return false;
+            case Op::Record: case Op::StopRecording:
+                if (dynamic_cast<Camera*>(device)) return true;
+                why = "only cameras record";
+                return false;
+            case Op::SetLevel:
+                if (dynamic_cast<Light*>(device)) {
+                    if (value >= 0.0f && value <= 100.0f) return true;
+                    why = "brightness must be between 0 and 100";
+                } else if (dynamic_cast<TemperatureControlledDevices*>(device)) {
+                    if (isfinite(value)) return true;
+                    why = "not a temperature";
+                } else {
+                    why = "has no level to set";
+                }
+                return false;
+        }
+        return false;
+    }
+
+    static Saved save(Device* device) {
+        Saved s{device, device->getStatus(), false, false, 0.0f};
+        if (auto light = dynamic_cast<Light*>(device)) s.level = light->getBrightness();
+        else if (auto tcd = dynamic_cast<TemperatureControlledDevices*>(device)) s.level = tcd->getTargetTemperature();
+        else if (auto lock = dynamic_cast<DoorLock*>(device)) s.locked = lock->checkLockStatus();
+        else if (auto camera = dynamic_cast<Camera*>(device)) s.recording = camera->recording();
+        return s;
+    }
+
+    static void restore(const Saved& s) {
+        Device* device = s.device;
+        if (auto light = dynamic_cast<Light*>(device)) {
+            if (light->getBrightness() != s.level) light->setBrightness(s.level);
+        } else if (auto tcd = dynamic_cast<TemperatureControlledDevices*>(device)) {
+            if (tcd->getTargetTemperature() != s.level) tcd->setTemperature(s.level);
+        } else if (auto lock = dynamic_cast<DoorLock*>(device)) {
+            if (lock->checkLockStatus() != s.locked) s.locked ? lock->lockDoor() : lock->unlockDoor();
+        } else if (auto camera = dynamic_cast<Camera*>(device)) {
+            if (camera->recording() != s.recording) s.recording ? camera->startRecording() : camera->stopRecording();
+        }
+        if (device->getStatus() != s.on) s.on ? device->restoreOn() : device->turnOff();
+    }
+
+    static bool apply(const Change& c) {
+        switch (c.op) {
+            case Op::TurnOn: return c.device->turnOn();
+            case Op::TurnOff: c.device->turnOff(); return true;
+            case Op::SetLevel:
+                if (auto light = dynamic_cast<Light*>(c.device)) light->setBrightness(c.value);
+                else dynamic_cast<TemperatureControlledDevices*>(c.device)->setTemperature(c.value);
+                return true;
+            case Op::Lock: dynamic_cast<DoorLock*>(c.device)->lockDoor(); return true;
+            case Op::Unlock: dynamic_cast<DoorLock*>(c.device)->unlockDoor(); return true;
+            case Op::Record: dynamic_cast<Camera*>(c.device)->startRecording(); return true;
+            case Op::StopRecording: dynamic_cast<Camera*>(c.device)->stopRecording(); return true;
+        }
+        return false;
+    }
+
+    // Whether the devices left on afterwards fit the budgets: releases what
+    // the ones being switched off hold, reserves for the ones being switched
+    // on, then undoes all of it.
+    // validate() has refused conflicting switches, so each device has one.
+    bool fitsBudgets() {
+        unordered_map<Device*, bool> ending;
+        for (const Change& c : changes)
+            if (c.op == Op::TurnOn || c.op == Op::TurnOff) ending[c.device] = c.op == Op::TurnOn;
+        vector<pair<Device*, int64_t>> released, reserved;
+        for (const auto& [device, on] : ending) {
+            if (!on && device->getStatus() && device->reservedPower()) {
+                device->power.add(-device->reservedPower());
+                released.emplace_back(device, device->reservedPower());
+            }
+        }
+        bool fits = true;
+        for (const auto& [device, on] : ending) {
+            if (!on || device->getStatus()) continue;
+            int64_t mw = llround(double(device->powerConsumption) * 1e6);
+            if (device->power.reserve(mw)) {
+                failure = "turning on " + device->getDeviceName() + " would exceed a power budget";
+                fits = false;
+                break;
+            }
+            reserved.emplace_back(device, mw);
+        }
+        for (const auto& [device, mw] : reserved) device->power.add(-mw);
+        for (const auto& [device, mw] : released) device->power.add(mw);
+        return fits;
+    }
+
+public:
+    static bool parseOp(string_view token, Op& op) {
+        static const pair<const char*, Op> names[] = {{"on", Op::TurnOn}, {"off", Op::TurnOff}, {"level", Op::SetLevel},
+                                                      {"lock", Op::Lock}, {"unlock", Op::Unlock}, {"record", Op::Record},
+                                                      {"stop", Op::StopRecording}};
+        for (const auto& [name, value] : names) {
+            if (token == name) {
+                op = value;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void stage(Device* device, Op op, float value = 0.0f) {
+        changes.push_back(Change{device, op, value, device->getVersion()});
+    }
+
+    bool validate() {
+        failure.clear();
+        if (changes.empty()) {
+            failure = "nothing to change";
+            return false;
+        }
+        // commit() applies switch-offs before everything else, so a device
+        // both switched on and off would not end the way it was staged.
+        unordered_map<Device*, Op> switched;
+        for (const Change& c : changes) {
+            if (c.op == Op::TurnOn || c.op == Op::TurnOff) {
+                auto [it, first] = switched.emplace(c.device, c.op);
+                if (!first && it->second != c.op) {
+                    failure = c.device->getDeviceName() + " is switched both on and off";
+                    return false;
+                }
+            }
+        }
+        for (const Change& c : changes) {
+            string why;
+            if (!supports(c.device, c.op, c.value, why)) {
+                failure = c.device->getDeviceName() + ": " + why;
+                return false;
+            }
+            if (c.device->getVersion() != c.version) {
+                failure = c.device->getDeviceName() + " changed since the transaction was staged";
+                return false;
+            }
+        }
+        return fitsBudgets();
+    }
+
+    // Validates, then applies every change: switch-offs first, so the load
+    // they release is there for the switch-ons. If one is still refused
+    // (the budgets moved in between), everything applied is put back.
+    bool commit() {
+        if (!validate()) return false;
+        vector<Saved> undo;
+        unordered_set<Device*> saved;
+        for (const Change& c : changes)
+            if (saved.insert(c.device).second) undo.push_back(save(c.device));
+        bool ok = true;
+        for (const Change& c : changes)
+            if (c.op == Op::TurnOff) apply(c);
+        for (const Change& c : changes) {
+            if (c.op != Op::TurnOff && !apply(c)) {
+                failure = "turning on " + c.device->getDeviceName() + " was refused by a power budget";
+                ok = false;
+                break;
+            }
+        }
+        if (!ok)
+            for (auto it = undo.rbegin(); it != undo.rend(); ++it) restore(*it);
+        return ok;
+    }
+
+    const string& error() const { return failure; }
+    size_t size() const { return changes.size(); }
+    const vector<Change>& staged() const { return changes; }
+
+    // Each device once, in the order first staged.
+    vector<Device*> devices() const {
+        vector<Device*> out;
+        for (const Change& c : changes)
+            if (find(out.begin(), out.end(), c.device) == out.end()) out.push_back(c.device);
+        return out;
+    }
+};
+
+// Maps the type names used in data files and prompts to concrete devices.
+// GCC inlines Device::operator new here and then flags the delete on a
+// constructor's failure path as a mismatch with the global new inside it;
+// the pair is Device's own, so the warning is off for these functions.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+Device* createDevice(string_view type, const string& id, const string& name, const string& loc) {
+    if (type == "Light") return new Light(id, name, loc);
+    if (type == "Thermostat") return new Thermostat(id, name, loc);
+    if (type == "Camera") return new Camera(id, name, loc);
+    if (type == "DoorLock" || type == "Door Lock") return new DoorLock(id, name, loc);
+    if (type == "AC" || type == "AirConditioner") return new AirConditioner(id, name, loc);
+    return nullptr;
+}
+#pragma GCC diagnostic pop
+
+// Single-token type name, so DEVICE lines always split cleanly on spaces.
+string deviceTypeToken(Device* device) {
+    if (dynamic_cast<DoorLock*>(device)) return "DoorLock";
+    if (dynamic_cast<AirConditioner*>(device)) return "AC";
+    return device->getDeciceType();
+}
+
+// Rated power in kW of a newly added device.
+float defaultPowerKw(Device* device) {
+    if (dynamic_cast<Light*>(device)) return 0.1f;
+    if (dynamic_cast<Thermostat*>(device)) return 0.5f;
+    if (dynamic_cast<Camera*>(device)) return 0.05f;
+    if (dynamic_cast<DoorLock*>(device)) return 0.02f;
+    if (dynamic_cast<AirConditioner*>(device)) return 1.5f;
+    return 0.0f;
+}
+
+// Adds the devices of a manifest as one batch. One device per line:
+//   USER ROOM ID NAME TYPE [INITIAL]
+// INITIAL is a light's brightness or a thermostat's/AC's target. Users must
+// exist; missing rooms are created. Lines are checked in parallel, and every
+// ID against the rest of the manifest and against the whole home (the
+// index's Bloom filter settles most of those without a lookup). Nothing is
+// added unless every line passes.
+class BulkProvisioner {
+public:
+    struct Problem {
+        size_t line;
+        string message;
+    };
+
+private:
+    struct Row {
+        size_t line = 0;
+        string_view text = {};
+        string_view user = {}, room = {}, id = {}, name = {}, type = {};
+        User* owner = nullptr;
+        float initial = 0.0f;
+        bool hasInitial = false, ok = false;
+        uint64_t hash = 0;
+    };
+
+    SmartHome& home;
+    DeviceIndex& index;
+    string manifest;
+    vector<Row> rows;
+    vector<Problem> problems;
+
+    void check(Row& row, const map<string, User*>& users, vector<Problem>& found) const {
+        string_view fields[7];
+        size_t n = 0;
+        for (size_t i = 0; i < row.text.size() && n < 7;) {
+            while (i < row.text.size() && isspace((unsigned char)row.text[i])) i++;
+            size_t start = i;
+            while (i < row.text.size() && !isspace((unsigned char)row.text[i])) i++;
+            if (i > start) fields[n++] = row.text.substr(start, i - start);
+        }
+        if (n < 5 || n > 6) return found.push_back({row.line, "expected USER ROOM ID NAME TYPE [INITIAL]"});
+        row.user = fields[0], row.room = fields[1], row.id = fields[2], row.name = fields[3], row.type = fields[4];
+        auto user = users.find(string(row.user));
+        if (user == users.end()) return found.push_back({row.line, "no such user '" + string(row.user) + "'"});
+        row.owner = user->second;
+        // Longer IDs would be cut short in events and collide.
+        if (row.id.size() >= sizeof(DeviceEvent::deviceID))
+            return found.push_back({row.line, "device ID longer than " + to_string(sizeof(DeviceEvent::deviceID) - 1) + " characters"});
+        unique_ptr<Device> probe(createDevice(row.type, "", "", ""));
+        if (!probe) return found.push_back({row.line, "unknown device type '" + string(row.type) + "'"});
+        if (n == 6) {
+            string value(fields[5]);
+            char* end;
+            row.initial = strtof(value.c_str(), &end);
+            row.hasInitial = true;
+            if (*end != '\0') return found.push_back({row.line, "initial value is not a number"});
+            if (dynamic_cast<Light*>(probe.get()) && (row.initial < 0.0f || row.initial > 100.0f))
+                return found.push_back({row.line, "brightness must be between 0 and 100"});
+            if (!dynamic_cast<Light*>(probe.get()) && !dynamic_cast<TemperatureControlledDevices*>(probe.get()))
+                return found.push_back({row.line, string(row.type) + " takes no initial value"});
+        }
+        row.hash = BloomFilter::hash(row.id);
+        if (index.mayContainID(row.hash) && index.findByID(string(row.id)))
+            return found.push_back({row.line, "device ID '" + string(row.id) + "' already exists"});
+        row.ok = true;
+    }
+
+    template <class F>
+    static void inParallel(unsigned threads, F f) {
+        vector<thread> pool;
+        for (unsigned t = 1; t < threads; t++) pool.emplace_back(f, t);
+        f(0);
+        for (thread& t : pool) t.join();
+    }
+
+public:
+    BulkProvisioner(SmartHome& h, DeviceIndex& idx) : home(h), index(idx) {}
+
+    void load(const string& path) {
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) throw DeviceException("Cannot open manifest: " + path);
+        parse(string(istreambuf_iterator<char>(in), istreambuf_iterator<char>()));
+    }
+
+    // Splits the manifest into lines; blank lines and '#' comments are skipped.
+    void parse(string text) {
+        manifest = move(text);
+        rows.clear();
+        problems.clear();
+        string_view all(manifest);
+        size_t line = 0;
+        for (size_t pos = 0; pos < all.size();) {
+            size_t end = all.find('\n', pos);
+            if (end == string_view::npos) end = all.size();
+            string_view text = all.substr(pos, end - pos);
+            line++;
+            pos = end + 1;
+            size_t first = text.find_first_not_of(" \t\r");
+            if (first == string_view::npos || text[first] == '#') continue;
+            rows.push_back(Row{line, text});
+        }
+    }
+
+    size_t size() const { return rows.size(); }
+    const vector<Problem>& errors() const { return problems; }
+
+    // Checks every line; returns the number of problems (see errors()).
+    size_t validate(unsigned threads = 0) {
+        if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+        threads = max<size_t>(1, min<size_t>(threads, rows.size() / 1024 + 1));
+        map<string, User*> users = home.getAllUsers();
+        vector<vector<Problem>> found(threads);
+        inParallel(threads, [&](unsigned t) {
+            size_t lo = rows.size() * t / threads, hi = rows.size() * (t + 1) / threads;
+            for (size_t i = lo; i < hi; i++) check(rows[i], users, found[t]);
+        });
+        // Duplicates within the manifest: each thread owns the IDs that hash to it.
+        inParallel(threads, [&](unsigned t) {
+            unordered_map<string_view, size_t> seen;
+            for (const Row& row : rows) {
+                if (!row.ok || row.hash % threads != t) continue;
+                auto [it, fresh] = seen.emplace(row.id, row.line);
+                if (!fresh)
+                    found[t].push_back({row.line, "device ID '" + string(row.id) + "' is also on line " + to_string(it->second)});
+            }
+        });
+        problems.clear();
+        for (auto& f : found) problems.insert(problems.end(), make_move_iterator(f.begin()), make_move_iterator(f.end()));
+        sort(problems.begin(), problems.end(), [](const Problem& a, const Problem& b) { return a.line < b.line; });
+        return problems.size();
+    }
+
+    // Adds every device; only after validate() found no problems. Returns
+    // the number of rooms created.
+    size_t commit() {
+        if (!problems.empty()) throw DeviceException("Manifest has problems; nothing was added");
+        size_t roomsAdded = 0;
+        for (const Row& row : rows) {
+            string roomName(row.room);
+            Room* room = row.owner->getRoom(roomName);
+            if (!room) {
+                room = new Room(roomName);
+                row.owner->addRoom(room);
+                roomsAdded++;
+            }
+            Device* device = createDevice(row.type, string(row.id), string(row.name), roomName);
+            device->powerConsumption = defaultPowerKw(device);
+            if (row.hasInitial) {
+                if (auto light = dynamic_cast<Light*>(device)) light->setBrightness(row.initial);
+                else if (auto tcd = dynamic_cast<TemperatureControlledDevices*>(device)) tcd->setTemperature(row.initial);
+            }
+            room->addDevice(device);
+        }
+        return roomsAdded;
+    }
+};
+
+enum class RecordKind { User, Room, Device, Invalid };
+
+// One USER/ROOM/DEVICE line. Fields point into the reader's buffer and are
+// only valid until the next call to RecordReader::next.
+// DEVICE fields: type id name location status [power [extra]]
+struct DataRecord {
+    static const size_t MaxFields = 7;
+    RecordKind kind;
+    size_t line;
+    size_t fieldCount;
+    string_view fields[MaxFields];
+    const char* error;
+    const char* text = nullptr;  // start of the line; null for binary records
+    size_t column = 0;           // where the error is, from 1; 0 if unknown
+
+    string field(size_t i) const { return i < fieldCount ? string(fields[i]) : string(); }
+    // Column (from 1) a field starts at in a text record, or 0.
+    size_t columnOf(size_t i) const { return text && i < fieldCount ? fields[i].data() - text + 1 : 0; }
+};
+
+// Byte scans for the text data format, 16 bytes at a time with SSE2. Loads
+// may run past `end` as far as `limit` (the end of the whole buffer), so
+// short lines and tokens still use whole vectors; results stop at `end`.
+struct TextScan {
+    static bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+#if defined(__SSE2__)
+    static unsigned blankBits(const char* p) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+        return _mm_movemask_epi8(_mm_or_si128(blank, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    }
+#endif
+
+    // The first blank at or after p if `blank`, else the first non-blank; end if none.
+    static const char* find(const char* p, const char* end, const char* limit, bool blank) {
+#if defined(__SSE2__)
+        while (p < end && p + 16 <= limit) {
+            unsigned bits = blankBits(p);
+            if (!blank) bits = ~bits & 0xffff;
+            if (bits) return min(end, p + __builtin_ctz(bits));
+            p += 16;
+        }
+#endif
+        while (p < end && isBlank(*p) != blank) p++;
+        return min(p, end);
+    }
+
+    static const char* findNewline(const char* p, const char* end) {
+#if defined(__SSE2__)
+        const __m128i nl = _mm_set1_epi8('\n');
+        for (; p + 16 <= end; p += 16) {
+            unsigned bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), nl));
+            if (bits) return p + __builtin_ctz(bits);
+        }
+#endif
+        while (p < end && *p != '\n') p++;
+        return p;
+    }
+};
+
+const char* recordKeyword(RecordKind kind) {
+    switch (kind) {
+        case RecordKind::User: return "USER";
+        case RecordKind::Room: return "ROOM";
+        case RecordKind::Device: return "DEVICE";
+        default: return "INVALID";
+    }
+}
+
+// Pull parser over text or binary ("SHB1") data files, in constant memory.
+class RecordReader {
+    istream& in;
+    bool binary;
+    string buffer;
+    size_t lineNo;
+    uint64_t consumed;
+    uint64_t recordStart;
+
+    static bool readVarint(istream& in, uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int c = in.get();
+            if (c == EOF) return false;
+            value |= uint64_t(c & 0x7f) << shift;
+            if (!(c & 0x80)) return true;
+        }
+        return false;
+    }
+
+    bool nextBinary(DataRecord& rec) {
+        recordStart = in.tellg();
+        int kind = in.get();
+        if (kind == EOF) return false;
+        int count = in.get();
+        lineNo++;
+        rec.line = lineNo;
+        rec.error = nullptr;
+        if (count == EOF || kind > (int)RecordKind::Device || count > (int)DataRecord::MaxFields) {
+            rec.kind = RecordKind::Invalid;
+            rec.fieldCount = 0;
+            rec.error = "corrupt binary record";
+            in.setstate(ios::failbit);
+            return true;
+        }
+        rec.kind = (RecordKind)kind;
+        size_t offsets[DataRecord::MaxFields + 1];
+        buffer.clear();
+        for (int i = 0; i < count; i++) {
+            uint64_t len;
+            bool whole = readVarint(in, len) && len <= (1u << 20);
+            if (whole) {
+                offsets[i] = buffer.size();
+                buffer.resize(buffer.size() + len);
+                in.read(&buffer[offsets[i]], len);
+                whole = uint64_t(in.gcount()) == len;
+            }
+            if (!whole) {
+                // Nothing after this can be trusted to start a record.
+                rec.kind = RecordKind::Invalid;
+                rec.fieldCount = 0;
+                rec.error = "truncated binary record";
+                in.setstate(ios::failbit);
+                return true;
+            }
+        }
+        offsets[count] = buffer.size();
+        rec.fieldCount = count;
+        for (int i = 0; i < count; i++)
+            rec.fields[i] = string_view(buffer).substr(offsets[i], offsets[i + 1] - offsets[i]);
+        return true;
+    }
+
+public:
+    static constexpr char Magic[4] = {'S', 'H', 'B', '1'};
+
+    // Splits one text line (without its newline) into rec, in place; bytes
+    // up to limit may be read past the line. Errors carry the column.
+    static void parseLine(string_view line, const char* limit, DataRecord& rec) {
+        const char* p = line.data();
+        const char* end = p + line.size();
+        rec.text = p;
+        rec.fieldCount = 0;
+        rec.error = nullptr;
+        rec.column = 0;
+        auto nextToken = [&] {
+            const char* start = TextScan::find(p, end, limit, false);
+            p = TextScan::find(start, end, limit, true);
+            return string_view(start, p - start);
+        };
+
+        string_view keyword = nextToken();
+        size_t expected;
+        if (keyword == "USER") { rec.kind = RecordKind::User; expected = 2; }
+        else if (keyword == "ROOM") { rec.kind = RecordKind::Room; expected = 1; }
+        else if (keyword == "DEVICE") { rec.kind = RecordKind::Device; expected = 5; }
+        else {
+            rec.kind = RecordKind::Invalid;
+            rec.error = "unknown record type";
+            rec.column = keyword.data() - line.data() + 1;
+            return;
+        }
+
+        size_t maxFields = rec.kind == RecordKind::Device ? DataRecord::MaxFields - 1 : expected;
+        if (rec.kind == RecordKind::Device) {
+            // Older saves wrote the display name "Door Lock" as the type.
+            const char* saved = p;
+            if (nextToken() == "Door" && nextToken() == "Lock") rec.fields[rec.fieldCount++] = "DoorLock";
+            else p = saved;
+        }
+        while (rec.fieldCount < maxFields) {
+            string_view token = nextToken();
+            if (token.empty()) break;
+            rec.fields[rec.fieldCount++] = token;
+        }
+        if (rec.kind == RecordKind::Device) {
+            // The rest of the line, which may hold blanks (a camera's motion time).
+            const char* start = TextScan::find(p, end, limit, false);
+            const char* last = end;
+            while (last > start && TextScan::isBlank(last[-1])) last--;
+            if (start < last) rec.fields[rec.fieldCount++] = string_view(start, last - start);
+        }
+        if (rec.fieldCount < expected) {
+            rec.kind = RecordKind::Invalid;
+            rec.error = "missing fields";
+            rec.column = line.size() + 1;
+            while (rec.column > 1 && TextScan::isBlank(line[rec.column - 2])) rec.column--;
+        }
+    }
+
+    RecordReader(istream& input) : in(input), binary(false), lineNo(0), consumed(0), recordStart(0) {
+        char head[4];
+        if (in.read(head, 4) && memcmp(head, Magic, 4) == 0) {
+            binary = true;
+            consumed = 4;
+        } else {
+            in.clear();
+            in.seekg(0);
+        }
+    }
+
+    bool isBinary() const { return binary; }
+
+    // Byte offset of the record last returned by next().
+    uint64_t recordOffset() const { return recordStart; }
+
+    bool next(DataRecord& rec) {
+        if (binary) return nextBinary(rec);
+        while (true) {
+            recordStart = consumed;
+            if (!getline(in, buffer)) break;
+            consumed += buffer.size() + (in.eof() ? 0 : 1);
+            lineNo++;
+            if (buffer.find_first_not_of(" \t\r") == string::npos) continue;
+            rec.line = lineNo;
+            parseLine(buffer, buffer.data() + buffer.size(), rec);
+            return true;
+        }
+        return false;
+    }
+};
+
+// Reads a text data file straight from a read-only mapping: lines are found
+// with TextScan and records point into the mapping, so nothing is copied.
+// Binary files aren't handled here (isBinary()); use RecordReader for them.
+class MappedTextReader {
+    int fd = -1;
+    const char* data = nullptr;
+    size_t size = 0;
+    const char* pos = nullptr;
+    const char* recordStart = nullptr;
+    size_t lineNo = 0;
+    bool binary = false;
+
+public:
+    MappedTextReader(const string& path) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                data = (const char*)p;
+                size = st.st_size;
+            }
+        }
+        pos = recordStart = data;
+        binary = size >= 4 && memcmp(data, RecordReader::Magic, 4) == 0;
+    }
+
+    MappedTextReader(const MappedTextReader&) = delete;
+    MappedTextReader& operator=(const MappedTextReader&) = delete;
+
+    ~MappedTextReader() {
+        if (data) munmap((void*)data, size);
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool isOpen() const { return fd >= 0; }
+    bool isBinary() const { return binary; }
+    size_t bytes() const { return size; }
+    // Byte offset of the record last returned by next().
+    uint64_t recordOffset() const { return recordStart - data; }
+
+    bool next(DataRecord& rec) {
+        const char* end = data + size;
+        while (!binary && pos < end) {
+            const char* nl = TextScan::findNewline(pos, end);
+            string_view line(pos, nl - pos);
+            recordStart = pos;
+            pos = nl < end ? nl + 1 : end;
+            lineNo++;
+            if (TextScan::find(line.data(), nl, end, false) == nl) continue;
+            rec.line = lineNo;
+            RecordReader::parseLine(line, end, rec);
+            return true;
+        }
+        return false;
+    }
+};
+
+class RecordWriter {
+    ostream& out;
+    bool binary;
+    string buffer;
+
+    void putVarint(uint64_t value) {
+        while (value >= 0x80) {
+            buffer += char((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        buffer += char(value);
+    }
+
+public:
+    RecordWriter(ostream& output, bool bin) : out(output), binary(bin) {
+        if (binary) out.write(RecordReader::Magic, 4);
+    }
+
+    void write(RecordKind kind, const string_view* fields, size_t count) {
+        buffer.clear();
+        if (binary) {
+            buffer += char(kind);
+            buffer += char(count);
+            for (size_t i = 0; i < count; i++) {
+                putVarint(fields[i].size());
+                buffer.append(fields[i]);
+            }
+        } else {
+            buffer += recordKeyword(kind);
+            for (size_t i = 0; i < count; i++) {
+                buffer += ' ';
+                buffer.append(fields[i]);
+            }
+            buffer += '\n';
+        }
+        out.write(buffer.data(), buffer.size());
+    }
+
+    void write(const DataRecord& rec) { write(rec.kind, rec.fields, rec.fieldCount); }
+};
+
+// Callbacks for streamRecords; returning false stops the scan.
+class RecordVisitor {
+public:
+    virtual bool onUser(const DataRecord&) { return true; }
+    virtual bool onRoom(const DataRecord&) { return true; }
+    virtual bool onDevice(const DataRecord&) { return true; }
+    virtual bool onInvalid(const DataRecord&) { return true; }
+    virtual ~RecordVisitor() {}
+};
+
+template <typename Reader>
+size_t visitRecords(Reader& reader, RecordVisitor& visitor) {
+    DataRecord rec;
+    size_t count = 0;
+    while (reader.next(rec)) {
+        count++;
+        bool more = true;
+        switch (rec.kind) {
+            case RecordKind::User: more = visitor.onUser(rec); break;
+            case RecordKind::Room: more = visitor.onRoom(rec); break;
+            case RecordKind::Device: more = visitor.onDevice(rec); break;
+            default: more = visitor.onInvalid(rec); break;
+        }
+        if (!more) break;
+    }
+    return count;
+}
+
+size_t streamRecords(istream& in, RecordVisitor& visitor) {
+    RecordReader reader(in);
+    return visitRecords(reader, visitor);
+}
+
+// A data file by path: text files are mapped and tokenized in place, binary
+// ones are streamed. A missing file has no records.
+size_t streamRecords(const string& path, RecordVisitor& visitor) {
+    MappedTextReader mapped(path);
+    if (!mapped.isBinary()) return visitRecords(mapped, visitor);
+    ifstream in(path, ios::binary);
+    return streamRecords(in, visitor);
+}
+
+// Sets status, power and the type-specific value from a DEVICE record.
+void applyDeviceRecord(Device* device, const DataRecord& rec) {
+    // Power first, so switching on reserves the right amount.
+    if (rec.fieldCount > 5) {
+        float power = strtof(rec.field(5).c_str(), nullptr);
+        if (device->getStatus() && power != device->powerConsumption) device->turnOff();
+        device->powerConsumption = power;
+    }
+    if (rec.fields[4] == "1") device->restoreOn();
+    else if (device->getStatus()) device->turnOff();
+    if (rec.fieldCount > 6) {
+        float value = strtof(rec.field(6).c_str(), nullptr);
+        if (auto light = dynamic_cast<Light*>(device)) light->setBrightness(value);
+        else if (auto tcd = dynamic_cast<TemperatureControlledDevices*>(device)) tcd->setTemperature(value);
+        else if (auto lock = dynamic_cast<DoorLock*>(device)) lock->restoreLocked(value != 0.0f);
+    }
+}
+
+// Builds a device from a DEVICE record, restoring status, power and the
+// type-specific value. Returns nullptr for unknown types.
+Device* deviceFromRecord(const DataRecord& rec) {
+    Device* device = createDevice(rec.fields[0], rec.field(1), rec.field(2), rec.field(3));
+    if (device) applyDeviceRecord(device, rec);
+    return device;
+}
+
+// Rebuilds users (with their rooms and devices) from a record stream.
+class HomeBuilder : public RecordVisitor {
+    User* currentUser = nullptr;
+    Room* currentRoom = nullptr;
+    unordered_map<string, size_t> userSlots;
+public:
+    vector<User*> users;
+    vector<Device*> devices;
+    bool collectDevicesOnly = false;
+
+    bool onUser(const DataRecord& rec) override {
+        if (collectDevicesOnly) return true;
+        currentUser = new User(rec.field(0), rec.fields[1] == "-" ? "" : rec.field(1));
+        currentRoom = nullptr;
+        // Stores that append user blocks may hold several copies; the last one wins.
+        auto seen = userSlots.find(currentUser->getUsername());
+        if (seen != userSlots.end()) {
+            delete users[seen->second];
+            users[seen->second] = currentUser;
+        } else {
+            userSlots[currentUser->getUsername()] = users.size();
+            users.push_back(currentUser);
+        }
+        return true;
+    }
+
+    bool onRoom(const DataRecord& rec) override {
+        if (collectDevicesOnly || !currentUser) return true;
+        currentRoom = new Room(rec.field(0));
+        if (!currentUser->addRoom(currentRoom)) {
+            delete currentRoom;
+            currentRoom = currentUser->getRoom(rec.field(0));
+        }
+        return true;
+    }
+
+    bool onDevice(const DataRecord& rec) override {
+        Device* device = deviceFromRecord(rec);
+        if (!device) return true;
+        if (collectDevicesOnly) devices.push_back(device);
+        else if (currentRoom) currentRoom->addDevice(device);
+        else delete device;
+        return true;
+    }
+};
+
+class DataStorage {
+private:
+    string filename;
+
+public:
+    DataStorage(const string& fname) : filename(fname) {}
+
+    static void writeUser(ostream& out, User* user) {
+        out << "USER " << user->getUsername() << " " << (user->hasLegacyPassword() ? user->getPassword() : "-") << "\n";
+
+        for (const auto& [roomName, room] : user->getAllRooms()) {
+            out << "ROOM " << roomName << "\n";
+            for (Device* device : room->getDevices()) writeDevice(out, device);
+        }
+    }
+
+    static void writeDevice(ostream& out, Device* device) {
+        out << "DEVICE " << deviceTypeToken(device) << " "
+            << device->getDeviceID() << " "
+            << device->getDeviceName() << " "
+            << device->getLocation() << " "
+            << device->getStatus() << " "
+            << device->powerConsumption << " ";
+        
+        if (auto light = dynamic_cast<Light*>(device)) {
+            out << light->getBrightness();
+        } 
+        else if (auto thermo = dynamic_cast<Thermostat*>(device)) {
+            out << thermo->getCurrentTemperature();
+        }
+        else if (auto camera = dynamic_cast<Camera*>(device)) {
+            out << (camera->getLastMotionTime().empty() ? "NoMotion" : camera->getLastMotionTime());
+        }
+        else if (auto doorLock = dynamic_cast<DoorLock*>(device)) {
+            out << doorLock->checkLockStatus();
+        }
+        else if (auto ac = dynamic_cast<AirConditioner*>(device)) {
+            out << ac->getCurrentTemperature();
+        }
+        out << "\n";
+    }
+
+    void saveSystem(SmartHome* smartHome) {
+        ofstream out(filename, ios::trunc);
+        if (!out.is_open()) {
+            throw DeviceException("Cannot open file for writing: " + filename);
+        }
+
+        for (const auto& [username, user] : smartHome->getAllUsers()) {
+            writeUser(out, user);
+            preemptionPoint();
+        }
+        out.close();
+    }
+
+    void saveUser(User* user) {
+        ofstream out(filename, ios::app);  
+        if (!out.is_open()) {
+            cerr << "Cannot open file to save user: " << filename << endl;
+            return;
+        }
+
+        out << "USER " << user->getUsername() << " " << (user->hasLegacyPassword() ? user->getPassword() : "-") << "\n";
+
+        auto& rooms = user->getAllRooms(); 
+        for (auto it = rooms.begin(); it != rooms.end(); ++it) {
+            const string& roomName = it->first;  
+            Room* room = it->second;
+            out << "ROOM " << roomName << "\n";
+
+            for (Device* device : room->getDevices()) {
+                saveDevice(device);
+            }
+        }
+
+        out.close();
+    }
+
+    // Streams a callback per record without materializing the file.
+    size_t streamRecords(RecordVisitor& visitor) { return ::streamRecords(filename, visitor); }
+
+    vector<User*> loadUsers() {
+        HomeBuilder builder;
+        streamRecords(builder);
+        return builder.users;
+    }
+
+    void saveDevice(Device* device) {
+        ofstream out(filename, ios::app);  
+        if (!out.is_open()) {
+            cerr << "Cannot open file to save device: " << filename << endl;
+            return;
+        }
+
+        out << "DEVICE " << deviceTypeToken(device) << " "
+            << device->getDeviceID() << " "
+            << device->getDeviceName() << " "
+            << device->getLocation() << " "
+            << device->getStatus() << "\n";
+
+        out.close();
+    }
+
+    vector<Device*> loadDevices() {
+        if (!MappedTextReader(filename).isOpen()) {
+            cerr << "Cannot open file to load devices: " << filename << endl;
+            return {};
+        }
+        HomeBuilder builder;
+        builder.collectDevicesOnly = true;
+        ::streamRecords(filename, builder);
+        return builder.devices;
+    }
+
+    string scheduleFile() const { return filename + ".sched"; }
+
+    void saveSchedules(const Scheduler& scheduler) {
+        string tmp = scheduleFile() + ".tmp";
+        {
+            ofstream out(tmp, ios::binary | ios::trunc);
+            if (!out.is_open()) throw DeviceException("Cannot open file for writing: " + tmp);
+            scheduler.save(out, time(0));
+        }
+        if (rename(tmp.c_str(), scheduleFile().c_str()) != 0)
+            throw DeviceException("Cannot replace schedule file: " + scheduleFile());
+    }
+
+    size_t loadSchedules(Scheduler& scheduler) {
+        ifstream in(scheduleFile(), ios::binary);
+        if (!in.is_open()) return 0;
+        return scheduler.load(in, time(0));
+    }
+
+    string usageFile() const { return filename + ".usage"; }
+    string historyFile() const { return filename + ".history"; }
+
+    // Where a closed month is kept for billing, e.g. data.txt.usage.2026-09.
+    string usageArchiveFile(const UsageLedger& ledger) const {
+        char month[16];
+        time_t start = ledger.start();
+        tm local;
+        localtime_r(&start, &local);
+        strftime(month, sizeof(month), ".%Y-%m", &local);
+        return usageFile() + month;
+    }
+
+    void saveUsage(const UsageLedger& ledger, const string& path) {
+        string tmp = path + ".tmp";
+        {
+            ofstream out(tmp, ios::binary | ios::trunc);
+            if (!out.is_open()) throw DeviceException("Cannot open file for writing: " + tmp);
+            ledger.save(out);
+        }
+        if (rename(tmp.c_str(), path.c_str()) != 0) throw DeviceException("Cannot replace usage file: " + path);
+    }
+
+    void saveUsage(EnergyMonitor& monitor) {
+        monitor.withLedger([&](const UsageLedger& ledger) { saveUsage(ledger, usageFile()); });
+    }
+
+    // Keeps the current month's ledger if the file holds an older one; the
+    // older month is archived first, as a checkpoint at the roll-over would.
+    bool loadUsage(EnergyMonitor& monitor) {
+        ifstream in(usageFile(), ios::binary);
+        if (!in.is_open()) return false;
+        UsageLedger stored;
+        if (!stored.load(in)) throw DeviceException("Corrupt usage file: " + usageFile());
+        bool current = monitor.withLedger([&](UsageLedger& ledger) {
+            if (stored.start() != ledger.start()) return false;
+            ledger = move(stored);
+            return true;
+        });
+        if (!current) saveUsage(stored, usageArchiveFile(stored));
+        return current;
+    }
+
+    void clearStorage() {
+        ofstream out(filename, ios::trunc);
+        out.close();
+    }
+
+
+};
+
+// Per-user access to a text data file through an on-disk index
+// (<data>.idx: "name offset length" per user, header holds the data size it
+// describes). Updated users are appended as new blocks and the index is
+// repointed; compact() drops the stale copies.
+class UserStore {
+    struct Entry {
+        uint64_t offset;
+        uint64_t length;
+    };
+    string dataFile, indexFile;
+    unordered_map<string, Entry> index;
+    uint64_t dataSize = 0;
+    uint64_t liveBytes = 0;
+
+    static uint64_t fileSize(const string& path) {
+        ifstream in(path, ios::binary | ios::ate);
+        return in.is_open() ? (uint64_t)in.tellg() : 0;
+    }
+
+    void writeHeader() {
+        fstream idx(indexFile, ios::in | ios::out | ios::binary);
+        char header[40];
+        snprintf(header, sizeof(header), "SHIDX1 %020llu\n", (unsigned long long)dataSize);
+        idx.write(header, strlen(header));
+    }
+
+    void writeIndex() {
+        ofstream idx(indexFile, ios::trunc | ios::binary);
+        char header[40];
+        snprintf(header, sizeof(header), "SHIDX1 %020llu\n", (unsigned long long)dataSize);
+        idx << header;
+        for (const auto& [name, entry] : index)
+            idx << name << " " << entry.offset << " " << entry.length << "\n";
+    }
+
+    bool loadIndex() {
+        ifstream idx(indexFile);
+        string magic;
+        uint64_t describedSize;
+        if (!(idx >> magic >> describedSize) || magic != "SHIDX1" || describedSize != dataSize) return false;
+        string name;
+        Entry entry;
+        while (idx >> name >> entry.offset >> entry.length) {
+            auto it = index.find(name);
+            if (it != index.end()) liveBytes -= it->second.length;
+            index[name] = entry;
+            liveBytes += entry.length;
+        }
+        return true;
+    }
+
+    void rebuildIndex() {
+        index.clear();
+        liveBytes = 0;
+        MappedTextReader reader(dataFile);
+        if (reader.isOpen()) {
+            if (reader.isBinary()) throw DeviceException("Lazy loading needs a text data file: " + dataFile);
+            DataRecord rec;
+            string current;
+            uint64_t start = 0;
+            auto close = [&](uint64_t end) {
+                if (current.empty()) return;
+                auto it = index.find(current);
+                if (it != index.end()) liveBytes -= it->second.length;
+                index[current] = Entry{start, end - start};
+                liveBytes += end - start;
+            };
+            while (reader.next(rec)) {
+                if (rec.kind != RecordKind::User) continue;
+                close(reader.recordOffset());
+                current = rec.field(0);
+                start = reader.recordOffset();
+            }
+            close(dataSize);
+        }
+        writeIndex();
+    }
+
+public:
+    UserStore(const string& fname) : dataFile(fname), indexFile(fname + ".idx") {
+        dataSize = fileSize(dataFile);
+        if (!loadIndex()) rebuildIndex();
+    }
+
+    bool contains(const string& name) const { return index.count(name) > 0; }
+    size_t userCount() const { return index.size(); }
+
+    User* load(const string& name) {
+        auto it = index.find(name);
+        if (it == index.end()) return nullptr;
+        ifstream in(dataFile, ios::binary);
+        in.seekg(it->second.offset);
+        string block(it->second.length, '\0');
+        in.read(&block[0], block.size());
+        istringstream blockStream(block);
+        HomeBuilder builder;
+        streamRecords(blockStream, builder);
+        if (builder.users.empty()) throw DeviceException("Index points at a non-user block for " + name);
+        for (size_t i = 1; i < builder.users.size(); i++) delete builder.users[i];
+        return builder.users[0];
+    }
+
+    void store(User* user) {
+        ostringstream block;
+        DataStorage::writeUser(block, user);
+        const string& bytes = block.str();
+        {
+            ofstream out(dataFile, ios::app | ios::binary);
+            if (!out.is_open()) throw DeviceException("Cannot open file for writing: " + dataFile);
+            out.write(bytes.data(), bytes.size());
+        }
+        Entry entry{dataSize, bytes.size()};
+        dataSize += bytes.size();
+        auto it = index.find(user->getUsername());
+        if (it != index.end()) liveBytes -= it->second.length;
+        index[user->getUsername()] = entry;
+        liveBytes += entry.length;
+
+        writeHeader();
+        ofstream idx(indexFile, ios::app | ios::binary);
+        idx << user->getUsername() << " " << entry.offset << " " << entry.length << "\n";
+    }
+
+    bool needsCompaction() const { return dataSize > 2 * liveBytes + 4096; }
+
+    // Rewrites only the live copy of each user, then the index.
+    void compact() {
+        string tmpFile = dataFile + ".tmp";
+        {
+            ifstream in(dataFile, ios::binary);
+            ofstream out(tmpFile, ios::trunc | ios::binary);
+            if (!out.is_open()) throw DeviceException("Cannot open file for writing: " + tmpFile);
+            string block;
+            uint64_t offset = 0;
+            for (auto& [name, entry] : index) {
+                block.resize(entry.length);
+                in.seekg(entry.offset);
+                in.read(&block[0], block.size());
+                out.write(block.data(), block.size());
+                entry.offset = offset;
+                offset += entry.length;
+            }
+            dataSize = liveBytes = offset;
+        }
+        if (rename(tmpFile.c_str(), dataFile.c_str()) != 0)
+            throw DeviceException("Cannot replace data file: " + dataFile);
+        writeIndex();
+    }
+};
+
+// LRU-bounded set of resident users on top of a UserStore. Dirty users are
+// written back when evicted or on flush(); pinned users are never evicted.
+class ResidentUserCache : public UserLoader {
+    struct Slot {
+        User* user;
+        bool dirty;
+        int pins;
+        list<string>::iterator position;
+    };
+    SmartHome* home;
+    UserStore& store;
+    size_t capacity;
+    list<string> recency;
+    unordered_map<string, Slot> slots;
+
+    void admitSlot(User* user, bool dirty) {
+        const string& name = user->getUsername();
+        recency.push_front(name);
+        slots[name] = Slot{user, dirty, 0, recency.begin()};
+        home->addUser(name, user);
+        evictIfNeeded();
+    }
+
+    // The most recent user is never the victim: it is the one just admitted
+    // or touched, and the caller is about to use it. With every other user
+    // pinned the set stays over capacity until an unpin.
+    void evictIfNeeded() {
+        auto it = recency.end();
+        while (slots.size() > capacity && --it != recency.begin()) {
+            Slot& slot = slots[*it];
+            if (slot.pins > 0) continue;
+            if (slot.dirty) {
+                store.store(slot.user);
+                writebacks++;
+            }
+            home->removeUser(*it);
+            delete slot.user;
+            slots.erase(*it);
+            it = recency.erase(it);
+            evictions++;
+        }
+    }
+
+public:
+    size_t loads = 0, evictions = 0, writebacks = 0;
+
+    ResidentUserCache(SmartHome* h, UserStore& s, size_t cap) : home(h), store(s), capacity(max<size_t>(1, cap)) {}
+
+    User* loadUser(const string& name) override {
+        if (!store.contains(name)) return nullptr;
+        User* user = store.load(name);
+        loads++;
+        admitSlot(user, false);
+        return user;
+    }
+
+    void touchUser(const string& name) override {
+        auto it = slots.find(name);
+        if (it != slots.end()) recency.splice(recency.begin(), recency, it->second.position);
+    }
+
+    // Takes ownership of a newly registered user.
+    void admit(User* user) { admitSlot(user, true); }
+
+    void markDirty(const string& name) {
+        auto it = slots.find(name);
+        if (it != slots.end()) it->second.dirty = true;
+    }
+
+    void pin(const string& name) {
+        auto it = slots.find(name);
+        if (it != slots.end()) it->second.pins++;
+    }
+
+    void unpin(const string& name) {
+        auto it = slots.find(name);
+        if (it != slots.end() && it->second.pins > 0) it->second.pins--;
+        evictIfNeeded();
+    }
+
+    void flush() {
+        for (auto& [name, slot] : slots) {
+            if (!slot.dirty) continue;
+            store.store(slot.user);
+            slot.dirty = false;
+            writebacks++;
+        }
+    }
+
+    size_t residentCount() const { return slots.size(); }
+};
+
+// Appends every device event to a journal file, one write per batch.
+class EventJournal : public EventSubscriber {
+    FILE* file;
+    string buffer;
+public:
+    EventJournal(const string& fname) : file(fopen(fname.c_str(), "a")) {
+        if (!file) throw DeviceException("Cannot open event journal: " + fname);
+    }
+
+    void onEvents(const DeviceEvent* events, size_t count) override {
+        buffer.clear();
+        char line[160];
+        for (size_t i = 0; i < count; i++) {
+            const DeviceEvent& ev = events[i];
+            int n = snprintf(line, sizeof(line), "%lld %d %s %g %g %d\n", (long long)ev.at, (int)ev.type,
+                             ev.deviceID, ev.value, ev.value2, ev.flag ? 1 : 0);
+            buffer.append(line, n);
+        }
+        fwrite(buffer.data(), 1, buffer.size(), file);
+        fflush(file);
+    }
+
+    ~EventJournal() { fclose(file); }
+};
+
+struct HistoryPolicy {
+    int64_t retainSec = 90 * 86400;     // dropped after this
+    int64_t downsampleSec = 7 * 86400;  // coarsened after this...
+    int64_t resolutionSec = 60;         // ...to this step
+    uint64_t maxBytes = 64u << 20;
+};
+
+// Per-device history of state transitions, kept in <data>.history. Each
+// device's transitions collect in an open block of up to BlockSize; a full
+// block is appended to the file compressed (varint time deltas, the value
+// only when it changes) behind a header with its time span, the kinds it
+// holds and the device's state when it opened. Those headers are the
+// sparse time index: startup reads only them, and range, duration and
+// "last time" queries decode only the blocks they overlap.
+// Timestamps are nanoseconds since the epoch, kept non-decreasing per
+// device. compact() applies the retention policy: old blocks are dropped,
+// older ones coarsened to one change per channel per resolution step, and
+// the oldest dropped beyond a size cap.
+class TransitionLog : public EventSubscriber {
+public:
+    struct Transition {
+        int64_t at;
+        DeviceEventType kind;
+        float value;
+    };
+    enum StateBit : uint8_t { On = 1, Locked = 2, Recording = 4 };
+    static const size_t BlockSize = 128;
+    static const size_t HeaderSize = 29;  // after the u8-prefixed device ID
+
+private:
+    struct Block {
+        int64_t first, last;
+        uint64_t offset;  // of the payload
+        uint32_t bytes, count;
+        uint16_t kinds;
+        uint8_t state, known, flags;
+    };
+    static const uint8_t Downsampled = 1;
+
+    struct History {
+        vector<Block> blocks;
+        vector<Transition> open;
+        uint8_t openState = 0, openKnown = 0;  // when the open block started
+        uint8_t state = 0, known = 0;          // after the latest transition
+        float brightness = NAN, target = NAN;  // latest settings
+        int64_t lastAt = 0;
+
+        // Applies t; false if it repeats the current state or setting
+        // (e.g. devices announcing their saved state at startup).
+        bool change(const Transition& t) {
+            bool sets;
+            uint8_t bit = stateBit(t.kind, &sets);
+            if (bit && (known & bit) && bool(state & bit) == sets) return false;
+            float* setting = t.kind == DeviceEventType::BrightnessChanged ? &brightness
+                           : t.kind == DeviceEventType::TargetTemperatureSet ? &target : nullptr;
+            if (setting && *setting == t.value) return false;
+            if (setting) *setting = t.value;
+            applyState(t.kind, state, known);
+            return true;
+        }
+    };
+
+    string path;
+    int fd;
+    uint64_t fileSize = 0, compactedSize = 0;
+    int64_t lastCompaction;
+    HistoryPolicy policy;
+    unordered_map<string, History> devices;
+    mutable mutex lock;
+
+    static bool tracked(DeviceEventType kind) {
+        switch (kind) {
+            case DeviceEventType::TurnedOn: case DeviceEventType::TurnedOff:
+            case DeviceEventType::RecordingStarted: case DeviceEventType::RecordingStopped:
+            case DeviceEventType::MotionDetected:
+            case DeviceEventType::DoorLocked: case DeviceEventType::DoorUnlocked:
+            case DeviceEventType::BrightnessChanged: case DeviceEventType::TargetTemperatureSet:
+            case DeviceEventType::PowerDenied: case DeviceEventType::LoadShed:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // The state channel a kind switches, and whether it switches it on.
+    static uint8_t stateBit(DeviceEventType kind, bool* sets = nullptr) {
+        bool on = kind == DeviceEventType::TurnedOn || kind == DeviceEventType::DoorLocked ||
+                  kind == DeviceEventType::RecordingStarted;
+        if (sets) *sets = on;
+        switch (kind) {
+            case DeviceEventType::TurnedOn: case DeviceEventType::TurnedOff: return On;
+            case DeviceEventType::DoorLocked: case DeviceEventType::DoorUnlocked: return Locked;
+            case DeviceEventType::RecordingStarted: case DeviceEventType::RecordingStopped: return Recording;
+            default: return 0;
+        }
+    }
+
+    static void applyState(DeviceEventType kind, uint8_t& state, uint8_t& known) {
+        bool sets;
+        uint8_t bit = stateBit(kind, &sets);
+        known |= bit;
+        state = sets ? state | bit : state & ~bit;
+    }
+
+    static void putVarint(string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out += char((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        out += char(value);
+    }
+
+    static void encode(const Transition* ts, size_t n, string& out) {
+        int64_t prev = ts[0].at;
+        float prevValue = 0.0f;
+        for (size_t i = 0; i < n; i++) {
+            putVarint(out, uint64_t(ts[i].at - prev));
+            prev = ts[i].at;
+            bool changed = memcmp(&ts[i].value, &prevValue, sizeof(float)) != 0;
+            out += char(uint8_t(ts[i].kind) | (changed ? 0x80 : 0));
+            if (changed) out.append((const char*)&ts[i].value, sizeof(float));
+            prevValue = ts[i].value;
+        }
+    }
+
+    bool decode(const Block& b, vector<Transition>& out) const {
+        out.clear();
+        string buf(b.bytes, '\0');
+        if (pread(fd, &buf[0], b.bytes, b.offset) != ssize_t(b.bytes)) return false;
+        const uint8_t* p = (const uint8_t*)buf.data();
+        const uint8_t* end = p + buf.size();
+        int64_t at = b.first;
+        float value = 0.0f;
+        for (uint32_t i = 0; i < b.count; i++) {
+            uint64_t delta = 0;
+            for (int shift = 0; p < end; shift += 7) {
+                delta |= uint64_t(*p & 0x7f) << shift;
+                if (!(*p++ & 0x80)) break;
+            }
+            if (p == end) return false;
+            uint8_t kind = *p++;
+            if (kind & 0x80) {
+                if (end - p < 4) return false;
+                memcpy(&value, p, 4);
+                p += 4;
+            }
+            at += int64_t(delta);
+            out.push_back({at, DeviceEventType(kind & 0x7f), value});
+        }
+        return true;
+    }
+
+    // Appends one block to the file behind `out`; false if the write failed.
+    static bool writeBlock(int out, uint64_t& size, const string& id, const Transition* ts, size_t n,
+                           uint8_t state, uint8_t known, uint8_t flags, Block& b) {
+        string payload;
+        encode(ts, n, payload);
+        b = Block{ts[0].at, ts[n - 1].at, 0, uint32_t(payload.size()), uint32_t(n), 0, state, known, flags};
+        for (size_t i = 0; i < n; i++) b.kinds |= uint16_t(1u << uint8_t(ts[i].kind));
+        uint8_t idLen = uint8_t(min<size_t>(id.size(), 255));
+        string rec(1, char(idLen));
+        rec.append(id, 0, idLen);
+        char h[HeaderSize];
+        memcpy(h, &b.first, 8);
+        memcpy(h + 8, &b.last, 8);
+        memcpy(h + 16, &b.count, 4);
+        memcpy(h + 20, &b.bytes, 4);
+        memcpy(h + 24, &b.kinds, 2);
+        h[26] = char(state);
+        h[27] = char(known);
+        h[28] = char(flags);
+        rec.append(h, HeaderSize);
+        b.offset = size + rec.size();
+        rec += payload;
+        if (write(out, rec.data(), rec.size()) != ssize_t(rec.size())) return false;
+        size += rec.size();
+        return true;
+    }
+
+    void seal(const string& id, History& h) {
+        if (h.open.empty()) return;
+        Block b;
+        if (writeBlock(fd, fileSize, id, h.open.data(), h.open.size(), h.openState, h.openKnown, 0, b))
+            h.blocks.push_back(b);
+        else
+            cerr << "smarthome: lost " << h.open.size() << " transitions of " << id << ": cannot write " << path << endl;
+        h.open.clear();
+        h.openState = h.state;
+        h.openKnown = h.known;
+    }
+
+    // Reads the block headers, cutting off a block left half-written.
+    void loadIndex() {
+        ifstream in(path, ios::binary);
+        char magic[5];
+        if (!in.read(magic, 5) || memcmp(magic, "SHHL1", 5) != 0) {
+            if (ftruncate(fd, 0) != 0 || write(fd, "SHHL1", 5) != 5) throw DeviceException("Cannot initialize " + path);
+            fileSize = 5;
+            return;
+        }
+        uint64_t end = lseek(fd, 0, SEEK_END), good = 5;
+        while (true) {
+            uint8_t idLen;
+            string id;
+            char h[HeaderSize];
+            if (!in.read((char*)&idLen, 1)) break;
+            id.resize(idLen);
+            if (!in.read(&id[0], idLen) || !in.read(h, HeaderSize)) break;
+            Block b;
+            memcpy(&b.first, h, 8);
+            memcpy(&b.last, h + 8, 8);
+            memcpy(&b.count, h + 16, 4);
+            memcpy(&b.bytes, h + 20, 4);
+            memcpy(&b.kinds, h + 24, 2);
+            b.state = uint8_t(h[26]);
+            b.known = uint8_t(h[27]);
+            b.flags = uint8_t(h[28]);
+            b.offset = good + 1 + idLen + HeaderSize;
+            if (b.offset + b.bytes > end) break;
+            devices[id].blocks.push_back(b);
+            good = b.offset + b.bytes;
+            in.seekg(b.bytes, ios::cur);
+        }
+        if (good < end && ftruncate(fd, good) != 0) throw DeviceException("Cannot repair " + path);
+        fileSize = good;
+        vector<Transition> ts;
+        for (auto& [id, h] : devices) {
+            const Block& last = h.blocks.back();
+            h.state = last.state;
+            h.known = last.known;
+            if (decode(last, ts))
+                for (const Transition& t : ts) h.change(t);
+            h.openState = h.state;
+            h.openKnown = h.known;
+            h.lastAt = last.last;
+        }
+    }
+
+    // Calls f with every transition of the device before `to`, starting at
+    // the first block that reaches `from`; state/known start as they were
+    // when that block opened.
+    template <class F>
+    void scan(const string& id, int64_t from, int64_t to, uint8_t& state, uint8_t& known, F f) const {
+        state = known = 0;
+        auto it = devices.find(id);
+        if (it == devices.end()) return;
+        const History& h = it->second;
+        size_t b = partition_point(h.blocks.begin(), h.blocks.end(), [&](const Block& k) { return k.last < from; }) -
+                   h.blocks.begin();
+        state = b < h.blocks.size() ? h.blocks[b].state : h.openState;
+        known = b < h.blocks.size() ? h.blocks[b].known : h.openKnown;
+        vector<Transition> ts;
+        for (; b < h.blocks.size(); b++) {
+            if (h.blocks[b].first >= to) return;
+            if (!decode(h.blocks[b], ts)) continue;
+            for (const Transition& t : ts) {
+                if (t.at >= to) return;
+                f(t);
+            }
+        }
+        for (const Transition& t : h.open) {
+            if (t.at >= to) return;
+            f(t);
+        }
+    }
+
+    // Per resolution step, keeps the last transition of each state channel
+    // that ended the step changed, and the last of every other kind.
+    static vector<Transition> downsample(const vector<Transition>& ts, uint8_t state, uint8_t known, int64_t res) {
+        vector<Transition> out;
+        for (size_t i = 0; i < ts.size();) {
+            int64_t step = ts[i].at - ts[i].at % res;
+            uint8_t startState = state, startKnown = known;
+            const Transition* last[16] = {};
+            for (; i < ts.size() && ts[i].at < step + res; i++) {
+                applyState(ts[i].kind, state, known);
+                last[uint8_t(ts[i].kind) & 15] = &ts[i];
+            }
+            uint8_t changed = (state ^ startState) | (known & ~startKnown);
+            for (const Transition* t : last) {
+                if (!t) continue;
+                bool sets;
+                uint8_t bit = stateBit(t->kind, &sets);
+                if (bit && (!(changed & bit) || sets != bool(state & bit))) continue;
+                out.push_back({step, t->kind, t->value});
+            }
+        }
+        return out;
+    }
+
+public:
+    TransitionLog(const string& file, HistoryPolicy p = HistoryPolicy()) : path(file), lastCompaction(time(0)), policy(p) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) throw DeviceException("Cannot open device history: " + path);
+        loadIndex();
+        compactedSize = fileSize;
+    }
+
+    void setPolicy(const HistoryPolicy& p) {
+        lock_guard<mutex> guard(lock);
+        policy = p;
+    }
+
+    void onEvents(const DeviceEvent* events, size_t count) override {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < count; i++) {
+            const DeviceEvent& ev = events[i];
+            if (!tracked(ev.type)) continue;
+            auto it = devices.try_emplace(ev.deviceID).first;
+            History& h = it->second;
+            Transition t{max(ev.atNs, h.lastAt), ev.type, ev.value};
+            if (!h.change(t)) continue;
+            h.open.push_back(t);
+            h.lastAt = t.at;
+            if (h.open.size() == BlockSize) seal(it->first, h);
+        }
+    }
+
+    // Writes out every open block.
+    void flush() {
+        lock_guard<mutex> guard(lock);
+        for (auto& [id, h] : devices) seal(id, h);
+    }
+
+    // Transitions of the device in [from, to).
+    vector<Transition> range(const string& id, int64_t from, int64_t to) const {
+        lock_guard<mutex> guard(lock);
+        vector<Transition> out;
+        uint8_t state, known;
+        scan(id, from, to, state, known, [&](const Transition& t) {
+            if (t.at >= from) out.push_back(t);
+        });
+        return out;
+    }
+
+    // The latest transition of the given kind before `before`.
+    bool last(const string& id, DeviceEventType kind, int64_t before, Transition& found) const {
+        lock_guard<mutex> guard(lock);
+        auto it = devices.find(id);
+        if (it == devices.end()) return false;
+        const History& h = it->second;
+        for (auto t = h.open.rbegin(); t != h.open.rend(); ++t)
+            if (t->kind == kind && t->at < before) return found = *t, true;
+        vector<Transition> ts;
+        for (auto b = h.blocks.rbegin(); b != h.blocks.rend(); ++b) {
+            if (b->first >= before || !(b->kinds & (1u << uint8_t(kind))) || !decode(*b, ts)) continue;
+            for (auto t = ts.rbegin(); t != ts.rend(); ++t)
+                if (t->kind == kind && t->at < before) return found = *t, true;
+        }
+        return false;
+    }
+
+    // Nanoseconds in [from, to) that the channel was known to be on (or off).
+    int64_t timeIn(const string& id, StateBit bit, int64_t from, int64_t to, bool on = true) const {
+        lock_guard<mutex> guard(lock);
+        uint8_t state, known;
+        int64_t total = 0, cursor = from;
+        auto counts = [&] { return (known & bit) && bool(state & bit) == on; };
+        scan(id, from, to, state, known, [&](const Transition& t) {
+            if (t.at >= from) {
+                if (counts()) total += t.at - cursor;
+                cursor = t.at;
+            }
+            applyState(t.kind, state, known);
+        });
+        if (counts()) total += to - cursor;
+        return total;
+    }
+
+    uint64_t bytes() const {
+        lock_guard<mutex> guard(lock);
+        return fileSize;
+    }
+
+    size_t blockCount() const {
+        lock_guard<mutex> guard(lock);
+        size_t n = 0;
+        for (const auto& [id, h] : devices) n += h.blocks.size();
+        return n;
+    }
+
+    // Due once a day, when the file has grown by a quarter since the last
+    // compaction, or when it is over the size cap.
+    bool compactionDue(int64_t now) const {
+        lock_guard<mutex> guard(lock);
+        return now - lastCompaction >= 86400 || fileSize > policy.maxBytes ||
+               fileSize - compactedSize > compactedSize / 4 + (1u << 20);
+    }
+
+    // Rewrites the file under the retention policy, merging the small
+    // blocks left by checkpoints. Events wait while this runs.
+    void compact(int64_t now) {
+        lock_guard<mutex> guard(lock);
+        for (auto& [id, h] : devices) seal(id, h);
+        const int64_t ns = 1000000000;
+        int64_t cutoff = (now - policy.retainSec) * ns;
+        int64_t coarseBefore = (now - policy.downsampleSec) * ns;
+        int64_t res = max<int64_t>(1, policy.resolutionSec) * ns;
+
+        // Over the cap, raise the cutoff until enough of the oldest blocks go.
+        if (fileSize > policy.maxBytes) {
+            vector<pair<int64_t, uint64_t>> ages;
+            for (const auto& [id, h] : devices)
+                for (const Block& b : h.blocks) ages.push_back({b.last, b.bytes + HeaderSize + 1 + id.size()});
+            sort(ages.begin(), ages.end());
+            uint64_t excess = fileSize - policy.maxBytes;
+            for (const auto& [last, size] : ages) {
+                cutoff = max(cutoff, last + 1);
+                if (size >= excess) break;
+                excess -= size;
+            }
+        }
+
+        string tmp = path + ".tmp";
+        int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0 || write(out, "SHHL1", 5) != 5) {
+            if (out >= 0) close(out);
+            throw DeviceException("Cannot write " + tmp);
+        }
+        uint64_t outSize = 5;
+        bool ok = true;
+        unordered_map<string, vector<Block>> fresh;
+        vector<Transition> ts, pending;
+        for (auto& [id, h] : devices) {
+            vector<Block>& blocks = fresh[id];
+            uint8_t state = 0, known = 0, flags = 0;
+            auto emit = [&](size_t n) {
+                Block b;
+                ok = ok && writeBlock(out, outSize, id, pending.data(), n, state, known, flags, b);
+                blocks.push_back(b);
+                for (size_t i = 0; i < n; i++) applyState(pending[i].kind, state, known);
+                pending.erase(pending.begin(), pending.begin() + n);
+            };
+            pending.clear();
+            for (const Block& b : h.blocks) {
+                if (b.last < cutoff || !decode(b, ts)) continue;
+                uint8_t f = b.flags;
+                if (!(f & Downsampled) && b.last < coarseBefore) {
+                    ts = downsample(ts, b.state, b.known, res);
+                    f |= Downsampled;
+                }
+                if (!pending.empty() && f != flags) emit(pending.size());
+                if (pending.empty()) {
+                    state = b.state;
+                    known = b.known;
+                    flags = f;
+                }
+                pending.insert(pending.end(), ts.begin(), ts.end());
+                while (pending.size() >= BlockSize) emit(BlockSize);
+            }
+            if (!pending.empty()) emit(pending.size());
+        }
+        if (!ok || fsync(out) != 0) {
+            close(out);
+            unlink(tmp.c_str());
+            throw DeviceException("Cannot write " + tmp);
+        }
+        close(out);
+        if (rename(tmp.c_str(), path.c_str()) != 0) throw DeviceException("Cannot replace " + path);
+        close(fd);
+        fd = ::open(path.c_str(), O_RDWR | O_APPEND);
+        if (fd < 0) throw DeviceException("Cannot reopen device history: " + path);
+        for (auto it = devices.begin(); it != devices.end();) {
+            it->second.blocks = move(fresh[it->first]);
+            if (it->second.blocks.empty() && it->second.lastAt < cutoff) it = devices.erase(it);
+            else ++it;
+        }
+        fileSize = compactedSize = outSize;
+        lastCompaction = now;
+    }
+
+    static string formatTime(int64_t ns) {
+        time_t t = ns / 1000000000;
+        tm local;
+        localtime_r(&t, &local);
+        char buf[32];
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &local);
+        return buf;
+    }
+
+    static const char* kindName(DeviceEventType kind) {
+        switch (kind) {
+            case DeviceEventType::TurnedOn: return "turned on";
+            case DeviceEventType::TurnedOff: return "turned off";
+            case DeviceEventType::RecordingStarted: return "recording started";
+            case DeviceEventType::RecordingStopped: return "recording stopped";
+            case DeviceEventType::MotionDetected: return "motion";
+            case DeviceEventType::DoorLocked: return "locked";
+            case DeviceEventType::DoorUnlocked: return "unlocked";
+            case DeviceEventType::BrightnessChanged: return "brightness set";
+            case DeviceEventType::TargetTemperatureSet: return "temperature set";
+            case DeviceEventType::PowerDenied: return "refused by budget";
+            case DeviceEventType::LoadShed: return "shed";
+            default: return "?";
+        }
+    }
+
+    // Time in each state over the last `hours`, when the notable
+    // transitions last happened, and the most recent transitions.
+    void report(ostream& os, Device* device, int hours) const {
+        const string& id = device->getDeviceID();
+        int64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        int64_t from = now - int64_t(hours) * 3600 * 1000000000;
+        auto span = [](int64_t ns) {
+            int64_t minutes = ns / 60000000000;
+            return to_string(minutes / 60) + "h " + to_string(minutes % 60) + "m";
+        };
+        os << "\n--- History of " << device->getDeviceName() << " (" << id << "), last " << hours << " h ---\n";
+        vector<DeviceEventType> notable;
+        if (dynamic_cast<DoorLock*>(device)) {
+            os << "Unlocked for " << span(timeIn(id, Locked, from, now, false)) << "\n";
+            notable = {DeviceEventType::DoorUnlocked, DeviceEventType::DoorLocked};
+        } else if (dynamic_cast<Camera*>(device)) {
+            os << "Recording for " << span(timeIn(id, Recording, from, now)) << "\n";
+            notable = {DeviceEventType::MotionDetected, DeviceEventType::RecordingStarted};
+        } else {
+            os << "On for " << span(timeIn(id, On, from, now)) << "\n";
+            notable = {DeviceEventType::TurnedOn, DeviceEventType::TurnedOff};
+        }
+        for (DeviceEventType kind : notable) {
+            Transition t;
+            os << "Last " << kindName(kind) << ": " << (last(id, kind, now + 1, t) ? formatTime(t.at) : "never") << "\n";
+        }
+        vector<Transition> recent = range(id, from, now + 1);
+        size_t shown = min<size_t>(recent.size(), 10);
+        os << recent.size() << " transition(s) in this window" << (shown ? ", latest:" : ".") << "\n";
+        for (size_t i = recent.size() - shown; i < recent.size(); i++) {
+            const Transition& t = recent[i];
+            os << "  " << formatTime(t.at) << "  " << kindName(t.kind);
+            if (t.kind == DeviceEventType::BrightnessChanged) os << " " << t.value << "%";
+            else if (t.kind == DeviceEventType::TargetTemperatureSet) os << " " << t.value << "°";
+            os << "\n";
+        }
+    }
+
+    ~TransitionLog() {
+        flush();
+        close(fd);
+    }
+};
+
+// Live home state in a POSIX shared-memory segment, for dashboards and
+// exporters in other processes. The controller process is the only
+// writer; any number of processes map the segment read-only.
+//
+// Layout (offsets are bytes from the start of the segment; nothing in it
+// is a pointer):
+//   SegmentHeader
+//   SegmentUser[userCount]      name, range of rooms
+//   SegmentRoom[roomCount]      name, owning user, range of devices
+//   SegmentDevice[deviceCount]  64 bytes each, one cache line
+//   strings                     u8 length + bytes, referenced by offset
+// Each device record is guarded by its own sequence counter (odd while
+// being written), so readers copy a consistent 32-byte state without
+// locks or system calls. The tables themselves change only when users,
+// rooms or devices come and go; the writer then rebuilds them under the
+// header's layout counter and readers re-resolve.
+struct SegmentHeader {
+    char magic[8];  // "SHSEG01"
+    uint32_t writerPid;
+    uint32_t userCount, roomCount, deviceCount;
+    uint32_t usersOff, roomsOff, devicesOff;
+    atomic<uint64_t> layoutSeq;  // odd while the tables are rebuilt
+    atomic<uint64_t> size;       // readers remap when it grows
+    atomic<int64_t> heartbeatNs; // last write
+};
+
+struct SegmentUser {
+    uint32_t name;
+    uint32_t firstRoom, roomCount;
+};
+
+struct SegmentRoom {
+    uint32_t name;
+    uint32_t user;
+    uint32_t firstDevice, deviceCount;
+};
+
+struct alignas(64) SegmentDevice {
+    enum Flags : uint8_t { On = 1, Locked = 2, Recording = 4, Motion = 8 };
+    atomic<uint32_t> seq;
+    atomic<uint32_t> flags;
+    atomic<float> power;    // kW
+    atomic<float> setting;  // brightness or target temperature
+    atomic<float> current;  // measured temperature
+    atomic<int64_t> changedNs;
+    atomic<uint64_t> updates;
+    uint32_t id, name, type, room;
+};
+
+// A device record as read from the segment.
+struct DeviceState {
+    uint32_t flags;
+    float power, setting, current;
+    int64_t changedNs;
+    uint64_t updates;
+};
+
+string segmentName(const string& name) { return name.empty() || name[0] == '/' ? name : "/" + name; }
+
+class HomeSegment : public EventSubscriber {
+    string name;
+    int fd;
+    char* base = nullptr;
+    size_t mapped = 0;
+    unordered_map<string, uint32_t> slots;  // device ID -> record index
+    mutex lock;                             // between the event thread and rebuilds
+
+    SegmentHeader* header() { return (SegmentHeader*)base; }
+    SegmentDevice* devices() { return (SegmentDevice*)(base + header()->devicesOff); }
+
+    static int64_t nowNs() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void grow(size_t bytes) {
+        if (bytes <= mapped) return;
+        bytes = max(bytes, mapped * 2);
+        if (ftruncate(fd, bytes) != 0) throw DeviceException("Cannot grow shared segment " + name);
+        void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) throw DeviceException("Cannot map shared segment " + name);
+        if (base) munmap(base, mapped);
+        base = (char*)p;
+        mapped = bytes;
+        header()->size.store(bytes, memory_order_release);
+    }
+
+    static void begin(SegmentDevice& d) {
+        d.seq.store(d.seq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+    static void end(SegmentDevice& d, int64_t at) {
+        d.changedNs.store(at, memory_order_relaxed);
+        d.updates.store(d.updates.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        d.seq.store(d.seq.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+public:
+    HomeSegment(const string& segment, size_t initialBytes = 1 << 20) : name(segmentName(segment)) {
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw DeviceException("Cannot create shared segment " + name);
+        grow(max(initialBytes, sizeof(SegmentHeader)));
+        SegmentHeader* h = new (base) SegmentHeader{};
+        memcpy(h->magic, "SHSEG01", 8);
+        h->writerPid = getpid();
+        h->usersOff = h->roomsOff = h->devicesOff = sizeof(SegmentHeader);
+        h->size.store(mapped, memory_order_release);
+    }
+
+    const string& segment() const { return name; }
+
+    // Lays the tables out afresh from the home; the caller holds whatever
+    // lock keeps the home still.
+    void rebuild(SmartHome& home) {
+        lock_guard<mutex> guard(lock);
+        size_t users = 0, rooms = 0, devs = 0, strBytes = 0;
+        for (const auto& [username, user] : home.getAllUsers()) {
+            users++;
+            strBytes += username.size() + 1;
+            for (const auto& [roomName, room] : user->getAllRooms()) {
+                rooms++;
+                strBytes += roomName.size() + 1;
+                for (Device* d : room->getDevices()) {
+                    devs++;
+                    strBytes += d->getDeviceID().size() + d->getDeviceName().size() + 12 + 3;
+                }
+            }
+        }
+        size_t usersOff = sizeof(SegmentHeader);
+        size_t roomsOff = usersOff + users * sizeof(SegmentUser);
+        size_t devicesOff = (roomsOff + rooms * sizeof(SegmentRoom) + 63) / 64 * 64;
+        size_t stringsOff = devicesOff + devs * sizeof(SegmentDevice);
+
+        SegmentHeader* h = header();
+        uint64_t layout = h->layoutSeq.load(memory_order_relaxed);
+        h->layoutSeq.store(layout + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        grow(stringsOff + strBytes);
+        h = header();
+
+        size_t strAt = stringsOff;
+        unordered_map<string, uint32_t> typeNames;
+        auto intern = [&](string_view s) {
+            uint32_t off = uint32_t(strAt);
+            uint8_t len = uint8_t(min<size_t>(s.size(), 255));
+            base[strAt] = char(len);
+            memcpy(base + strAt + 1, s.data(), len);
+            strAt += len + 1;
+            return off;
+        };
+        auto* userRecs = (SegmentUser*)(base + usersOff);
+        auto* roomRecs = (SegmentRoom*)(base + roomsOff);
+        auto* devRecs = (SegmentDevice*)(base + devicesOff);
+        uint32_t u = 0, r = 0, d = 0;
+        int64_t now = nowNs();
+        slots.clear();
+        for (const auto& [username, user] : home.getAllUsers()) {
+            userRecs[u] = SegmentUser{intern(username), r, 0};
+            for (const auto& [roomName, room] : user->getAllRooms()) {
+                roomRecs[r] = SegmentRoom{intern(roomName), u, d, 0};
+                for (Device* device : room->getDevices()) {
+                    SegmentDevice& rec = devRecs[d];
+                    string type = deviceTypeToken(device);
+                    auto t = typeNames.find(type);
+                    uint32_t typeOff = t != typeNames.end() ? t->second : (typeNames[type] = intern(type));
+                    uint32_t flags = device->getStatus() ? SegmentDevice::On : 0;
+                    float setting = 0.0f, current = 0.0f;
+                    if (auto light = dynamic_cast<Light*>(device)) setting = light->getBrightness();
+                    else if (auto tcd = dynamic_cast<TemperatureControlledDevices*>(device)) {
+                        setting = tcd->getTargetTemperature();
+                        current = tcd->getCurrentTemperature();
+                    } else if (auto lock = dynamic_cast<DoorLock*>(device)) {
+                        if (lock->checkLockStatus()) flags |= SegmentDevice::Locked;
+                    } else if (auto camera = dynamic_cast<Camera*>(device)) {
+                        if (camera->recording()) flags |= SegmentDevice::Recording;
+                        if (camera->sawMotion()) flags |= SegmentDevice::Motion;
+                    }
+                    // The slot may hold old string bytes when the tables moved; an odd
+                    // count left there would read as a write in progress forever.
+                    uint32_t seq = rec.seq.load(memory_order_relaxed);
+                    rec.seq.store(seq + (seq & 1), memory_order_relaxed);
+                    begin(rec);
+                    rec.flags.store(flags, memory_order_relaxed);
+                    rec.power.store(device->powerConsumption, memory_order_relaxed);
+                    rec.setting.store(setting, memory_order_relaxed);
+                    rec.current.store(current, memory_order_relaxed);
+                    rec.id = intern(device->getDeviceID());
+                    rec.name = intern(device->getDeviceName());
+                    rec.type = typeOff;
+                    rec.room = r;
+                    end(rec, now);
+                    slots[device->getDeviceID()] = d++;
+                    roomRecs[r].deviceCount++;
+                }
+                userRecs[u].roomCount++;
+                r++;
+            }
+            u++;
+        }
+        h->userCount = u;
+        h->roomCount = r;
+        h->deviceCount = d;
+        h->usersOff = uint32_t(usersOff);
+        h->roomsOff = uint32_t(roomsOff);
+        h->devicesOff = uint32_t(devicesOff);
+        h->heartbeatNs.store(now, memory_order_relaxed);
+        h->layoutSeq.store(layout + 2, memory_order_release);
+    }
+
+    // Applies state carried by device events to their records.
+    void onEvents(const DeviceEvent* events, size_t count) override {
+        lock_guard<mutex> guard(lock);
+        SegmentDevice* recs = devices();
+        for (size_t i = 0; i < count; i++) {
+            const DeviceEvent& ev = events[i];
+            auto it = slots.find(ev.deviceID);
+            if (it == slots.end()) continue;
+            SegmentDevice& rec = recs[it->second];
+            uint32_t flags = rec.flags.load(memory_order_relaxed);
+            begin(rec);
+            switch (ev.type) {
+                case DeviceEventType::TurnedOn: flags |= SegmentDevice::On; rec.power.store(ev.value, memory_order_relaxed); break;
+                case DeviceEventType::TurnedOff: flags &= ~SegmentDevice::On; break;
+                case DeviceEventType::DoorLocked: flags |= SegmentDevice::Locked; break;
+                case DeviceEventType::DoorUnlocked: flags &= ~SegmentDevice::Locked; break;
+                case DeviceEventType::RecordingStarted: flags |= SegmentDevice::Recording; break;
+                case DeviceEventType::RecordingStopped: flags &= ~SegmentDevice::Recording; break;
+                case DeviceEventType::MotionDetected: flags |= SegmentDevice::Motion; break;
+                case DeviceEventType::BrightnessChanged:
+                case DeviceEventType::LightDimming:
+                    rec.setting.store(ev.value, memory_order_relaxed);
+                    break;
+                case DeviceEventType::TargetTemperatureSet:
+                case DeviceEventType::ThermostatRegulating:
+                case DeviceEventType::AcCooling:
+                    rec.setting.store(ev.value, memory_order_relaxed);
+                    rec.current.store(ev.value2, memory_order_relaxed);
+                    break;
+                default: break;
+            }
+            rec.flags.store(flags, memory_order_relaxed);
+            end(rec, ev.atNs);
+        }
+        header()->heartbeatNs.store(nowNs(), memory_order_relaxed);
+    }
+
+    ~HomeSegment() {
+        if (base) munmap(base, mapped);
+        close(fd);
+        shm_unlink(name.c_str());
+    }
+};
+
+// Read-only view of a HomeSegment from any process. Every offset taken
+// from the segment is checked against the mapping before use.
+class HomeSegmentReader {
+    int fd;
+    const char* base = nullptr;
+    size_t mapped = 0;
+    uint64_t layout = 0;
+    uint32_t users = 0, rooms = 0, devs = 0;
+    const SegmentUser* userRecs = nullptr;
+    const SegmentRoom* roomRecs = nullptr;
+    const SegmentDevice* devRecs = nullptr;
+
+    static const int MaxReadAttempts = 100000;
+
+    const SegmentHeader* header() const { return (const SegmentHeader*)base; }
+
+    void map(size_t bytes) {
+        void* p = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) throw DeviceException("Cannot map shared segment");
+        if (base) munmap((void*)base, mapped);
+        base = (const char*)p;
+        mapped = bytes;
+    }
+
+    bool fits(size_t off, size_t bytes) const { return off <= mapped && bytes <= mapped - off; }
+
+public:
+    HomeSegmentReader(const string& segment) {
+        string name = segmentName(segment);
+        fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) throw DeviceException("No shared segment " + name);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(SegmentHeader))
+            throw DeviceException("Shared segment " + name + " is not ready");
+        map(st.st_size);
+        if (memcmp(header()->magic, "SHSEG01", 8) != 0) throw DeviceException("Not a home segment: " + name);
+        refresh();
+    }
+
+    // Picks up a new layout if the writer has rebuilt the tables; true if
+    // it did. Record indexes from before are meaningless afterwards.
+    bool refresh() {
+        while (true) {
+            uint64_t seq = header()->layoutSeq.load(memory_order_acquire);
+            if (seq == layout && devRecs) return false;
+            if (seq & 1) {
+                this_thread::yield();
+                continue;
+            }
+            size_t size = header()->size.load(memory_order_acquire);
+            if (size > mapped) map(size);
+            const SegmentHeader* h = header();
+            uint32_t u = h->userCount, r = h->roomCount, d = h->deviceCount;
+            size_t uo = h->usersOff, ro = h->roomsOff, dof = h->devicesOff;
+            atomic_thread_fence(memory_order_acquire);
+            if (h->layoutSeq.load(memory_order_relaxed) != seq) continue;
+            if (!fits(uo, u * sizeof(SegmentUser)) || !fits(ro, r * sizeof(SegmentRoom)) ||
+                !fits(dof, d * sizeof(SegmentDevice)))
+                throw DeviceException("Corrupt home segment");
+            users = u, rooms = r, devs = d;
+            userRecs = (const SegmentUser*)(base + uo);
+            roomRecs = (const SegmentRoom*)(base + ro);
+            devRecs = (const SegmentDevice*)(base + dof);
+            layout = seq;
+            return true;
+        }
+    }
+
+    // True if the tables read since the last refresh() are still current.
+    bool stable() const { return header()->layoutSeq.load(memory_order_acquire) == layout; }
+
+    uint32_t userCount() const { return users; }
+    uint32_t roomCount() const { return rooms; }
+    uint32_t deviceCount() const { return devs; }
+    const SegmentUser& user(uint32_t i) const { return userRecs[i]; }
+    const SegmentRoom& room(uint32_t i) const { return roomRecs[i]; }
+    const SegmentDevice& device(uint32_t i) const { return devRecs[i]; }
+    int64_t heartbeatNs() const { return header()->heartbeatNs.load(memory_order_relaxed); }
+    uint32_t writerPid() const { return header()->writerPid; }
+
+    // Points into the mapping; empty if the offset is out of bounds.
+    string_view str(uint32_t off) const {
+        if (!fits(off, 1) || !fits(off + 1, uint8_t(base[off]))) return {};
+        return string_view(base + off + 1, uint8_t(base[off]));
+    }
+
+    // Copies one consistent state out of record i. A write takes
+    // nanoseconds, so a record that stays odd means a writer died mid-write.
+    DeviceState read(uint32_t i) const {
+        const SegmentDevice& d = devRecs[i];
+        DeviceState s;
+        for (int attempt = 0;; attempt++) {
+            if (attempt == MaxReadAttempts) throw DeviceException("Device record " + to_string(i) + " is stuck mid-write");
+            if (attempt) this_thread::yield();
+            uint32_t seq = d.seq.load(memory_order_acquire);
+            if (seq & 1) continue;
+            s.flags = d.flags.load(memory_order_relaxed);
+            s.power = d.power.load(memory_order_relaxed);
+            s.setting = d.setting.load(memory_order_relaxed);
+            s.current = d.current.load(memory_order_relaxed);
+            s.changedNs = d.changedNs.load(memory_order_relaxed);
+            s.updates = d.updates.load(memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (d.seq.load(memory_order_relaxed) == seq) return s;
+        }
+    }
+
+    ~HomeSegmentReader() {
+        if (base) munmap((void*)base, mapped);
+        close(fd);
+    }
+};
+
+// Just enough of a FlatBuffers builder for Arrow's IPC metadata. Like the
+// real one it builds back to front, so every reference points forward;
+// positions are distances from the end of the buffer. Strings, vectors
+// and child tables go in before the table that refers to them.
+class FlatBuilder {
+    string buf;
+    size_t maxAlign = 4;
+    uint32_t tableStart = 0;
+    vector<pair<uint16_t, uint32_t>> fields;  // slot and position, for the open table
+
+    template <class T> void put(T v) { buf.insert(0, (const char*)&v, sizeof(T)); }
+
+    // Pads so the front is aligned once `following` more bytes go in.
+    void align(size_t alignment, size_t following = 0) {
+        maxAlign = max(maxAlign, alignment);
+        buf.insert(0, (alignment - (buf.size() + following) % alignment) % alignment, '\0');
+    }
+
+public:
+    uint32_t offset() const { return buf.size(); }
+
+    uint32_t createString(string_view s) {
+        align(4, s.size() + 1);
+        put<char>(0);
+        buf.insert(0, s.data(), s.size());
+        put<uint32_t>(s.size());
+        return offset();
+    }
+
+    // A vector of structs made of int64s (Arrow's FieldNode and Buffer).
+    uint32_t createStructs(const vector<int64_t>& words, size_t wordsPerStruct) {
+        align(8);
+        buf.insert(0, (const char*)words.data(), words.size() * 8);
+        put<uint32_t>(words.size() / wordsPerStruct);
+        return offset();
+    }
+
+    uint32_t createOffsets(const vector<uint32_t>& targets) {
+        align(4);
+        for (size_t i = targets.size(); i-- > 0;) put<uint32_t>(offset() + 4 - targets[i]);
+        put<uint32_t>(targets.size());
+        return offset();
+    }
+
+    void startTable() {
+        fields.clear();
+        tableStart = offset();
+    }
+
+    template <class T> void addScalar(uint16_t slot, T v) {
+        align(sizeof(T));
+        put(v);
+        fields.emplace_back(slot, offset());
+    }
+
+    void addOffset(uint16_t slot, uint32_t target) {
+        align(4);
+        put<uint32_t>(offset() + 4 - target);
+        fields.emplace_back(slot, offset());
+    }
+
+    // The vtable goes right in front of its table.
+    uint32_t endTable() {
+        align(4);
+        put<int32_t>(0);
+        uint32_t table = offset();
+        uint16_t slots = 0;
+        for (const auto& f : fields) slots = max<uint16_t>(slots, f.first + 1);
+        vector<uint16_t> vtable(2 + slots, 0);
+        vtable[0] = uint16_t(vtable.size() * 2);
+        vtable[1] = uint16_t(table - tableStart);
+        for (const auto& [slot, at] : fields) vtable[2 + slot] = uint16_t(table - at);
+        for (size_t i = vtable.size(); i-- > 0;) put(vtable[i]);
+        int32_t back = int32_t(offset() - table);
+        memcpy(&buf[buf.size() - table], &back, 4);
+        return table;
+    }
+
+    string finish(uint32_t root) {
+        align(maxAlign, 4);
+        put<uint32_t>(offset() + 4 - root);
+        return move(buf);
+    }
+};
+
+enum class ArrowType : uint8_t { Bool, Int32, Int64, Float32, Utf8, TimestampSec, TimestampNs };
+
+// One column of the record batch being filled: the values (bit-packed for
+// Bool, the bytes for Utf8), string offsets, and a validity bitmap for
+// nullable columns. Buffers keep their capacity from batch to batch.
+struct ArrowColumn {
+    string name;
+    ArrowType type;
+    bool nullable;
+    string values;
+    vector<int32_t> offsets{0};
+    string validity;
+    size_t rows = 0, nulls = 0;
+
+    ArrowColumn(string n, ArrowType t, bool canBeNull = false) : name(move(n)), type(t), nullable(canBeNull) {}
+
+    size_t width() const {
+        switch (type) {
+            case ArrowType::Int32: case ArrowType::Float32: return 4;
+            case ArrowType::Int64: case ArrowType::TimestampSec: case ArrowType::TimestampNs: return 8;
+            default: return 0;
+        }
+    }
+
+    template <class T> void addValue(T v) {
+        static_assert(is_arithmetic_v<T>, "fixed-width values only");
+        values.append((const char*)&v, sizeof(T));
+        mark(true);
+    }
+
+    // n values at once, copied straight from the caller's array.
+    template <class T> void addValues(const T* v, size_t n) {
+        static_assert(is_arithmetic_v<T>, "fixed-width values only");
+        values.append((const char*)v, n * sizeof(T));
+        for (size_t i = 0; i < n; i++) mark(true);
+    }
+
+    void addBool(bool v) {
+        setBit(values, rows, v);
+        mark(true);
+    }
+
+    void addString(string_view s) {
+        values.append(s);
+        offsets.push_back(int32_t(values.size()));
+        mark(true);
+    }
+
+    void addNull() {
+        if (type == ArrowType::Bool) setBit(values, rows, false);
+        else if (type == ArrowType::Utf8) offsets.push_back(offsets.back());
+        else values.append(width(), '\0');
+        mark(false);
+    }
+
+    void clear() {
+        values.clear();
+        offsets.assign(1, 0);
+        validity.clear();
+        rows = nulls = 0;
+    }
+
+private:
+    static void setBit(string& bits, size_t i, bool on) {
+        if (i % 8 == 0) bits.push_back(0);
+        if (on) bits.back() |= char(1 << (i % 8));
+    }
+
+    void mark(bool valid) {
+        if (nullable) setBit(validity, rows, valid);
+        nulls += !valid;
+        rows++;
+    }
+};
+
+// Writes the Arrow IPC streaming format: a schema message, a record batch
+// every batchRows rows, and the end-of-stream marker. Each message is a
+// continuation marker, the FlatBuffers metadata padded to 8 bytes, and
+// the body; bodies are gathered straight from the column buffers, so an
+// export holds one batch in memory however large it is.
+class ArrowStreamWriter {
+    int fd;
+    vector<ArrowColumn> columns;
+    size_t batchRows;
+    uint64_t bytesOut = 0, rowsOut = 0, batchesOut = 0;
+
+    void writeAll(vector<iovec>& iov) {
+        size_t first = 0;
+        while (first < iov.size()) {
+            ssize_t n = writev(fd, &iov[first], int(min<size_t>(iov.size() - first, IOV_MAX)));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) throw DeviceException(string("Cannot write export: ") + strerror(errno));
+            bytesOut += n;
+            for (; first < iov.size() && size_t(n) >= iov[first].iov_len; first++) n -= iov[first].iov_len;
+            if (first < iov.size()) {
+                iov[first].iov_base = (char*)iov[first].iov_base + n;
+                iov[first].iov_len -= n;
+            }
+        }
+    }
+
+    void writeMessage(FlatBuilder& fb, uint8_t headerType, uint32_t header, vector<iovec> body, int64_t bodyLength) {
+        static const char zeros[8] = {};
+        fb.startTable();
+        fb.addScalar<int16_t>(0, 4);  // MetadataVersion V5
+        fb.addScalar<uint8_t>(1, headerType);
+        fb.addOffset(2, header);
+        fb.addScalar<int64_t>(3, bodyLength);
+        string meta = fb.finish(fb.endTable());
+        int32_t prefix[2] = {-1, int32_t((meta.size() + 7) & ~size_t(7))};
+        vector<iovec> iov = {{prefix, 8}, {meta.data(), meta.size()}, {(void*)zeros, size_t(prefix[1]) - meta.size()}};
+        iov.insert(iov.end(), body.begin(), body.end());
+        writeAll(iov);
+    }
+
+    void writeSchema() {
+        FlatBuilder fb;
+        vector<uint32_t> fields;
+        for (const ArrowColumn& col : columns) {
+            uint32_t name = fb.createString(col.name);
+            uint32_t children = fb.createOffsets({});
+            bool timestamp = col.type == ArrowType::TimestampSec || col.type == ArrowType::TimestampNs;
+            uint32_t zone = timestamp ? fb.createString("UTC") : 0;
+            uint8_t typeID = 0;  // Type union: Int 2, FloatingPoint 3, Utf8 5, Bool 6, Timestamp 10
+            fb.startTable();
+            switch (col.type) {
+                case ArrowType::Bool: typeID = 6; break;
+                case ArrowType::Int32: case ArrowType::Int64:
+                    fb.addScalar<int32_t>(0, int32_t(col.width() * 8));
+                    fb.addScalar<uint8_t>(1, 1);
+                    typeID = 2;
+                    break;
+                case ArrowType::Float32: fb.addScalar<int16_t>(0, 1); typeID = 3; break;  // SINGLE
+                case ArrowType::Utf8: typeID = 5; break;
+                case ArrowType::TimestampSec: case ArrowType::TimestampNs:
+                    fb.addScalar<int16_t>(0, col.type == ArrowType::TimestampSec ? 0 : 3);  // SECOND, NANOSECOND
+                    fb.addOffset(1, zone);
+                    typeID = 10;
+                    break;
+            }
+            uint32_t type = fb.endTable();
+            fb.startTable();
+            fb.addOffset(0, name);
+            fb.addScalar<uint8_t>(1, col.nullable);
+            fb.addScalar<uint8_t>(2, typeID);
+            fb.addOffset(3, type);
+            fb.addOffset(5, children);
+            fields.push_back(fb.endTable());
+        }
+        uint32_t list = fb.createOffsets(fields);
+        fb.startTable();
+        fb.addScalar<int16_t>(0, 0);  // little-endian
+        fb.addOffset(1, list);
+        writeMessage(fb, 1, fb.endTable(), {}, 0);
+    }
+
+public:
+    ArrowStreamWriter(int out, vector<ArrowColumn> schema, size_t rowsPerBatch = 65536)
+        : fd(out), columns(move(schema)), batchRows(max<size_t>(1, rowsPerBatch)) {
+        writeSchema();
+    }
+
+    ArrowColumn& operator[](size_t i) { return columns[i]; }
+
+    // Call once every column has its values for the row(s).
+    void endRow() {
+        if (columns[0].rows >= batchRows) flush();
+    }
+
+    void flush() {
+        static const char zeros[8] = {};
+        size_t rows = columns[0].rows;
+        if (rows == 0) return;
+        vector<int64_t> nodes, buffers;
+        vector<iovec> body;
+        int64_t bodyLength = 0;
+        auto add = [&](const void* data, size_t len) {
+            buffers.push_back(bodyLength);
+            buffers.push_back(len);
+            size_t pad = (8 - len % 8) % 8;
+            if (len) body.push_back({(void*)data, len});
+            if (pad) body.push_back({(void*)zeros, pad});
+            bodyLength += len + pad;
+        };
+        for (const ArrowColumn& col : columns) {
+            if (col.rows != rows) throw DeviceException("Export column " + col.name + " is not the same length as the others");
+            nodes.push_back(rows);
+            nodes.push_back(col.nulls);
+            add(col.validity.data(), col.nulls ? col.validity.size() : 0);
+            if (col.type == ArrowType::Utf8) add(col.offsets.data(), col.offsets.size() * 4);
+            add(col.values.data(), col.values.size());
+        }
+        FlatBuilder fb;
+        uint32_t nodeList = fb.createStructs(nodes, 2);
+        uint32_t bufferList = fb.createStructs(buffers, 2);
+        fb.startTable();
+        fb.addScalar<int64_t>(0, rows);
+        fb.addOffset(1, nodeList);
+        fb.addOffset(2, bufferList);
+        writeMessage(fb, 3, fb.endTable(), move(body), bodyLength);
+        for (ArrowColumn& col : columns) col.clear();
+        rowsOut += rows;
+        batchesOut++;
+    }
+
+    void finish() {
+        flush();
+        int32_t end[2] = {-1, 0};
+        vector<iovec> iov = {{end, 8}};
+        writeAll(iov);
+    }
+
+    uint64_t bytes() const { return bytesOut; }
+    uint64_t rows() const { return rowsOut; }
+    uint64_t batches() const { return batchesOut; }
+};
+
+// Columnar exports for analytics, one Arrow stream each. They return the
+// number of rows written.
+
+// One row per device: where it is, its state and settings, and this
+// month's kWh when a ledger is given.
+uint64_t exportDevices(int fd, SmartHome& home, const UsageLedger* ledger, size_t batchRows) {
+    ArrowStreamWriter out(fd, {{"user", ArrowType::Utf8}, {"room", ArrowType::Utf8}, {"device_id", ArrowType::Utf8},
+                               {"name", ArrowType::Utf8}, {"type", ArrowType::Utf8}, {"on", ArrowType::Bool},
+                               {"power_kw", ArrowType::Float32}, {"setting", ArrowType::Float32, true},
+                               {"temperature", ArrowType::Float32, true}, {"locked", ArrowType::Bool, true},
+                               {"recording", ArrowType::Bool, true}, {"month_kwh", ArrowType::Float32, true}},
+                          batchRows);
+    for (const auto& [username, user] : home.getAllUsers()) {
+        for (const auto& [roomName, room] : user->getAllRooms()) {
+            for (Device* device : room->getDevices()) {
+                out[0].addString(username);
+                out[1].addString(roomName);
+                out[2].addString(device->getDeviceID());
+                out[3].addString(device->getDeviceName());
+                out[4].addString(deviceTypeToken(device));
+                out[5].addBool(device->getStatus());
+                out[6].addValue(device->powerConsumption);
+                auto light = dynamic_cast<Light*>(device);
+                auto tcd = dynamic_cast<TemperatureControlledDevices*>(device);
+                if (light) out[7].addValue(light->getBrightness());
+                else if (tcd) out[7].addValue(tcd->getTargetTemperature());
+                else out[7].addNull();
+                if (tcd) out[8].addValue(tcd->getCurrentTemperature());
+                else out[8].addNull();
+                if (auto lock = dynamic_cast<DoorLock*>(device)) out[9].addBool(lock->checkLockStatus());
+                else out[9].addNull();
+                if (auto camera = dynamic_cast<Camera*>(device)) out[10].addBool(camera->recording());
+                else out[10].addNull();
+                const float* series = ledger ? ledger->find(device->getDeviceID()) : nullptr;
+                if (series) {
+                    double kWh = 0;
+                    for (uint32_t i = 0; i < ledger->intervalCount(); i++) kWh += series[i];
+                    out[11].addValue(float(kWh));
+                } else {
+                    out[11].addNull();
+                }
+                out.endRow();
+            }
+        }
+    }
+    out.finish();
+    return out.rows();
+}
+
+// Every recorded transition in [from, to), device by device.
+uint64_t exportHistory(int fd, SmartHome& home, const TransitionLog& log, int64_t from, int64_t to, size_t batchRows) {
+    ArrowStreamWriter out(fd, {{"device_id", ArrowType::Utf8}, {"at", ArrowType::TimestampNs},
+                               {"kind", ArrowType::Utf8}, {"value", ArrowType::Float32}},
+                          batchRows);
+    for (const auto& [username, user] : home.getAllUsers()) {
+        for (const auto& [roomName, room] : user->getAllRooms()) {
+            for (Device* device : room->getDevices()) {
+                const string& id = device->getDeviceID();
+                for (const TransitionLog::Transition& t : log.range(id, from, to)) {
+                    if (t.at >= to) break;
+                    out[0].addString(id);
+                    out[1].addValue(t.at);
+                    out[2].addString(TransitionLog::kindName(t.kind));
+                    out[3].addValue(t.value);
+                    out.endRow();
+                }
+            }
+        }
+    }
+    out.finish();
+    return out.rows();
+}
+
+// The ledger's hourly kWh, one row per device and hour. Each device's
+// series goes into the batch as one copy.
+uint64_t exportUsage(int fd, SmartHome& home, const UsageLedger& ledger, size_t batchRows) {
+    ArrowStreamWriter out(fd, {{"device_id", ArrowType::Utf8}, {"hour", ArrowType::TimestampSec},
+                               {"kwh", ArrowType::Float32}},
+                          batchRows);
+    uint32_t intervals = ledger.intervalCount();
+    for (const auto& [username, user] : home.getAllUsers()) {
+        for (const auto& [roomName, room] : user->getAllRooms()) {
+            for (Device* device : room->getDevices()) {
+                const string& id = device->getDeviceID();
+                const float* series = ledger.find(id);
+                if (!series) continue;
+                for (uint32_t i = 0; i < intervals; i++) {
+                    out[0].addString(id);
+                    out[1].addValue(ledger.start() + int64_t(i) * UsageLedger::IntervalSec);
+                }
+                out[2].addValues(series, intervals);
+                out.endRow();
+            }
+        }
+    }
+    out.finish();
+    return out.rows();
+}
+
+// Device driver wire protocol, spoken over Unix stream sockets. Every frame
+// is a WireHeader followed by the device ID; requests carry an ID echoed in
+// the response, so many can be in flight on one connection.
+enum class DriverOp : uint8_t { Query, TurnOn, TurnOff, SetLevel, Lock, Unlock };
+enum class DriverStatus : uint8_t { Ok, UnknownDevice, BadRequest, Timeout, Disconnected };
+
+struct WireHeader {
+    uint16_t length;  // whole frame, header included
+    uint8_t op;
+    uint8_t status;
+    uint32_t id;
+    float value;
+};
+
+const size_t MaxWireID = 64;
+
+void appendFrame(string& out, DriverOp op, DriverStatus status, uint32_t id, float value, string_view device) {
+    WireHeader h{uint16_t(sizeof(WireHeader) + min(device.size(), MaxWireID)), uint8_t(op), uint8_t(status), id, value};
+    out.append((const char*)&h, sizeof(h));
+    out.append(device.substr(0, MaxWireID));
+}
+
+// Calls handle(header, deviceID) for each complete frame at the front of
+// `in` and erases them. Returns false on a malformed frame.
+template <typename F>
+bool drainFrames(string& in, F handle) {
+    size_t pos = 0;
+    while (in.size() - pos >= sizeof(WireHeader)) {
+        WireHeader h;
+        memcpy(&h, in.data() + pos, sizeof(h));
+        if (h.length < sizeof(WireHeader) || h.length > sizeof(WireHeader) + MaxWireID) return false;
+        if (in.size() - pos < h.length) break;
+        handle(h, string_view(in.data() + pos + sizeof(h), h.length - sizeof(h)));
+        pos += h.length;
+    }
+    in.erase(0, pos);
+    return true;
+}
+
+int unixSocket(const string& path, sockaddr_un& addr) {
+    if (path.size() >= sizeof(addr.sun_path)) throw DeviceException("Socket path too long: " + path);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw DeviceException("Cannot create socket: " + string(strerror(errno)));
+    return fd;
+}
+
+int64_t steadyMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Stands in for a gateway with any number of devices: holds their state in
+// memory and answers every request at once. dropPercent of requests are
+// silently ignored, to exercise client timeouts and retries.
+class DeviceEmulator {
+    struct EmulatedDevice {
+        bool on = false;
+        bool locked = true;
+        float level = 0;
+    };
+    struct Conn {
+        string in, out;
+    };
+    string path;
+    int listenFd, epollFd, wakeFd;
+    int dropPercent;
+    uint64_t seed = 88172645463325252ULL;
+    unordered_map<string, EmulatedDevice> devices;
+    unordered_map<int, Conn> conns;
+    atomic<bool> running{true};
+
+    bool dropped() {
+        if (dropPercent <= 0) return false;
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        return int(seed % 100) < dropPercent;
+    }
+
+    void respond(Conn& c, const WireHeader& h, string_view id) {
+        if (dropped()) return;
+        EmulatedDevice& d = devices[string(id)];
+        switch (DriverOp(h.op)) {
+            case DriverOp::TurnOn: d.on = true; break;
+            case DriverOp::TurnOff: d.on = false; break;
+            case DriverOp::SetLevel: d.level = h.value; break;
+            case DriverOp::Lock: d.locked = true; break;
+            case DriverOp::Unlock: d.locked = false; break;
+            case DriverOp::Query: break;
+            default:
+                appendFrame(c.out, DriverOp(h.op), DriverStatus::BadRequest, h.id, 0, id);
+                return;
+        }
+        float value = DriverOp(h.op) == DriverOp::Query ? (d.on ? 1.0f : 0.0f) : d.level;
+        appendFrame(c.out, DriverOp(h.op), DriverStatus::Ok, h.id, value, id);
+    }
+
+    void flushOut(int fd, Conn& c) {
+        while (!c.out.empty()) {
+            ssize_t n = ::send(fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+            if (n <= 0) break;
+            c.out.erase(0, n);
+        }
+        epoll_event ev{EPOLLIN | (c.out.empty() ? 0u : uint32_t(EPOLLOUT)), {}};
+        ev.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev);
+    }
+
+    void close(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        conns.erase(fd);
+    }
+
+public:
+    DeviceEmulator(const string& socketPath, size_t deviceCount, int dropPct = 0) : path(socketPath), dropPercent(dropPct) {
+        sockaddr_un addr;
+        listenFd = unixSocket(path, addr);
+        unlink(path.c_str());
+        if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 128) != 0) {
+            ::close(listenFd);
+            throw DeviceException("Cannot listen on " + path + ": " + strerror(errno));
+        }
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event ev{EPOLLIN, {}};
+        ev.data.fd = listenFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+        ev.data.fd = wakeFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+        devices.reserve(deviceCount);
+        for (size_t i = 0; i < deviceCount; i++) devices["E" + to_string(i)];
+    }
+
+    size_t deviceCount() const { return devices.size(); }
+
+    void run() {
+        epoll_event events[64];
+        char buf[65536];
+        while (running.load()) {
+            int n = epoll_wait(epollFd, events, 64, -1);
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == wakeFd) continue;
+                if (fd == listenFd) {
+                    int client;
+                    while ((client = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                        epoll_event ev{EPOLLIN, {}};
+                        ev.data.fd = client;
+                        epoll_ctl(epollFd, EPOLL_CTL_ADD, client, &ev);
+                        conns[client];
+                    }
+                    continue;
+                }
+                Conn& c = conns[fd];
+                bool closed = events[i].events & (EPOLLHUP | EPOLLERR);
+                if (events[i].events & EPOLLIN) {
+                    ssize_t r;
+                    while ((r = ::recv(fd, buf, sizeof(buf), 0)) > 0) c.in.append(buf, r);
+                    if (r == 0) closed = true;
+                    if (!drainFrames(c.in, [&](const WireHeader& h, string_view id) { respond(c, h, id); })) closed = true;
+                }
+                if (closed) close(fd);
+                else flushOut(fd, c);
+            }
+        }
+    }
+
+    void stop() {
+        running.store(false);
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {}
+    }
+
+    ~DeviceEmulator() {
+        for (auto& [fd, c] : conns) ::close(fd);
+        ::close(listenFd);
+        ::close(epollFd);
+        ::close(wakeFd);
+        unlink(path.c_str());
+    }
+};
+
+// Client side of the driver protocol for one gateway. A single I/O thread
+// multiplexes a pool of connections with epoll; requests are pipelined on
+// whichever connection has the fewest outstanding, answered out of order by
+// ID, retried on timeout and re-sent elsewhere if their connection drops.
+class DeviceTransport {
+public:
+    struct Result {
+        DriverStatus status;
+        float value;
+    };
+    using Callback = function<void(const Result&)>;
+
+private:
+    struct Request {
+        DriverOp op;
+        string device;
+        float value;
+        Callback done;
+        int attempts = 0;
+        int conn = -1;
+        int64_t deadline = 0;
+    };
+    struct Conn {
+        int fd = -1;
+        string in, out;
+        size_t outstanding = 0;
+        int64_t retryAt = 0;
+    };
+    struct Deadline {
+        int64_t at;
+        uint32_t id;
+        int attempt;
+        bool operator<(const Deadline& o) const { return at > o.at; }
+    };
+
+    string path;
+    int timeoutMs, maxRetries;
+    int epollFd, wakeFd;
+    vector<Conn> conns;
+    unordered_map<uint32_t, Request> pending;
+    vector<Deadline> deadlines;
+    uint32_t nextID = 1;
+
+    mutex submitLock;
+    vector<Request> submitted;
+    atomic<bool> running{true};
+    thread io;
+
+    void connect(int i) {
+        Conn& c = conns[i];
+        sockaddr_un addr;
+        int fd = unixSocket(path, addr);
+        if (::connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            ::close(fd);
+            c.retryAt = steadyMs() + 100;
+            return;
+        }
+        c.fd = fd;
+        epoll_event ev{EPOLLIN, {}};
+        ev.data.u32 = i;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void disconnect(int i) {
+        Conn& c = conns[i];
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c.fd, nullptr);
+        ::close(c.fd);
+        c = Conn{};
+        c.retryAt = steadyMs() + 100;
+        reconnects++;
+        for (auto& [id, req] : pending) {
+            if (req.conn == i) {
+                req.conn = -1;
+                dispatch(id, req);
+            }
+        }
+    }
+
+    int pickConn() {
+        int best = -1;
+        for (int i = 0; i < int(conns.size()); i++) {
+            if (conns[i].fd < 0) continue;
+            if (best < 0 || conns[i].outstanding < conns[best].outstanding) best = i;
+        }
+        return best;
+    }
+
+    void finish(uint32_t id, Request& req, Result result) {
+        if (req.conn >= 0) conns[req.conn].outstanding--;
+        Callback done = move(req.done);
+        pending.erase(id);
+        if (result.status == DriverStatus::Ok) completed++;
+        else failed++;
+        if (done) done(result);
+    }
+
+    // Queues the request on a connection; with none up it just waits for
+    // its deadline, by which time a reconnect may have succeeded.
+    void dispatch(uint32_t id, Request& req) {
+        req.attempts++;
+        req.deadline = steadyMs() + timeoutMs;
+        deadlines.push_back(Deadline{req.deadline, id, req.attempts});
+        push_heap(deadlines.begin(), deadlines.end());
+        int i = pickConn();
+        if (i < 0) return;
+        req.conn = i;
+        conns[i].outstanding++;
+        appendFrame(conns[i].out, req.op, DriverStatus::Ok, id, req.value, req.device);
+        sent++;
+    }
+
+    void flushOut(int i) {
+        Conn& c = conns[i];
+        while (!c.out.empty()) {
+            ssize_t n = ::send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) { disconnect(i); return; }
+            if (n <= 0) break;
+            c.out.erase(0, n);
+        }
+        epoll_event ev{EPOLLIN | (c.out.empty() ? 0u : uint32_t(EPOLLOUT)), {}};
+        ev.data.u32 = i;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+
+    void expire(int64_t now) {
+        while (!deadlines.empty() && deadlines.front().at <= now) {
+            pop_heap(deadlines.begin(), deadlines.end());
+            Deadline d = deadlines.back();
+            deadlines.pop_back();
+            auto it = pending.find(d.id);
+            if (it == pending.end() || it->second.attempts != d.attempt) continue;
+            Request& req = it->second;
+            if (req.conn >= 0) {
+                conns[req.conn].outstanding--;
+                req.conn = -1;
+            }
+            timeouts++;
+            if (req.attempts > maxRetries) {
+                finish(d.id, req, Result{DriverStatus::Timeout, 0});
+            } else {
+                retries++;
+                dispatch(d.id, req);
+            }
+        }
+    }
+
+    void loop() {
+        epoll_event events[64];
+        char buf[65536];
+        while (running.load()) {
+            int64_t now = steadyMs();
+            int wait = 100;
+            if (!deadlines.empty()) wait = int(max<int64_t>(0, min<int64_t>(wait, deadlines.front().at - now)));
+            int n = epoll_wait(epollFd, events, 64, wait);
+            for (int e = 0; e < n; e++) {
+                if (events[e].data.u32 == UINT32_MAX) {
+                    uint64_t count;
+                    if (read(wakeFd, &count, sizeof(count)) < 0) {}
+                    continue;
+                }
+                int i = events[e].data.u32;
+                Conn& c = conns[i];
+                if (c.fd < 0) continue;
+                bool closed = events[e].events & (EPOLLHUP | EPOLLERR);
+                if (events[e].events & EPOLLIN) {
+                    ssize_t r;
+                    while ((r = ::recv(c.fd, buf, sizeof(buf), 0)) > 0) c.in.append(buf, r);
+                    if (r == 0) closed = true;
+                    bool ok = drainFrames(c.in, [&](const WireHeader& h, string_view) {
+                        auto it = pending.find(h.id);
+                        // Late answers to a request that was already retried or given up on.
+                        if (it == pending.end()) return;
+                        if (it->second.conn != i) {
+                            if (it->second.conn >= 0) conns[it->second.conn].outstanding--;
+                            it->second.conn = i;
+                            conns[i].outstanding++;
+                        }
+                        finish(h.id, it->second, Result{DriverStatus(h.status), h.value});
+                    });
+                    if (!ok) closed = true;
+                }
+                if (closed) disconnect(i);
+            }
+
+            vector<Request> batch;
+            {
+                lock_guard<mutex> guard(submitLock);
+                batch.swap(submitted);
+            }
+            for (Request& req : batch) {
+                uint32_t id = nextID++;
+                if (!id) id = nextID++;
+                Request& stored = pending[id] = move(req);
+                dispatch(id, stored);
+            }
+            now = steadyMs();
+            for (int i = 0; i < int(conns.size()); i++)
+                if (conns[i].fd < 0 && conns[i].retryAt <= now) connect(i);
+            expire(now);
+            for (int i = 0; i < int(conns.size()); i++)
+                if (conns[i].fd >= 0 && !conns[i].out.empty()) flushOut(i);
+        }
+        for (auto& [id, req] : pending)
+            if (req.done) req.done(Result{DriverStatus::Disconnected, 0});
+        pending.clear();
+    }
+
+public:
+    atomic<uint64_t> sent{0}, completed{0}, failed{0}, timeouts{0}, retries{0}, reconnects{0};
+
+    DeviceTransport(const string& socketPath, size_t connections = 4, int timeout = 200, int retryCount = 2)
+        : path(socketPath), timeoutMs(timeout), maxRetries(retryCount), conns(max<size_t>(1, connections)) {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event ev{EPOLLIN, {}};
+        ev.data.u32 = UINT32_MAX;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+        for (int i = 0; i < int(conns.size()); i++) connect(i);
+        io = thread(&DeviceTransport::loop, this);
+    }
+
+    size_t connected() const {
+        return count_if(conns.begin(), conns.end(), [](const Conn& c) { return c.fd >= 0; });
+    }
+
+    // Thread-safe. `done` runs on the I/O thread and must not block.
+    void submit(DriverOp op, const string& device, float value, Callback done) {
+        {
+            lock_guard<mutex> guard(submitLock);
+            submitted.push_back(Request{op, device, value, move(done)});
+        }
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {}
+    }
+
+    Result call(DriverOp op, const string& device, float value = 0) {
+        promise<Result> result;
+        future<Result> answer = result.get_future();
+        submit(op, device, value, [&](const Result& r) { result.set_value(r); });
+        return answer.get();
+    }
+
+    ~DeviceTransport() {
+        running.store(false);
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {}
+        io.join();
+        for (Conn& c : conns)
+            if (c.fd >= 0) ::close(c.fd);
+        ::close(epollFd);
+        ::close(wakeFd);
+    }
+};
+
+// Mirrors device state changes to a gateway: each event becomes a pipelined
+// driver request, so commands never wait on device I/O.
+class GatewayDriver : public EventSubscriber {
+    DeviceTransport& transport;
+public:
+    atomic<uint64_t> failures{0};
+
+    GatewayDriver(DeviceTransport& t) : transport(t) {}
+
+    void onEvents(const DeviceEvent* events, size_t count) override {
+        for (size_t i = 0; i < count; i++) {
+            const DeviceEvent& ev = events[i];
+            DriverOp op;
+            switch (ev.type) {
+                case DeviceEventType::TurnedOn:
+                case DeviceEventType::RecordingStarted: op = DriverOp::TurnOn; break;
+                case DeviceEventType::TurnedOff:
+                case DeviceEventType::RecordingStopped: op = DriverOp::TurnOff; break;
+                case DeviceEventType::BrightnessChanged:
+                case DeviceEventType::TargetTemperatureSet: op = DriverOp::SetLevel; break;
+                case DeviceEventType::DoorLocked: op = DriverOp::Lock; break;
+                case DeviceEventType::DoorUnlocked: op = DriverOp::Unlock; break;
+                default: continue;
+            }
+            transport.submit(op, ev.deviceID, ev.value, [this](const DeviceTransport::Result& r) {
+                if (r.status != DriverStatus::Ok) failures++;
+            });
+        }
+    }
+};
+
+// Latency histogram with power-of-two microsecond buckets.
+struct LatencyHistogram {
+    static const int Buckets = 24;
+    uint64_t counts[Buckets] = {};
+
+    uint64_t total = 0;
+    double sumUs = 0, maxUs = 0;
+
+    void add(double us) {
+        int b = 0;
+        while (b < Buckets - 1 && us >= double(1u << b)) b++;
+        counts[b]++;
+        total++;
+        sumUs += us;
+        maxUs = max(maxUs, us);
+    }
+
+    // Upper bound of the bucket holding quantile q.
+    double quantile(double q) const {
+        uint64_t rank = uint64_t(q * total), seen = 0;
+        for (int b = 0; b < Buckets; b++) {
+            seen += counts[b];
+            if (seen > rank) return min(double(1u << b), maxUs);
+        }
+        return maxUs;
+    }
+};
+
+// Priority classes for commands, most urgent first.
+enum class CommandClass : uint8_t { Security, Climate, Lighting, Bulk };
+const size_t CommandClasses = 4;
+
+const char* commandClassName(CommandClass c) {
+    static const char* names[] = {"security", "climate", "lighting", "bulk"};
+    return names[size_t(c)];
+}
+
+// Locks and cameras first, then heating and cooling; other devices go with lighting.
+CommandClass commandClassOf(const Device* device) {
+    if (dynamic_cast<const DoorLock*>(device) || dynamic_cast<const Camera*>(device)) return CommandClass::Security;
+    if (dynamic_cast<const TemperatureControlledDevices*>(device)) return CommandClass::Climate;
+    return CommandClass::Lighting;
+}
+
+// Runs commands under the home lock by class rather than arrival: whenever
+// the lock comes free, the executor thread takes the most urgent waiting
+// command (first come first served within a class). Long operations run
+// under a Hold and call preemptionPoint() between items; waiting commands
+// of a more urgent class then run right there, on the holder's thread, so
+// a lock or camera command waits for one item instead of a whole save.
+// Only device-level commands should go in the classes above Bulk: they run
+// in the middle of other work, so they mustn't add or remove anything.
+// Time from submit to done is kept per class against a deadline.
+class CommandQueue {
+public:
+    struct ClassStats {
+        CommandClass type;
+        uint64_t run, preempted, missed;  // preempted: run at a preemption point
+        double p50Ms, p99Ms, maxMs, deadlineMs;
+    };
+    using MissHandler = function<void(CommandClass, double ms)>;
+
+    // Takes the home lock as work of class c; preemptionPoint() under it
+    // runs waiting work of a more urgent class.
+    class Hold {
+        CommandQueue& queue;
+        CommandQueue* outerQueue;
+        CommandClass outerClass;
+    public:
+        Hold(CommandQueue& q, CommandClass c) : queue(q), outerQueue(holder), outerClass(holding) {
+            queue.homeLock.lock();
+            holder = &queue;
+            holding = c;
+        }
+        ~Hold() {
+            holder = outerQueue;
+            holding = outerClass;
+            queue.homeLock.unlock();
+        }
+        Hold(const Hold&) = delete;
+        Hold& operator=(const Hold&) = delete;
+    };
+
+private:
+    struct Task {
+        function<void()> run;
+        int64_t queuedNs;
+    };
+
+    mutex& homeLock;
+    mutex queueLock;
+    condition_variable ready;
+    deque<Task> waiting[CommandClasses];
+    atomic<uint32_t> waitingClasses{0};  // bit per class with work waiting
+    bool running = true;
+    thread executor;
+
+    mutex statsLock;
+    LatencyHistogram latency[CommandClasses];
+    uint64_t preempted[CommandClasses] = {}, missed[CommandClasses] = {};
+    double deadlineMs[CommandClasses] = {50, 250, 500, 0};  // 0: none
+    MissHandler onMiss;
+
+    inline static thread_local CommandQueue* holder = nullptr;
+    inline static thread_local CommandClass holding = CommandClass::Bulk;
+
+    static int64_t nowNs() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // The oldest task of the most urgent class above `below`.
+    bool pop(size_t below, Task& task, CommandClass& c) {
+        lock_guard<mutex> guard(queueLock);
+        for (size_t i = 0; i < below; i++) {
+            if (waiting[i].empty()) continue;
+            task = move(waiting[i].front());
+            waiting[i].pop_front();
+            if (waiting[i].empty()) waitingClasses.fetch_and(~(1u << i), memory_order_relaxed);
+            c = CommandClass(i);
+            return true;
+        }
+        return false;
+    }
+
+    // With the home lock held.
+    void run(Task& task, CommandClass c, bool preempting) {
+        CommandClass outer = holding;
+        holding = c;
+        try {
+            task.run();
+        } catch (const exception& e) {
+            cerr << "Command failed: " << e.what() << endl;
+        }
+        holding = outer;
+        double ms = (nowNs() - task.queuedNs) / 1e6;
+        size_t i = size_t(c);
+        bool late;
+        MissHandler handler;
+        {
+            lock_guard<mutex> guard(statsLock);
+            latency[i].add(ms * 1000);
+            preempted[i] += preempting;
+            late = deadlineMs[i] > 0 && ms > deadlineMs[i];
+            missed[i] += late;
+            if (late) handler = onMiss;
+        }
+        if (handler) handler(c, ms);
+    }
+
+    void loop() {
+        while (true) {
+            {
+                unique_lock<mutex> guard(queueLock);
+                ready.wait(guard, [this] { return !running || waitingClasses.load(memory_order_relaxed); });
+                if (!running && !waitingClasses.load(memory_order_relaxed)) return;
+            }
+            // Pick only once the lock is ours, so what came in meanwhile competes too.
+            Hold hold(*this, CommandClass::Bulk);
+            Task task;
+            CommandClass c;
+            if (pop(CommandClasses, task, c)) run(task, c, false);
+        }
+    }
+
+public:
+    CommandQueue(mutex& lock) : homeLock(lock) { executor = thread(&CommandQueue::loop, this); }
+
+    CommandQueue(const CommandQueue&) = delete;
+    CommandQueue& operator=(const CommandQueue&) = delete;
+
+    void setDeadline(CommandClass c, double ms) {
+        lock_guard<mutex> guard(statsLock);
+        deadlineMs[size_t(c)] = max(0.0, ms);
+    }
+    // Called on the thread that ran the late command, still holding the home lock.
+    void setMissHandler(MissHandler handler) {
+        lock_guard<mutex> guard(statsLock);
+        onMiss = move(handler);
+    }
+
+    // Queues task to run under the home lock and returns at once.
+    void post(CommandClass c, function<void()> task) {
+        {
+            lock_guard<mutex> guard(queueLock);
+            waiting[size_t(c)].push_back(Task{move(task), nowNs()});
+            waitingClasses.fetch_or(1u << size_t(c), memory_order_release);
+        }
+        ready.notify_one();
+    }
+
+    // Queues task and waits for it; its exceptions come back to the caller.
+    // Run in place if this thread already holds the lock.
+    void call(CommandClass c, function<void()> task) {
+        if (holder == this) {
+            task();
+            return;
+        }
+        promise<void> done;
+        future<void> result = done.get_future();
+        post(c, [&] {
+            try {
+                task();
+                done.set_value();
+            } catch (...) {
+                done.set_exception(current_exception());
+            }
+        });
+        result.get();
+    }
+
+    // Cheap unless something more urgent than the current work is waiting.
+    static void preemptionPoint() {
+        CommandQueue* queue = holder;
+        if (!queue || !(queue->waitingClasses.load(memory_order_acquire) & ((1u << size_t(holding)) - 1))) return;
+        Task task;
+        CommandClass c;
+        while (queue->pop(size_t(holding), task, c)) queue->run(task, c, true);
+    }
+
+    vector<ClassStats> stats() {
+        vector<ClassStats> out;
+        lock_guard<mutex> guard(statsLock);
+        for (size_t i = 0; i < CommandClasses; i++) {
+            const LatencyHistogram& h = latency[i];
+            out.push_back(ClassStats{CommandClass(i), h.total, preempted[i], missed[i], h.quantile(0.5) / 1000,
+                                     h.quantile(0.99) / 1000, h.maxUs / 1000, deadlineMs[i]});
+        }
+        return out;
+    }
+
+    void report(ostream& os) {
+        ios state(nullptr);
+        state.copyfmt(os);
+        os << "\n--- Command Latency ---\n" << left << setw(10) << "class" << right << setw(10) << "commands"
+           << setw(12) << "preempting" << setw(10) << "p50 ms" << setw(10) << "p99 ms" << setw(10) << "max ms"
+           << setw(12) << "deadline" << setw(8) << "missed" << "\n" << fixed << setprecision(2);
+        for (const ClassStats& s : stats()) {
+            os << left << setw(10) << commandClassName(s.type) << right << setw(10) << s.run << setw(12) << s.preempted
+               << setw(10) << s.p50Ms << setw(10) << s.p99Ms << setw(10) << s.maxMs;
+            if (s.deadlineMs > 0) os << setw(9) << s.deadlineMs << " ms";
+            else os << setw(12) << "-";
+            os << setw(8) << s.missed << "\n";
+        }
+        os.copyfmt(state);
+    }
+
+    // Runs what is still queued, then stops.
+    ~CommandQueue() {
+        {
+            lock_guard<mutex> guard(queueLock);
+            running = false;
+        }
+        ready.notify_one();
+        executor.join();
+    }
+};
+
+void preemptionPoint() { CommandQueue::preemptionPoint(); }
+
+struct MotionPolicy {
+    uint32_t startEvents = 2;  // motion reports within...
+    int64_t windowMs = 3000;   // ...this long start a recording
+    int64_t holdMs = 30000;    // which stops after this long without motion
+};
+
+// Motion reports from many cameras at high rates. Each camera has a
+// bounded lock-free queue of binary timestamps (ns since the epoch, as the
+// camera saw them); one thread drains them all, turns bursts of motion
+// into recordings as MotionPolicy says, and keeps per-camera rates and
+// report-to-pickup latency. Recordings started by hand are left alone.
+// Devices are only touched with deviceLock held, and only if it can be
+// taken at once; otherwise the change waits for the next pass, so a long
+// command never holds up ingestion.
+class MotionIngest {
+public:
+    static const uint32_t NoHandle = 0xffffffff;
+    static const size_t MaxCameras = 4096;
+    static const size_t RingSize = 1024;
+
+    struct Stats {
+        string id;
+        uint64_t events, dropped, recordings;
+        double perSec, p50Us, p99Us;
+        bool recording;
+    };
+
+private:
+    // Bounded multi-producer, single-consumer queue, as EventQueue.
+    struct Ring {
+        struct Slot {
+            atomic<uint64_t> sequence;
+            int64_t at;
+        };
+        Slot slots[RingSize];
+        alignas(64) atomic<uint64_t> tail{0};
+        alignas(64) uint64_t head = 0;
+        atomic<uint64_t> dropped{0};
+
+        Ring() {
+            for (size_t i = 0; i < RingSize; i++) slots[i].sequence.store(i, memory_order_relaxed);
+        }
+
+        bool push(int64_t at) {
+            uint64_t pos = tail.load(memory_order_relaxed);
+            while (true) {
+                Slot& slot = slots[pos % RingSize];
+                int64_t diff = int64_t(slot.sequence.load(memory_order_acquire)) - int64_t(pos);
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                        slot.at = at;
+                        slot.sequence.store(pos + 1, memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    dropped.fetch_add(1, memory_order_relaxed);
+                    return false;
+                } else {
+                    pos = tail.load(memory_order_relaxed);
+                }
+            }
+        }
+
+        bool pending() const { return slots[head % RingSize].sequence.load(memory_order_acquire) == head + 1; }
+
+        bool pop(int64_t& at) {
+            Slot& slot = slots[head % RingSize];
+            if (slot.sequence.load(memory_order_acquire) != head + 1) return false;
+            at = slot.at;
+            slot.sequence.store(head + RingSize, memory_order_release);
+            head++;
+            return true;
+        }
+    };
+
+    struct CameraState {
+        string id;
+        Ring ring;
+        // Drain thread only, read by stats() under statsLock.
+        int64_t windowStart = 0, lastMotion = 0, pendingStart = 0;
+        uint32_t windowEvents = 0;
+        bool autoRecording = false;
+        uint64_t events = 0, recordings = 0, sinceRate = 0;
+        double perSec = 0;
+        LatencyHistogram latency;
+    };
+
+    unique_ptr<atomic<CameraState*>[]> cameras;
+    atomic<uint32_t> cameraCount{0};
+    unordered_map<string, uint32_t> handles;
+    mutex registry;
+    // Cameras are looked up by ID when a recording starts or stops: in lazy
+    // mode a user's devices may have been unloaded since rebuild() saw them.
+    DeviceIndex* index = nullptr;
+    mutex* deviceLock = nullptr;
+    CommandQueue* commands = nullptr;
+    atomic<bool> decisionQueued{false};
+    mutex statsLock;
+    MotionPolicy policy;
+
+    atomic<bool> running{false}, sleeping{false};
+    mutex wakeLock;
+    condition_variable wake;
+    thread worker;
+    int listenFd = -1;
+    string listenPath;
+    thread receiver;
+    int64_t rateStart = 0;
+    bool timersPending = false;  // a recording to start or stop later
+
+    static int64_t nowNs() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    CameraState* state(uint32_t handle) const {
+        return handle < cameraCount.load(memory_order_acquire) ? cameras[handle].load(memory_order_acquire) : nullptr;
+    }
+
+    void motion(CameraState& c, int64_t at) {
+        if (at - c.windowStart > policy.windowMs * 1000000) {
+            c.windowStart = at;
+            c.windowEvents = 0;
+        }
+        c.lastMotion = max(c.lastMotion, at);
+        if (++c.windowEvents >= policy.startEvents && !c.autoRecording && !c.pendingStart) c.pendingStart = at;
+    }
+
+    // Starts or stops c's recording if the policy calls for it and the
+    // device lock is free (or `locked`, already held). With a command queue,
+    // a busy lock queues a security command to decide again at the holder's
+    // next preemption point.
+    void decide(CameraState& c, int64_t now, bool locked = false) {
+        bool start = c.pendingStart && !c.autoRecording;
+        bool stop = c.autoRecording && now - c.lastMotion >= policy.holdMs * 1000000;
+        if (!start && !stop) return;
+        unique_lock<mutex> guard;
+        if (deviceLock && !locked) {
+            guard = unique_lock<mutex>(*deviceLock, try_to_lock);
+            if (!guard.owns_lock()) {
+                if (commands && !decisionQueued.exchange(true)) commands->post(CommandClass::Security, [this] { decideQueued(); });
+                return;
+            }
+        }
+        Camera* camera = index ? dynamic_cast<Camera*>(index->findByID(c.id)) : nullptr;
+        if (!camera) {
+            c.pendingStart = 0;
+            c.autoRecording = false;
+        } else if (start) {
+            if (!camera->recording()) {
+                if (camera->lastMotionAt() < c.pendingStart) camera->detectMotion(c.pendingStart);
+                camera->startRecording();
+                c.autoRecording = true;
+                c.recordings++;
+            }
+            c.pendingStart = 0;
+        } else {
+            if (camera->recording()) camera->stopRecording();
+            c.autoRecording = false;
+        }
+    }
+
+    // Runs from the command queue, with the device lock held.
+    void decideQueued() {
+        decisionQueued.store(false);
+        int64_t now = nowNs();
+        uint32_t n = cameraCount.load(memory_order_acquire);
+        lock_guard<mutex> guard(statsLock);
+        for (uint32_t i = 0; i < n; i++) decide(*cameras[i].load(memory_order_acquire), now, true);
+    }
+
+    size_t drain() {
+        size_t drained = 0;
+        int64_t now = nowNs();
+        uint32_t n = cameraCount.load(memory_order_acquire);
+        lock_guard<mutex> guard(statsLock);
+        timersPending = false;
+        for (uint32_t i = 0; i < n; i++) {
+            CameraState& c = *cameras[i].load(memory_order_acquire);
+            int64_t at;
+            while (c.ring.pop(at)) {
+                c.events++;
+                c.sinceRate++;
+                c.latency.add(max(0.0, (now - at) / 1000.0));
+                motion(c, at);
+                drained++;
+            }
+            decide(c, now);
+            timersPending |= c.autoRecording || c.pendingStart;
+        }
+        if (now - rateStart >= 1000000000) {
+            double seconds = (now - rateStart) / 1e9;
+            for (uint32_t i = 0; i < n; i++) {
+                CameraState& c = *cameras[i].load(memory_order_acquire);
+                c.perSec = c.sinceRate / seconds;
+                c.sinceRate = 0;
+            }
+            rateStart = now;
+        }
+        return drained;
+    }
+
+    bool anyPending() const {
+        uint32_t n = cameraCount.load(memory_order_acquire);
+        for (uint32_t i = 0; i < n; i++)
+            if (cameras[i].load(memory_order_acquire)->ring.pending()) return true;
+        return false;
+    }
+
+    // Spins while reports keep coming; otherwise sleeps until a post wakes
+    // it, or while recordings are running, until it's time to look at their
+    // stop timers again.
+    void run() {
+        int idle = 0;
+        while (running.load()) {
+            if (drain()) {
+                idle = 0;
+                continue;
+            }
+            if (++idle < 64) {
+                this_thread::yield();
+                continue;
+            }
+            unique_lock<mutex> guard(wakeLock);
+            sleeping.store(true);
+            if (!anyPending() && running.load()) {
+                if (timersPending) wake.wait_for(guard, chrono::milliseconds(50));
+                else wake.wait(guard);
+            }
+            sleeping.store(false);
+        }
+    }
+
+    // Datagrams of [u8 ID length][camera ID][i64 ns] records, any number
+    // per datagram, so a bridge can batch many cameras' reports in one send.
+    void receive() {
+        vector<char> buf(65536);
+        unordered_map<string, uint32_t> known;
+        while (running.load()) {
+            pollfd p{listenFd, POLLIN, 0};
+            if (poll(&p, 1, 200) <= 0) continue;
+            ssize_t n = recv(listenFd, buf.data(), buf.size(), 0);
+            for (ssize_t i = 0; n > 0 && i < n;) {
+                uint8_t len = uint8_t(buf[i]);
+                if (i + 1 + len + 8 > n) break;
+                string id(&buf[i + 1], len);
+                int64_t at;
+                memcpy(&at, &buf[i + 1 + len], 8);
+                i += 1 + len + 8;
+                auto it = known.find(id);
+                if (it == known.end()) {
+                    uint32_t handle = handleFor(id);
+                    if (handle == NoHandle) continue;
+                    it = known.emplace(id, handle).first;
+                }
+                post(it->second, at);
+            }
+        }
+    }
+
+public:
+    MotionIngest(MotionPolicy p = MotionPolicy()) : cameras(new atomic<CameraState*>[MaxCameras]), policy(p) {
+        for (size_t i = 0; i < MaxCameras; i++) cameras[i].store(nullptr, memory_order_relaxed);
+    }
+
+    // The lock that guards the devices wherever commands change them.
+    void setDeviceLock(mutex* lock) { deviceLock = lock; }
+    // The queue that guards that lock, if any; see decide().
+    void attachQueue(CommandQueue* queue) { commands = queue; }
+
+    void setPolicy(const MotionPolicy& p) {
+        lock_guard<mutex> guard(statsLock);
+        policy = p;
+    }
+
+    // Registers the home's cameras; ones already known keep their handles,
+    // and reports for ones no longer loaded are counted but not acted on.
+    // Call with the device lock held, on a thread using the home's index.
+    void rebuild(SmartHome& home) {
+        lock_guard<mutex> guard(registry);
+        index = Device::hooks().index;
+        for (const auto& [username, user] : home.getAllUsers()) {
+            for (const auto& [roomName, room] : user->getAllRooms()) {
+                for (Device* device : room->getDevices()) {
+                    auto camera = dynamic_cast<Camera*>(device);
+                    if (!camera) continue;
+                    if (handles.count(camera->getDeviceID())) continue;
+                    uint32_t n = cameraCount.load(memory_order_relaxed);
+                    if (n == MaxCameras) throw DeviceException("Too many cameras for motion ingestion");
+                    CameraState* c = new CameraState();
+                    c->id = camera->getDeviceID();
+                    cameras[n].store(c, memory_order_release);
+                    handles[c->id] = n;
+                    cameraCount.store(n + 1, memory_order_release);
+                }
+            }
+        }
+    }
+
+    uint32_t handleFor(const string& cameraID) {
+        lock_guard<mutex> guard(registry);
+        auto it = handles.find(cameraID);
+        return it == handles.end() ? NoHandle : it->second;
+    }
+
+    // Lock-free; false if the camera is unknown or its queue is full.
+    bool post(uint32_t handle, int64_t atNs) {
+        CameraState* c = state(handle);
+        if (!c || !c->ring.push(atNs)) return false;
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleeping.load()) {
+            lock_guard<mutex> guard(wakeLock);
+            wake.notify_one();
+        }
+        return true;
+    }
+
+    void start() {
+        rateStart = nowNs();
+        running.store(true);
+        worker = thread(&MotionIngest::run, this);
+    }
+
+    // Also takes reports on a Unix datagram socket at path.
+    void listen(const string& path) {
+        listenFd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (listenFd < 0 || path.size() >= sizeof(addr.sun_path))
+            throw DeviceException("Cannot open motion socket: " + path);
+        strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+        if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(listenFd);
+            listenFd = -1;
+            throw DeviceException("Cannot bind motion socket: " + path);
+        }
+        int size = 4 << 20;
+        setsockopt(listenFd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        listenPath = path;
+        receiver = thread(&MotionIngest::receive, this);
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        {
+            lock_guard<mutex> guard(wakeLock);
+            wake.notify_one();
+        }
+        if (worker.joinable()) worker.join();
+        if (receiver.joinable()) receiver.join();
+        // Wait out a decision still in the queue; it comes before this one.
+        if (commands && decisionQueued.load()) commands->call(CommandClass::Security, [] {});
+        if (listenFd >= 0) {
+            close(listenFd);
+            unlink(listenPath.c_str());
+            listenFd = -1;
+        }
+    }
+
+    // Drains what has been posted so far on the caller's thread (for tests
+    // and benchmarks, with the thread stopped).
+    size_t drainNow() { return drain(); }
+
+    vector<Stats> stats() {
+        vector<Stats> out;
+        uint32_t n = cameraCount.load(memory_order_acquire);
+        lock_guard<mutex> guard(statsLock);
+        // Rates are refreshed while reports come in; an idle thread leaves them behind.
+        bool fresh = nowNs() - rateStart < 2000000000;
+        for (uint32_t i = 0; i < n; i++) {
+            const CameraState& c = *cameras[i].load(memory_order_acquire);
+            out.push_back(Stats{c.id, c.events, c.ring.dropped.load(memory_order_relaxed), c.recordings, fresh ? c.perSec : 0,
+                                c.latency.quantile(0.5), c.latency.quantile(0.99), c.autoRecording});
+        }
+        return out;
+    }
+
+    // The busiest cameras first.
+    void report(ostream& os, size_t top = 20) {
+        vector<Stats> all = stats();
+        sort(all.begin(), all.end(), [](const Stats& a, const Stats& b) {
+            return a.perSec != b.perSec ? a.perSec > b.perSec : a.events > b.events;
+        });
+        ios state(nullptr);
+        state.copyfmt(os);
+        os << "\n--- Camera Activity ---\n" << left << setw(12) << "camera" << right << setw(10) << "events/s"
+           << setw(12) << "events" << setw(10) << "dropped" << setw(12) << "recordings" << setw(10) << "p50 us"
+           << setw(10) << "p99 us" << "\n" << fixed << setprecision(1);
+        for (size_t i = 0; i < all.size() && i < top; i++) {
+            const Stats& s = all[i];
+            os << left << setw(12) << s.id << right << setw(10) << s.perSec << setw(12) << s.events << setw(10)
+               << s.dropped << setw(12) << s.recordings << setw(10) << s.p50Us << setw(10) << s.p99Us
+               << (s.recording ? "  recording" : "") << "\n";
+        }
+        if (all.size() > top) os << "(" << all.size() - top << " more cameras)\n";
+        os.copyfmt(state);
+    }
+
+    ~MotionIngest() {
+        stop();
+        for (uint32_t i = 0; i < cameraCount.load(); i++) delete cameras[i].load();
+    }
+};
+
+// Replication log shipped from a primary to a hot standby. Frames are
+// u32 payload length, u8 type, u64 sequence, i64 primary wall-clock ns,
+// then the payload; the standby acknowledges with the u64 sequence it has
+// applied. Payloads reuse the data file formats:
+//   UserBlock    a user's USER/ROOM/DEVICE lines (replaces the whole user)
+//   DeviceState  one DEVICE line (state of an existing device)
+//   DeviceBatch  DEVICE lines for every device one transaction changed
+//   ScheduleSet  "deviceID hour minute"
+//   Credential   one credential store record
+enum class ReplicationRecord : uint8_t {
+    Heartbeat, SnapshotBegin, SnapshotEnd, UserBlock, DeviceState,
+    ScheduleSet, Credential, Goodbye,
+    DeviceBatch
+};
+
+const size_t ReplicationHeaderSize = 21;
+
+int64_t wallNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void appendReplicationFrame(string& out, ReplicationRecord type, uint64_t seq, int64_t at, string_view payload) {
+    char header[ReplicationHeaderSize];
+    uint32_t len = payload.size();
+    memcpy(header, &len, 4);
+    header[4] = char(type);
+    memcpy(header + 5, &seq, 8);
+    memcpy(header + 13, &at, 8);
+    out.append(header, sizeof(header));
+    out.append(payload);
+}
+
+// Primary side. append() only encodes into a buffer; a sender thread ships
+// whatever has accumulated in one write, so commands never wait on the
+// standby, and reads acknowledgements as they arrive. After every
+// (re)connect the snapshot callback re-sends the full state.
+//
+// Device changes, the bulk of the log, cost commands less still:
+// deviceChanged() queues the device's ID and version without locking, and
+// the sender thread serializes each changed device's current state.
+class ReplicationSender {
+    static const size_t ChangeCapacity = 8192;
+
+    string path;
+    function<void()> snapshot;
+    mutex lock;
+    int wakeFd;
+    string pending;
+    bool connected = false;
+    // Changed devices as DeviceEvents carrying the ID and, in ref, the version.
+    EventQueue changes{ChangeCapacity};
+    mutex* stateLock = nullptr;
+    DeviceIndex* index = nullptr;  // resolves queued IDs, under stateLock
+    atomic<bool> live{false};      // connected, as deviceChanged() sees it
+    atomic<bool> resync{false};    // a change didn't fit; send a snapshot
+    atomic<bool> sleeping{false};
+    unordered_map<string, uint64_t> shippedVersions;  // sender thread only
+    uint64_t nextSeq = 1;
+    deque<pair<uint64_t, int64_t>> unacked;  // sequence, enqueue time
+    LatencyHistogram ackLatency;
+    atomic<bool> running{true};
+    int fd = -1;
+    thread worker;
+
+    bool tryConnect() {
+        sockaddr_un addr;
+        int s = unixSocket(path, addr);
+        if (::connect(s, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            ::close(s);
+            return false;
+        }
+        int flags = fcntl(s, F_GETFL);
+        fcntl(s, F_SETFL, flags & ~O_NONBLOCK);
+        fd = s;
+        return true;
+    }
+
+    void notify() {
+        uint64_t one = 1;
+        ssize_t n = ::write(wakeFd, &one, sizeof(one));
+        (void)n;
+    }
+
+    void drop() {
+        ::close(fd);
+        fd = -1;
+        live.store(false);
+        lock_guard<mutex> guard(lock);
+        connected = false;
+        pending.clear();
+        unacked.clear();
+    }
+
+    // Returns whether it was the first record of a batch.
+    bool enqueue(ReplicationRecord type, string_view payload) {
+        lock_guard<mutex> guard(lock);
+        if (!connected) return false;
+        int64_t now = wallNs();
+        bool first = pending.empty();
+        unacked.emplace_back(nextSeq, now);
+        appendReplicationFrame(pending, type, nextSeq++, now, payload);
+        return first;
+    }
+
+    void discardChanges() {
+        DeviceEvent ev;
+        while (changes.pop(ev)) {}
+        shippedVersions.clear();
+    }
+
+    // Serializes the queued devices, each once and as it is now, into one
+    // batch. Under the state lock, so a transaction's devices land in the
+    // same batch and the batch is ordered with records commands append.
+    void shipChanges() {
+        if (changes.empty()) return;
+        lock_guard<mutex> state(*stateLock);
+        ostringstream batch;
+        DeviceEvent ev;
+        while (changes.pop(ev)) {
+            uint64_t& shipped = shippedVersions[ev.deviceID];
+            if (shipped >= uint64_t(ev.ref)) continue;
+            Device* device = index->findByID(ev.deviceID);
+            if (!device) continue;
+            shipped = device->getVersion();
+            DataStorage::writeDevice(batch, device);
+        }
+        string out = batch.str();
+        if (!out.empty()) enqueue(ReplicationRecord::DeviceBatch, out);
+    }
+
+    bool sendAll(const string& out) {
+        size_t off = 0;
+        while (off < out.size()) {
+            ssize_t n = ::send(fd, out.data() + off, out.size() - off, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            off += n;
+        }
+        return true;
+    }
+
+    bool readAcks() {
+        uint64_t seqs[512];
+        ssize_t n;
+        while ((n = ::recv(fd, seqs, sizeof(seqs), MSG_DONTWAIT)) > 0) {
+            // Acks are 8 bytes; a short read leaves the remainder for the next call.
+            if (n % 8) {
+                ssize_t rest = 8 - n % 8;
+                if (::recv(fd, (char*)seqs + n, rest, MSG_WAITALL) != rest) return false;
+                n += rest;
+            }
+            uint64_t seq = seqs[n / 8 - 1];
+            int64_t now = wallNs();
+            lock_guard<mutex> guard(lock);
+            while (!unacked.empty() && unacked.front().first <= seq) {
+                ackLatency.add((now - unacked.front().second) / 1000.0);
+                unacked.pop_front();
+            }
+            acked.store(seq);
+        }
+        return n != 0 && (n > 0 || errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
+    void loop() {
+        string out;
+        auto lastSend = chrono::steady_clock::now();
+        while (running.load()) {
+            if (fd < 0) {
+                if (!tryConnect()) {
+                    this_thread::sleep_for(chrono::milliseconds(200));
+                    continue;
+                }
+                {
+                    lock_guard<mutex> guard(lock);
+                    connected = true;
+                    pending.clear();
+                    unacked.clear();
+                }
+                discardChanges();
+                live.store(true);
+                if (snapshot) snapshot();
+            }
+            pollfd fds[2] = {{fd, POLLIN, 0}, {wakeFd, POLLIN, 0}};
+            sleeping.store(true);
+            ::poll(fds, 2, changes.empty() ? 100 : 0);
+            sleeping.store(false);
+            if (fds[1].revents & POLLIN) {
+                uint64_t count;
+                ssize_t n = ::read(wakeFd, &count, sizeof(count));
+                (void)n;
+            }
+            if (fds[0].revents && !readAcks()) {
+                drop();
+                continue;
+            }
+            if (resync.exchange(false)) {
+                discardChanges();
+                if (snapshot) snapshot();
+            }
+            shipChanges();
+            auto now = chrono::steady_clock::now();
+            {
+                lock_guard<mutex> guard(lock);
+                // Heartbeats keep the standby's lag figure fresh while idle.
+                if (pending.empty() && now - lastSend >= chrono::milliseconds(100)) {
+                    unacked.emplace_back(nextSeq, wallNs());
+                    appendReplicationFrame(pending, ReplicationRecord::Heartbeat, nextSeq++, wallNs(), {});
+                }
+                out.clear();
+                out.swap(pending);
+            }
+            if (out.empty()) continue;
+            if (!sendAll(out)) drop();
+            lastSend = now;
+        }
+        if (fd >= 0) {
+            shipChanges();
+            enqueue(ReplicationRecord::Goodbye, {});
+            lock_guard<mutex> guard(lock);
+            sendAll(pending);
+            ::close(fd);
+        }
+    }
+
+public:
+    atomic<uint64_t> acked{0};
+
+    ReplicationSender(const string& socketPath) : path(socketPath), wakeFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {}
+
+    // Both must be set before start(). The snapshot runs on the sender
+    // thread and should append the whole state between SnapshotBegin and
+    // SnapshotEnd; the lock is the one held wherever devices change, and
+    // the index is the one the changed devices are in.
+    void setSnapshot(function<void()> fn) { snapshot = move(fn); }
+    void setState(mutex* state, DeviceIndex* devices) { stateLock = state; index = devices; }
+    void start() { worker = thread(&ReplicationSender::loop, this); }
+
+    // Thread-safe and cheap; dropped while no standby is connected, since
+    // the snapshot on reconnect covers it.
+    void append(ReplicationRecord type, string_view payload = {}) {
+        // Only the first record of a batch needs to wake the sender.
+        if (enqueue(type, payload)) notify();
+    }
+
+    // Lock-free; call with the state lock held, after changing the device.
+    void deviceChanged(const Device* device) {
+        if (!live.load(memory_order_relaxed)) return;
+        DeviceEvent ev;
+        const string& id = device->getDeviceID();
+        ev.ref = int64_t(device->getVersion());
+        copyField(ev.deviceID, id);
+        if (id.size() >= sizeof(ev.deviceID) || !changes.push(ev)) resync.store(true);
+        atomic_thread_fence(memory_order_seq_cst);
+        // One wake per sleep, not one per change.
+        if (sleeping.load() && sleeping.exchange(false)) notify();
+    }
+
+    // Whether the standby has acknowledged everything so far, queued
+    // device changes included.
+    bool caughtUp() {
+        lock_guard<mutex> state(*stateLock);
+        lock_guard<mutex> guard(lock);
+        return connected && changes.empty() && acked.load() >= nextSeq - 1;
+    }
+
+    bool isConnected() {
+        lock_guard<mutex> guard(lock);
+        return connected;
+    }
+
+    uint64_t lastSeq() {
+        lock_guard<mutex> guard(lock);
+        return nextSeq - 1;
+    }
+
+    // Age of the oldest change the standby hasn't acknowledged; 0 when caught up.
+    double lagMs() {
+        lock_guard<mutex> guard(lock);
+        return unacked.empty() ? 0.0 : (wallNs() - unacked.front().second) / 1e6;
+    }
+
+    LatencyHistogram ackLatencies() {
+        lock_guard<mutex> guard(lock);
+        return ackLatency;
+    }
+
+    // Ships queued changes and says goodbye; call without the state lock.
+    ~ReplicationSender() {
+        running.store(false);
+        notify();
+        if (worker.joinable()) worker.join();
+        ::close(wakeFd);
+    }
+};
+
+// Builds replication payloads from live objects on the primary.
+struct ReplicationSource {
+    static string userBlock(User* user) {
+        ostringstream out;
+        DataStorage::writeUser(out, user);
+        return out.str();
+    }
+
+    static string deviceState(Device* device) {
+        ostringstream out;
+        DataStorage::writeDevice(out, device);
+        return out.str();
+    }
+
+    static string schedule(const string& id, const Time& t) {
+        return id + " " + to_string(t.hour) + " " + to_string(t.minute);
+    }
+
+    static void snapshot(ReplicationSender& sender, SmartHome& home, const Scheduler& scheduler,
+                         CredentialStore* credentials) {
+        sender.append(ReplicationRecord::SnapshotBegin);
+        string record;
+        for (const auto& [name, user] : home.getAllUsers()) {
+            sender.append(ReplicationRecord::UserBlock, userBlock(user));
+            if (credentials && credentials->exportRecord(name, record)) sender.append(ReplicationRecord::Credential, record);
+        }
+        scheduler.forEachSchedule([&](const string& id, const Time& t) {
+            sender.append(ReplicationRecord::ScheduleSet, schedule(id, t));
+        });
+        sender.append(ReplicationRecord::SnapshotEnd);
+    }
+
+    // Queues every device whose version moved since it was last queued, for
+    // loops (like the daemon's) that change devices without going through
+    // commands. A null sender only records versions, e.g. after a snapshot.
+    unordered_map<const Device*, uint64_t> shipped;
+    void shipChangedDevices(ReplicationSender* sender, SmartHome& home) {
+        for (const auto& [name, user] : home.getAllUsers())
+            for (const auto& [roomName, room] : user->getAllRooms())
+                for (Device* d : room->getDevices()) {
+                    uint64_t& version = shipped[d];
+                    if (version == d->getVersion()) continue;
+                    version = d->getVersion();
+                    if (sender) sender->deviceChanged(d);
+                }
+    }
+};
+
+// Standby side: applies log records to a home as they arrive.
+class ReplicaApplier {
+    SmartHome& home;
+    Scheduler& scheduler;
+    CredentialStore* credentials;
+
+    void replaceUsers(string_view block) {
+        istringstream in{string(block)};
+        HomeBuilder builder;
+        streamRecords(in, builder);
+        for (User* user : builder.users) {
+            string name = user->getUsername();
+            const auto& users = home.getAllUsers();
+            auto old = users.find(name);
+            if (old != users.end()) {
+                User* previous = old->second;
+                home.removeUser(name);
+                delete previous;
+            }
+            home.addUser(name, user);
+        }
+    }
+
+    void clear() {
+        for (const auto& [name, user] : home.getAllUsers()) {
+            home.removeUser(name);
+            delete user;
+        }
+        scheduler.clearAllSchedules();
+    }
+
+public:
+    uint64_t appliedSeq = 0;
+    uint64_t applied = 0;
+    int64_t lastPrimaryNs = 0;
+    double lagMs = 0;
+    bool primaryDone = false;
+
+    ReplicaApplier(SmartHome& h, Scheduler& s, CredentialStore* c) : home(h), scheduler(s), credentials(c) {}
+
+    void apply(ReplicationRecord type, uint64_t seq, int64_t at, string_view payload) {
+        switch (type) {
+            case ReplicationRecord::SnapshotBegin: clear(); break;
+            case ReplicationRecord::UserBlock: replaceUsers(payload); break;
+            case ReplicationRecord::DeviceState:
+            case ReplicationRecord::DeviceBatch: {
+                const char* end = payload.data() + payload.size();
+                DataRecord rec;
+                for (const char* p = payload.data(); p < end && Device::hooks().index;) {
+                    const char* nl = TextScan::findNewline(p, end);
+                    RecordReader::parseLine(string_view(p, nl - p), end, rec);
+                    p = nl + 1;
+                    if (rec.kind != RecordKind::Device) break;
+                    if (Device* device = Device::hooks().index->findByID(rec.field(1))) applyDeviceRecord(device, rec);
+                }
+                break;
+            }
+            case ReplicationRecord::ScheduleSet: {
+                istringstream in{string(payload)};
+                string id;
+                int hour, minute;
+                if (in >> id >> hour >> minute) scheduler.addSchedule(id, Time(hour, minute));
+                break;
+            }
+            case ReplicationRecord::Credential: if (credentials) credentials->importRecord(payload); break;
+            case ReplicationRecord::Goodbye: primaryDone = true; break;
+            default: break;
+        }
+        if (type != ReplicationRecord::Goodbye) primaryDone = false;
+        appliedSeq = seq;
+        lastPrimaryNs = at;
+        lagMs = (wallNs() - at) / 1e6;
+        applied++;
+    }
+};
+
+// Accepts a primary on a Unix socket and applies its log until it goes
+// away, acknowledging after each batch read.
+class StandbyServer {
+    string path;
+    int listenFd;
+    ReplicaApplier& applier;
+public:
+    enum class Outcome { PrimaryLost, PrimaryDone, Signalled };
+
+    StandbyServer(const string& socketPath, ReplicaApplier& a) : path(socketPath), applier(a) {
+        sockaddr_un addr;
+        listenFd = unixSocket(path, addr);
+        unlink(path.c_str());
+        if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 4) != 0) {
+            ::close(listenFd);
+            throw DeviceException("Cannot listen on " + path + ": " + strerror(errno));
+        }
+    }
+
+    // Serves one primary connection. `poll` runs about every 200 ms and
+    // returns true to stop serving.
+    Outcome serve(const function<bool()>& poll) {
+        int fd = -1;
+        while (fd < 0) {
+            if (poll()) return Outcome::Signalled;
+            pollfd wait{listenFd, POLLIN, 0};
+            if (::poll(&wait, 1, 200) > 0) fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        }
+        string in;
+        char buf[65536];
+        Outcome outcome = Outcome::PrimaryLost;
+        while (true) {
+            if (poll()) { outcome = Outcome::Signalled; break; }
+            pollfd wait{fd, POLLIN, 0};
+            if (::poll(&wait, 1, 200) <= 0) continue;
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                outcome = applier.primaryDone ? Outcome::PrimaryDone : Outcome::PrimaryLost;
+                break;
+            }
+            in.append(buf, n);
+            size_t pos = 0;
+            uint64_t before = applier.appliedSeq;
+            while (in.size() - pos >= ReplicationHeaderSize) {
+                uint32_t len;
+                uint64_t seq;
+                int64_t at;
+                memcpy(&len, in.data() + pos, 4);
+                if (in.size() - pos < ReplicationHeaderSize + len) break;
+                memcpy(&seq, in.data() + pos + 5, 8);
+                memcpy(&at, in.data() + pos + 13, 8);
+                applier.apply(ReplicationRecord(in[pos + 4]), seq, at,
+                              string_view(in.data() + pos + ReplicationHeaderSize, len));
+                pos += ReplicationHeaderSize + len;
+            }
+            in.erase(0, pos);
+            if (applier.appliedSeq != before) {
+                uint64_t seq = applier.appliedSeq;
+                if (::send(fd, &seq, 8, MSG_NOSIGNAL) != 8) break;
+            }
+        }
+        ::close(fd);
+        return outcome;
+    }
+
+    ~StandbyServer() {
+        ::close(listenFd);
+        unlink(path.c_str());
+    }
+};
+
+
+// Console requests as data, so live input and trace replay share one path.
+enum class CommandType : uint8_t {
+    Register = 1, Login, AddRoom, AddDevice, ViewRoom, Dashboard, Control,
+    Schedule, EnergyReport, ViewAlerts, FindDevices, Exit,
+    Tick,  // scheduled actions that fired between commands
+    History, Memory,
+    Transaction, Motion, Latency
+};
+
+const char* commandName(CommandType type) {
+    static const char* names[] = {"?", "register", "login", "add-room", "add-device", "view-room", "dashboard",
+                                  "control", "schedule", "energy", "alerts", "find", "exit", "tick",
+                                  "history", "memory", "transaction", "motion", "latency"};
+    size_t i = size_t(type);
+    return i < sizeof(names) / sizeof(names[0]) ? names[i] : "?";
+}
+
+// Arguments by type:
+//   Register/Login  username password
+//   AddRoom         room
+//   AddDevice       room id name type [initial brightness/temperature]
+//   ViewRoom        room
+//   Control         room device op [value] [minutes, for op 4]
+//   Schedule        room device hour minute
+//   FindDevices     type status [lock]
+//   Tick            device IDs whose scheduled action ran
+//   History         room device [hours]
+//   Transaction     room device op value, repeated (op: on off level lock unlock record stop)
+struct Command {
+    CommandType type;
+    vector<string> args;
+
+    const string& arg(size_t i) const {
+        static const string none;
+        return i < args.size() ? args[i] : none;
+    }
+};
+
+// Appends commands to a binary trace ("SHTR1"):
+//   magic, varint snapshot length, snapshot (SHB1 data, passwords removed),
+//   varint schedule length, schedule section (SHSC1), then per command
+//   varint ns since the previous command, u8 type, u8 argc, varint-prefixed
+//   args; a final u8 0 and u64 checksum close the trace.
+// Passwords never reach the trace: each one is replaced by a stand-in that
+// reproduces the original outcome (ReplayPassword where it was accepted).
+class TraceRecorder {
+    ofstream out;
+    string buffer;
+    chrono::steady_clock::time_point last;
+    bool finished = false;
+
+    void putVarint(uint64_t value) {
+        while (value >= 0x80) {
+            buffer += char((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        buffer += char(value);
+    }
+
+    void putBlob(const string& blob) {
+        putVarint(blob.size());
+        buffer += blob;
+    }
+
+    class Redactor : public RecordVisitor {
+        RecordWriter& writer;
+    public:
+        Redactor(RecordWriter& w) : writer(w) {}
+        bool onUser(const DataRecord& rec) override {
+            string_view fields[2] = {rec.fields[0], "-"};
+            writer.write(RecordKind::User, fields, 2);
+            return true;
+        }
+        bool onRoom(const DataRecord& rec) override { writer.write(rec); return true; }
+        bool onDevice(const DataRecord& rec) override { writer.write(rec); return true; }
+    };
+
+    static string readFile(const string& path) {
+        ifstream in(path, ios::binary);
+        return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+
+public:
+    static constexpr const char* Magic = "SHTR1";
+    static constexpr const char* ReplayPassword = "replay0";
+
+    TraceRecorder(const string& path, const string& dataFile, const string& scheduleFile)
+        : out(path, ios::binary | ios::trunc) {
+        if (!out.is_open()) throw DeviceException("Cannot open trace file: " + path);
+        ostringstream snapshot;
+        {
+            RecordWriter writer(snapshot, true);
+            Redactor redactor(writer);
+            streamRecords(dataFile, redactor);
+        }
+        buffer = Magic;
+        putBlob(snapshot.str());
+        putBlob(readFile(scheduleFile));
+        out.write(buffer.data(), buffer.size());
+        last = chrono::steady_clock::now();
+    }
+
+    void record(const Command& cmd, chrono::steady_clock::time_point at, bool succeeded) {
+        buffer.clear();
+        putVarint(max<int64_t>(0, chrono::duration_cast<chrono::nanoseconds>(at - last).count()));
+        last = at;
+        buffer += char(cmd.type);
+        buffer += char(min<size_t>(cmd.args.size(), 255));
+        for (size_t i = 0; i < cmd.args.size() && i < 255; i++) {
+            bool secret = i == 1 && (cmd.type == CommandType::Register || cmd.type == CommandType::Login);
+            if (!secret) { putBlob(cmd.args[i]); continue; }
+            const string& pwd = cmd.args[i];
+            if (succeeded) putBlob(ReplayPassword);
+            else if (cmd.type == CommandType::Login) putBlob("invalid");
+            else putBlob(pwd.length() < 6 ? "short" : "nodigit");
+        }
+        out.write(buffer.data(), buffer.size());
+        out.flush();
+    }
+
+    void finish(uint64_t checksum) {
+        if (finished) return;
+        finished = true;
+        out.put(0);
+        out.write((const char*)&checksum, 8);
+        out.flush();
+    }
+};
+
+// FNV-1a over users, rooms, devices and schedules. Wall-clock values such
+// as motion timestamps are left out, so replays of one trace agree.
+uint64_t homeChecksum(SmartHome& home, const Scheduler& scheduler) {
+    auto fnv = [](uint64_t h, const string& s) {
+        for (unsigned char c : s) h = (h ^ c) * 1099511628211ULL;
+        return (h ^ 0xff) * 1099511628211ULL;
+    };
+    uint64_t h = 14695981039346656037ULL;
+    char num[32];
+    for (const auto& [username, user] : home.getAllUsers()) {
+        h = fnv(h, username);
+        for (const auto& [roomName, room] : user->getAllRooms()) {
+            h = fnv(h, roomName);
+            for (Device* device : room->getDevices()) {
+                float extra = 0;
+                if (auto light = dynamic_cast<Light*>(device)) extra = light->getBrightness();
+                else if (auto tcd = dynamic_cast<TemperatureControlledDevices*>(device)) extra = tcd->getCurrentTemperature();
+                else if (auto lock = dynamic_cast<DoorLock*>(device)) extra = lock->checkLockStatus();
+                else if (auto camera = dynamic_cast<Camera*>(device)) extra = !camera->getLastMotionTime().empty();
+                snprintf(num, sizeof(num), "%d %g %g", device->getStatus() ? 1 : 0, device->powerConsumption, extra);
+                h = fnv(fnv(fnv(fnv(fnv(h, deviceTypeToken(device)), device->getDeviceID()),
+                                device->getDeviceName()), device->getLocation()), num);
+            }
+        }
+    }
+    // Schedules live in a hash map; combine them order-independently.
+    uint64_t schedules = 0;
+    scheduler.forEachSchedule([&](const string& id, const Time& t) {
+        schedules += fnv(14695981039346656037ULL, id + " " + t.toString());
+    });
+    return fnv(h, to_string(schedules));
+}
+
+// Executes console commands against the home. main() only prompts for
+// input and builds Commands; the trace replayer feeds them in directly.
+class HomeController {
+    SmartHome& home;
+    DataStorage& storage;
+    Scheduler& scheduler;
+    EnergyMonitor& energyMonitor;
+    Notification& notifications;
+    EventBus& eventBus;
+    DeviceIndex& deviceIndex;
+    Authenticator& authenticator;
+    ResidentUserCache* residentSet = nullptr;
+    UserStore* userStore = nullptr;
+    TraceRecorder* recorder = nullptr;
+    ReplicationSender* replica = nullptr;
+    const TariffBook* tariffs = nullptr;
+    const PowerBudget* budget = nullptr;
+    TransitionLog* history = nullptr;
+    MemoryReport memoryReport;
+    HomeSegment* segment = nullptr;
+    MotionIngest* motion = nullptr;
+    CommandQueue* commands = nullptr;
+    mutex stateLock;  // held by commands and by the replication snapshot
+    mutex classLock;
+    unordered_map<string, CommandClass> deviceClasses;  // "room\ndevice" of the current user
+    bool saving = false, saveAgain = false;
+    User* currentUser = nullptr;
+    unique_ptr<RemoteControl> remote;
+    string sessionToken;
+    DashboardRenderer dashboard;
+
+    void persist() {
+        if (residentSet) residentSet->markDirty(currentUser->getUsername());
+        else saveHome();
+    }
+
+    // A command run at a preemption point inside the save only asks for
+    // another pass, so the file is never written by two saves at once.
+    void saveHome() {
+        if (saving) {
+            saveAgain = true;
+            return;
+        }
+        saving = true;
+        try {
+            do {
+                saveAgain = false;
+                storage.saveSystem(&home);
+            } while (saveAgain);
+        } catch (...) {
+            saving = false;
+            throw;
+        }
+        saving = false;
+    }
+
+    // Under stateLock; classify() reads the result without it.
+    void rebuildClasses() {
+        unordered_map<string, CommandClass> fresh;
+        if (currentUser)
+            for (const auto& [roomName, room] : currentUser->getAllRooms())
+                for (Device* device : room->getDevices()) fresh[roomName + '\n' + device->getDeviceName()] = commandClassOf(device);
+        lock_guard<mutex> guard(classLock);
+        deviceClasses.swap(fresh);
+    }
+
+    // Control and Transaction go by their most urgent device; the rest is bulk.
+    CommandClass classify(const Command& cmd) {
+        if (cmd.type != CommandType::Control && cmd.type != CommandType::Transaction) return CommandClass::Bulk;
+        size_t step = cmd.type == CommandType::Control ? max<size_t>(2, cmd.args.size()) : 4;
+        CommandClass urgent = CommandClass::Bulk;
+        lock_guard<mutex> guard(classLock);
+        for (size_t i = 0; i + 1 < cmd.args.size(); i += step) {
+            auto it = deviceClasses.find(cmd.args[i] + '\n' + cmd.args[i + 1]);
+            if (it != deviceClasses.end()) urgent = min(urgent, it->second);
+        }
+        return urgent;
+    }
+
+    bool registerUser(const Command& cmd) {
+        const string& username = cmd.arg(0);
+        const string& password = cmd.arg(1);
+        if (home.getUser(username) != nullptr) {
+            cout << "Username already exists! Please choose a different username.\n";
+            return false;
+        }
+        if (password.length() < 6) {
+            cout << "Password must be at least 6 characters long.\n";
+            return false;
+        }
+        if (none_of(password.begin(), password.end(), ::isdigit)) {
+            cout << "Password must contain at least 1 digit.\n";
+            return false;
+        }
+        authenticator.credentials().enroll(username, password);
+        User* newUser = new User(username, "");
+        if (residentSet) {
+            residentSet->admit(newUser);
+        } else {
+            home.addUser(username, newUser);
+            storage.saveUser(newUser);  // Save the new user immediately
+        }
+        cout << "Registration successful!\n";
+        return true;
+    }
+
+    bool login(const Command& cmd) {
+        const string& username = cmd.arg(0);
+        if (!home.loginUser(username, cmd.arg(1))) {
+            cout << "Invalid credentials!\n";
+            return false;
+        }
+        if (residentSet) {
+            if (currentUser) residentSet->unpin(currentUser->getUsername());
+            residentSet->pin(username);
+        }
+        currentUser = home.getUser(username);
+        if (!sessionToken.empty()) authenticator.closeSession(sessionToken);
+        sessionToken = authenticator.openSession(username);
+        remote = make_unique<RemoteControl>(currentUser);
+        cout << "Login successful! Welcome " << username << "!\n";
+        return true;
+    }
+
+    bool addRoom(const Command& cmd) {
+        if (!requireLogin()) return false;
+        if (currentUser->hasRoom(cmd.arg(0))) {
+            cout << "Room already exists!\n";
+            return false;
+        }
+        currentUser->addRoom(new Room(cmd.arg(0)));
+        persist();  // Save after adding room
+        cout << "Room added successfully!\n";
+        return true;
+    }
+
+    bool addDevice(const Command& cmd) {
+        if (!requireLogin()) return false;
+        const string& roomName = cmd.arg(0);
+        const string& id = cmd.arg(1);
+        const string& name = cmd.arg(2);
+        const string& deviceType = cmd.arg(3);
+        float initial = strtof(cmd.arg(4).c_str(), nullptr);
+        if (!currentUser->hasRoom(roomName)) {
+            cout << "Room not found!\n";
+            return false;
+        }
+
+        if (deviceIndex.findByID(id)) {
+            cout << "Device ID already in use!\n";
+            return false;
+        }
+
+        Device* device = createDevice(deviceType, id, name, roomName);
+        if (!device) {
+            cout << "Invalid device type!\n";
+            return false;
+        }
+        device->powerConsumption = defaultPowerKw(device);
+        if (auto light = dynamic_cast<Light*>(device)) light->setBrightness(initial);
+        else if (auto tcd = dynamic_cast<TemperatureControlledDevices*>(device)) tcd->setTemperature(initial);
+
+        currentUser->addDeviceToRoom(roomName, device);
+        persist();
+        cout << "Device added successfully!\n";
+        return true;
+    }
+
+    bool control(const Command& cmd) {
+        if (!currentUser || !remote) {
+            cout << "Please login first!\n";
+            return false;
+        }
+        const string& deviceName = cmd.arg(1);
+        Device* device = findDevice(cmd.arg(0), deviceName);
+        if (!device) {
+            cout << "Device not found!\n";
+            return false;
+        }
+        float value = strtof(cmd.arg(3).c_str(), nullptr);
+        int op = atoi(cmd.arg(2).c_str());
+        // Anything the user does to a device overrides its fade or ramp.
+        if (op != 4 && scheduler.cancelSequence(device->getDeviceID()))
+            cout << "Stopped the gradual change on " << deviceName << "\n";
+
+        switch (op) {
+            case 1:
+                if (dynamic_cast<Camera*>(device)) {
+                    dynamic_cast<Camera*>(device)->startRecording();
+                    eventBus.flush();
+                    cout << "Recording started for " << deviceName << endl;
+                } else if (dynamic_cast<DoorLock*>(device)) {
+                    dynamic_cast<DoorLock*>(device)->lockDoor();
+                    eventBus.flush();
+                } else if (device->turnOn()) {
+                    cout << deviceName << " turned on\n";
+                } else {
+                    cout << "Power budget exceeded, " << deviceName << " stays off\n";
+                }
+                break;
+            case 2:
+                if (dynamic_cast<Camera*>(device)) {
+                    dynamic_cast<Camera*>(device)->stopRecording();
+                    eventBus.flush();
+                    cout << "Recording stopped for " << deviceName << endl;
+                } else if (dynamic_cast<DoorLock*>(device)) {
+                    dynamic_cast<DoorLock*>(device)->unlockDoor();
+                    eventBus.flush();
+                } else {
+                    device->turnOff();
+                    cout << deviceName << " turned off\n";
+                }
+                break;
+            case 3:
+                if (dynamic_cast<Light*>(device)) {
+                    dynamic_cast<Light*>(device)->setBrightness(value);
+                    cout << "Brightness set to " << value << "%\n";
+                } else if (dynamic_cast<Thermostat*>(device) || dynamic_cast<AirConditioner*>(device)) {
+                    dynamic_cast<TemperatureControlledDevices*>(device)->setTemperature(value);
+                    cout << "Temperature set to " << value << "°\n";
+                } else if (dynamic_cast<Camera*>(device)) {
+                    dynamic_cast<Camera*>(device)->detectMotion();
+                    eventBus.flush();
+                    // Counts towards automatic recording like a report from the camera.
+                    if (motion) motion->post(motion->handleFor(device->getDeviceID()), dynamic_cast<Camera*>(device)->lastMotionAt());
+                    cout << "Motion detection activated\n";
+                } else if (dynamic_cast<DoorLock*>(device)) {
+                    cout << "Door is " << (dynamic_cast<DoorLock*>(device)->checkLockStatus() ? "locked" : "unlocked") << endl;
+                } else {
+                    device->performAction();
+                    eventBus.flush();
+                }
+                break;
+            case 4: {  // gradually, over arg 4 minutes
+                int64_t now = time(0), until = now + llround(max(0.0, strtod(cmd.arg(4).c_str(), nullptr)) * 60);
+                if (auto light = dynamic_cast<Light*>(device)) {
+                    scheduler.startSequence(device->getDeviceID(), fadeLight(scheduler, light, value, now, until), now);
+                    cout << deviceName << " fading to " << value << "%\n";
+                } else if (auto tcd = dynamic_cast<TemperatureControlledDevices*>(device)) {
+                    scheduler.startSequence(device->getDeviceID(), rampTemperature(scheduler, tcd, value, now, until), now);
+                    cout << deviceName << " ramping to " << value << "°\n";
+                } else {
+                    cout << "Invalid operation!\n";
+                }
+                eventBus.flush();
+                break;
+            }
+            default:
+                cout << "Invalid operation!\n";
+        }
+
+        // Record energy usage only if device is on
+        if (device->getStatus()) {
+            float usage = device->getEnergyUsage(0.1f); // 6 minutes of usage
+            energyMonitor.recordUsage(device->getDeviceID(), usage);
+            cout << "Energy used: " << fixed << setprecision(2) << usage
+                 << " kWh (Power: " << device->powerConsumption << " kW)\n";
+        }
+        persist();
+        return true;
+    }
+
+    // Every change in the command is applied, or none is; one save and one
+    // replication record cover them all.
+    bool transact(const Command& cmd) {
+        if (!requireLogin()) return false;
+        if (cmd.args.empty() || cmd.args.size() % 4 != 0) {
+            cout << "Invalid transaction!\n";
+            return false;
+        }
+        DeviceTransaction txn;
+        for (size_t i = 0; i < cmd.args.size(); i += 4) {
+            Device* device = findDevice(cmd.arg(i), cmd.arg(i + 1));
+            if (!device) {
+                cout << "Device not found: " << cmd.arg(i + 1) << "\n";
+                return false;
+            }
+            DeviceTransaction::Op op;
+            if (!DeviceTransaction::parseOp(cmd.arg(i + 2), op)) {
+                cout << "Unknown operation: " << cmd.arg(i + 2) << "\n";
+                return false;
+            }
+            txn.stage(device, op, strtof(cmd.arg(i + 3).c_str(), nullptr));
+        }
+        if (!txn.commit()) {
+            cout << "Nothing changed: " << txn.error() << "\n";
+            return false;
+        }
+        for (Device* device : txn.devices()) scheduler.cancelSequence(device->getDeviceID());
+        cout << "Applied " << txn.size() << " change(s) to " << txn.devices().size() << " device(s)\n";
+        persist();
+        return true;
+    }
+
+    bool schedule(const Command& cmd) {
+        if (!requireLogin()) return false;
+        const string& deviceName = cmd.arg(1);
+        int hour = atoi(cmd.arg(2).c_str()), minute = atoi(cmd.arg(3).c_str());
+        Device* device = findDevice(cmd.arg(0), deviceName);
+        if (!device) {
+            cout << "Device not found!\n";
+            return false;
+        }
+        scheduler.addSchedule(device, Time(hour, minute));
+        cout << "Device scheduled successfully at "
+             << setw(2) << setfill('0') << hour << ":"
+             << setw(2) << setfill('0') << minute << "!\n";
+        notifications.sendAlert(device->getDeviceID(), AlertSeverity::Info, "Device " + deviceName + " scheduled");
+        persist();
+        storage.saveSchedules(scheduler);
+        return true;
+    }
+
+    bool findDevices(const Command& cmd) {
+        if (!requireLogin()) return false;
+        const string& typeToken = cmd.arg(0);
+        const string& statusFilter = cmd.arg(1);
+        const string& lockFilter = cmd.arg(2);
+
+        DeviceQuery query(deviceIndex);
+        query.ownedBy(currentUser);
+        string typeName;
+        if (typeToken != "*") {
+            unique_ptr<Device> probe(createDevice(typeToken, "", "", ""));
+            if (!probe) {
+                cout << "Invalid device type!\n";
+                return false;
+            }
+            typeName = probe->getDeciceType();
+            query.ofType(typeName);
+            if (dynamic_cast<DoorLock*>(probe.get()) && (lockFilter == "locked" || lockFilter == "unlocked"))
+                query.withLock(lockFilter == "locked");
+        }
+        if (statusFilter == "on" || statusFilter == "off") query.withStatus(statusFilter == "on");
+
+        size_t found = 0;
+        query.forEach([&](Device* d) {
+            cout << "- " << d->getDeviceName() << " (" << d->getDeviceID() << ") in "
+                 << d->getLocation() << ": " << (d->getStatus() ? "On" : "Off") << "\n";
+            found++;
+        });
+        cout << found << " device(s) found.\n";
+        return true;
+    }
+
+    bool exitHome() {
+        if (residentSet) {
+            residentSet->flush();
+            if (userStore->needsCompaction()) userStore->compact();
+        } else {
+            saveHome();
+        }
+        storage.saveSchedules(scheduler);
+        storage.saveUsage(energyMonitor);
+        if (history) history->flush();
+        cout << "Goodbye!\n";
+        return true;
+    }
+
+    bool showHistory(const Command& cmd) {
+        if (!requireLogin()) return false;
+        Device* device = findDevice(cmd.arg(0), cmd.arg(1));
+        if (!device) {
+            cout << "Device not found!\n";
+            return false;
+        }
+        if (!history) {
+            cout << "Device history is not being kept.\n";
+            return false;
+        }
+        history->report(cout, device, cmd.arg(2).empty() ? 24 : max(1, atoi(cmd.arg(2).c_str())));
+        return true;
+    }
+
+    // Replays scheduled actions by device ID instead of consulting the clock.
+    bool tick(const Command& cmd) {
+        for (const string& id : cmd.args) {
+            if (Device* device = deviceIndex.findByID(id)) device->runScheduledAction();
+        }
+        return !cmd.args.empty();
+    }
+
+    // Ships the effect of a successful command to the standby.
+    void replicate(const Command& cmd) {
+        switch (cmd.type) {
+            case CommandType::Register: {
+                User* user = home.getUser(cmd.arg(0));
+                string record;
+                if (user) replica->append(ReplicationRecord::UserBlock, ReplicationSource::userBlock(user));
+                if (authenticator.credentials().exportRecord(cmd.arg(0), record))
+                    replica->append(ReplicationRecord::Credential, record);
+                break;
+            }
+            case CommandType::AddRoom:
+            case CommandType::AddDevice:
+                replica->append(ReplicationRecord::UserBlock, ReplicationSource::userBlock(currentUser));
+                break;
+            case CommandType::Control:
+                if (Device* device = findDevice(cmd.arg(0), cmd.arg(1))) replica->deviceChanged(device);
+                break;
+            case CommandType::Schedule:
+                if (Device* device = findDevice(cmd.arg(0), cmd.arg(1)))
+                    replica->append(ReplicationRecord::ScheduleSet,
+                                    ReplicationSource::schedule(device->getDeviceID(),
+                                                                Time(atoi(cmd.arg(2).c_str()), atoi(cmd.arg(3).c_str()))));
+                break;
+            case CommandType::Tick:
+                for (const string& id : cmd.args)
+                    if (Device* device = deviceIndex.findByID(id)) replica->deviceChanged(device);
+                break;
+            case CommandType::Transaction:
+                // The sender ships them as one batch; see ReplicationSender::shipChanges().
+                for (size_t i = 0; i < cmd.args.size(); i += 4)
+                    if (Device* device = findDevice(cmd.arg(i), cmd.arg(i + 1))) replica->deviceChanged(device);
+                break;
+            default: break;
+        }
+    }
+
+    bool apply(const Command& cmd) {
+        switch (cmd.type) {
+            case CommandType::Register: return registerUser(cmd);
+            case CommandType::Login: return login(cmd);
+            case CommandType::AddRoom: return addRoom(cmd);
+            case CommandType::AddDevice: return addDevice(cmd);
+            case CommandType::ViewRoom:
+                if (!requireLogin()) return false;
+                dashboard.showRoom(currentUser, cmd.arg(0));
+                return true;
+            case CommandType::Dashboard:
+                if (!requireLogin()) return false;
+                dashboard.showUser(currentUser);
+                return true;
+            case CommandType::Control: return control(cmd);
+            case CommandType::Schedule: return schedule(cmd);
+            case CommandType::EnergyReport:
+                energyMonitor.displayUsageReport();
+                if (tariffs && currentUser)
+                    energyMonitor.withLedger([&](const UsageLedger& ledger) {
+                        BillingEngine(*tariffs, ledger).bill(currentUser).print(cout);
+                    });
+                if (budget && currentUser) budget->report(cout, currentUser);
+                return true;
+            case CommandType::ViewAlerts: notifications.viewAlerts(); return true;
+            case CommandType::FindDevices: return findDevices(cmd);
+            case CommandType::Exit: return exitHome();
+            case CommandType::Tick: return tick(cmd);
+            case CommandType::History: return showHistory(cmd);
+            case CommandType::Memory: memoryReport.print(cout); return true;
+            case CommandType::Transaction: return transact(cmd);
+            case CommandType::Motion:
+                if (motion) motion->report(cout);
+                else cout << "Motion ingestion is off.\n";
+                return true;
+            case CommandType::Latency:
+                if (commands) commands->report(cout);
+                else cout << "Commands run in the order they arrive.\n";
+                return true;
+        }
+        cout << "Invalid choice!\n";
+        return false;
+    }
+
+public:
+    HomeController(SmartHome& h, DataStorage& s, Scheduler& sch, EnergyMonitor& em, Notification& n,
+                   EventBus& bus, DeviceIndex& idx, Authenticator& auth)
+        : home(h), storage(s), scheduler(sch), energyMonitor(em), notifications(n),
+          eventBus(bus), deviceIndex(idx), authenticator(auth) {}
+
+    void attachResidentSet(ResidentUserCache* cache, UserStore* store) {
+        residentSet = cache;
+        userStore = store;
+    }
+    void attachRecorder(TraceRecorder* r) { recorder = r; }
+    void attachTariffs(const TariffBook* book) { tariffs = book; }
+    void attachBudget(const PowerBudget* b) { budget = b; }
+    void attachHistory(TransitionLog* log) { history = log; }
+    void attachSegment(HomeSegment* shared) {
+        segment = shared;
+        lock_guard<mutex> guard(stateLock);
+        segment->rebuild(home);
+    }
+    // Camera reports then drive recordings under the same lock as commands.
+    void attachMotion(MotionIngest* ingest) {
+        motion = ingest;
+        motion->setDeviceLock(&stateLock);
+        lock_guard<mutex> guard(stateLock);
+        motion->rebuild(home);
+    }
+    // Commands then run by class through the queue, which must guard homeLock().
+    void attachQueue(CommandQueue* queue) {
+        commands = queue;
+        lock_guard<mutex> guard(stateLock);
+        rebuildClasses();
+    }
+    mutex& homeLock() { return stateLock; }
+
+    // Streams changes to a standby from now on; the sender's snapshot
+    // callback covers everything before.
+    void attachReplica(ReplicationSender* sender) {
+        replica = sender;
+        replica->setState(&stateLock, &deviceIndex);
+        replica->setSnapshot([this] {
+            lock_guard<mutex> guard(stateLock);
+            ReplicationSource::snapshot(*replica, home, scheduler, &authenticator.credentials());
+        });
+        replica->start();
+    }
+
+    User* user() const { return currentUser; }
+    // Under the lock, and asking the store first: in lazy mode loading a
+    // user can evict another, deleting its devices.
+    bool userExists(const string& name) {
+        lock_guard<mutex> guard(stateLock);
+        if (userStore && userStore->contains(name)) return true;
+        return home.getUser(name) != nullptr;
+    }
+
+    bool requireLogin() {
+        if (currentUser) return true;
+        cout << "Please login first!\n";
+        return false;
+    }
+
+    Device* findDevice(const string& roomName, const string& deviceName) {
+        Room* room = currentUser ? currentUser->getRoom(roomName) : nullptr;
+        return room ? room->getDevicesByName(deviceName) : nullptr;
+    }
+
+    // Drops the login once its session has lapsed.
+    void checkSession() {
+        if (!currentUser || !authenticator.sessionUser(sessionToken).empty()) return;
+        if (residentSet) residentSet->unpin(currentUser->getUsername());
+        currentUser = nullptr;
+        remote.reset();
+        cout << "Session expired, please login again.\n";
+    }
+
+    // Returns whether the command took effect.
+    bool execute(const Command& cmd) {
+        auto started = chrono::steady_clock::now();
+        if (commands) {
+            bool ok = false;
+            commands->call(classify(cmd), [&] { ok = executeLocked(cmd, started); });
+            return ok;
+        }
+        lock_guard<mutex> guard(stateLock);
+        return executeLocked(cmd, started);
+    }
+
+    bool executeLocked(const Command& cmd, chrono::steady_clock::time_point started) {
+        checkSession();
+        size_t evictions = residentSet ? residentSet->evictions : 0;
+        bool ok = apply(cmd);
+        eventBus.flush();
+        if (replica && ok) replicate(cmd);
+        // Users, rooms and devices that came or went change the segment's
+        // tables and the cameras motion reports go to. Even a failed login
+        // can load a user and evict another.
+        bool evicted = residentSet && residentSet->evictions != evictions;
+        if (evicted || (ok && (cmd.type == CommandType::Register || cmd.type == CommandType::Login ||
+                               cmd.type == CommandType::AddRoom || cmd.type == CommandType::AddDevice))) {
+            if (segment) segment->rebuild(home);
+            if (motion) motion->rebuild(home);
+            if (commands) rebuildClasses();
+        }
+        if (recorder) {
+            recorder->record(cmd, started, ok);
+            // Only resident users are in memory in lazy mode, so no checksum there.
+            if (cmd.type == CommandType::Exit && !residentSet) recorder->finish(homeChecksum(home, scheduler));
+        }
+        return ok;
+    }
+
+    void runSchedules() {
+        if (commands) {
+            commands->call(CommandClass::Bulk, [this] { runSchedulesLocked(); });
+            return;
+        }
+        lock_guard<mutex> guard(stateLock);
+        runSchedulesLocked();
+    }
+
+    void runSchedulesLocked() {
+        auto started = chrono::steady_clock::now();
+        Command fired{CommandType::Tick, {}};
+        scheduler.runDue(time(0), &fired.args);
+        if (fired.args.empty()) return;
+        if (recorder) recorder->record(fired, started, true);
+        if (replica) replicate(fired);
+    }
+
+    uint64_t checksum() { return homeChecksum(home, scheduler); }
+
+    // Redraws the live dashboard every intervalMs, running due schedules in
+    // between, until a line is entered on stdin.
+    void watch(int intervalMs) {
+        if (!requireLogin()) return;
+        dashboard.resetLive();
+        for (uint64_t frame = 0;; frame++) {
+            runSchedules();
+            eventBus.flush();
+            // Event output lands on top of the table now and then; repaint in full.
+            if (frame % 10 == 0) dashboard.resetLive();
+            time_t now = time(0);
+            char when[32];
+            string status = string("Updated ") + strtok(ctime_r(&now, when), "\n");
+            if (replica) {
+                ostringstream lag;
+                lag << fixed << setprecision(1) << "  standby " << (replica->isConnected() ? "lag " : "down, lag ")
+                    << replica->lagMs() << " ms";
+                status += lag.str();
+            }
+            dashboard.showLive(currentUser, status);
+            pollfd input{0, POLLIN, 0};
+            if (poll(&input, 1, intervalMs) > 0) {
+                string line;
+                getline(cin, line);
+                break;
+            }
+        }
+        cout << "\x1b[2J\x1b[H";
+    }
+};
+
+// Households split across worker threads by username hash, one thread per
+// core. A shard owns its users, rooms, devices, device index, scheduler and
+// energy monitor, and only its own thread ever touches them (with its
+// device hooks confined to it), so none of that is locked. Everything
+// else reaches a shard by message: requests for one household go to its
+// shard, and cross-shard queries go to every shard and combine the
+// replies.
+class ShardedHome {
+public:
+    struct Shard {
+        size_t id;
+        DeviceHooks hooks;
+        DeviceIndex index;
+        SmartHome home;
+        Scheduler scheduler;
+        EnergyMonitor energy;
+        uint64_t handled = 0;  // messages run
+    };
+    using Task = function<void(Shard&)>;
+
+    struct Totals {
+        size_t users = 0, devices = 0, devicesOn = 0, schedules = 0;
+        float kWh = 0;
+        vector<uint64_t> handled;  // per shard
+    };
+
+private:
+    struct Message {
+        Task task;
+        atomic<Message*> next{nullptr};
+    };
+
+    // Messages form an intrusive multi-producer, single-consumer list:
+    // senders swap themselves in as the tail, and the worker follows next
+    // links from the head.
+    struct Worker {
+        alignas(64) atomic<Message*> tail;
+        alignas(64) Message* head;
+        Message stub;
+        atomic<bool> sleeping{false};
+        mutex wakeLock;
+        condition_variable wake;
+        thread runner;
+
+        Worker() : tail(&stub), head(&stub) {}
+
+        void push(Message* m) {
+            m->next.store(nullptr, memory_order_relaxed);
+            Message* prev = tail.exchange(m, memory_order_acq_rel);
+            prev->next.store(m, memory_order_release);
+        }
+
+        // Null when empty, or when a sender is halfway through linking in.
+        Message* pop() {
+            Message* first = head;
+            Message* next = first->next.load(memory_order_acquire);
+            if (first == &stub) {
+                if (!next) return nullptr;
+                head = first = next;
+                next = next->next.load(memory_order_acquire);
+            }
+            if (next) {
+                head = next;
+                return first;
+            }
+            if (first != tail.load(memory_order_acquire)) return nullptr;
+            push(&stub);
+            next = first->next.load(memory_order_acquire);
+            if (!next) return nullptr;
+            head = next;
+            return first;
+        }
+
+        bool pending() const { return head != &stub || tail.load(memory_order_acquire) != &stub; }
+    };
+
+    vector<unique_ptr<Worker>> workers;
+    atomic<bool> running{true};
+
+    // Runs the shard's messages, and its due schedules once a second. The
+    // shard is built and torn down here too, so its devices only ever see
+    // its own hooks.
+    void run(Worker& w, size_t id, promise<void> ready) {
+        unique_ptr<Shard> shard(new Shard());
+        shard->id = id;
+        shard->hooks.index = &shard->index;
+        Device::confineHooks(&shard->hooks);
+        shard->scheduler.setVerbose(false);
+        ready.set_value();
+        time_t lastRun = time(0);
+        int idle = 0;
+        while (true) {
+            if (Message* m = w.pop()) {
+                m->task(*shard);
+                shard->handled++;
+                delete m;
+                idle = 0;
+                continue;
+            }
+            if (time(0) != lastRun) {
+                lastRun = time(0);
+                shard->scheduler.runDue(lastRun);
+            }
+            if (w.pending()) {
+                this_thread::yield();
+                continue;
+            }
+            if (!running.load()) break;
+            if (++idle < 64) {
+                this_thread::yield();
+                continue;
+            }
+            unique_lock<mutex> guard(w.wakeLock);
+            w.sleeping.store(true);
+            if (!w.pending() && running.load()) w.wake.wait_for(guard, chrono::seconds(1));
+            w.sleeping.store(false);
+        }
+        shard.reset();
+        Device::confineHooks(nullptr);
+    }
+
+public:
+    ShardedHome(size_t shards = max(1u, thread::hardware_concurrency())) {
+        for (size_t i = 0; i < shards; i++) {
+            workers.emplace_back(new Worker());
+            promise<void> ready;
+            future<void> started = ready.get_future();
+            workers.back()->runner = thread(&ShardedHome::run, this, ref(*workers.back()), i, move(ready));
+            started.wait();
+        }
+    }
+
+    // Runs what was already sent, then tears every shard down.
+    ~ShardedHome() {
+        running.store(false);
+        for (auto& w : workers) {
+            {
+                lock_guard<mutex> guard(w->wakeLock);
+                w->wake.notify_one();
+            }
+            w->runner.join();
+        }
+    }
+
+    size_t shards() const { return workers.size(); }
+    size_t shardOf(const string& username) const { return hash<string>()(username) % workers.size(); }
+
+    // Messages to one shard run in the order they were sent.
+    void send(size_t shard, Task task) {
+        Worker& w = *workers[shard];
+        w.push(new Message{move(task)});
+        atomic_thread_fence(memory_order_seq_cst);
+        if (w.sleeping.load()) {
+            lock_guard<mutex> guard(w.wakeLock);
+            w.wake.notify_one();
+        }
+    }
+
+    template <typename F>
+    auto ask(size_t shard, F f) -> future<invoke_result_t<F, Shard&>> {
+        using R = invoke_result_t<F, Shard&>;
+        auto reply = make_shared<promise<R>>();
+        future<R> answer = reply->get_future();
+        send(shard, [reply, f = move(f)](Shard& s) mutable {
+            try {
+                if constexpr (is_void_v<R>) {
+                    f(s);
+                    reply->set_value();
+                } else {
+                    reply->set_value(f(s));
+                }
+            } catch (...) {
+                reply->set_exception(current_exception());
+            }
+        });
+        return answer;
+    }
+
+    // The same question to every shard; replies in shard order.
+    template <typename F>
+    auto askAll(F f) -> vector<invoke_result_t<F, Shard&>> {
+        vector<future<invoke_result_t<F, Shard&>>> pending;
+        for (size_t i = 0; i < workers.size(); i++) pending.push_back(ask(i, f));
+        vector<invoke_result_t<F, Shard&>> replies;
+        for (auto& p : pending) replies.push_back(p.get());
+        return replies;
+    }
+
+    // Hands a user over to its shard, which indexes its devices. Build
+    // users with the process-wide device index detached.
+    void adopt(User* user) {
+        send(shardOf(user->getUsername()), [user](Shard& s) {
+            s.home.addUser(user->getUsername(), user);
+            for (const auto& [name, room] : user->getAllRooms())
+                for (Device* device : room->getDevices()) s.index.add(device, room);
+        });
+    }
+
+    future<bool> control(const string& username, const string& room, const string& device,
+                         DeviceTransaction::Op op, float value = 0) {
+        return ask(shardOf(username), [=](Shard& s) {
+            User* user = s.home.getUser(username);
+            Room* r = user ? user->getRoom(room) : nullptr;
+            Device* d = r ? r->getDevicesByName(device) : nullptr;
+            if (!d) return false;
+            DeviceTransaction txn;
+            txn.stage(d, op, value);
+            return txn.commit();
+        });
+    }
+
+    future<bool> schedule(const string& username, const string& room, const string& device, Time at) {
+        return ask(shardOf(username), [=](Shard& s) {
+            User* user = s.home.getUser(username);
+            Room* r = user ? user->getRoom(room) : nullptr;
+            Device* d = r ? r->getDevicesByName(device) : nullptr;
+            if (d) s.scheduler.addSchedule(d->getDeviceID(), at);
+            return d != nullptr;
+        });
+    }
+
+    // Charges every device that is on for the hours that passed.
+    void accrue(float hours) {
+        for (size_t i = 0; i < workers.size(); i++)
+            send(i, [hours](Shard& s) {
+                DeviceQuery(s.index).withStatus(true).forEach([&](Device* d) {
+                    s.energy.addUsage(d->getDeviceID(), d->getEnergyUsage(hours));
+                });
+            });
+    }
+
+    // Admin queries across every household.
+    size_t countDevices(const string& type, int on = -1) {
+        size_t n = 0;
+        for (size_t c : askAll([&type, on](Shard& s) {
+                 DeviceQuery q(s.index);
+                 q.ofType(type);
+                 if (on >= 0) q.withStatus(on == 1);
+                 return q.count();
+             }))
+            n += c;
+        return n;
+    }
+
+    Totals totals() {
+        Totals t;
+        for (const Totals& part : askAll([](Shard& s) {
+                 Totals p;
+                 p.users = s.home.getAllUsers().size();
+                 p.devices = s.index.size();
+                 p.devicesOn = DeviceQuery(s.index).withStatus(true).count();
+                 p.schedules = s.scheduler.size();
+                 p.kWh = s.energy.getTotalUsage();
+                 p.handled.push_back(s.handled);
+                 return p;
+             })) {
+            t.users += part.users;
+            t.devices += part.devices;
+            t.devicesOn += part.devicesOn;
+            t.schedules += part.schedules;
+            t.kWh += part.kWh;
+            t.handled.push_back(part.handled[0]);
+        }
+        return t;
+    }
+};
+
+struct SystemConfig {
+    string dataFile = "data.txt";
+    string journalFile = "events.log";
+    string credentialsFile = "credentials.db";
+    string replicateTo;  // standby socket; empty disables replication
+    string budgetFile;   // power budgets; empty means none
+    string segment;      // shared-memory segment to publish; empty means none
+    string motionSocket; // camera motion reports; empty means none
+    MotionPolicy motion;
+    HistoryPolicy history;
+    int schedulerIntervalSec = 15;
+    int simulationIntervalSec = 60;
+    int checkpointIntervalSec = 300;
+    int memoryReportIntervalSec = 0;  // 0 disables the periodic dump
+    int motionReportIntervalSec = 0;  // likewise for camera activity
+    int commandReportIntervalSec = 0;  // and for command latency
+    double deadlineMs[CommandClasses] = {50, 250, 500, 0};  // by CommandClass; 0 = none
+    float memoryLimitMb[size_t(MemoryTag::Count)] = {};  // 0 = no limit
+    float energyThreshold = 30.0f;
+    CatchUpPolicy catchUp = CatchUpPolicy::RunOnce;
+
+    // key=value lines; unknown keys and '#' comments are ignored. A value
+    // that doesn't parse throws, naming the line; this object may then be
+    // half loaded, so load into a fresh one.
+    bool load(const string& path) {
+        ifstream in(path);
+        if (!in.is_open()) return false;
+        string line;
+        while (getline(in, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            size_t eq = line.find('=');
+            if (eq == string::npos) continue;
+            try {
+                set(line.substr(0, eq), line.substr(eq + 1));
+            } catch (const logic_error&) {  // stoi and friends
+                throw DeviceException("Bad setting in " + path + ": " + line);
+            }
+        }
+        return true;
+    }
+
+private:
+    void set(const string& key, const string& value) {
+        if (key == "data_file") dataFile = value;
+        else if (key == "journal_file") journalFile = value;
+        else if (key == "credentials_file") credentialsFile = value;
+        else if (key == "replicate_to") replicateTo = value;
+        else if (key == "budget_file") budgetFile = value;
+        else if (key == "segment") segment = value;
+        else if (key == "motion_socket") motionSocket = value;
+        else if (key == "motion_start_events") motion.startEvents = max(1, stoi(value));
+        else if (key == "motion_window_ms") motion.windowMs = max(1, stoi(value));
+        else if (key == "motion_hold_ms") motion.holdMs = max(1, stoi(value));
+        else if (key == "motion_report_interval") motionReportIntervalSec = max(0, stoi(value));
+        else if (key == "command_report_interval") commandReportIntervalSec = max(0, stoi(value));
+        else if (key == "deadline_security_ms") deadlineMs[size_t(CommandClass::Security)] = max(0.0, stod(value));
+        else if (key == "deadline_climate_ms") deadlineMs[size_t(CommandClass::Climate)] = max(0.0, stod(value));
+        else if (key == "deadline_lighting_ms") deadlineMs[size_t(CommandClass::Lighting)] = max(0.0, stod(value));
+        else if (key == "deadline_bulk_ms") deadlineMs[size_t(CommandClass::Bulk)] = max(0.0, stod(value));
+        else if (key == "scheduler_interval") schedulerIntervalSec = max(1, stoi(value));
+        else if (key == "simulation_interval") simulationIntervalSec = max(1, stoi(value));
+        else if (key == "checkpoint_interval") checkpointIntervalSec = max(1, stoi(value));
+        else if (key == "energy_threshold") energyThreshold = stof(value);
+        else if (key == "history_retain_days") history.retainSec = max(1, stoi(value)) * int64_t(86400);
+        else if (key == "history_downsample_days") history.downsampleSec = max(0, stoi(value)) * int64_t(86400);
+        else if (key == "history_resolution") history.resolutionSec = max(1, stoi(value));
+        else if (key == "history_max_mb") history.maxBytes = uint64_t(max(1, stoi(value))) << 20;
+        else if (key == "memory_report_interval") memoryReportIntervalSec = max(0, stoi(value));
+        else if (key.rfind("memory_limit_", 0) == 0) {
+            MemoryTag tag;
+            if (MemoryReport::parseTag(string_view(key).substr(13), tag)) memoryLimitMb[size_t(tag)] = max(0.0f, stof(value));
+        }
+        else if (key == "catch_up") {
+            if (value == "skip") catchUp = CatchUpPolicy::Skip;
+            else if (value == "all") catchUp = CatchUpPolicy::RunAll;
+            else catchUp = CatchUpPolicy::RunOnce;
+        }
+    }
+};
+
+struct ResourceUsage {
+    double cpuSeconds;
+    long rssKB;
+    long peakRssKB;
+
+    static ResourceUsage sample() {
+        ResourceUsage r{0.0, 0, 0};
+        rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru) == 0) {
+            r.cpuSeconds = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+                           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+        }
+        ifstream status("/proc/self/status");
+        string key;
+        while (status >> key) {
+            if (key == "VmRSS:") status >> r.rssKB;
+            else if (key == "VmHWM:") status >> r.peakRssKB;
+        }
+        return r;
+    }
+};
+
+// Long-running service: scheduling, device simulation and notifications on
+// background threads, no console interaction. SIGTERM/SIGINT checkpoint and
+// exit, SIGHUP checkpoints and reloads the configuration.
+class HomeDaemon {
+    string configPath;
+    SystemConfig config;
+    DeviceIndex deviceIndex;
+    SmartHome smartHome;
+    Scheduler scheduler;
+    EnergyMonitor energyMonitor;
+    Notification notifications;
+    mutex stateMutex;
+    CommandQueue commands{stateMutex};  // background work holds stateMutex through it
+    ReplicationSender* replica = nullptr;
+    ReplicationSource replicaSource;
+    unique_ptr<PowerBudget> budget;
+    TransitionLog* history = nullptr;
+    HomeSegment* segment = nullptr;
+    MotionIngest* motion = nullptr;
+    MemoryReport memoryReport;
+    atomic<bool> stopping;
+    atomic<bool> stopRequested;
+    atomic<int> schedulerIntervalSec, simulationIntervalSec;  // config's, for the loops
+    mutex wakeMutex;
+    condition_variable wake;
+
+    void sleepFor(int seconds) {
+        unique_lock<mutex> guard(wakeMutex);
+        wake.wait_for(guard, chrono::seconds(seconds), [this] { return stopping.load(); });
+    }
+
+    void schedulerLoop() {
+        while (!stopping.load()) {
+            {
+                CommandQueue::Hold hold(commands, CommandClass::Bulk);
+                scheduler.checkAndRunSchedules();
+                if (replica) replicaSource.shipChangedDevices(replica, smartHome);
+            }
+            sleepFor(schedulerIntervalSec.load());
+        }
+    }
+
+    void simulationLoop() {
+        while (!stopping.load()) {
+            int interval = simulationIntervalSec.load();
+            sleepFor(interval);
+            if (stopping.load()) break;
+            float hours = interval / 3600.0f;
+            CommandQueue::Hold hold(commands, CommandClass::Bulk);
+            for (const auto& [username, user] : smartHome.getAllUsers()) {
+                for (const auto& [roomName, room] : user->getAllRooms()) {
+                    for (Device* device : room->getDevices()) {
+                        if (!device->getStatus()) continue;
+                        if (auto tcd = dynamic_cast<TemperatureControlledDevices*>(device))
+                            tcd->adjustTemperature();
+                        energyMonitor.addUsage(device->getDeviceID(), device->getEnergyUsage(hours));
+                    }
+                    preemptionPoint();
+                }
+            }
+            if (replica) replicaSource.shipChangedDevices(replica, smartHome);
+        }
+    }
+
+    void notificationLoop() {
+        bool over = false;
+        while (!stopping.load()) {
+            sleepFor(simulationIntervalSec.load());
+            float total = energyMonitor.getTotalUsage();
+            bool nowOver = total > energyMonitor.getThreshold();
+            if (nowOver && !over)
+                notifications.sendAlert("energy", AlertSeverity::Critical,
+                                        "Energy usage exceeded threshold (" + to_string(total) + ")");
+            over = nowOver;
+            notifications.flushSummaries();
+        }
+    }
+
+    void checkpoint() {
+        CommandQueue::Hold hold(commands, CommandClass::Bulk);
+        try {
+            DataStorage storage(config.dataFile);
+            storage.saveSystem(&smartHome);
+            storage.saveSchedules(scheduler);
+            UsageLedger finished;
+            if (energyMonitor.rollOver(time(0), finished)) storage.saveUsage(finished, storage.usageArchiveFile(finished));
+            storage.saveUsage(energyMonitor);
+            if (history) {
+                history->flush();
+                if (history->compactionDue(time(0))) history->compact(time(0));
+            }
+            // Also picks up the temperatures the simulation moved without an event.
+            if (segment) segment->rebuild(smartHome);
+        } catch (const exception& e) {
+            cerr << "smarthome: checkpoint failed: " << e.what() << endl;
+        }
+    }
+
+    // Rereads the file from scratch, so removed keys go back to their
+    // defaults; a bad value leaves the settings as they were.
+    bool reloadConfig() {
+        SystemConfig fresh;
+        try {
+            fresh.load(configPath);
+        } catch (const exception& e) {
+            cerr << "smarthome: configuration not reloaded: " << e.what() << endl;
+            return false;
+        }
+        config = fresh;
+        return true;
+    }
+
+    void applyConfig() {
+        schedulerIntervalSec.store(config.schedulerIntervalSec);
+        simulationIntervalSec.store(config.simulationIntervalSec);
+        energyMonitor.setThresholdQuiet(config.energyThreshold);
+        scheduler.setCatchUpPolicy(config.catchUp);
+        if (history) history->setPolicy(config.history);
+        if (motion) motion->setPolicy(config.motion);
+        for (size_t i = 0; i < CommandClasses; i++) commands.setDeadline(CommandClass(i), config.deadlineMs[i]);
+        for (size_t i = 0; i < size_t(MemoryTag::Count); i++)
+            memoryAccounts[i].limit.store(int64_t(double(config.memoryLimitMb[i]) * (1 << 20)));
+    }
+
+    // The periodic footprint dump; a subsystem over its limit raises an alert.
+    void reportMemory() {
+        memoryReport.print(cerr);
+        for (MemoryTag tag : MemoryReport::overLimit())
+            notifications.sendAlert(memoryTagName(tag), AlertSeverity::Warning, "Memory limit exceeded by ",
+                                    memoryTagName(tag));
+    }
+
+    // Replaces the budgets wholesale; an empty budget_file clears them.
+    void loadBudget() {
+        lock_guard<mutex> guard(stateMutex);
+        auto fresh = make_unique<PowerBudget>(smartHome);
+        try {
+            if (!config.budgetFile.empty()) fresh->load(config.budgetFile);
+        } catch (const exception& e) {
+            cerr << "smarthome: budgets not loaded: " << e.what() << endl;
+            return;
+        }
+        Device::attachBudget(fresh.get());
+        fresh->apply();
+        budget = move(fresh);
+    }
+
+public:
+    // Throws DeviceException if the configuration has a bad value.
+    HomeDaemon(const string& cfg) : configPath(cfg), stopping(false), stopRequested(false) {
+        Device::attachIndex(&deviceIndex);
+        config.load(configPath);
+        scheduler.setVerbose(false);
+        applyConfig();
+        commands.setMissHandler([this](CommandClass c, double ms) {
+            notifications.sendAlert("commands", AlertSeverity::Warning, "Command deadline missed: ",
+                                    string(commandClassName(c)) + " took " + to_string(int(ms)) + " ms");
+        });
+    }
+
+    ~HomeDaemon() {
+        Device::attachBudget(nullptr);
+        Device::attachIndex(nullptr);
+    }
+
+    SmartHome& home() { return smartHome; }
+    Scheduler& schedules() { return scheduler; }
+    const SystemConfig& settings() const { return config; }
+    void requestStop() { stopRequested.store(true); }
+
+    int run(bool loadState = true) {
+        if (loadState) {
+            try {
+                DataStorage storage(config.dataFile);
+                for (User* user : storage.loadUsers())
+                    smartHome.addUser(user->getUsername(), user);
+                storage.loadSchedules(scheduler);
+                storage.loadUsage(energyMonitor);
+            } catch (const exception& e) {
+                cerr << "smarthome: load failed: " << e.what() << endl;
+            }
+        }
+
+        // Block the control signals before any thread starts so only sigtimedwait sees them.
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+        EventJournal journal(config.journalFile);
+        TransitionLog transitions(DataStorage(config.dataFile).historyFile(), config.history);
+        history = &transitions;
+        {
+            unique_ptr<HomeSegment> shared;  // outlives the bus that feeds it
+            EventBus eventBus;
+            eventBus.subscribe(&journal);
+            eventBus.subscribe(&energyMonitor);
+            eventBus.subscribe(&notifications);
+            eventBus.subscribe(&transitions);
+            if (!config.segment.empty()) {
+                shared = make_unique<HomeSegment>(config.segment);
+                eventBus.subscribe(shared.get());
+                shared->rebuild(smartHome);
+                segment = shared.get();
+            }
+            Device::attachEventBus(&eventBus);
+            loadBudget();
+
+            unique_ptr<MotionIngest> cameras;
+            if (!config.motionSocket.empty()) {
+                cameras = make_unique<MotionIngest>(config.motion);
+                cameras->setDeviceLock(&stateMutex);
+                cameras->attachQueue(&commands);
+                {
+                    lock_guard<mutex> guard(stateMutex);
+                    cameras->rebuild(smartHome);
+                }
+                cameras->start();
+                try {
+                    cameras->listen(config.motionSocket);
+                    motion = cameras.get();
+                } catch (const exception& e) {
+                    cerr << "smarthome: " << e.what() << endl;
+                    cameras.reset();
+                }
+            }
+
+            unique_ptr<CredentialStore> credentials;
+            unique_ptr<ReplicationSender> sender;
+            if (!config.replicateTo.empty()) {
+                credentials = make_unique<CredentialStore>(config.credentialsFile);
+                sender = make_unique<ReplicationSender>(config.replicateTo);
+                sender->setState(&stateMutex, &deviceIndex);
+                sender->setSnapshot([&] {
+                    lock_guard<mutex> guard(stateMutex);
+                    ReplicationSource::snapshot(*sender, smartHome, scheduler, credentials.get());
+                    replicaSource.shipChangedDevices(nullptr, smartHome);
+                });
+                replica = sender.get();
+                sender->start();
+            }
+
+            thread schedulerThread(&HomeDaemon::schedulerLoop, this);
+            thread simulationThread(&HomeDaemon::simulationLoop, this);
+            thread notificationThread(&HomeDaemon::notificationLoop, this);
+
+            time_t lastCheckpoint = time(0), lastMemoryReport = time(0), lastMotionReport = time(0), lastCommandReport = time(0);
+            timespec tick{0, 200 * 1000 * 1000};
+            while (!stopRequested.load()) {
+                int sig = sigtimedwait(&signals, nullptr, &tick);
+                if (sig == SIGTERM || sig == SIGINT) break;
+                if (sig == SIGHUP) {
+                    checkpoint();
+                    if (reloadConfig()) {
+                        applyConfig();
+                        loadBudget();
+                    }
+                    lastCheckpoint = time(0);
+                } else if (time(0) - lastCheckpoint >= config.checkpointIntervalSec) {
+                    checkpoint();
+                    lastCheckpoint = time(0);
+                }
+                if (config.memoryReportIntervalSec > 0 && time(0) - lastMemoryReport >= config.memoryReportIntervalSec) {
+                    reportMemory();
+                    lastMemoryReport = time(0);
+                }
+                if (motion && config.motionReportIntervalSec > 0 && time(0) - lastMotionReport >= config.motionReportIntervalSec) {
+                    motion->report(cerr);
+                    lastMotionReport = time(0);
+                }
+                if (config.commandReportIntervalSec > 0 && time(0) - lastCommandReport >= config.commandReportIntervalSec) {
+                    commands.report(cerr);
+                    lastCommandReport = time(0);
+                }
+            }
+
+            stopping.store(true);
+            {
+                lock_guard<mutex> guard(wakeMutex);
+                wake.notify_all();
+            }
+            schedulerThread.join();
+            simulationThread.join();
+            notificationThread.join();
+            if (motion) motion->stop();
+            motion = nullptr;
+            checkpoint();
+            segment = nullptr;
+            replica = nullptr;
+            sender.reset();
+            Device::attachEventBus(nullptr);
+        }
+        history = nullptr;
+        pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+        return 0;
+    }
+};
+
+// Checks record structure and field values, reporting each problem by line.
+class RecordValidator : public RecordVisitor {
+    bool inUser = false, inRoom = false;
+
+    // Text records are reported by line and column (of `field` if given).
+    bool fail(const DataRecord& rec, const string& msg, int field = -1) {
+        errors++;
+        if (errors > 50) return true;
+        size_t column = field >= 0 ? rec.columnOf(field) : rec.column;
+        if (!rec.text) cerr << "record " << rec.line << ": " << msg << "\n";
+        else if (column) cerr << "line " << rec.line << ", column " << column << ": " << msg << "\n";
+        else cerr << "line " << rec.line << ": " << msg << "\n";
+        return true;
+    }
+
+    static bool isNumber(string_view v) {
+        if (v.empty()) return false;
+        char* end;
+        string tmp(v);
+        strtod(tmp.c_str(), &end);
+        return *end == '\0';
+    }
+
+public:
+    size_t users = 0, rooms = 0, devices = 0, errors = 0;
+
+    bool onUser(const DataRecord&) override {
+        users++;
+        inUser = true;
+        inRoom = false;
+        return true;
+    }
+
+    bool onRoom(const DataRecord& rec) override {
+        rooms++;
+        inRoom = true;
+        if (!inUser) return fail(rec, "ROOM outside of a USER");
+        return true;
+    }
+
+    bool onDevice(const DataRecord& rec) override {
+        devices++;
+        if (!inRoom) return fail(rec, "DEVICE outside of a ROOM");
+        unique_ptr<Device> probe(createDevice(rec.fields[0], "", "", ""));
+        if (!probe) return fail(rec, "unknown device type '" + rec.field(0) + "'", 0);
+        if (rec.fields[4] != "0" && rec.fields[4] != "1") return fail(rec, "status must be 0 or 1", 4);
+        if (rec.fieldCount > 5 && !isNumber(rec.fields[5])) return fail(rec, "power is not a number", 5);
+        return true;
+    }
+
+    bool onInvalid(const DataRecord& rec) override { return fail(rec, rec.error); }
+};
+
+// Copies records to a writer, optionally keeping only one user's subtree.
+class RecordConverter : public RecordVisitor {
+    RecordWriter& writer;
+    string onlyUser;
+    bool keep = true;
+public:
+    size_t written = 0, skipped = 0;
+
+    RecordConverter(RecordWriter& w, const string& user) : writer(w), onlyUser(user) {}
+
+    bool copy(const DataRecord& rec) {
+        if (keep) { writer.write(rec); written++; }
+        else skipped++;
+        return true;
+    }
+    bool onUser(const DataRecord& rec) override {
+        keep = onlyUser.empty() || rec.fields[0] == onlyUser;
+        return copy(rec);
+    }
+    bool onRoom(const DataRecord& rec) override { return copy(rec); }
+    bool onDevice(const DataRecord& rec) override { return copy(rec); }
+    bool onInvalid(const DataRecord& rec) override {
+        cerr << "line " << rec.line << ": " << rec.error << " (skipped)\n";
+        skipped++;
+        return true;
+    }
+};
+
+int runDataTool(const string& mode, int argc, char* argv[]) {
+    if (mode == "--validate" && argc >= 1) {
+        if (!MappedTextReader(argv[0]).isOpen()) { cerr << "Cannot open " << argv[0] << "\n"; return 1; }
+        RecordValidator validator;
+        streamRecords(argv[0], validator);
+        cout << validator.users << " users, " << validator.rooms << " rooms, "
+             << validator.devices << " devices, " << validator.errors << " errors\n";
+        return validator.errors ? 2 : 0;
+    }
+    if (mode == "--convert" && argc >= 2) {
+        bool binary = false;
+        string user;
+        for (int i = 2; i + 1 < argc; i += 2) {
+            string opt = argv[i];
+            if (opt == "--to") binary = string(argv[i + 1]) == "binary";
+            else if (opt == "--user") user = argv[i + 1];
+        }
+        if (!MappedTextReader(argv[0]).isOpen()) { cerr << "Cannot open input or output file\n"; return 1; }
+        ofstream out(argv[1], ios::binary | ios::trunc);
+        if (!out.is_open()) { cerr << "Cannot open input or output file\n"; return 1; }
+        RecordWriter writer(out, binary);
+        RecordConverter converter(writer, user);
+        streamRecords(argv[0], converter);
+        cout << converter.written << " records written, " << converter.skipped << " skipped\n";
+        return 0;
+    }
+    cerr << "Usage: --validate <file> | --convert <in> <out> [--to text|binary] [--user NAME]\n";
+    return 1;
+}
+
+// Reads a trace written by TraceRecorder.
+class TraceReader {
+    ifstream in;
+
+    bool readVarint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int c = in.get();
+            if (c == EOF) return false;
+            value |= uint64_t(c & 0x7f) << shift;
+            if (!(c & 0x80)) return true;
+        }
+        return false;
+    }
+
+    bool readBlob(string& blob) {
+        uint64_t len;
+        if (!readVarint(len) || len > (1u << 30)) return false;
+        blob.resize(len);
+        return len == 0 || bool(in.read(&blob[0], len));
+    }
+
+public:
+    string snapshot, schedules;
+    bool hasChecksum = false;
+    uint64_t checksum = 0;
+
+    TraceReader(const string& path) : in(path, ios::binary) {
+        char magic[5];
+        if (!in.read(magic, 5) || memcmp(magic, TraceRecorder::Magic, 5) != 0 ||
+            !readBlob(snapshot) || !readBlob(schedules))
+            throw DeviceException("Not a command trace: " + path);
+    }
+
+    // False at the end of the trace; the closing checksum is read on the way out.
+    bool next(Command& cmd, uint64_t& deltaNs) {
+        if (!readVarint(deltaNs)) return false;
+        int type = in.get(), argc = in.get();
+        if (type == 0 || type == EOF) {
+            if (type == 0 && argc != EOF) {
+                in.unget();
+                hasChecksum = bool(in.read((char*)&checksum, 8));
+            }
+            return false;
+        }
+        if (argc == EOF) return false;
+        cmd.type = CommandType(type);
+        cmd.args.resize(argc);
+        for (string& arg : cmd.args)
+            if (!readBlob(arg)) return false;
+        return true;
+    }
+};
+
+// --replay <trace> [--paced] [--expect HEX] [--verbose]
+// Replays a trace against a scratch copy of the recorded starting state.
+// Output is discarded unless --verbose; scheduled actions are replayed from
+// the trace rather than the clock so every build reaches the same state.
+int runReplay(int argc, char* argv[]) {
+    if (argc < 1) {
+        cerr << "Usage: --replay <trace> [--paced] [--expect HEX] [--verbose]\n";
+        return 1;
+    }
+    bool paced = false, verbose = false, expect = false;
+    uint64_t expected = 0;
+    for (int i = 1; i < argc; i++) {
+        string opt = argv[i];
+        if (opt == "--paced") paced = true;
+        else if (opt == "--verbose") verbose = true;
+        else if (opt == "--expect" && i + 1 < argc) { expect = true; expected = strtoull(argv[++i], nullptr, 16); }
+    }
+
+    TraceReader trace(argv[0]);
+    string scratch = "replay_" + to_string(getpid());
+    {
+        ofstream(scratch + ".txt", ios::binary | ios::trunc) << trace.snapshot;
+        ofstream(scratch + ".txt.sched", ios::binary | ios::trunc) << trace.schedules;
+    }
+
+    LatencyHistogram perType[32], overall;
+    size_t commands = 0;
+    uint64_t checksum;
+    double wallSec;
+    // Output is still formatted, just thrown away.
+    struct NullBuffer : streambuf {
+        char sink[256];
+        int overflow(int c) override { setp(sink, sink + sizeof(sink)); return c; }
+    } discard;
+    streambuf* console = cout.rdbuf();
+    if (!verbose) cout.rdbuf(&discard);
+    {
+        DeviceIndex deviceIndex;
+        Device::attachIndex(&deviceIndex);
+        {
+            SmartHome home;
+            DataStorage storage(scratch + ".txt");
+            EnergyMonitor energyMonitor;
+            Scheduler scheduler;
+            Notification notifications;
+            ConsoleRenderer consoleRenderer;
+            EventBus eventBus;
+            if (verbose) eventBus.subscribe(&consoleRenderer);
+            eventBus.subscribe(&energyMonitor);
+            eventBus.subscribe(&notifications);
+            Device::attachEventBus(&eventBus);
+            // Cheap hashes and no rate limit: replay measures the home, not scrypt.
+            CredentialStore credentials(scratch + ".db", 4, 1, 1);
+            Authenticator authenticator(credentials, 1e9, 1e9);
+            home.attachAuthenticator(&authenticator);
+            for (User* user : storage.loadUsers()) home.addUser(user->getUsername(), user);
+            storage.loadSchedules(scheduler);
+            scheduler.setVerbose(verbose);
+            HomeController controller(home, storage, scheduler, energyMonitor, notifications,
+                                      eventBus, deviceIndex, authenticator);
+
+            Command cmd;
+            uint64_t deltaNs;
+            auto start = chrono::steady_clock::now();
+            auto due = start;
+            while (trace.next(cmd, deltaNs)) {
+                due += chrono::nanoseconds(deltaNs);
+                if (paced) this_thread::sleep_until(due);
+                // Users from the snapshot carry no credential; give them the stand-in.
+                if (cmd.type == CommandType::Login && cmd.arg(1) == TraceRecorder::ReplayPassword &&
+                    !credentials.contains(cmd.arg(0)) && controller.userExists(cmd.arg(0)))
+                    credentials.enroll(cmd.arg(0), TraceRecorder::ReplayPassword);
+                auto began = chrono::steady_clock::now();
+                controller.execute(cmd);
+                double us = chrono::duration<double, micro>(chrono::steady_clock::now() - began).count();
+                perType[size_t(cmd.type) & 31].add(us);
+                overall.add(us);
+                commands++;
+                if (cmd.type == CommandType::Exit) break;
+            }
+            wallSec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            checksum = controller.checksum();
+            Device::attachEventBus(nullptr);
+        }
+        Device::attachIndex(nullptr);
+    }
+    cout.rdbuf(console);
+    for (const char* ext : {".txt", ".txt.sched", ".txt.sched.tmp", ".txt.usage", ".txt.usage.tmp", ".db"})
+        remove((scratch + ext).c_str());
+
+    cout << setfill(' ') << "replay: " << commands << " commands in " << fixed << setprecision(3) << wallSec << " s ("
+         << setprecision(0) << (wallSec > 0 ? commands / wallSec : 0.0) << " cmd/s, "
+         << (paced ? "original pacing" : "max speed") << ")\n";
+    cout << "  " << left << setw(12) << "command" << right << setw(8) << "count" << setw(10) << "mean us"
+         << setw(10) << "p50 us" << setw(10) << "p99 us" << setw(10) << "max us" << "\n";
+    for (size_t t = 1; t < 32; t++) {
+        const LatencyHistogram& h = perType[t];
+        if (!h.total) continue;
+        cout << "  " << left << setw(12) << commandName(CommandType(t)) << right << setw(8) << h.total
+             << setprecision(1) << setw(10) << h.sumUs / h.total << setw(10) << h.quantile(0.5)
+             << setw(10) << h.quantile(0.99) << setw(10) << h.maxUs << "\n";
+        cout << "    ";
+        for (int b = 0; b < LatencyHistogram::Buckets; b++)
+            if (h.counts[b]) cout << " <" << (1u << b) << "us:" << h.counts[b];
+        cout << "\n";
+    }
+    cout << "  checksum: " << hex << setw(16) << setfill('0') << checksum << dec << setfill(' ') << "\n";
+    bool match = true;
+    if (trace.hasChecksum && trace.checksum != checksum) {
+        cout << "  MISMATCH: recording ended at " << hex << trace.checksum << dec << "\n";
+        match = false;
+    }
+    if (expect && expected != checksum) {
+        cout << "  MISMATCH: expected " << hex << expected << dec << "\n";
+        match = false;
+    }
+    return match ? 0 : 2;
+}
+
+// --bill <tariffs> [data file] [--usage FILE] [--user NAME] [--csv FILE]
+// Bills every household in a data file for the month held in a usage
+// ledger (<data file>.usage by default, or an archived month).
+int runBilling(int argc, char* argv[]) {
+    if (argc < 1) {
+        cerr << "Usage: --bill <tariffs> [data file] [--usage FILE] [--user NAME] [--csv FILE]\n";
+        return 1;
+    }
+    string dataPath = "data.txt", usagePath, onlyUser, csvPath;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--usage" && i + 1 < argc) usagePath = argv[++i];
+        else if (arg == "--user" && i + 1 < argc) onlyUser = argv[++i];
+        else if (arg == "--csv" && i + 1 < argc) csvPath = argv[++i];
+        else dataPath = arg;
+    }
+    try {
+        TariffBook book;
+        book.load(argv[0]);
+        DataStorage storage(dataPath);
+        if (usagePath.empty()) usagePath = storage.usageFile();
+        UsageLedger ledger;
+        ifstream in(usagePath, ios::binary);
+        if (!in.is_open() || !ledger.load(in)) throw DeviceException("Cannot read usage ledger: " + usagePath);
+        SmartHome home;
+        for (User* user : storage.loadUsers()) home.addUser(user->getUsername(), user);
+
+        BillingEngine engine(book, ledger);
+        if (!onlyUser.empty()) {
+            User* user = home.getUser(onlyUser);
+            if (!user) throw DeviceException("No such user: " + onlyUser);
+            engine.bill(user).print(cout);
+            return 0;
+        }
+        auto start = chrono::steady_clock::now();
+        vector<Bill> bills = engine.run(home);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        double kWh = 0, revenue = 0;
+        for (const Bill& bill : bills) {
+            kWh += bill.kWh;
+            revenue += bill.total();
+        }
+        if (!csvPath.empty()) {
+            ofstream csv(csvPath);
+            if (!csv.is_open()) throw DeviceException("Cannot open file for writing: " + csvPath);
+            csv << fixed << setprecision(4) << "user,tariff,kwh,energy,blocks,standing,total\n";
+            for (const Bill& b : bills)
+                csv << b.user << "," << b.tariff << "," << b.kWh << "," << b.energyCost << "," << b.blockCost << ","
+                    << b.standingCost << "," << b.total() << "\n";
+        }
+        char month[16];
+        time_t periodStart = ledger.start();
+        tm local;
+        localtime_r(&periodStart, &local);
+        strftime(month, sizeof(month), "%Y-%m", &local);
+        cout << fixed << setprecision(2) << "Billed " << bills.size() << " households for " << month << ": "
+             << kWh << " kWh, " << revenue << " total, in " << setprecision(1) << ms << " ms\n";
+    } catch (const exception& e) {
+        cerr << "smarthome: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// --export <devices|history|usage> <file or -> [data file] [--batch ROWS]
+// [--hours H]: writes an Arrow IPC stream for analytics tools.
+int runExport(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: --export <devices|history|usage> <file or -> [data file] [--batch ROWS] [--hours H]\n";
+        return 1;
+    }
+    string what = argv[0], outPath = argv[1], dataPath = "data.txt";
+    size_t batchRows = 65536;
+    int64_t hours = 0;  // 0 = all history
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--batch" && i + 1 < argc) batchRows = max(1, atoi(argv[++i]));
+        else if (arg == "--hours" && i + 1 < argc) hours = max(1, atoi(argv[++i]));
+        else dataPath = arg;
+    }
+    if (what != "devices" && what != "history" && what != "usage") {
+        cerr << "smarthome: nothing to export called " << what << " (devices, history or usage)\n";
+        return 1;
+    }
+    bool toStdout = outPath == "-";
+    ostream& log = toStdout ? cerr : cout;
+    int fd = -1;
+    try {
+        SmartHome home;
+        DataStorage storage(dataPath);
+        for (User* user : storage.loadUsers()) home.addUser(user->getUsername(), user);
+        UsageLedger ledger;
+        ifstream usage(storage.usageFile(), ios::binary);
+        bool haveUsage = usage.is_open() && ledger.load(usage);
+        if (what == "usage" && !haveUsage) throw DeviceException("Cannot read usage ledger: " + storage.usageFile());
+        fd = toStdout ? STDOUT_FILENO : ::open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw DeviceException("Cannot open file for writing: " + outPath);
+        auto start = chrono::steady_clock::now();
+        uint64_t rows;
+        if (what == "devices") {
+            rows = exportDevices(fd, home, haveUsage ? &ledger : nullptr, batchRows);
+        } else if (what == "history") {
+            TransitionLog log(storage.historyFile());
+            int64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+            rows = exportHistory(fd, home, log, hours ? now - hours * 3600 * 1000000000LL : INT64_MIN, INT64_MAX, batchRows);
+        } else {
+            rows = exportUsage(fd, home, ledger, batchRows);
+        }
+        log << "Exported " << rows << " " << what << " rows to " << (toStdout ? "stdout" : outPath) << " in " << fixed
+            << setprecision(1) << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms\n";
+    } catch (const exception& e) {
+        cerr << "smarthome: " << e.what() << endl;
+        if (fd >= 0 && !toStdout) close(fd);
+        return 1;
+    }
+    if (!toStdout) close(fd);
+    return 0;
+}
+
+// --provision <manifest> [data file] [--threads N] [--dry-run]: checks a
+// device manifest against the saved home and adds it with a single save.
+int runProvision(int argc, char* argv[]) {
+    if (argc < 1) {
+        cerr << "Usage: --provision <manifest> [data file] [--threads N] [--dry-run]\n";
+        return 1;
+    }
+    string dataPath = "data.txt";
+    unsigned threads = 0;
+    bool dryRun = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) threads = max(1, atoi(argv[++i]));
+        else if (arg == "--dry-run") dryRun = true;
+        else dataPath = arg;
+    }
+    DeviceIndex index;
+    Device::attachIndex(&index);
+    try {
+        SmartHome home;
+        DataStorage storage(dataPath);
+        for (User* user : storage.loadUsers()) home.addUser(user->getUsername(), user);
+        BulkProvisioner provisioner(home, index);
+        provisioner.load(argv[0]);
+        auto start = chrono::steady_clock::now();
+        size_t bad = provisioner.validate(threads);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (bad > 0) {
+            size_t shown = 0;
+            for (const auto& problem : provisioner.errors()) {
+                if (++shown > 50) break;
+                cerr << "line " << problem.line << ": " << problem.message << "\n";
+            }
+            cerr << bad << " problem(s) in " << provisioner.size() << " devices; nothing was added.\n";
+            Device::attachIndex(nullptr);
+            return 2;
+        }
+        cout << fixed << setprecision(1) << "Validated " << provisioner.size() << " devices in " << ms << " ms\n";
+        if (!dryRun) {
+            start = chrono::steady_clock::now();
+            size_t rooms = provisioner.commit();
+            storage.saveSystem(&home);
+            cout << "Added " << provisioner.size() << " devices and " << rooms << " room(s) to " << dataPath << " in "
+                 << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms\n";
+        }
+    } catch (const exception& e) {
+        cerr << "smarthome: " << e.what() << endl;
+        Device::attachIndex(nullptr);
+        return 1;
+    }
+    Device::attachIndex(nullptr);
+    return 0;
+}
+
+// Devices by user and room, as --attach prints them.
+string segmentTable(const HomeSegmentReader& reader) {
+    ostringstream out;
+    int64_t ageMs = (chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count() -
+                     reader.heartbeatNs()) / 1000000;
+    out << "Writer " << reader.writerPid() << ", " << reader.deviceCount() << " devices, last update " << ageMs
+        << " ms ago\n" << fixed << setprecision(1);
+    for (uint32_t u = 0; u < reader.userCount(); u++) {
+        const SegmentUser& user = reader.user(u);
+        out << reader.str(user.name) << "\n";
+        for (uint32_t r = user.firstRoom; r < user.firstRoom + user.roomCount && r < reader.roomCount(); r++) {
+            const SegmentRoom& room = reader.room(r);
+            out << "  " << reader.str(room.name) << "\n";
+            for (uint32_t d = room.firstDevice; d < room.firstDevice + room.deviceCount && d < reader.deviceCount(); d++) {
+                const SegmentDevice& rec = reader.device(d);
+                DeviceState s = reader.read(d);
+                string_view type = reader.str(rec.type);
+                out << "    " << left << setw(16) << reader.str(rec.name) << setw(12) << reader.str(rec.id)
+                    << setw(11) << type << right << ((s.flags & SegmentDevice::On) ? "On " : "Off");
+                if (type == "Light") out << "  " << s.setting << "%";
+                else if (type == "Thermostat" || type == "AC") out << "  " << s.current << "° -> " << s.setting << "°";
+                else if (type == "DoorLock") out << ((s.flags & SegmentDevice::Locked) ? "  locked" : "  unlocked");
+                else if (type == "Camera") {
+                    if (s.flags & SegmentDevice::Recording) out << "  recording";
+                    if (s.flags & SegmentDevice::Motion) out << "  motion";
+                }
+                out << "\n";
+            }
+        }
+    }
+    return out.str();
+}
+
+// Prometheus text format, one family at a time.
+string segmentMetrics(const HomeSegmentReader& reader) {
+    ostringstream out;
+    vector<string> labels(reader.deviceCount());
+    for (uint32_t r = 0; r < reader.roomCount(); r++) {
+        const SegmentRoom& room = reader.room(r);
+        string prefix = "{user=\"" + string(reader.str(reader.user(room.user).name)) + "\",room=\"" +
+                        string(reader.str(room.name)) + "\",device=\"";
+        for (uint32_t d = room.firstDevice; d < room.firstDevice + room.deviceCount && d < labels.size(); d++)
+            labels[d] = prefix + string(reader.str(reader.device(d).id)) + "\",type=\"" +
+                        string(reader.str(reader.device(d).type)) + "\"}";
+    }
+    vector<DeviceState> states(labels.size());
+    for (uint32_t d = 0; d < states.size(); d++) states[d] = reader.read(d);
+    auto family = [&](const char* name, const char* kind, auto value) {
+        out << "# TYPE " << name << " " << kind << "\n";
+        for (uint32_t d = 0; d < states.size(); d++) out << name << labels[d] << " " << value(states[d]) << "\n";
+    };
+    family("smarthome_device_on", "gauge", [](const DeviceState& s) { return (s.flags & SegmentDevice::On) ? 1 : 0; });
+    family("smarthome_device_power_kw", "gauge", [](const DeviceState& s) { return s.power; });
+    family("smarthome_device_setting", "gauge", [](const DeviceState& s) { return s.setting; });
+    family("smarthome_device_flags", "gauge", [](const DeviceState& s) { return s.flags; });
+    family("smarthome_device_updates_total", "counter", [](const DeviceState& s) { return s.updates; });
+    int64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    out << "# TYPE smarthome_segment_age_seconds gauge\nsmarthome_segment_age_seconds "
+        << (now - reader.heartbeatNs()) / 1e9 << "\n";
+    return out.str();
+}
+
+// Reads a segment published with --share (or segment= in the daemon
+// configuration) from a separate process.
+int runAttach(int argc, char* argv[]) {
+    if (argc < 1) {
+        cerr << "Usage: smarthome --attach <segment> [--watch [ms]] [--metrics]\n";
+        return 1;
+    }
+    bool metrics = false;
+    int watchMs = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--metrics") metrics = true;
+        else if (arg == "--watch") watchMs = i + 1 < argc && isdigit(argv[i + 1][0]) ? max(50, atoi(argv[++i])) : 1000;
+    }
+    try {
+        HomeSegmentReader reader(argv[0]);
+        while (true) {
+            reader.refresh();
+            string out = metrics ? segmentMetrics(reader) : segmentTable(reader);
+            if (!reader.stable()) continue;  // the tables were rebuilt under us
+            if (watchMs) out = "\x1b[H\x1b[2J" + out;
+            fwrite(out.data(), 1, out.size(), stdout);
+            fflush(stdout);
+            pollfd input{0, POLLIN, 0};
+            if (!watchMs || poll(&input, 1, watchMs) > 0) break;
+        }
+    } catch (const exception& e) {
+        cerr << "smarthome: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// --emulator <socket> [devices] [drop%]: serves emulated devices until
+// SIGINT/SIGTERM.
+int runEmulator(int argc, char* argv[]) {
+    if (argc < 1) {
+        cerr << "Usage: --emulator <socket> [devices] [drop%]\n";
+        return 1;
+    }
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    DeviceEmulator emulator(argv[0], argc > 1 ? max(0, atoi(argv[1])) : 1000, argc > 2 ? atoi(argv[2]) : 0);
+    cout << "Emulating " << emulator.deviceCount() << " devices on " << argv[0] << endl;
+    thread server(&DeviceEmulator::run, &emulator);
+    int sig;
+    sigwait(&signals, &sig);
+    emulator.stop();
+    server.join();
+    return 0;
+}
+
+// --standby <socket> [config]: applies a primary's replication log to the
+// daemon's state. If the primary drops without saying goodbye (or on
+// SIGUSR1) the standby checkpoints and carries on as the daemon itself;
+// SIGINT/SIGTERM checkpoint and exit.
+int runStandby(int argc, char* argv[]) {
+    if (argc < 1) {
+        cerr << "Usage: --standby <socket> [config]\n";
+        return 1;
+    }
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    unique_ptr<HomeDaemon> standby;
+    try {
+        standby = make_unique<HomeDaemon>(argc > 1 ? argv[1] : "smarthome.conf");
+    } catch (const DeviceException& e) {
+        cerr << "smarthome: " << e.what() << endl;
+        return 1;
+    }
+    HomeDaemon& daemon = *standby;
+    const SystemConfig& config = daemon.settings();
+    CredentialStore credentials(config.credentialsFile);
+    bool promote = false;
+    try {
+        ReplicaApplier applier(daemon.home(), daemon.schedules(), &credentials);
+        StandbyServer server(argv[0], applier);
+        cout << "Standing by on " << argv[0] << endl;
+        bool stop = false;
+        time_t lastReport = time(0);
+        timespec noWait{0, 0};
+        auto poll = [&] {
+            int sig = sigtimedwait(&signals, nullptr, &noWait);
+            if (sig == SIGUSR1) promote = stop = true;
+            else if (sig == SIGTERM || sig == SIGINT) stop = true;
+            if (time(0) - lastReport >= 5) {
+                cout << "standby: seq " << applier.appliedSeq << ", " << applier.applied << " records, lag "
+                     << fixed << setprecision(1) << applier.lagMs << " ms" << endl;
+                lastReport = time(0);
+            }
+            return stop;
+        };
+        while (!stop) {
+            StandbyServer::Outcome outcome = server.serve(poll);
+            if (outcome == StandbyServer::Outcome::PrimaryLost) {
+                cout << "Primary lost at seq " << applier.appliedSeq << endl;
+                promote = true;
+                break;
+            }
+            if (outcome == StandbyServer::Outcome::PrimaryDone) cout << "Primary shut down; waiting for it to return" << endl;
+        }
+    } catch (const exception& e) {
+        cerr << "smarthome: standby failed: " << e.what() << endl;
+        return 1;
+    }
+
+    DataStorage storage(config.dataFile);
+    storage.saveSystem(&daemon.home());
+    storage.saveSchedules(daemon.schedules());
+    if (!promote) return 0;
+    cout << "Taking over as primary" << endl;
+    return daemon.run(false);
+}
+
+// Fills a home with generated users/rooms/devices for benchmarks.
+// User u of a generated home; device IDs continue from serial.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"  // see createDevice()
+User* syntheticUser(int u, int roomsPerUser, int devicesPerRoom, int& serial) {
+    static const char* roomNames[] = {"Kitchen", "Bedroom", "Hall", "Garage", "Office", "Porch"};
+    string username = "user" + to_string(u);
+    User* user = new User(username, "secret" + to_string(u));
+    for (int r = 0; r < roomsPerUser; r++) {
+        string roomName = string(roomNames[r % 6]) + to_string(r);
+        Room* room = new Room(roomName);
+        user->addRoom(room);
+        for (int d = 0; d < devicesPerRoom; d++) {
+            string id = "D" + to_string(serial++);
+            Device* device;
+            switch (d % 5) {
+                case 0: device = new Light(id, "light" + to_string(d), roomName); device->powerConsumption = 0.1f; break;
+                case 1: device = new Thermostat(id, "thermo" + to_string(d), roomName); device->powerConsumption = 0.5f; break;
+                case 2: device = new Camera(id, "cam" + to_string(d), roomName); device->powerConsumption = 0.05f; break;
+                case 3: device = new DoorLock(id, "door" + to_string(d), roomName); device->powerConsumption = 0.02f; break;
+                default: device = new AirConditioner(id, "ac" + to_string(d), roomName); device->powerConsumption = 1.5f; break;
+            }
+            if (d % 2 == 0) device->turnOn();
+            room->addDevice(device);
+        }
+    }
+    return user;
+}
+#pragma GCC diagnostic pop
+
+void populateSyntheticHome(SmartHome& home, int users, int roomsPerUser, int devicesPerRoom) {
+    int serial = 0;
+    for (int u = 0; u < users; u++) {
+        User* user = syntheticUser(u, roomsPerUser, devicesPerRoom, serial);
+        home.addUser(user->getUsername(), user);
+    }
+}
+
+int benchDaemon(int seconds) {
+    string cfgPath = "bench_daemon.conf";
+    {
+        ofstream cfg(cfgPath);
+        cfg << "data_file=bench_daemon.txt\njournal_file=bench_daemon.log\n"
+            << "scheduler_interval=1\nsimulation_interval=1\ncheckpoint_interval=3600\n";
+    }
+    HomeDaemon daemon(cfgPath);
+    populateSyntheticHome(daemon.home(), 100, 4, 10);
+
+    ResourceUsage before = ResourceUsage::sample();
+    auto start = chrono::steady_clock::now();
+    thread runner([&] { daemon.run(false); });
+    this_thread::sleep_for(chrono::seconds(seconds));
+    ResourceUsage steady = ResourceUsage::sample();
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    daemon.requestStop();
+    runner.join();
+
+    cout << "daemon: 4000 devices, " << seconds << "s steady state\n"
+         << "  cpu: " << fixed << setprecision(2) << (steady.cpuSeconds - before.cpuSeconds) / wall * 100.0 << "%\n"
+         << "  rss: " << steady.rssKB << " KB (peak " << steady.peakRssKB << " KB)\n";
+    remove(cfgPath.c_str());
+    remove("bench_daemon.txt");
+    remove("bench_daemon.log");
+    remove("bench_daemon.txt.history");
+    return 0;
+}
+
+// Login latency through the lazy resident set as the total user count grows.
+int benchLazyLogin(size_t residentCapacity) {
+    const char* file = "bench_lazy.txt";
+    for (size_t total : {1000, 10000, 100000}) {
+        {
+            ofstream out(file, ios::trunc);
+            for (size_t u = 0; u < total; u++) {
+                out << "USER user" << u << " secret" << u << "\nROOM Hall\n"
+                    << "DEVICE Light L" << u << " lamp Hall 1 0.1 50\n"
+                    << "DEVICE DoorLock K" << u << " door Hall 0 0.02 1\n";
+            }
+        }
+        remove((string(file) + ".idx").c_str());
+        auto indexStart = chrono::steady_clock::now();
+        UserStore store(file);
+        double indexMs = chrono::duration<double, milli>(chrono::steady_clock::now() - indexStart).count();
+
+        SmartHome home;
+        ResidentUserCache cache(&home, store, residentCapacity);
+        home.attachLoader(&cache);
+        const int logins = 20000;
+        uint64_t seed = 42;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < logins; i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            size_t u = (seed >> 33) % total;
+            home.loginUser("user" + to_string(u), "secret" + to_string(u));
+        }
+        double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / logins;
+        cout << setw(7) << total << " users: index " << fixed << setprecision(1) << indexMs << " ms, "
+             << setprecision(2) << us << " us/login, resident " << cache.residentCount()
+             << ", rss " << ResourceUsage::sample().rssKB << " KB\n";
+    }
+    remove(file);
+    remove((string(file) + ".idx").c_str());
+    return 0;
+}
+
+// Concurrent login throughput: full scrypt verifications, cached session
+// checks, and a brute-force attacker being rate limited alongside.
+int benchLogin(int threads) {
+    const char* file = "bench_credentials.db";
+    remove(file);
+    CredentialStore store(file);
+    const int users = 8;
+    for (int u = 0; u < users; u++) store.enroll("user" + to_string(u), "secret" + to_string(u));
+
+    auto timed = [&](auto&& body) {
+        atomic<bool> stop(false);
+        atomic<long> done(0);
+        vector<thread> pool;
+        auto start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; t++)
+            pool.emplace_back([&, t] { long n = 0; while (!stop.load()) { body(t, n); n++; } done += n; });
+        this_thread::sleep_for(chrono::seconds(2));
+        stop = true;
+        for (auto& th : pool) th.join();
+        return done.load() / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+
+    Authenticator open(store, 1e9, 1e9);
+    double hashed = timed([&](int t, long n) {
+        int u = (t + n) % users;
+        User user("user" + to_string(u), "");
+        open.verify(&user, "secret" + to_string(u), "bench" + to_string(t));
+    });
+
+    string token = open.openSession("user0");
+    double cached = timed([&](int, long) { open.sessionUser(token); });
+
+    // Real users and the attacker go through the same limited authenticator,
+    // so the attacker's rejections are paid for on the path real logins take.
+    // The attacker guesses user0's password; user0 also logs in, from its own
+    // source, and must not be locked out.
+    Authenticator limited(store);
+    atomic<long> rejected(0), refused(0);
+    atomic<bool> attackerStop(false);
+    thread attacker([&] {
+        User victim("user0", "");
+        while (!attackerStop.load()) {
+            try { limited.verify(&victim, "guess000", "attacker"); } catch (const DeviceException&) { rejected++; }
+        }
+    });
+    double underAttack = timed([&](int t, long n) {
+        int u = (t + n) % users;
+        User user("user" + to_string(u), "");
+        try { limited.verify(&user, "secret" + to_string(u), "bench" + to_string(t)); } catch (const DeviceException&) { refused++; }
+    });
+    attackerStop = true;
+    attacker.join();
+
+    cout << "login: " << threads << " threads, scrypt N=2^14 r=8 p=1\n" << fixed << setprecision(1)
+         << "  full verification:   " << hashed << " logins/s\n"
+         << "  cached session:      " << cached << " checks/s\n"
+         << "  during brute force:  " << underAttack << " logins/s (" << rejected.load() << " attacker attempts rejected, "
+         << refused.load() << " real logins rate limited)\n";
+    remove(file);
+    return 0;
+}
+
+// Filtered device queries through the secondary indexes versus walking
+// every user, room and device.
+int benchQuery() {
+    DeviceIndex index;
+    Device::attachIndex(&index);
+    {
+        SmartHome home;
+        populateSyntheticHome(home, 1000, 4, 50);
+        User* someone = home.getUser("user500");
+        string light = "Light", lock = "Door Lock";
+
+        auto scan = [&](auto pred) {
+            size_t n = 0;
+            for (const auto& [u, user] : home.getAllUsers())
+                for (const auto& [r, room] : user->getAllRooms())
+                    for (Device* d : room->getDevices())
+                        if (pred(d)) n++;
+            return n;
+        };
+        auto time = [](auto body) {
+            auto start = chrono::steady_clock::now();
+            size_t n = body();
+            return make_pair(n, chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+        };
+        auto report = [](const char* label, pair<size_t, double> indexed, pair<size_t, double> scanned) {
+            cout << "  " << left << setw(24) << label << right << setw(7) << indexed.first << " hits  index "
+                 << fixed << setprecision(1) << setw(9) << indexed.second << " us  scan "
+                 << setw(9) << scanned.second << " us\n";
+        };
+
+        cout << "query: " << index.size() << " devices\n";
+        report("lights on",
+               time([&] { return DeviceQuery(index).ofType(light).withStatus(true).count(); }),
+               time([&] { return scan([&](Device* d) { return d->getDeciceType() == light && d->getStatus(); }); }));
+        report("unlocked doors",
+               time([&] { return DeviceQuery(index).ofType(lock).withLock(false).count(); }),
+               time([&] { return scan([&](Device* d) {
+                   auto l = dynamic_cast<DoorLock*>(d);
+                   return l && !l->checkLockStatus(); }); }));
+        report("devices on",
+               time([&] { return DeviceQuery(index).withStatus(true).count(); }),
+               time([&] { return scan([&](Device* d) { return d->getStatus(); }); }));
+        report("user500 lights on",
+               time([&] { return DeviceQuery(index).ownedBy(someone).ofType(light).withStatus(true).count(); }),
+               time([&] { size_t n = 0;
+                   for (const auto& [r, room] : someone->getAllRooms())
+                       for (Device* d : room->getDevices()) n += d->getDeciceType() == light && d->getStatus();
+                   return n; }));
+
+        vector<Device*> all = DeviceQuery(index).run();
+        auto start = chrono::steady_clock::now();
+        for (Device* d : all) { d->turnOff(); d->turnOn(); }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (2.0 * all.size());
+        cout << "  index maintenance: " << fixed << setprecision(1) << ns << " ns per turnOn/turnOff\n";
+    }
+    Device::attachIndex(nullptr);
+    return 0;
+}
+
+// Schedule persistence: save, O(n) reload with heapify, and the
+// equivalent one-insert-at-a-time rebuild for comparison.
+int benchSchedules(int count) {
+    const char* file = "bench_schedules.sched";
+    Scheduler scheduler;
+    for (int i = 0; i < count; i++) scheduler.addSchedule("D" + to_string(i), Time(i % 24, (i * 7) % 60));
+
+    auto start = chrono::steady_clock::now();
+    {
+        ofstream out(file, ios::binary | ios::trunc);
+        scheduler.save(out, time(0) - 3 * 86400);
+    }
+    double saveMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    Scheduler reloaded;
+    reloaded.setCatchUpPolicy(CatchUpPolicy::RunOnce);
+    start = chrono::steady_clock::now();
+    {
+        ifstream in(file, ios::binary);
+        reloaded.load(in, time(0));
+    }
+    double loadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    Scheduler incremental;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) incremental.addSchedule("D" + to_string(i), Time(i % 24, (i * 7) % 60));
+    double insertMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    ifstream sized(file, ios::binary | ios::ate);
+    cout << "schedules: " << count << " entries, " << sized.tellg() << " bytes on disk\n" << fixed << setprecision(1)
+         << "  save:              " << saveMs << " ms\n"
+         << "  load + heapify:    " << loadMs << " ms\n"
+         << "  n inserts:         " << insertMs << " ms\n";
+    reloaded.setVerbose(false);
+    start = chrono::steady_clock::now();
+    size_t fired = reloaded.runDue(time(0));
+    cout << "  catch-up run:      " << fired << " missed triggers in "
+         << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms\n";
+    remove(file);
+    return 0;
+}
+
+// Alert storms: one camera firing continuously, then millions of distinct
+// sources, to show suppression cost and that tracking memory stays fixed.
+int benchAlerts() {
+    Notification notifications;
+    const int storm = 1000000;
+    int64_t t0 = 1700000000000LL;
+    long rssBefore = ResourceUsage::sample().rssKB;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < storm; i++)
+        notifications.sendAlert("CAM1", AlertSeverity::Warning, "Motion detected by ", "porch", t0 + i * 10);
+    double stormNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / storm;
+    cout << "alerts: one camera, " << storm << " motion alerts over " << storm / 100 / 60 << " min\n"
+         << "  admitted " << notifications.admittedTotal << ", suppressed " << notifications.suppressedTotal
+         << ", " << fixed << setprecision(1) << stormNs << " ns/alert\n";
+
+    const int sources = 2000000;
+    uint64_t admitted = notifications.admittedTotal;
+    char id[16];
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < sources; i++) {
+        snprintf(id, sizeof(id), "S%d", i);
+        notifications.sendAlert(id, AlertSeverity::Warning, "Motion detected by ", id, t0 + i);
+    }
+    double spreadNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / sources;
+    notifications.flushSummaries();
+    cout << "  " << sources << " distinct sources: " << spreadNs << " ns/alert, "
+         << notifications.admittedTotal - admitted << " admitted, " << notifications.size() << " alerts retained, rss +" << ResourceUsage::sample().rssKB - rssBefore << " KB\n";
+    return 0;
+}
+
+// Dashboard rendering for one large home, written to /dev/null: the old
+// endl-flushed walk versus buffered frames served from the line cache.
+int benchDashboard() {
+    SmartHome home;
+    populateSyntheticHome(home, 1, 50, 200);
+    User* user = home.getUser("user0");
+    vector<Device*> devices;
+    for (const auto& [name, room] : user->getAllRooms())
+        for (Device* d : room->getDevices()) devices.push_back(d);
+
+    fflush(stdout);
+    int saved = dup(1), devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, 1);
+    auto time = [](auto body) {
+        auto start = chrono::steady_clock::now();
+        body();
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    };
+    DashboardRenderer renderer;
+    double legacy = time([&] { user->viewAllRooms(); cout.flush(); });
+    double cold = time([&] { renderer.showUser(user); });
+    double warm = time([&] { renderer.showUser(user); });
+    for (size_t i = 0; i < devices.size(); i += 100) devices[i]->turnOff();
+    double partial = time([&] { renderer.showUser(user); });
+    double live = time([&] { renderer.showLive(user, "bench"); });
+    double liveIdle = time([&] { renderer.showLive(user, "bench"); });
+    fflush(stdout);
+    dup2(saved, 1);
+    close(devnull);
+    close(saved);
+
+    cout << "dashboard: " << devices.size() << " devices\n" << fixed << setprecision(2)
+         << "  viewAllRooms:          " << legacy << " ms\n"
+         << "  first frame:           " << cold << " ms\n"
+         << "  unchanged frame:       " << warm << " ms\n"
+         << "  1% devices changed:    " << partial << " ms\n"
+         << "  live view, full draw:  " << live << " ms\n"
+         << "  live view, no changes: " << liveIdle << " ms\n"
+         << "  device lines formatted: " << renderer.renderedCount() << "\n";
+    return 0;
+}
+
+// Driver transport against an in-process emulator: closed-loop load with a
+// fixed number of requests in flight, from no pipelining up to deep queues.
+int benchTransport(size_t devices, size_t connections) {
+    string path = "/tmp/smarthome_bench_" + to_string(getpid()) + ".sock";
+    DeviceEmulator emulator(path, devices);
+    thread server(&DeviceEmulator::run, &emulator);
+    cout << "transport: " << devices << " emulated devices, " << connections << " connections\n";
+    for (int window : {1, 16, 256}) {
+        DeviceTransport transport(path, connections);
+        const int total = window == 1 ? 20000 : 200000;
+        LatencyHistogram latency;
+        mutex latencyLock;
+        atomic<int> inFlight(0), issued(0), done(0);
+        auto start = chrono::steady_clock::now();
+        auto issue = [&](auto& self) -> void {
+            int n = issued.fetch_add(1);
+            if (n >= total) return;
+            inFlight++;
+            auto sentAt = chrono::steady_clock::now();
+            DriverOp op = n % 2 ? DriverOp::TurnOn : DriverOp::TurnOff;
+            transport.submit(op, "E" + to_string(n % devices), 0, [&, sentAt](const DeviceTransport::Result&) {
+                double us = chrono::duration<double, micro>(chrono::steady_clock::now() - sentAt).count();
+                {
+                    lock_guard<mutex> guard(latencyLock);
+                    latency.add(us);
+                }
+                inFlight--;
+                done++;
+                self(self);
+            });
+        };
+        for (int i = 0; i < window; i++) issue(issue);
+        while (done.load() < total) this_thread::sleep_for(chrono::milliseconds(1));
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  window " << setw(3) << window << ": " << fixed << setprecision(0) << setw(8) << total / sec
+             << " req/s  p50 " << setprecision(0) << latency.quantile(0.5) << " us  p99 " << latency.quantile(0.99)
+             << " us  p99.9 " << latency.quantile(0.999) << " us  max " << setprecision(0) << latency.maxUs << " us\n";
+    }
+    {
+        DeviceEmulator lossy(path + ".lossy", devices, 5);
+        thread lossyServer(&DeviceEmulator::run, &lossy);
+        DeviceTransport transport(path + ".lossy", connections, 20, 3);
+        int ok = 0;
+        for (int i = 0; i < 2000; i++) ok += transport.call(DriverOp::Query, "E" + to_string(i)).status == DriverStatus::Ok;
+        cout << "  5% loss: " << ok << "/2000 answered, " << transport.retries.load() << " retries\n";
+        lossy.stop();
+        lossyServer.join();
+    }
+    emulator.stop();
+    server.join();
+    return 0;
+}
+
+// Mutation latency on the primary with and without a standby attached, how
+// far behind the standby runs, and whether it ends up with the same state.
+int benchReplication(int mutations) {
+    string path = "/tmp/smarthome_repl_" + to_string(getpid()) + ".sock";
+    int result[2];
+    if (pipe(result) != 0) return 1;
+    // Fork before any thread exists; the child is the standby.
+    pid_t child = fork();
+    if (child == 0) {
+        ::close(result[0]);
+        DeviceIndex index;
+        Device::attachIndex(&index);
+        SmartHome home;
+        Scheduler scheduler;
+        scheduler.setVerbose(false);
+        ReplicaApplier applier(home, scheduler, nullptr);
+        uint64_t report[2] = {0, 0};
+        {
+            StandbyServer server(path, applier);
+            server.serve([] { return false; });
+        }
+        report[0] = homeChecksum(home, scheduler);
+        report[1] = applier.applied;
+        ssize_t written = write(result[1], report, sizeof(report));
+        _exit(written == sizeof(report) ? 0 : 1);
+    }
+    ::close(result[1]);
+
+    DeviceIndex index;
+    Device::attachIndex(&index);
+    SmartHome home;
+    Scheduler scheduler;
+    scheduler.setVerbose(false);
+    populateSyntheticHome(home, 100, 4, 10);
+    vector<Light*> lights;
+    for (const auto& [name, user] : home.getAllUsers())
+        for (const auto& [roomName, room] : user->getAllRooms())
+            for (Device* d : room->getDevices()) {
+                if (auto light = dynamic_cast<Light*>(d)) lights.push_back(light);
+                if (lights.size() % 4 == 0) scheduler.addSchedule(d->getDeviceID(), Time(lights.size() % 24, 30));
+            }
+    cout << "replication: " << home.getAllUsers().size() << " users, " << lights.size() << " lights, "
+         << mutations << " mutations\n";
+
+    mutex stateLock;
+    auto run = [&](ReplicationSender* sender, const char* label) {
+        LatencyHistogram latency;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < mutations; i++) {
+            auto t0 = chrono::steady_clock::now();
+            {
+                lock_guard<mutex> guard(stateLock);
+                Light* light = lights[(i * 7919) % lights.size()];
+                light->setBrightness(i % 101);
+                if (i % 3 == 0) {
+                    if (light->getStatus()) light->turnOff();
+                    else light->turnOn();
+                }
+                if (sender) sender->deviceChanged(light);
+            }
+            latency.add(chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count());
+        }
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  " << label << fixed << setprecision(0) << setw(10) << mutations / sec << " mutations/s  p50 "
+             << setprecision(2) << latency.quantile(0.5) << " us  p99 " << latency.quantile(0.99) << " us\n";
+    };
+    run(nullptr, "no standby:  ");
+
+    auto sender = make_unique<ReplicationSender>(path);
+    sender->setState(&stateLock, &index);
+    sender->setSnapshot([&] {
+        lock_guard<mutex> guard(stateLock);
+        ReplicationSource::snapshot(*sender, home, scheduler, nullptr);
+    });
+    sender->start();
+    auto caughtUp = [&] { return sender->caughtUp(); };
+    while (!caughtUp()) this_thread::sleep_for(chrono::milliseconds(1));
+    run(sender.get(), "with standby:");
+    auto drainStart = chrono::steady_clock::now();
+    double lagAtEnd = sender->lagMs();
+    while (!caughtUp()) this_thread::sleep_for(chrono::microseconds(100));
+    double drainMs = chrono::duration<double, milli>(chrono::steady_clock::now() - drainStart).count();
+    LatencyHistogram acks = sender->ackLatencies();
+    cout << "  ack latency p50 " << setprecision(0) << acks.quantile(0.5) << " us  p99 " << acks.quantile(0.99)
+         << " us; lag when the burst ended " << setprecision(2) << lagAtEnd << " ms, caught up "
+         << drainMs << " ms later\n";
+
+    uint64_t expected = homeChecksum(home, scheduler);
+    sender.reset();  // says goodbye, so the standby reports back
+    uint64_t report[2] = {0, 0};
+    bool got = read(result[0], report, sizeof(report)) == sizeof(report);
+    waitpid(child, nullptr, 0);
+    ::close(result[0]);
+    cout << "  standby applied " << report[1] << " records, checksum "
+         << (got && report[0] == expected ? "matches" : "DIFFERS") << "\n";
+    Device::attachIndex(nullptr);
+    return got && report[0] == expected ? 0 : 1;
+}
+
+// Month-end billing for a generated fleet: the batch engine on one core and
+// on all cores, against pricing each reading as it is visited.
+int benchBilling(int households) {
+    DeviceIndex index;
+    Device::attachIndex(&index);
+    SmartHome home;
+    populateSyntheticHome(home, households, 2, 4);
+
+    // Every device runs a daily window of its own.
+    UsageLedger ledger;
+    uint32_t n = ledger.intervalCount();
+    size_t serial = 0, devices = 0;
+    for (const auto& [name, user] : home.getAllUsers())
+        for (const auto& [roomName, room] : user->getAllRooms())
+            for (Device* device : room->getDevices()) {
+                int firstHour = (serial * 7) % 24, hours = 1 + serial % 6;
+                serial++;
+                devices++;
+                for (uint32_t day = 0; day * 24 < n; day++)
+                    for (int h = 0; h < hours; h++)
+                        ledger.add(device->getDeviceID(),
+                                   ledger.start() + int64_t(day * 24 + (firstHour + h) % 24) * UsageLedger::IntervalSec,
+                                   device->powerConsumption);
+            }
+
+    TariffBook book;
+    Tariff& flat = book.add("flat");
+    for (auto& hours : flat.hourly) fill(begin(hours), end(hours), 0.20f);
+    flat.standingPerDay = 0.30f;
+    Tariff& tou = book.add("time-of-use");
+    for (int h = 0; h < 24; h++) {
+        tou.hourly[0][h] = h < 7 ? 0.10f : h >= 16 && h < 21 ? 0.38f : 0.22f;
+        tou.hourly[1][h] = 0.15f;
+    }
+    tou.blocks = {{200.0f, 0.0f}, {500.0f, 0.03f}, {FLT_MAX, 0.07f}};
+    tou.standingPerDay = 0.45f;
+    int u = 0;
+    for (const auto& [name, user] : home.getAllUsers())
+        if (u++ % 2) book.assign(name, "time-of-use");
+    cout << "billing: " << households << " households, " << devices << " devices, " << n << " hourly intervals\n";
+
+    auto timed = [](const char* label, auto&& fn) {
+        auto start = chrono::steady_clock::now();
+        double total = fn();
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "  " << left << setw(18) << label << right << fixed << setprecision(1) << setw(8) << ms
+             << " ms  total " << setprecision(2) << total << "\n";
+        return total;
+    };
+    auto revenue = [](const vector<Bill>& bills) {
+        double total = 0;
+        for (const Bill& b : bills) total += b.total();
+        return total;
+    };
+    double reference = timed("per reading:", [&] {
+        double total = 0;
+        for (const auto& [name, user] : home.getAllUsers()) {
+            const Tariff& t = book.at(book.indexFor(name));
+            double running = 0;
+            size_t b = 0;
+            vector<const float*> series;
+            for (const auto& [roomName, room] : user->getAllRooms())
+                for (Device* device : room->getDevices())
+                    if (const float* s = ledger.find(device->getDeviceID())) series.push_back(s);
+            for (uint32_t i = 0; i < n; i++) {
+                time_t at = ledger.start() + int64_t(i) * UsageLedger::IntervalSec;
+                tm local;
+                localtime_r(&at, &local);
+                float price = t.hourly[local.tm_wday == 0 || local.tm_wday == 6][local.tm_hour];
+                for (const float* s : series) {
+                    double left = s[i];
+                    total += left * price;
+                    while (left > 0 && !t.blocks.empty()) {
+                        bool last = b + 1 == t.blocks.size();
+                        double take = last ? left : min(left, max(0.0, double(t.blocks[b].first) - running));
+                        total += take * t.blocks[b].second;
+                        running += take;
+                        left -= take;
+                        if (left > 0) b++;
+                    }
+                }
             }
+            total += t.standingPerDay * (double(n) * UsageLedger::IntervalSec / 86400.0);
         }
-        cout << "Failed to turn ON device. Room or device not found." << endl;
-        return false;
+        return total;
+    });
+    BillingEngine engine(book, ledger);
+    timed("batch, 1 core:", [&] { return revenue(engine.run(home, 1)); });
+    double batch = timed("batch, all cores:", [&] { return revenue(engine.run(home)); });
+    bool same = abs(batch - reference) <= 1e-4 * abs(reference);
+    cout << "  totals " << (same ? "agree" : "DIFFER") << "\n";
+    Device::attachIndex(nullptr);
+    return same ? 0 : 1;
+}
+
+// Admission cost with budgets at every level, against summing the draw by
+// walking the home; concurrent admission from several threads; and a
+// demand-response pass over a home whose budget covers half its load.
+int benchBudget() {
+    SmartHome home;
+    populateSyntheticHome(home, 1000, 4, 10);
+    vector<vector<Device*>> byUser;
+    for (const auto& [name, user] : home.getAllUsers()) {
+        byUser.emplace_back();
+        for (const auto& [roomName, room] : user->getAllRooms())
+            for (Device* d : room->getDevices()) {
+                if (d->getStatus()) d->turnOff();
+                byUser.back().push_back(d);
+            }
     }
+    size_t devices = byUser.size() * byUser[0].size();
+    cout << "budget: " << byUser.size() << " users, " << devices << " devices\n";
+
+    PowerBudget budget(home);
+    budget.setHome(double(devices) * 2000);
+    for (const auto& [name, user] : home.getAllUsers()) {
+        budget.setUser(name, 4000);
+        for (const auto& [roomName, room] : user->getAllRooms()) budget.setRoom(name, roomName, 2500);
+    }
+    Device::attachBudget(&budget);
+    budget.apply();
+
+    auto perOp = [](const char* label, size_t ops, auto&& fn) {
+        auto start = chrono::steady_clock::now();
+        fn();
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ops;
+        cout << "  " << left << setw(30) << label << right << fixed << setprecision(1) << setw(10) << ns << " ns/op\n";
+    };
+    const size_t toggles = 2000000;
+    size_t admitted = 0;
+    perOp("admit/release, 4 levels:", toggles, [&] {
+        for (size_t i = 0; i < toggles; i++) {
+            Device* d = byUser[i % byUser.size()][(i / byUser.size()) % byUser[0].size()];
+            if (d->getStatus()) d->turnOff();
+            else admitted += d->turnOn();
+        }
+    });
+    // What a check has to do without running totals: walk everything the
+    // budget covers (here the home budget, so all devices).
+    const size_t scans = 2000;
+    double sink = 0;
+    perOp("admit by walking the home:", scans, [&] {
+        for (size_t i = 0; i < scans; i++) {
+            double draw = 0;
+            for (const auto& [name, user] : home.getAllUsers())
+                for (const auto& [roomName, room] : user->getAllRooms())
+                    for (Device* d : room->getDevices())
+                        if (d->getStatus()) draw += d->powerConsumption;
+            sink += draw;
+        }
+    });
+    for (auto& devicesOf : byUser)
+        for (Device* d : devicesOf) d->turnOff();
+
+    // Threads own disjoint users and contend only on the home total; the
+    // home budget is tight enough that some admissions are refused.
+    unsigned threads = max(2u, thread::hardware_concurrency());
+    budget.setHome(double(devices) * 50);
+    budget.apply();
+    atomic<int64_t> peak(0);
+    atomic<size_t> refused(0);
+    perOp(("concurrent, " + to_string(threads) + " threads:").c_str(), toggles, [&] {
+        vector<thread> pool;
+        for (unsigned t = 0; t < threads; t++)
+            pool.emplace_back([&, t] {
+                size_t mine = 0;
+                for (size_t i = t; i < byUser.size() * 50 && mine < toggles / threads; i += threads)
+                    for (size_t k = 0; k < byUser[0].size() && mine < toggles / threads; k++, mine++) {
+                        Device* d = byUser[i % byUser.size()][k];
+                        if (d->getStatus()) d->turnOff();
+                        else if (!d->turnOn()) refused++;
+                        int64_t draw = home.power.drawMw.load(memory_order_relaxed), seen = peak.load();
+                        while (draw > seen && !peak.compare_exchange_weak(seen, draw)) {}
+                    }
+            });
+        for (thread& t : pool) t.join();
+    });
+    int64_t expected = 0;
+    for (auto& devicesOf : byUser)
+        for (Device* d : devicesOf) expected += d->reservedPower();
+    bool consistent = expected == home.power.drawMw.load() && peak.load() <= home.power.limitMw.load();
+    cout << "  " << refused.load() << " refused; peak draw " << peak.load() / 1e6 << " kW of "
+         << home.power.limitMw.load() / 1e6 << " kW; totals " << (consistent ? "consistent" : "INCONSISTENT") << "\n";
+    for (auto& devicesOf : byUser)
+        for (Device* d : devicesOf) d->turnOff();
+
+    // Demand response: every AC and light on, then cameras and thermostats
+    // arrive and push lower-priority loads out.
+    budget.setDemandResponse(true);
+    budget.setHome(0);
+    for (const auto& [name, user] : home.getAllUsers()) budget.setUser(name, 3000);
+    budget.apply();
+    for (auto& devicesOf : byUser)
+        for (Device* d : devicesOf)
+            if (PowerBudget::priority(d) <= 1) d->turnOn();
+    vector<Device*> later;
+    for (auto& devicesOf : byUser)
+        for (Device* d : devicesOf)
+            if (PowerBudget::priority(d) >= 2) later.push_back(d);
+    uint64_t shedBefore = budget.shed.load();
+    size_t laterAdmitted = 0;
+    perOp("admit with shedding:", later.size(), [&] {
+        for (Device* d : later) laterAdmitted += d->turnOn();
+    });
+    cout << "  " << laterAdmitted << "/" << later.size() << " thermostats, cameras and locks admitted, "
+         << budget.shed.load() - shedBefore << " lower-priority loads shed\n";
+    Device::attachBudget(nullptr);
+    return consistent && sink >= 0 ? 0 : 1;
+}
 
-    bool turnDeviceOff(string roomName, string deviceName) {
-        Room* room = user->getRoom(roomName);
-        if (room) {
-            Device* device = room->getDevicesByName(deviceName);
-            if (device) {
-                device->turnOff();
-                cout << "Turned OFF device: " << deviceName << " in " << roomName << endl;
-                return true;
+// Three months of transitions for a fleet of devices: ingest, reopening
+// (index only), range/duration/last queries against decoding a device's
+// whole history, then compaction under the default retention policy.
+int benchHistory(int devices) {
+    const char* file = "bench_history.history";
+    remove(file);
+    const int64_t ns = 1000000000, step = 1800 * ns;
+    int64_t now = time(0) * ns, start = now - 90 * 86400 * ns;
+    auto deviceID = [](int d) { return "H" + to_string(d); };
+    size_t written = 0;
+    auto begun = chrono::steady_clock::now();
+    {
+        TransitionLog log(file);
+        DeviceEvent batch[64];
+        size_t n = 0;
+        for (int64_t k = 0; start + k * step < now; k++) {
+            for (int d = 0; d < devices; d++) {
+                DeviceEvent& ev = batch[n++];
+                ev = DeviceEvent{};
+                bool on = (k + d) % 2 == 0;
+                switch (d % 3) {
+                    case 0: ev.type = k % 5 == 0 ? DeviceEventType::BrightnessChanged
+                                                 : on ? DeviceEventType::TurnedOn : DeviceEventType::TurnedOff;
+                            ev.value = k % 5 == 0 ? float(k % 100) : 0.1f; break;
+                    case 1: ev.type = on ? DeviceEventType::DoorUnlocked : DeviceEventType::DoorLocked; break;
+                    default: ev.type = on ? DeviceEventType::TurnedOn : DeviceEventType::TurnedOff; ev.value = 1.5f;
+                }
+                ev.atNs = start + k * step + (d * 7919 % 1800) * ns;
+                ev.at = ev.atNs / ns;
+                copyField(ev.deviceID, deviceID(d));
+                if (n == 64) {
+                    log.onEvents(batch, n);
+                    written += n;
+                    n = 0;
+                }
             }
         }
-        cout << "Failed to turn OFF device. Room or device not found." << endl;
-        return false;
+        log.onEvents(batch, n);
+        written += n;
+    }
+    double ingestMs = chrono::duration<double, milli>(chrono::steady_clock::now() - begun).count();
+
+    begun = chrono::steady_clock::now();
+    TransitionLog log(file);
+    double openMs = chrono::duration<double, milli>(chrono::steady_clock::now() - begun).count();
+    uint64_t bytes = log.bytes();
+    cout << "history: " << devices << " devices, " << written << " events over 90 days\n" << fixed << setprecision(2)
+         << "  ingest:            " << written / ingestMs * 1000 / 1e6 << " M events/s\n"
+         << "  on disk:           " << bytes / 1048576.0 << " MB, " << double(bytes) / written << " bytes/event, "
+         << log.blockCount() << " blocks\n"
+         << "  reopen (index):    " << openMs << " ms\n";
+
+    const int queries = 2000;
+    int64_t day = 86400 * ns;
+    size_t found = 0;
+    auto timeQueries = [&](auto query) {
+        auto t0 = chrono::steady_clock::now();
+        for (int q = 0; q < queries; q++) query(deviceID(q * 7 % devices), now - (q % 80 + 1) * day);
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count() / queries;
+    };
+    double rangeUs = timeQueries([&](const string& id, int64_t from) { found += log.range(id, from, from + day).size(); });
+    double durationUs = timeQueries([&](const string& id, int64_t from) {
+        found += log.timeIn(id, TransitionLog::On, from, from + day) > 0;
+    });
+    double lastUs = timeQueries([&](const string& id, int64_t from) {
+        TransitionLog::Transition t;
+        found += log.last(id, DeviceEventType::DoorUnlocked, from, t);
+    });
+    double fullUs = timeQueries([&](const string& id, int64_t from) {
+        for (const auto& t : log.range(id, 0, INT64_MAX)) found += t.at >= from && t.at < from + day;
+    });
+    cout << "  1-day range:       " << rangeUs << " us\n"
+         << "  1-day on-time:     " << durationUs << " us\n"
+         << "  last unlock:       " << lastUs << " us\n"
+         << "  full decode scan:  " << fullUs << " us (" << found % 10 << ")\n";
+
+    // On-time recomputed from the raw transitions must agree.
+    string probe = deviceID(2);
+    int64_t from = now - 3 * day, to = now - 2 * day, expected = 0, onAt = -1;
+    for (const auto& t : log.range(probe, 0, to)) {
+        if (t.kind == DeviceEventType::TurnedOn && onAt < 0) onAt = t.at;
+        if (t.kind == DeviceEventType::TurnedOff && onAt >= 0) {
+            expected += max<int64_t>(0, t.at - max(onAt, from));
+            onAt = -1;
+        }
     }
+    if (onAt >= 0) expected += to - max(onAt, from);
+    int64_t measured = log.timeIn(probe, TransitionLog::On, from, to);
+    int64_t recent = log.timeIn(probe, TransitionLog::On, now - day, now);
+
+    HistoryPolicy policy;
+    policy.retainSec = 60 * 86400;
+    log.setPolicy(policy);
+    begun = chrono::steady_clock::now();
+    log.compact(now / ns);
+    double compactMs = chrono::duration<double, milli>(chrono::steady_clock::now() - begun).count();
+    int64_t recentAfter = log.timeIn(probe, TransitionLog::On, now - day, now);
+    cout << "  compact (60 d retention, 1-min steps after 7 d): " << compactMs << " ms, "
+         << bytes / 1048576.0 << " -> " << log.bytes() / 1048576.0 << " MB, " << log.blockCount() << " blocks\n";
+    policy.maxBytes = log.bytes() / 2;
+    log.setPolicy(policy);
+    log.compact(now / ns);
+    cout << "  with a cap of half that: " << log.bytes() / 1048576.0 << " MB\n";
+    bool ok = measured == expected && recent == recentAfter;
+    cout << "  on-time check:     " << (ok ? "ok" : "MISMATCH") << " (" << measured / ns << " s vs " << expected / ns
+         << " s; last day " << recent / ns << " s vs " << recentAfter / ns << " s after compaction)\n";
+    remove(file);
+    return ok ? 0 : 2;
+}
 
-    bool performDeviceAction(string roomName, string deviceName) {
-        Room* room = user->getRoom(roomName);
-        if (room) {
-            Device* device = room->getDevicesByName(deviceName);
-            if (device) {
-                device->performAction();
-                return true;
+// A forked reader polls every device record while this process rewrites
+// them as fast as it can; reports read throughput and checks that no read
+// saw a half-written record.
+int benchSegment(int devices) {
+    SmartHome home;
+    populateSyntheticHome(home, max(1, devices / 50), 5, 10);
+    string name = "/smarthome-bench-" + to_string(getpid());
+    HomeSegment segment(name);
+    auto started = chrono::steady_clock::now();
+    segment.rebuild(home);
+    double rebuildMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    int fds[2];
+    if (pipe(fds) != 0) return 1;
+    pid_t child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        uint64_t result[3] = {0, 0, 0};  // reads, torn reads, passes
+        HomeSegmentReader reader(name);
+        auto until = chrono::steady_clock::now() + chrono::seconds(1);
+        while (chrono::steady_clock::now() < until) {
+            for (uint32_t d = 0; d < reader.deviceCount(); d++) {
+                DeviceState s = reader.read(d);
+                // The writer keeps current == -setting in every record it touches.
+                if (s.setting >= 1e6f && s.current != -s.setting) result[1]++;
             }
+            result[0] += reader.deviceCount();
+            result[2]++;
         }
-        cout << "Failed to perform action. Room or device not found." << endl;
-        return false;
+        if (write(fds[1], result, sizeof(result)) != sizeof(result)) _exit(1);
+        _exit(0);
     }
-
-    void listAllDevices() {
-        map<string, Room*> rooms = user->getAllRooms();
-        for (auto& pair : rooms) {
-            cout << "Room: " << pair.first << endl;
-            pair.second->displayDevices();
+    close(fds[1]);
+
+    vector<string> ids;
+    for (const auto& [username, user] : home.getAllUsers())
+        for (const auto& [roomName, room] : user->getAllRooms())
+            for (Device* d : room->getDevices()) ids.push_back(d->getDeviceID());
+    DeviceEvent batch[64];
+    uint64_t writes = 0;
+    started = chrono::steady_clock::now();
+    while (waitpid(child, nullptr, WNOHANG) == 0) {
+        for (size_t i = 0; i < 64; i++) {
+            DeviceEvent& ev = batch[i];
+            ev = DeviceEvent{};
+            ev.type = DeviceEventType::TargetTemperatureSet;
+            ev.value = 1e6f + float(writes % 1000);
+            ev.value2 = -ev.value;
+            copyField(ev.deviceID, ids[(writes * 7919) % ids.size()]);
+            writes++;
         }
+        segment.onEvents(batch, 64);
     }
-
-    ~RemoteControl() {
-        cout << "RemoteControl disconnected.\n";
+    double writeSec = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    uint64_t result[3] = {0, 0, 0};
+    bool got = read(fds[0], result, sizeof(result)) == sizeof(result);
+    close(fds[0]);
+
+    // Users added after the first rebuild move the device table over old
+    // strings; every record must still read as settled.
+    uint32_t unsettled = 0, grownDevices = 0;
+    {
+        SmartHome grown;
+        int serial = 0;
+        for (int u = 0; u < 6; u++) {
+            User* user = syntheticUser(u, 3, 3, serial);
+            grown.addUser(user->getUsername(), user);
+            if (u == 0) segment.rebuild(grown);
+        }
+        segment.rebuild(grown);
+        HomeSegmentReader reader(name);
+        grownDevices = reader.deviceCount();
+        for (uint32_t d = 0; d < reader.deviceCount(); d++) {
+            if (reader.device(d).seq.load(memory_order_relaxed) & 1) unsettled++;
+            else reader.read(d);
+        }
     }
-};
-
-class DataStorage {
-private:
-    string filename;
+    cout << "segment: " << ids.size() << " devices, tables rebuilt in " << fixed << setprecision(2) << rebuildMs
+         << " ms\n"
+         << "  reader:  " << result[0] / 1000.0 / 1000.0 << "k device states/ms, full pass "
+         << (result[2] ? 1000.0 / result[2] : 0.0) << " ms\n"
+         << "  writer:  " << writes / writeSec / 1e6 << " M updates/s alongside\n"
+         << "  torn reads: " << result[1] << "\n"
+         << "  grown layout: " << unsettled << " of " << grownDevices << " records left mid-write\n";
+    return got && result[1] == 0 && unsettled == 0 ? 0 : 2;
+}
 
-public:
-    DataStorage(const string& fname) : filename(fname) {}
+// A manifest of new devices against a home of 200k: validation on one
+// thread and on all, ID checks with and without the Bloom filter in front,
+// the batch commit and its single save, then planted duplicates.
+int benchProvision(int devices) {
+    DeviceIndex index;
+    Device::attachIndex(&index);
+    int failures = 0;
+    {
+        SmartHome home;
+        populateSyntheticHome(home, 4000, 5, 10);
+        static const char* types[] = {"Light", "Thermostat", "Camera", "DoorLock", "AC"};
+        auto manifest = [&](auto idFor) {
+            string text;
+            for (int i = 0; i < devices; i++) {
+                text += "user" + to_string(i % 4000) + " Wing" + to_string(i % 7) + " " + idFor(i) + " dev" +
+                        to_string(i) + " " + types[i % 5];
+                text += i % 5 == 0 ? " 40\n" : i % 5 == 1 || i % 5 == 4 ? " 21\n" : "\n";
+            }
+            return text;
+        };
+        BulkProvisioner provisioner(home, index);
+        provisioner.parse(manifest([](int i) { return "P" + to_string(i); }));
+        auto timed = [](auto f) {
+            auto start = chrono::steady_clock::now();
+            f();
+            return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        };
+        unsigned cores = max(1u, thread::hardware_concurrency());
+        double oneMs = timed([&] { provisioner.validate(1); });
+        double allMs = timed([&] { provisioner.validate(cores); });
+
+        vector<string> ids;
+        for (int i = 0; i < devices; i++) ids.push_back("P" + to_string(i));
+        size_t hits = 0;
+        double lookupMs = timed([&] {
+            for (const string& id : ids) hits += index.findByID(id) != nullptr;
+        });
+        double filteredMs = timed([&] {
+            for (const string& id : ids) hits += index.mayContainID(BloomFilter::hash(id)) && index.findByID(id);
+        });
+        size_t falsePositives = 0;
+        for (const string& id : ids) falsePositives += index.mayContainID(BloomFilter::hash(id));
+
+        const char* file = "bench_provision.txt";
+        size_t rooms = 0;
+        double commitMs = timed([&] { rooms = provisioner.commit(); });
+        double saveMs = timed([&] { DataStorage(file).saveSystem(&home); });
+        cout << "provision: " << devices << " devices into a home of " << index.size() - devices << "\n" << fixed
+             << setprecision(1)
+             << "  validate, 1 thread:        " << oneMs << " ms\n"
+             << "  " << left << setw(27) << "validate, " + to_string(cores) + " threads:" << right << allMs << " ms\n"
+             << setprecision(2)
+             << "  ID checks, map lookups:    " << lookupMs * 1e6 / devices << " ns/ID\n"
+             << "  ID checks, Bloom in front: " << filteredMs * 1e6 / devices << " ns/ID ("
+             << 100.0 * falsePositives / devices << "% false positives)\n" << setprecision(1)
+             << "  commit:                    " << commitMs << " ms (" << rooms << " rooms created)\n"
+             << "  one save:                  " << saveMs << " ms (a save per device would be ~"
+             << saveMs * devices / 1000 << " s)\n";
+        remove(file);
+
+        // Every 100th ID already exists, and every 100th repeats the line before.
+        size_t planted = 0;
+        BulkProvisioner duplicates(home, index);
+        duplicates.parse(manifest([&](int i) {
+            if (i % 100 == 0) return planted++, "P" + to_string(i);
+            if (i % 100 == 2) return planted++, "Q" + to_string(i - 1);
+            return "Q" + to_string(i);
+        }));
+        size_t found = duplicates.validate(cores);
+        cout << "  planted duplicates:        " << found << " of " << planted << " found\n";
+        failures = found != planted;
+    }
+    Device::attachIndex(nullptr);
+    return failures ? 2 : 0;
+}
 
-    void saveSystem(SmartHome* smartHome) {
-        ofstream out(filename, ios::trunc);
-        if (!out.is_open()) {
-            throw DeviceException("Cannot open file for writing: " + filename);
+// Generates a text data file (default 200000 devices) and reads it with the
+// stream reader and with the mapped reader, checking both give the same
+// records and that parse errors point at the right column.
+int benchParse(int devices) {
+    const char* dataFile = "bench_parse.txt";
+    const char* types[] = {"Light", "Thermostat", "SecurityCamera", "DoorLock", "SmartPlug"};
+    {
+        ofstream out(dataFile, ios::trunc);
+        for (int d = 0; d < devices; d++) {
+            if (d % 500 == 0) out << "USER user" << d / 500 << " secret" << d << "\n";
+            if (d % 10 == 0) out << "ROOM Room" << d / 10 % 50 << "\n";
+            const char* type = types[d % 5];
+            out << "DEVICE " << type << " dev" << d << " " << type << "_" << d << " Room" << d / 10 % 50 << " " << d % 2 << " "
+                << 5 + d % 40 << "." << d % 10;
+            if (d % 5 == 2) out << " Mon Oct 19 08:" << d % 60 / 10 << d % 10 << ":00 2026";
+            else if (d % 5 == 1) out << " 21.5";
+            out << (d % 7 == 0 ? " \r\n" : "\n");
         }
+    }
 
-        for (const auto& [username, user] : smartHome->getAllUsers()) {
-            out << "USER " << username << " " << user->getPassword() << "\n";
+    // Folds every record into a hash so the two readers can be compared.
+    auto digest = [](uint64_t& h, const DataRecord& rec) {
+        auto mix = [&h](string_view bytes) {
+            for (char c : bytes) h = (h ^ (unsigned char)c) * 1099511628211ULL;
+            h = (h ^ 0xff) * 1099511628211ULL;
+        };
+        h = (h ^ (uint64_t(rec.kind) << 32 | rec.line)) * 1099511628211ULL;
+        for (size_t i = 0; i < rec.fieldCount; i++) mix(rec.fields[i]);
+    };
+    // Each reader hands every record to visit; timed runs only sum field
+    // lengths, so the clock measures the reader rather than the digest.
+    auto streamed = [&](auto visit) {
+        ifstream in(dataFile, ios::binary);
+        RecordReader reader(in);
+        DataRecord rec;
+        while (reader.next(rec)) visit(rec);
+    };
+    auto mapped = [&](auto visit) {
+        MappedTextReader reader(dataFile);
+        DataRecord rec;
+        while (reader.next(rec)) visit(rec);
+    };
+    auto timed = [&](auto read) {
+        size_t records = 0, bytes = 0;
+        auto start = chrono::steady_clock::now();
+        read([&](const DataRecord& rec) {
+            records++;
+            for (size_t i = 0; i < rec.fieldCount; i++) bytes += rec.fields[i].size();
+        });
+        return make_pair(records, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    };
+    auto hashed = [&](auto read) {
+        uint64_t h = 1469598103934665603ULL;
+        read([&](const DataRecord& rec) { digest(h, rec); });
+        return h;
+    };
+    timed(mapped);  // warm the page cache
+    auto [streamRecords, streamMs] = timed(streamed);
+    auto [mappedRecords, mappedMs] = timed(mapped);
+    double mb = MappedTextReader(dataFile).bytes() / 1048576.0;
+
+    cout << "parse: " << devices << " devices, " << fixed << setprecision(1) << mb << " MB\n";
+    auto report = [&](const char* what, size_t records, double ms) {
+        cout << "  " << left << setw(10) << what << right << setw(10) << records << " records " << setw(8) << ms << " ms "
+             << setw(8) << mb / (ms / 1000) << " MB/s\n";
+    };
+    report("stream", streamRecords, streamMs);
+    report("mapped", mappedRecords, mappedMs);
+    cout << "  speedup:           " << setprecision(2) << streamMs / mappedMs << "x\n";
+
+    // Error positions, from 1: where the bad keyword starts, the end of a
+    // short line, and the field the validator rejects.
+    DataRecord rec;
+    string unknown = "  DEVCE Light dev1 Lamp Hall 1";
+    RecordReader::parseLine(unknown, unknown.data() + unknown.size(), rec);
+    bool unknownAt = rec.kind == RecordKind::Invalid && rec.column == 3;
+    string shortLine = "DEVICE Light dev1 Lamp  \r";
+    RecordReader::parseLine(shortLine, shortLine.data() + shortLine.size(), rec);
+    bool shortAt = rec.kind == RecordKind::Invalid && rec.column == 23;
+    string badStatus = "DEVICE Light dev1 Lamp Hall\t2 10";
+    RecordReader::parseLine(badStatus, badStatus.data() + badStatus.size(), rec);
+    bool statusAt = rec.kind == RecordKind::Device && rec.columnOf(4) == 29 && rec.fields[4] == "2";
+
+    bool same = hashed(streamed) == hashed(mapped) && streamRecords == mappedRecords;
+    cout << "  same records:      " << (same ? "yes" : "NO") << "\n"
+         << "  error columns:     " << (unknownAt && shortAt && statusAt ? "ok" : "WRONG") << "\n";
+    remove(dataFile);
+    return same && unknownAt && shortAt && statusAt ? 0 : 2;
+}
 
-            for (const auto& [roomName, room] : user->getAllRooms()) {
-                out << "ROOM " << roomName << "\n";
-                
-                for (Device* device : room->getDevices()) {
-                    out << "DEVICE " << device->getDeciceType() << " "
-                        << device->getDeviceID() << " "
-                        << device->getDeviceName() << " "
-                        << device->getLocation() << " "
-                        << device->getStatus() << " "
-                        << device->powerConsumption << " ";
-                    
-                    if (auto light = dynamic_cast<Light*>(device)) {
-                        out << light->getBrightness();
-                    } 
-                    else if (auto thermo = dynamic_cast<Thermostat*>(device)) {
-                        out << thermo->getCurrentTemperature();
-                    }
-                    else if (auto camera = dynamic_cast<Camera*>(device)) {
-                        out << (camera->getLastMotionTime().empty() ? "NoMotion" : camera->getLastMotionTime());
-                    }
-                    else if (auto doorLock = dynamic_cast<DoorLock*>(device)) {
-                        out << doorLock->checkLockStatus();
-                    }
-                    else if (auto ac = dynamic_cast<AirConditioner*>(device)) {
-                        out << ac->getCurrentTemperature();
-                    }
-                    out << "\n";
+// Locks doors of a generated home (default 50000 devices) every few
+// milliseconds while one thread saves the whole home over and over and
+// another switches lights in batches: first with everything taking the home
+// lock in arrival order, then through a CommandQueue. Reports lock command
+// latency for both, and checks the queue's ordering and preemption.
+int benchPriority(int devices) {
+    const char* dataFile = "bench_priority.txt";
+    SmartHome home;
+    populateSyntheticHome(home, max(1, devices / 50), 5, 10);
+    vector<DoorLock*> locks;
+    vector<Light*> lights;
+    for (const auto& [username, user] : home.getAllUsers())
+        for (const auto& [roomName, room] : user->getAllRooms())
+            for (Device* d : room->getDevices()) {
+                if (auto lock = dynamic_cast<DoorLock*>(d)) locks.push_back(lock);
+                else if (auto light = dynamic_cast<Light*>(d)) lights.push_back(light);
+            }
+    DataStorage storage(dataFile);
+    mutex homeLock;
+    const int lockCommands = 400;
+
+    struct Run {
+        LatencyHistogram security;
+        uint64_t saves = 0, batches = 0;
+    };
+    auto measure = [&](CommandQueue* queue) {
+        Run result;
+        atomic<bool> stop{false};
+        atomic<uint64_t> saves{0}, batches{0};
+        thread saver([&] {
+            while (!stop.load()) {
+                if (queue) {
+                    CommandQueue::Hold hold(*queue, CommandClass::Bulk);
+                    storage.saveSystem(&home);
+                } else {
+                    lock_guard<mutex> guard(homeLock);
+                    storage.saveSystem(&home);
+                }
+                saves++;
+            }
+        });
+        thread switcher([&] {
+            for (size_t next = 0; !stop.load(); next += 200) {
+                auto batch = [&] {
+                    for (size_t i = 0; i < 200; i++) lights[(next + i) % lights.size()]->setBrightness(float(next % 100));
+                };
+                if (queue) queue->call(CommandClass::Lighting, batch);
+                else {
+                    lock_guard<mutex> guard(homeLock);
+                    batch();
                 }
+                batches++;
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+        });
+        for (int i = 0; i < lockCommands; i++) {
+            this_thread::sleep_for(chrono::milliseconds(5));
+            DoorLock* lock = locks[i % locks.size()];
+            auto toggle = [&] { i % 2 ? lock->unlockDoor() : lock->lockDoor(); };
+            auto start = chrono::steady_clock::now();
+            if (queue) queue->call(CommandClass::Security, toggle);
+            else {
+                lock_guard<mutex> guard(homeLock);
+                toggle();
             }
+            result.security.add(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
         }
-        out.close();
+        stop.store(true);
+        saver.join();
+        switcher.join();
+        result.saves = saves;
+        result.batches = batches;
+        return result;
+    };
+
+    auto saveStart = chrono::steady_clock::now();
+    storage.saveSystem(&home);
+    double saveMs = chrono::duration<double, milli>(chrono::steady_clock::now() - saveStart).count();
+    cout << "priority: " << home.getAllUsers().size() * 50 << " devices, a save takes " << fixed << setprecision(1)
+         << saveMs << " ms; " << lockCommands << " lock commands against saves and light batches\n";
+    auto report = [](const char* what, const Run& r) {
+        cout << "  " << left << setw(16) << what << right << "lock p50 " << setw(8) << r.security.quantile(0.5) / 1000
+             << " ms  p99 " << setw(8) << r.security.quantile(0.99) / 1000 << " ms  max " << setw(8)
+             << r.security.maxUs / 1000 << " ms  " << r.saves << " saves, " << r.batches << " light batches\n";
+    };
+    Run fifo = measure(nullptr);
+    report("arrival order", fifo);
+    CommandQueue queue(homeLock);
+    Run prioritized = measure(&queue);
+    report("priority queue", prioritized);
+    queue.report(cout);
+
+    // Ordering: with the lock held, queue a mix; once it is free, the most
+    // urgent class runs first and each class in arrival order.
+    string order;
+    auto mark = [&order](const char* tag) { return [&order, tag] { order += tag; }; };
+    {
+        CommandQueue::Hold hold(queue, CommandClass::Bulk);
+        queue.post(CommandClass::Lighting, mark("L1 "));
+        queue.post(CommandClass::Bulk, mark("B1 "));
+        queue.post(CommandClass::Security, mark("S1 "));
+        queue.post(CommandClass::Climate, mark("C1 "));
+        queue.post(CommandClass::Lighting, mark("L2 "));
+        queue.post(CommandClass::Security, mark("S2 "));
+    }
+    queue.call(CommandClass::Bulk, [] {});
+    bool ordered = order == "S1 S2 C1 L1 L2 B1 ";
+
+    // Preemption: a point under bulk work runs everything more urgent; under
+    // lighting work only security and climate, leaving lighting for later.
+    order.clear();
+    string atPoint;
+    {
+        CommandQueue::Hold hold(queue, CommandClass::Bulk);
+        queue.post(CommandClass::Lighting, mark("L "));
+        queue.post(CommandClass::Security, mark("S "));
+        preemptionPoint();
+        atPoint = order;
+        queue.post(CommandClass::Lighting, [&] {
+            queue.post(CommandClass::Lighting, mark("l "));
+            queue.post(CommandClass::Climate, mark("c "));
+            preemptionPoint();
+            order += "| ";
+        });
     }
+    queue.call(CommandClass::Bulk, [] {});
+    bool preempts = atPoint == "S L " && order == "S L c | l ";
 
-    void loadSystem(SmartHome* smartHome) {
-        ifstream in(filename);
-        if (!in.is_open()) {
-            return; 
+    bool propagated = false;
+    try {
+        queue.call(CommandClass::Security, [] { throw DeviceException("refused"); });
+    } catch (const DeviceException&) {
+        propagated = true;
+    }
 
-        User* currentUser = nullptr;
-        Room* currentRoom = nullptr;
-        string line;
+    // A save interrupted by lock commands still writes every device.
+    {
+        CommandQueue::Hold hold(queue, CommandClass::Bulk);
+        for (size_t i = 0; i < 100; i++) queue.post(CommandClass::Security, [&locks, i] { locks[i % locks.size()]->lockDoor(); });
+        storage.saveSystem(&home);
+    }
+    vector<Device*> saved = storage.loadDevices();
+    bool complete = saved.size() == home.getAllUsers().size() * 50;
+    for (Device* d : saved) delete d;
+
+    bool faster = prioritized.security.quantile(0.99) < fifo.security.quantile(0.99);
+    cout << "  lock p99 improved:     " << (faster ? "yes" : "NO") << "\n"
+         << "  class order:           " << (ordered ? "ok" : "WRONG (" + order + ")") << "\n"
+         << "  preemption points:     " << (preempts ? "ok" : "WRONG") << "\n"
+         << "  errors reach caller:   " << (propagated ? "yes" : "NO") << "\n"
+         << "  preempted save intact: " << (complete ? "yes" : "NO") << "\n";
+    remove(dataFile);
+    return faster && ordered && preempts && propagated && complete ? 0 : 2;
+}
 
-        while (getline(in, line)) {
-            stringstream ss(line);
-            string type;
-            ss >> type;
-
-            if (type == "USER") {
-                string username, password;
-                ss >> username >> password;
-                currentUser = new User(username, password);
-                smartHome->addUser(username, currentUser);
-            }
-            else if (type == "ROOM") {
-                string roomName;
-                ss >> roomName;
-                if (currentUser) {
-                    currentRoom = new Room(roomName);
-                    currentUser->addRoom(currentRoom);
-                }
-            }
-            else if (type == "DEVICE") {
-                string devType, id, name, loc;
-                bool status;
-                float power;
-                ss >> devType >> id >> name >> loc >> status >> power;
-
-                Device* device = nullptr;
-                if (devType == "Light") {
-                    float brightness;
-                    ss >> brightness;
-                    device = new Light(id, name, loc);
-                    dynamic_cast<Light*>(device)->setBrightness(brightness);
-                }
-                else if (devType == "Thermostat") {
-                    float temp;
-                    ss >> temp;
-                    device = new Thermostat(id, name, loc);
-                    dynamic_cast<Thermostat*>(device)->setTemperature(temp);
-                }
-
-                if (device) {
-                    device->powerConsumption = power;
-                    if (status) device->turnOn();
-                    else device->turnOff();
-
-                    if (currentRoom) {
-                        currentRoom->addDevice(device);
-                    }
-                }
+// Exports a generated fleet (default 20000 devices, a month of hourly
+// usage and a week of on/off history each) and compares the usage export
+// with writing its rows as CSV text.
+int benchExport(int devices) {
+    const char* historyFile = "bench_export.history";
+    const char* outFile = "bench_export.arrows";
+    remove(historyFile);
+    SmartHome home;
+    populateSyntheticHome(home, max(1, devices / 50), 5, 10);
+    vector<string> ids;
+    for (const auto& [username, user] : home.getAllUsers())
+        for (const auto& [roomName, room] : user->getAllRooms())
+            for (Device* d : room->getDevices()) ids.push_back(d->getDeviceID());
+
+    UsageLedger ledger;
+    for (size_t d = 0; d < ids.size(); d++)
+        for (uint32_t i = 0; i < ledger.intervalCount(); i++)
+            ledger.add(ids[d], ledger.start() + int64_t(i) * UsageLedger::IntervalSec, float((d + i) % 17) * 0.01f);
+    const int64_t ns = 1000000000;
+    int64_t now = time(0) * ns;
+    {
+        TransitionLog log(historyFile);
+        DeviceEvent ev{};
+        for (size_t d = 0; d < ids.size(); d++) {
+            copyField(ev.deviceID, ids[d]);
+            for (int h = 0; h < 7 * 24; h++) {
+                ev.type = h % 2 ? DeviceEventType::TurnedOff : DeviceEventType::TurnedOn;
+                ev.value = 0.5f;
+                ev.atNs = now - (7 * 24 - h) * 3600 * ns;
+                ev.at = ev.atNs / ns;
+                log.onEvents(&ev, 1);
             }
         }
-        in.close();
     }
+
+    auto timed = [&](auto exportTo) {
+        int fd = ::open(outFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        auto start = chrono::steady_clock::now();
+        uint64_t rows = exportTo(fd);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        close(fd);
+        struct stat st;
+        stat(outFile, &st);
+        return make_tuple(rows, ms, double(st.st_size));
+    };
+    cout << "export: " << ids.size() << " devices\n" << fixed << setprecision(1);
+    auto report = [](const char* what, tuple<uint64_t, double, double> r) {
+        auto [rows, ms, bytes] = r;
+        cout << "  " << left << setw(10) << what << right << setw(10) << rows << " rows " << setw(8) << ms << " ms "
+             << setw(8) << bytes / 1048576 / (ms / 1000) << " MB/s, " << rows / ms / 1000 << " M rows/s\n";
+    };
+    report("devices", timed([&](int fd) { return exportDevices(fd, home, &ledger, 65536); }));
+    {
+        TransitionLog log(historyFile);
+        report("history", timed([&](int fd) { return exportHistory(fd, home, log, INT64_MIN, INT64_MAX, 65536); }));
+    }
+    auto usage = timed([&](int fd) { return exportUsage(fd, home, ledger, 65536); });
+    report("usage", usage);
+
+    // A tenth of the same usage rows as text, the way they'd be scraped today.
+    auto start = chrono::steady_clock::now();
+    {
+        ofstream csv(outFile, ios::trunc);
+        csv << fixed << setprecision(4) << "device_id,hour,kwh\n";
+        for (size_t d = 0; d < ids.size(); d += 10) {
+            const string& id = ids[d];
+            const float* series = ledger.find(id);
+            for (uint32_t i = 0; i < ledger.intervalCount(); i++)
+                csv << id << "," << ledger.start() + int64_t(i) * UsageLedger::IntervalSec << "," << series[i] << "\n";
+        }
+    }
+    double csvMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout << "  usage as CSV text:   " << csvMs << " ms for a tenth of the rows (~" << setprecision(0)
+         << csvMs * 10 / get<1>(usage) << "x the Arrow export)\n";
+    remove(outFile);
+    remove(historyFile);
+    return 0;
 }
-        
-    void saveUser(User* user) {
-        ofstream out(filename, ios::app);  
-        if (!out.is_open()) {
-            cerr << "Cannot open file to save user: " << filename << endl;
-            return;
+
+// Accounted bytes per device (per retained alert for notifications) with a
+// schedule and a month of usage on every device. Exits 2 when a subsystem
+// grows past its budget or anything is still accounted after teardown.
+int benchMemory(int devices) {
+    const size_t tags = size_t(MemoryTag::Count);
+    // Budgets leave room for allocator and standard library differences.
+    static const double budgets[] = {320, 32, 256, 4096, 160};
+    int64_t baseline[tags];
+    for (size_t i = 0; i < tags; i++) baseline[i] = memoryAccounts[i].live();
+    int failures = 0;
+    {
+        MemoryReport report;
+        SmartHome home;
+        Scheduler scheduler;
+        EnergyMonitor energy;
+        Notification notifications;
+        scheduler.setVerbose(false);
+        populateSyntheticHome(home, max(1, devices / 50), 5, 10);
+        size_t count = 0;
+        for (const auto& [username, user] : home.getAllUsers())
+            for (const auto& [roomName, room] : user->getAllRooms())
+                for (Device* d : room->getDevices()) {
+                    scheduler.addSchedule(d->getDeviceID(), Time(count % 24, count % 60));
+                    energy.addUsage(d->getDeviceID(), 0.5f);
+                    count++;
+                }
+        for (int i = 0; i < 5000; i++)
+            notifications.sendAlert("CAM" + to_string(i), AlertSeverity::Warning, "Motion detected by ",
+                                    "camera " + to_string(i) + " on the porch");
+        report.print(cout);
+
+        cout << "memory: " << count << " devices, " << notifications.size() << " alerts retained\n" << fixed
+             << setprecision(1);
+        for (size_t i = 0; i < tags; i++) {
+            size_t per = MemoryTag(i) == MemoryTag::Notifications ? notifications.size() : count;
+            double bytes = double(memoryAccounts[i].live() - baseline[i]) / max<size_t>(1, per);
+            bool over = bytes > budgets[i];
+            failures += over;
+            cout << "  " << left << setw(16) << memoryTagName(MemoryTag(i)) << right << setw(8) << bytes << " B each (budget "
+                 << budgets[i] << ")" << (over ? "  OVER BUDGET" : "") << "\n";
         }
+    }
+    for (size_t i = 0; i < tags; i++) {
+        int64_t left = memoryAccounts[i].live() - baseline[i];
+        if (left != 0) {
+            cout << "  " << memoryTagName(MemoryTag(i)) << ": " << left << " bytes still accounted after teardown\n";
+            failures++;
+        }
+    }
+    return failures ? 2 : 0;
+}
 
-        out << "USER " << user->getUsername() << " " << user->getPassword() << "\n";
+// A scene of `changes` devices in a 4000-device home, applied as separate
+// changes that each save the home (as the Control command does) and as one
+// transaction with one save. Then checks that a scene over a room budget,
+// or staged against a device that changed since, changes nothing, and that
+// switch-offs in a scene make room for its switch-ons.
+int benchMotion(int count) {
+    DeviceIndex index;
+    Device::attachIndex(&index);
+    SmartHome home;
+    populateSyntheticHome(home, (count + 3) / 4, 4, 5);
+    vector<Camera*> cams;
+    for (const auto& [name, user] : home.getAllUsers())
+        for (const auto& [roomName, room] : user->getAllRooms())
+            for (Device* d : room->getDevices())
+                if (auto c = dynamic_cast<Camera*>(d)) cams.push_back(c);
+    auto now = [] {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    };
+    auto total = [](MotionIngest& ingest, uint64_t MotionIngest::Stats::*field) {
+        uint64_t sum = 0;
+        for (const auto& s : ingest.stats()) sum += s.*field;
+        return sum;
+    };
+    auto settle = [&](MotionIngest& ingest, uint64_t expected) {
+        for (int i = 0; i < 2000 && total(ingest, &MotionIngest::Stats::events) < expected; i++)
+            this_thread::sleep_for(chrono::milliseconds(1));
+    };
+    // The median camera's p50 and the worst camera's p99.
+    auto latency = [](MotionIngest& ingest, double& p50, double& p99) {
+        vector<double> medians;
+        p99 = 0;
+        for (const auto& s : ingest.stats()) {
+            medians.push_back(s.p50Us);
+            p99 = max(p99, s.p99Us);
+        }
+        nth_element(medians.begin(), medians.begin() + medians.size() / 2, medians.end());
+        p50 = medians[medians.size() / 2];
+    };
+    MotionPolicy quiet;
+    quiet.startEvents = 1u << 30;  // never records; throughput only
+    cout << "motion: " << cams.size() << " cameras\n" << fixed << setprecision(1);
+
+    // Flat out from four producers, retrying when a camera's queue is full.
+    const uint64_t perCamera = 2000;
+    {
+        MotionIngest ingest(quiet);
+        ingest.rebuild(home);
+        ingest.start();
+        auto start = chrono::steady_clock::now();
+        vector<thread> producers;
+        for (int t = 0; t < 4; t++)
+            producers.emplace_back([&, t] {
+                for (uint64_t n = 0; n < perCamera; n++)
+                    for (uint32_t h = t; h < cams.size(); h += 4)
+                        while (!ingest.post(h, now())) this_thread::yield();
+            });
+        for (thread& p : producers) p.join();
+        uint64_t expected = perCamera * cams.size();
+        settle(ingest, expected);
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  flat out:  " << setprecision(0) << expected / sec << " events/s, "
+             << total(ingest, &MotionIngest::Stats::dropped) << " posts retried on a full queue\n";
+    }
 
-        auto& rooms = user->getAllRooms(); 
-        for (auto it = rooms.begin(); it != rooms.end(); ++it) {
-            const string& roomName = it->first;  
-            Room* room = it->second;
-            out << "ROOM " << roomName << "\n";
+    // Every camera at 200 reports/s for a second.
+    {
+        MotionIngest ingest(quiet);
+        ingest.rebuild(home);
+        ingest.start();
+        int64_t start = now();
+        for (int tick = 0; tick < 200; tick++) {
+            for (uint32_t h = 0; h < cams.size(); h++) ingest.post(h, now());
+            this_thread::sleep_until(chrono::system_clock::time_point(chrono::nanoseconds(start + (tick + 1) * 5000000)));
+        }
+        settle(ingest, 200 * cams.size());
+        double p50, p99;
+        latency(ingest, p50, p99);
+        cout << "  200/s per camera: latency p50 " << setprecision(1) << p50 << " us, worst p99 " << p99 << " us, "
+             << total(ingest, &MotionIngest::Stats::dropped) << " dropped\n";
+    }
 
-            for (Device* device : room->getDevices()) {
-                saveDevice(device);
+    // Batched datagrams through the socket, as a camera bridge sends them.
+    {
+        string path = "/tmp/smarthome-bench-motion-" + to_string(getpid());
+        MotionIngest ingest(quiet);
+        ingest.rebuild(home);
+        ingest.start();
+        ingest.listen(path);
+        int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path.c_str());
+        auto start = chrono::steady_clock::now();
+        string batch;
+        uint64_t sent = 0;
+        for (uint64_t n = 0; n < perCamera / 4; n++) {
+            for (Camera* c : cams) {
+                const string& id = c->getDeviceID();
+                int64_t at = now();
+                batch += char(id.size());
+                batch += id;
+                batch.append((const char*)&at, 8);
+                if (batch.size() > 4000) {
+                    sendto(fd, batch.data(), batch.size(), 0, (sockaddr*)&addr, sizeof(addr));
+                    batch.clear();
+                }
+                sent++;
             }
         }
-
-        out.close();
+        sendto(fd, batch.data(), batch.size(), 0, (sockaddr*)&addr, sizeof(addr));
+        close(fd);
+        settle(ingest, sent);
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  via socket: " << setprecision(0) << total(ingest, &MotionIngest::Stats::events) / sec
+             << " events/s, " << total(ingest, &MotionIngest::Stats::events) << " of " << sent << " taken\n";
     }
 
-    vector<User*> loadUsers() {
-        ifstream in(filename);
-        vector<User*> users;
+    // Recording follows motion: a burst starts it, a lone report doesn't,
+    // steady motion keeps one recording going, and one started by hand is
+    // left alone.
+    MotionPolicy policy;
+    policy.startEvents = 3;
+    policy.windowMs = 150;
+    policy.holdMs = 200;
+    MotionIngest ingest(policy);
+    mutex devices;
+    ingest.setDeviceLock(&devices);
+    ingest.rebuild(home);
+    ingest.start();
+    Camera *burst = cams[0], *lone = cams[1], *steady = cams[2], *manual = cams[3];
+    manual->startRecording();
+    for (int i = 0; i < 3; i++) {
+        ingest.post(0, now());
+        ingest.post(3, now());
+    }
+    ingest.post(1, now());
+    bool steadyOn = true;
+    for (int i = 0; i < 12; i++) {
+        ingest.post(2, now());
+        this_thread::sleep_for(chrono::milliseconds(50));
+        if (i >= 3) {
+            lock_guard<mutex> guard(devices);
+            steadyOn &= steady->recording();
+        }
+    }
+    bool burstStopped, steadyStillOn;
+    {
+        lock_guard<mutex> guard(devices);
+        burstStopped = !burst->recording();
+        steadyStillOn = steady->recording();
+    }
+    this_thread::sleep_for(chrono::milliseconds(400));
+    vector<MotionIngest::Stats> stats = ingest.stats();
+    lock_guard<mutex> guard(devices);
+    bool ok = stats[0].recordings == 1 && burstStopped && stats[1].recordings == 0 && !lone->recording() &&
+              steadyOn && steadyStillOn && stats[2].recordings == 1 && !steady->recording() &&
+              stats[3].recordings == 0 && manual->recording();
+    cout << "  burst: " << stats[0].recordings << " recording, " << (burstStopped ? "stopped" : "still on")
+         << " after the hold; lone report: " << stats[1].recordings << " recordings\n"
+         << "  steady motion: " << stats[2].recordings << " recording, " << (steadyOn ? "on throughout" : "gaps")
+         << ", " << (steady->recording() ? "still on" : "stopped") << " after it ends\n"
+         << "  started by hand: " << (manual->recording() ? "left running" : "stopped") << "\n";
+    Device::attachIndex(nullptr);
+    return ok ? 0 : 2;
+}
 
-        if (!in.is_open() || in.peek() == ifstream::traits_type::eof()) {
-            return users; 
-        }
-
-        string type;
-        User* currentUser = nullptr;
-        Room* currentRoom = nullptr;
-
-        while (in >> type) {
-            if (type == "USER") {
-                string username, password;
-                in >> username >> password;
-                currentUser = new User(username, password);
-                users.push_back(currentUser);
-            } else if (type == "ROOM") {
-                string roomName;
-                in >> roomName;
-                currentRoom = new Room(roomName);
-                if (currentUser) {
-                    currentUser->addRoom(currentRoom);
-                }
-            } else if (type == "DEVICE") {
-                string devType, id, name, loc;
-                int status;
-                in >> devType >> id >> name >> loc >> status;
-
-                Device* dev = nullptr;
-                if (devType == "Light") dev = new Light(id, name, loc);
-                else if (devType == "Thermostat") dev = new Thermostat(id, name, loc);
-                else if (devType == "Camera") dev = new Camera(id, name, loc);
-                else if (devType == "DoorLock") dev = new DoorLock(id, name, loc);
-                else if (devType == "AC") dev = new AirConditioner(id, name, loc);
-
-                if (dev) {
-                    if (status) dev->turnOn();
-                    else dev->turnOff();
-
-                    if (currentRoom) {
-                        currentRoom->addDevice(dev);
+int benchShards(int households) {
+    const int clients = 4, perClient = 125000, batch = 128;
+    // Every client drives its own households, so each household sees the
+    // same sequence of requests whatever the sharding.
+    struct Request {
+        const string* user;
+        const string* room;
+        const string* device;
+        bool on;
+    };
+    vector<string> users, rooms, devices;
+    for (int u = 0; u < households; u++) users.push_back("user" + to_string(u));
+    static const char* roomNames[] = {"Kitchen", "Bedroom", "Hall", "Garage", "Office", "Porch"};
+    for (int r = 0; r < 4; r++) rooms.push_back(string(roomNames[r % 6]) + to_string(r));
+    for (string prefix : {"light", "thermo", "cam", "door", "ac"}) devices.push_back(prefix + to_string(devices.size()));
+    auto requestsFor = [&](int client) {
+        vector<Request> out;
+        uint64_t seed = 42 + client;
+        auto next = [&seed] {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            return seed >> 33;
+        };
+        for (int i = 0; i < perClient; i++) {
+            int u = int(next() % (households / clients)) * clients + client;
+            out.push_back(Request{&users[u], &rooms[next() % 4], &devices[next() % 5], bool(next() & 1)});
+        }
+        return out;
+    };
+    vector<vector<Request>> work;
+    for (int c = 0; c < clients; c++) work.push_back(requestsFor(c));
+    auto apply = [](SmartHome& home, EnergyMonitor& energy, const Request& r) {
+        Room* room = home.getUser(*r.user)->getRoom(*r.room);
+        Device* d = room->getDevicesByName(*r.device);
+        if (r.on) d->turnOn();
+        else d->turnOff();
+        energy.addUsage(d->getDeviceID(), 0.001f);
+    };
+    auto seconds = [](auto start) { return chrono::duration<double>(chrono::steady_clock::now() - start).count(); };
+    double total = double(clients) * perClient;
+    cout << "shards: " << households << " households, " << total << " requests from " << clients << " clients, "
+         << thread::hardware_concurrency() << " cores\n" << fixed;
+
+    // One home behind one lock, as the controller runs it.
+    size_t expectedOn;
+    double lockedRate;
+    {
+        DeviceIndex index;
+        Device::attachIndex(&index);
+        {
+            SmartHome home;
+            EnergyMonitor energy;
+            int serial = 0;
+            for (int u = 0; u < households; u++) {
+                User* user = syntheticUser(u, 4, 5, serial);
+                home.addUser(user->getUsername(), user);
+            }
+            mutex lock;
+            auto start = chrono::steady_clock::now();
+            vector<thread> threads;
+            for (int c = 0; c < clients; c++)
+                threads.emplace_back([&, c] {
+                    for (const Request& r : work[c]) {
+                        lock_guard<mutex> guard(lock);
+                        apply(home, energy, r);
                     }
+                });
+            for (thread& t : threads) t.join();
+            lockedRate = total / seconds(start);
+            expectedOn = DeviceQuery(index).withStatus(true).count();
+        }
+        Device::attachIndex(nullptr);
+    }
+    cout << "  one home, one lock: " << setprecision(0) << lockedRate << " req/s\n";
+
+    bool same = true;
+    double oneShard = 0;
+    int most = max(4, int(thread::hardware_concurrency()));
+    for (int shards = 1; shards <= most; shards *= 2) {
+        ShardedHome sharded(shards);
+        int serial = 0;
+        for (int u = 0; u < households; u++) sharded.adopt(syntheticUser(u, 4, 5, serial));
+        sharded.totals();
+        auto start = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (int c = 0; c < clients; c++)
+            threads.emplace_back([&, c] {
+                vector<vector<Request>> pending(shards);
+                auto flush = [&](size_t s) {
+                    sharded.send(s, [requests = move(pending[s]), &apply](ShardedHome::Shard& shard) {
+                        for (const Request& r : requests) apply(shard.home, shard.energy, r);
+                    });
+                    pending[s].clear();
+                };
+                for (const Request& r : work[c]) {
+                    size_t s = sharded.shardOf(*r.user);
+                    pending[s].push_back(r);
+                    if (pending[s].size() == size_t(batch)) flush(s);
                 }
-            }
+                for (int s = 0; s < shards; s++)
+                    if (!pending[s].empty()) flush(s);
+            });
+        for (thread& t : threads) t.join();
+        ShardedHome::Totals totals = sharded.totals();  // also waits for the shards to finish
+        double rate = total / seconds(start);
+        if (shards == 1) oneShard = rate;
+        same &= totals.devicesOn == expectedOn && totals.users == size_t(households);
+        uint64_t busiest = 0, messages = 0;
+        for (uint64_t n : totals.handled) {
+            busiest = max(busiest, n);
+            messages += n;
         }
-
-        in.close();
-        return users;
+        cout << "  " << setw(2) << shards << " shards: " << setprecision(0) << setw(9) << rate << " req/s, "
+             << setprecision(2) << rate / oneShard << "x one shard, " << rate / lockedRate << "x one lock; busiest shard "
+             << setprecision(0) << 100.0 * busiest / messages
+             << "% of messages\n";
     }
+    cout << "  final device states " << (same ? "match" : "DIFFER") << " across every run\n";
+    return same ? 0 : 2;
+}
 
-    void saveDevice(Device* device) {
-        ofstream out(filename, ios::app);  
-        if (!out.is_open()) {
-            cerr << "Cannot open file to save device: " << filename << endl;
-            return;
+int benchSequences(int devices) {
+    DeviceIndex index;
+    Device::attachIndex(&index);
+    int ok;
+    {
+        SmartHome home;
+        populateSyntheticHome(home, max(1, devices / 12), 4, 5);
+        Scheduler scheduler;
+        scheduler.setVerbose(false);
+        vector<Light*> lights;
+        vector<TemperatureControlledDevices*> climate;
+        for (const auto& [name, user] : home.getAllUsers())
+            for (const auto& [roomName, room] : user->getAllRooms())
+                for (Device* d : room->getDevices()) {
+                    if (auto l = dynamic_cast<Light*>(d)) lights.push_back(l);
+                    else if (auto t = dynamic_cast<TemperatureControlledDevices*>(d)) climate.push_back(t);
+                }
+        const int64_t t0 = 1800000000;
+        MemoryAccount& memory = memoryAccount(MemoryTag::Scheduler);
+        int64_t before = memory.live();
+        auto start = chrono::steady_clock::now();
+        for (Light* l : lights) scheduler.startSequence(l->getDeviceID(), fadeLight(scheduler, l, 100, t0, t0 + 20 * 60), t0);
+        for (auto* t : climate) scheduler.startSequence(t->getDeviceID(), rampTemperature(scheduler, t, 18, t0, t0 + 3600), t0);
+        double startUs = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        size_t running = scheduler.sequenceCount();
+        double perSequence = double(memory.live() - before) / running;
+
+        // A tenth of the lights are set by hand and a tenth of the climate
+        // devices are told to stop, five minutes in.
+        size_t overridden = 0, stopped = 0;
+        start = chrono::steady_clock::now();
+        for (int64_t now = t0 + 1; now <= t0 + 3600; now++) {
+            if (now == t0 + 300) {
+                for (size_t i = 0; i < lights.size(); i += 10, overridden++) lights[i]->setBrightness(42);
+                for (size_t i = 0; i < climate.size(); i += 10, stopped++) scheduler.cancelSequence(climate[i]->getDeviceID());
+            }
+            scheduler.runDue(now);
         }
-
-        out << "DEVICE " << device->getDeciceType() << " "
-            << device->getDeviceID() << " "
-            << device->getDeviceName() << " "
-            << device->getStatus() << "\n";
-
-        out.close();
+        double runSec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        uint64_t steps = scheduler.sequenceResumes();
+
+        bool reached = true;
+        for (size_t i = 0; i < lights.size(); i++)
+            reached &= lights[i]->getBrightness() == (i % 10 == 0 ? 42.0f : 100.0f);
+        size_t midway = 0;
+        for (size_t i = 0; i < climate.size(); i++) {
+            float target = climate[i]->getTargetTemperature();
+            if (i % 10 == 0) midway += target > 18 && target < 25;
+            else reached &= target == 18;
+        }
+        // Finished sequences give their frames back: a second round of
+        // fades leaves the scheduler holding what it did before.
+        int64_t settled = memory.live();
+        for (Light* l : lights) scheduler.startSequence(l->getDeviceID(), fadeLight(scheduler, l, 0, t0, t0 + 600), t0);
+        for (int64_t now = t0 + 1; now <= t0 + 600; now++) scheduler.runDue(now);
+        int64_t left = memory.live() - settled;
+
+        // A scheduler that only runs now and then catches up in one step.
+        Light* late = lights[1];
+        late->setBrightness(0);
+        scheduler.startSequence(late->getDeviceID(), fadeLight(scheduler, late, 80, t0, t0 + 600), t0);
+        scheduler.runDue(t0 + 1000);
+        bool caughtUp = late->getBrightness() == 80 && !scheduler.hasSequence(late->getDeviceID());
+
+        cout << "sequences: " << lights.size() << " light fades over 20 min, " << climate.size()
+             << " temperature ramps over an hour\n" << fixed << setprecision(1)
+             << "  memory: " << perSequence << " bytes per running sequence (frame and scheduler entry), no threads\n"
+             << "  started in " << startUs / running << " us each; " << steps << " steps run in " << setprecision(3)
+             << runSec << " s of simulated-hour ticks (" << setprecision(2) << runSec * 1e6 / max<uint64_t>(1, steps)
+             << " us/step)\n"
+             << "  overrides: " << overridden << " lights set by hand kept their level, " << midway << " of " << stopped
+             << " stopped ramps left midway\n"
+             << "  finished: " << (reached ? "all others reached their targets" : "some MISSED their targets") << ", "
+             << left << " bytes held after a second round, late scheduler " << (caughtUp ? "caught up" : "did NOT catch up") << "\n";
+        ok = running == lights.size() + climate.size() && perSequence < 512 && reached && midway == stopped &&
+             left == 0 && scheduler.sequenceCount() == 0 && caughtUp;
     }
+    Device::attachIndex(nullptr);
+    return ok ? 0 : 2;
+}
 
-    vector<Device*> loadDevices() {
-        ifstream in(filename);
-        vector<Device*> devices;
-        if (!in.is_open()) {
-            cerr << "Cannot open file to load devices: " << filename << endl;
-            return devices;
+int benchTransaction(int changes) {
+    const char* file = "bench_transaction.txt";
+    SmartHome home;
+    populateSyntheticHome(home, 100, 4, 10);
+    vector<Device*> scene;
+    for (const auto& [name, user] : home.getAllUsers())
+        for (const auto& [roomName, room] : user->getAllRooms())
+            for (Device* d : room->getDevices())
+                if (scene.size() < size_t(changes)) scene.push_back(d);
+    auto allOff = [](const vector<Device*>& devices) {
+        for (Device* d : devices) d->turnOff();
+    };
+    DataStorage storage(file);
+    auto timed = [](auto f) {
+        auto start = chrono::steady_clock::now();
+        f();
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    };
+    allOff(scene);
+    double separateMs = timed([&] {
+        for (Device* d : scene) {
+            d->turnOn();
+            storage.saveSystem(&home);
         }
+    });
+    allOff(scene);
+    double txnMs = timed([&] {
+        DeviceTransaction txn;
+        for (Device* d : scene) txn.stage(d, DeviceTransaction::Op::TurnOn);
+        if (txn.commit()) storage.saveSystem(&home);
+    });
+    remove(file);
+    cout << "transaction: " << scene.size() << " changes in a home of 4000 devices\n" << fixed << setprecision(2)
+         << "  separate changes: " << separateMs / scene.size() << " ms/change\n"
+         << "  one transaction:  " << txnMs / scene.size() << " ms/change\n";
+
+    // One room, budgeted just under everything in it being on.
+    User* user = home.getUser("user0");
+    Room* room = user->getAllRooms().begin()->second;
+    vector<Device*> devices = room->getDevices();
+    allOff(devices);
+    double watts = 0;
+    for (Device* d : devices) watts += d->powerConsumption * 1000;
+    PowerBudget budget(home);
+    budget.setRoom("user0", room->getRoomName(), watts - 1);
+    Device::attachBudget(&budget);
+    budget.apply();
+    auto onCount = [&] { return count_if(devices.begin(), devices.end(), [](Device* d) { return d->getStatus(); }); };
+
+    for (Device* d : devices) d->turnOn();
+    long halfApplied = onCount();
+    allOff(devices);
+    DeviceTransaction over;
+    for (Device* d : devices) over.stage(d, DeviceTransaction::Op::TurnOn);
+    bool overCommitted = over.commit();
+    long afterRefusal = onCount();
+
+    // The scene switches the biggest load off as it switches the rest on.
+    Device* biggest = *max_element(devices.begin(), devices.end(),
+                                   [](Device* a, Device* b) { return a->powerConsumption < b->powerConsumption; });
+    biggest->turnOn();
+    DeviceTransaction swap;
+    for (Device* d : devices) swap.stage(d, d == biggest ? DeviceTransaction::Op::TurnOff : DeviceTransaction::Op::TurnOn);
+    bool swapped = swap.commit();
+
+    DeviceTransaction stale;
+    stale.stage(biggest, DeviceTransaction::Op::TurnOn);
+    biggest->setLocation(biggest->getLocation());  // someone else touches it
+    bool staleCommitted = stale.commit();
+    Device::attachBudget(nullptr);
+
+    cout << "  over the room budget, separately: " << halfApplied << " of " << devices.size() << " switched on\n"
+         << "  over the room budget, as one:     " << (overCommitted ? "applied" : "refused") << ", " << afterRefusal
+         << " switched on (" << over.error() << ")\n"
+         << "  switch-off making room:           " << (swapped ? "applied" : "refused " + swap.error()) << "\n"
+         << "  stale version:                    " << (staleCommitted ? "applied" : "refused") << "\n";
+    return !overCommitted && afterRefusal == 0 && swapped && !staleCommitted ? 0 : 2;
+}
 
-        string type;
-        while (in >> type) {
-            if (type == "DEVICE") {
-                string devType, id, name, loc;
-                int status;
-                in >> devType >> id >> name >> loc >> status;
-
-                Device* dev = nullptr;
-                if (devType == "Light") dev = new Light(id, name, loc);
-                else if (devType == "Thermostat") dev = new Thermostat(id, name, loc);
-                else if (devType == "Camera") dev = new Camera(id, name, loc);
-                else if (devType == "DoorLock") dev = new DoorLock(id, name, loc);
-                else if (devType == "AC") dev = new AirConditioner(id, name, loc);
-
-                if (dev) {
-                    if (status) dev->turnOn();
-                    else dev->turnOff();
+int runBenchmarks(const string& name, int argc, char* argv[]) {
+    if (name == "alerts") return benchAlerts();
+    if (name == "billing") return benchBilling(argc > 0 ? max(1, atoi(argv[0])) : 5000);
+    if (name == "budget") return benchBudget();
+    if (name == "dashboard") return benchDashboard();
+    if (name == "transport")
+        return benchTransport(argc > 0 ? max(1, atoi(argv[0])) : 5000, argc > 1 ? max(1, atoi(argv[1])) : 4);
+    if (name == "daemon") return benchDaemon(argc > 0 ? max(1, atoi(argv[0])) : 10);
+    if (name == "export") return benchExport(argc > 0 ? max(1, atoi(argv[0])) : 20000);
+    if (name == "history") return benchHistory(argc > 0 ? max(1, atoi(argv[0])) : 1000);
+    if (name == "motion") return benchMotion(argc > 0 ? max(4, atoi(argv[0])) : 256);
+    if (name == "shards") return benchShards(argc > 0 ? max(4, atoi(argv[0])) : 4000);
+    if (name == "sequences") return benchSequences(argc > 0 ? max(12, atoi(argv[0])) : 12000);
+    if (name == "parse") return benchParse(argc > 0 ? max(1, atoi(argv[0])) : 200000);
+    if (name == "memory") return benchMemory(argc > 0 ? max(1, atoi(argv[0])) : 10000);
+    if (name == "lazy") return benchLazyLogin(argc > 0 ? max(1, atoi(argv[0])) : 64);
+    if (name == "priority") return benchPriority(argc > 0 ? max(50, atoi(argv[0])) : 50000);
+    if (name == "provision") return benchProvision(argc > 0 ? max(1, atoi(argv[0])) : 100000);
+    if (name == "query") return benchQuery();
+    if (name == "replication") return benchReplication(argc > 0 ? max(1, atoi(argv[0])) : 200000);
+    if (name == "segment") return benchSegment(argc > 0 ? max(1, atoi(argv[0])) : 10000);
+    if (name == "schedules") return benchSchedules(argc > 0 ? max(1, atoi(argv[0])) : 100000);
+    if (name == "transaction") return benchTransaction(argc > 0 ? max(1, atoi(argv[0])) : 8);
+    if (name == "login") return benchLogin(argc > 0 ? max(1, atoi(argv[0])) : (int)max(1u, thread::hardware_concurrency()));
+    cerr << "Unknown benchmark: " << name << "\n"
+         << "Available: alerts, billing [households], budget, daemon [seconds], dashboard, export [devices], history [devices], lazy [resident users], login [threads], memory [devices], motion [cameras], parse [devices], priority [devices], provision [devices], query, replication [mutations],"
+         << " schedules [count], segment [devices], sequences [devices], shards [households], transaction [changes], transport [devices] [connections]\n";
+    return 1;
+}
 
-                    devices.push_back(dev);
+int main(int argc, char* argv[]) {
+    size_t residentCapacity = 0;
+    string tracePath, gatewayPath, replicaPath, segmentPath, motionPath;
+    for (int i = 1; i < argc; i++) {
+        string mode = argv[i];
+        if (mode == "--lazy") {
+            residentCapacity = i + 1 < argc && isdigit(argv[i + 1][0]) ? max(1, atoi(argv[++i])) : 64;
+            continue;
+        }
+        if (mode == "--record" && i + 1 < argc) {
+            tracePath = argv[++i];
+            continue;
+        }
+        if (mode == "--gateway" && i + 1 < argc) {
+            gatewayPath = argv[++i];
+            continue;
+        }
+        if (mode == "--replicate-to" && i + 1 < argc) {
+            replicaPath = argv[++i];
+            continue;
+        }
+        if (mode == "--share" && i + 1 < argc) {
+            segmentPath = argv[++i];
+            continue;
+        }
+        if (mode == "--motion" && i + 1 < argc) {
+            motionPath = argv[++i];
+            continue;
+        }
+        if (i == 1) {
+            if (mode == "--daemon") {
+                try {
+                    HomeDaemon daemon(argc > 2 ? argv[2] : "smarthome.conf");
+                    return daemon.run();
+                } catch (const DeviceException& e) {
+                    cerr << "smarthome: " << e.what() << endl;
+                    return 1;
                 }
             }
+            if (mode == "--bench" && argc > 2) return runBenchmarks(argv[2], argc - 3, argv + 3);
+            if (mode == "--validate" || mode == "--convert") return runDataTool(mode, argc - 2, argv + 2);
+            if (mode == "--replay") return runReplay(argc - 2, argv + 2);
+            if (mode == "--emulator") return runEmulator(argc - 2, argv + 2);
+            if (mode == "--standby") return runStandby(argc - 2, argv + 2);
+            if (mode == "--bill") return runBilling(argc - 2, argv + 2);
+            if (mode == "--attach") return runAttach(argc - 2, argv + 2);
+            if (mode == "--provision") return runProvision(argc - 2, argv + 2);
+            if (mode == "--export") return runExport(argc - 2, argv + 2);
         }
-
-        in.close();
-        return devices;
+        cerr << "Usage: " << argv[0] << " [--lazy [resident users]] [--record <trace>] [--gateway <socket>]"
+             << " [--replicate-to <socket>] [--share <segment>] [--motion <socket>]\n"
+             << "       " << argv[0] << " --daemon [config] | --standby <socket> [config] | --bench <name> [args] | --replay <trace> [--paced] [--expect HEX]"
+             << " | --emulator <socket> [devices] [drop%] | --bill <tariffs> [data] [--usage FILE] [--user NAME] [--csv FILE]"
+             << " | --attach <segment> [--watch [ms]] [--metrics] | --provision <manifest> [data] [--threads N] [--dry-run]"
+             << " | --export <devices|history|usage> <file|-> [data] [--batch ROWS] [--hours H]"
+             << " | --validate <file> | --convert <in> <out> [--to text|binary] [--user NAME]\n";
+        return 1;
     }
-
-    void clearStorage() {
-        ofstream out(filename, ios::trunc);
-        out.close();
+    if (!replicaPath.empty() && residentCapacity > 0) {
+        cerr << "--replicate-to needs the whole home in memory and can't be combined with --lazy\n";
+        return 1;
     }
 
-
-};
-
-int main() {
+    DeviceIndex deviceIndex;
+    Device::attachIndex(&deviceIndex);
     SmartHome smartHome;
     DataStorage storage("data.txt");
     EnergyMonitor energyMonitor;
     Scheduler scheduler;
     Notification notifications;
+    ConsoleRenderer consoleRenderer;
+    EventJournal journal("events.log");
+    TransitionLog history(storage.historyFile());
+    unique_ptr<DeviceTransport> transport;
+    unique_ptr<GatewayDriver> gateway;
+    unique_ptr<HomeSegment> segment;
+    EventBus eventBus;
+    eventBus.subscribe(&consoleRenderer);
+    eventBus.subscribe(&journal);
+    eventBus.subscribe(&energyMonitor);
+    eventBus.subscribe(&notifications);
+    eventBus.subscribe(&history);
+    if (!segmentPath.empty()) {
+        segment = make_unique<HomeSegment>(segmentPath);
+        eventBus.subscribe(segment.get());
+    }
+    if (!gatewayPath.empty()) {
+        transport = make_unique<DeviceTransport>(gatewayPath);
+        gateway = make_unique<GatewayDriver>(*transport);
+        eventBus.subscribe(gateway.get());
+    }
+    Device::attachEventBus(&eventBus);
+    CredentialStore credentials("credentials.db");
+    Authenticator authenticator(credentials);
+    smartHome.attachAuthenticator(&authenticator);
+    HomeController controller(smartHome, storage, scheduler, energyMonitor, notifications,
+                              eventBus, deviceIndex, authenticator);
     
+    unique_ptr<UserStore> userStore;
+    unique_ptr<ResidentUserCache> residentSet;
+    unique_ptr<TraceRecorder> recorder;
+    unique_ptr<ReplicationSender> replica;
+
     // Load existing data at startup
     try {
-        vector<User*> loadedUsers = storage.loadUsers();
-        for (User* user : loadedUsers) {
-            smartHome.addUser(user->getUsername(), user);
+        if (residentCapacity > 0) {
+            // Users are loaded on demand through the index instead.
+            userStore = make_unique<UserStore>("data.txt");
+            residentSet = make_unique<ResidentUserCache>(&smartHome, *userStore, residentCapacity);
+            smartHome.attachLoader(residentSet.get());
+            controller.attachResidentSet(residentSet.get(), userStore.get());
+        } else {
+            vector<User*> loadedUsers = storage.loadUsers();
+            for (User* user : loadedUsers) {
+                smartHome.addUser(user->getUsername(), user);
+            }
         }
+        storage.loadSchedules(scheduler);
+        storage.loadUsage(energyMonitor);
     } catch (const exception& e) {
         cout << "Error loading data: " << e.what() << "\nStarting with empty system.\n";
     }
+    PowerBudget budget(smartHome);
+    if (ifstream("budgets.conf").good()) {
+        try {
+            budget.load("budgets.conf");
+            Device::attachBudget(&budget);
+            budget.apply();
+            controller.attachBudget(&budget);
+        } catch (const exception& e) {
+            cout << "Power budgets not loaded: " << e.what() << "\n";
+        }
+    }
+    controller.attachHistory(&history);
+    try {
+        if (history.compactionDue(time(0))) history.compact(time(0));
+    } catch (const exception& e) {
+        cout << "Device history not compacted: " << e.what() << "\n";
+    }
+    TariffBook tariffs;
+    if (ifstream("tariffs.conf").good()) {
+        try {
+            tariffs.load("tariffs.conf");
+            controller.attachTariffs(&tariffs);
+        } catch (const exception& e) {
+            cout << "Tariffs not loaded: " << e.what() << "\n";
+        }
+    }
+    if (!tracePath.empty()) {
+        recorder = make_unique<TraceRecorder>(tracePath, "data.txt", storage.scheduleFile());
+        controller.attachRecorder(recorder.get());
+    }
+    if (!replicaPath.empty()) {
+        replica = make_unique<ReplicationSender>(replicaPath);
+        controller.attachReplica(replica.get());
+    }
+    if (segment) controller.attachSegment(segment.get());
+    // A recorded trace replays commands in the order they came, so they run in that order too.
+    unique_ptr<CommandQueue> commands;
+    if (!recorder) {
+        commands = make_unique<CommandQueue>(controller.homeLock());
+        controller.attachQueue(commands.get());
+    }
+    // Manual motion (Device Control) feeds it too, so it runs without a socket.
+    MotionIngest motion;
+    controller.attachMotion(&motion);
+    if (commands) motion.attachQueue(commands.get());
+    motion.start();
+    if (!motionPath.empty()) {
+        try {
+            motion.listen(motionPath);
+        } catch (const exception& e) {
+            cout << e.what() << "\n";
+        }
+    }
 
     ConsoleUI ui(&smartHome);
-    unique_ptr<RemoteControl> remote;
-    User* currentUser = nullptr;
+
+    auto prompt = [](const char* text) {
+        string value;
+        cout << text;
+        getline(cin, value);
+        return value;
+    };
+    auto promptNumber = [](const char* text) {
+        float value;
+        cout << text;
+        cin >> value;
+        cin.ignore();
+        return to_string(value);
+    };
 
     while (true) {
         try {
+            eventBus.flush();
             ui.displayMenu();
             int choice;
             cin >> choice;
             cin.ignore();
+            controller.checkSession();
 
+            Command cmd{CommandType::Exit, {}};
             switch (choice) {
                 case 1: { // Registration
-                    string username, password;
-                    cout << "Enter username: ";
-                    getline(cin, username);
+                    string username = prompt("Enter username: ");
                     
                     // Check if username already exists
-                    if (smartHome.getUser(username) != nullptr) {
+                    if (controller.userExists(username)) {
                         cout << "Username already exists! Please choose a different username.\n";
                         break;
                     }
-
-                    cout << "Enter password (min 6 chars with at least 1 digit): ";
-                    getline(cin, password);
-
-                    // Password validation
-                    if (password.length() < 6) {
-                        cout << "Password must be at least 6 characters long.\n";
-                        break;
-                    }
-                    if (none_of(password.begin(), password.end(), ::isdigit)) {
-                        cout << "Password must contain at least 1 digit.\n";
-                        break;
-                    }
-
-                    User* newUser = new User(username, password);
-                    smartHome.addUser(username, newUser);
-                    storage.saveUser(newUser);  // Save the new user immediately
-                    cout << "Registration successful!\n";
+                    cmd = {CommandType::Register, {username, prompt("Enter password (min 6 chars with at least 1 digit): ")}};
                     break;
                 }
                 case 2: { // Login
-                    string username, password;
-                    cout << "Enter username: ";
-                    getline(cin, username);
-                    cout << "Enter password: ";
-                    getline(cin, password);
-
-                    if (smartHome.loginUser(username, password)) {
-                        currentUser = smartHome.getUser(username);
-                        remote = make_unique<RemoteControl>(currentUser);
-                        cout << "Login successful! Welcome " << username << "!\n";
-                        
-                        // Load user-specific data
-                        try {
-                            storage.loadSystem(&smartHome);
-                        } catch (const exception& e) {
-                            cout << "Warning: Couldn't load user data: " << e.what() << "\n";
-                        }
-                    } else {
-                        cout << "Invalid credentials!\n";
-                    }
+                    string username = prompt("Enter username: ");
+                    cmd = {CommandType::Login, {username, prompt("Enter password: ")}};
                     break;
                 }
-                case 3: { // Add Room
-                    if (!currentUser) {
-                        cout << "Please login first!\n";
-                        break;
-                    }
-                    string roomName;
-                    cout << "Enter room name: ";
-                    getline(cin, roomName);
-                    
-                    if (currentUser->hasRoom(roomName)) {
-                        cout << "Room already exists!\n";
-                    } else {
-                        currentUser->addRoom(new Room(roomName));
-                        storage.saveSystem(&smartHome);  // Save after adding room
-                        cout << "Room added successfully!\n";
-                    }
+                case 3: // Add Room
+                    if (!controller.requireLogin()) break;
+                    cmd = {CommandType::AddRoom, {prompt("Enter room name: ")}};
                     break;
-                }
                 case 4: { // Add Device
-                    if (!currentUser) {
-                        cout << "Please login first!\n";
-                        break;
-                    }
-
-                    string roomName, deviceType, id, name;
-                    cout << "Enter room name: ";
-                    getline(cin, roomName);
-                    
-                    if (!currentUser->hasRoom(roomName)) {
+                    if (!controller.requireLogin()) break;
+                    string roomName = prompt("Enter room name: ");
+                    if (!controller.user()->hasRoom(roomName)) {
                         cout << "Room not found!\n";
                         break;
                     }
-
-                    cout << "Enter device ID: ";
-                    getline(cin, id);
-                    cout << "Enter device name: ";
-                    getline(cin, name);
-                    cout << "Enter device type (Light/Thermostat/Camera/DoorLock/AC): ";
-                    getline(cin, deviceType);
-
-                    Device* device = nullptr;
-                    if (deviceType == "Light") {
-                        device = new Light(id, name, roomName);
-                        device->powerConsumption = 0.1f;
-                        cout << "Enter initial brightness (0-100): ";
-                        float brightness;
-                        cin >> brightness;
-                        cin.ignore();
-                        dynamic_cast<Light*>(device)->setBrightness(brightness);
-                    } 
-                    else if (deviceType == "Thermostat") {
-                        device = new Thermostat(id, name, roomName);
-                        device->powerConsumption = 0.5f;
-                        cout << "Enter initial temperature: ";
-                        float temp;
-                        cin >> temp;
-                        cin.ignore();
-                        dynamic_cast<Thermostat*>(device)->setTemperature(temp);
-                    } 
-					else if (deviceType == "Camera") {
-                        device = new Camera(id, name, roomName);
-                        device->powerConsumption = 0.05f;
-                    } else if (deviceType == "DoorLock") {
-                        device = new DoorLock(id, name, roomName);
-                        device->powerConsumption = 0.02f;
-                    } else if (deviceType == "AC") {
-                        device = new AirConditioner(id, name, roomName);
-                        device->powerConsumption = 1.5f;
-                        cout << "Enter initial temperature: ";
-                        float temp;
-                        cin >> temp;
-                        cin.ignore();
-                        dynamic_cast<AirConditioner*>(device)->setTemperature(temp);
-                    } else {
-                        cout << "Invalid device type!\n";
-                        break;
-                    }
-
-                    currentUser->addDeviceToRoom(roomName, device);
-                    storage.saveSystem(&smartHome);
-                    cout << "Device added successfully!\n";
+                    string id = prompt("Enter device ID: ");
+                    string name = prompt("Enter device name: ");
+                    string deviceType = prompt("Enter device type (Light/Thermostat/Camera/DoorLock/AC): ");
+                    cmd = {CommandType::AddDevice, {roomName, id, name, deviceType}};
+                    if (deviceType == "Light") cmd.args.push_back(promptNumber("Enter initial brightness (0-100): "));
+                    else if (deviceType == "Thermostat" || deviceType == "AC") cmd.args.push_back(promptNumber("Enter initial temperature: "));
                     break;
                 }
-                case 5: { // View Devices
-                    if (!currentUser) {
-                        cout << "Please login first!\n";
-                        break;
-                    }
-                    string roomName;
-                    cout << "Enter room name: ";
-                    getline(cin, roomName);
-                    currentUser->viewDevicesInRoom(roomName);
+                case 5: // View Devices
+                    if (!controller.requireLogin()) break;
+                    cmd = {CommandType::ViewRoom, {prompt("Enter room name: ")}};
                     break;
-                }
-                case 6: { // Dashboard
-                    if (currentUser) {
-                        currentUser->viewAllRooms();
-                    } else {
-                        cout << "Please login first!\n";
-                    }
+                case 6: // Dashboard
+                    cmd = {CommandType::Dashboard, {}};
                     break;
-                }
                 case 7: { // Remote Control
-                    if (!currentUser || !remote) {
-                        cout << "Please login first!\n";
-                        break;
-                    }
-
-                    string roomName, deviceName;
-                    cout << "Enter room name: ";
-                    getline(cin, roomName);
-                    cout << "Enter device name: ";
-                    getline(cin, deviceName);
-
-                    Device* device = currentUser->getRoom(roomName)->getDevicesByName(deviceName);
+                    if (!controller.requireLogin()) break;
+                    string roomName = prompt("Enter room name: ");
+                    string deviceName = prompt("Enter device name: ");
+                    Device* device = controller.findDevice(roomName, deviceName);
                     if (!device) {
                         cout << "Device not found!\n";
                         break;
                     }
 
                     cout << "Choose operation:\n";
+                    bool takesValue = false;
                     if (dynamic_cast<Light*>(device)) {
-                        cout << "1. Turn On\n2. Turn Off\n3. Set Brightness\n";
+                        cout << "1. Turn On\n2. Turn Off\n3. Set Brightness\n4. Fade Brightness\n";
+                        takesValue = true;
                     } else if (dynamic_cast<Thermostat*>(device) || dynamic_cast<AirConditioner*>(device)) {
-                        cout << "1. Turn On\n2. Turn Off\n3. Set Temperature\n";
+                        cout << "1. Turn On\n2. Turn Off\n3. Set Temperature\n4. Ramp Temperature\n";
+                        takesValue = true;
                     } else if (dynamic_cast<Camera*>(device)) {
                         cout << "1. Start Recording\n2. Stop Recording\n3. Detect Motion\n";
                     } else if (dynamic_cast<DoorLock*>(device)) {
@@ -1191,113 +12173,82 @@ int main() {
                     int op;
                     cin >> op;
                     cin.ignore();
-
-                    switch (op) {
-                        case 1:
-                            if (dynamic_cast<Camera*>(device)) {
-                                dynamic_cast<Camera*>(device)->startRecording();
-                                cout << "Recording started for " << deviceName << endl;
-                            } else {
-                                device->turnOn();
-                                cout << deviceName << " turned on\n";
-                            }
-                            break;
-                        case 2:
-                            if (dynamic_cast<Camera*>(device)) {
-                                dynamic_cast<Camera*>(device)->stopRecording();
-                                cout << "Recording stopped for " << deviceName << endl;
-                            } else {
-                                device->turnOff();
-                                cout << deviceName << " turned off\n";
-                            }
-                            break;
-                        case 3:
-                            if (dynamic_cast<Light*>(device)) {
-                                cout << "Enter brightness (0-100): ";
-                                float brightness;
-                                cin >> brightness;
-                                cin.ignore();
-                                dynamic_cast<Light*>(device)->setBrightness(brightness);
-                                cout << "Brightness set to " << brightness << "%\n";
-                            } else if (dynamic_cast<Thermostat*>(device) || dynamic_cast<AirConditioner*>(device)) {
-                                cout << "Enter temperature: ";
-                                float temp;
-                                cin >> temp;
-                                cin.ignore();
-                                dynamic_cast<TemperatureControlledDevices*>(device)->setTemperature(temp);
-                                cout << "Temperature set to " << temp << "°\n";
-                            } else if (dynamic_cast<Camera*>(device)) {
-                                dynamic_cast<Camera*>(device)->detectMotion();
-                                notifications.sendAlert("Motion detected by " + deviceName);
-                                cout << "Motion detection activated\n";
-                            } else if (dynamic_cast<DoorLock*>(device)) {
-                                cout << "Door is " << (dynamic_cast<DoorLock*>(device)->checkLockStatus() ? "locked" : "unlocked") << endl;
-                            } else {
-                                device->performAction();
-                            }
-                            break;
-                        default:
-                            cout << "Invalid operation!\n";
-                    }
-
-                    // Record energy usage only if device is on
-                    if (device->getStatus()) {
-    float usage = device->getEnergyUsage(0.1f); // 6 minutes of usage
-    energyMonitor.recordUsage(device->getDeviceID(), usage);
-    cout << "Energy used: " << fixed << setprecision(2) << usage 
-         << " kWh (Power: " << device->powerConsumption << " kW)\n";} // Add power display
-                    storage.saveSystem(&smartHome);
+                    cmd = {CommandType::Control, {roomName, deviceName, to_string(op)}};
+                    if ((op == 3 || op == 4) && takesValue)
+                        cmd.args.push_back(promptNumber(dynamic_cast<Light*>(device) ? "Enter brightness (0-100): " : "Enter temperature: "));
+                    if (op == 4 && takesValue) cmd.args.push_back(promptNumber("Over how many minutes: "));
                     break;
-                
-            }
+                }
                 case 8: { // Scheduling
-                    if (!currentUser) {
-                        cout << "Please login first!\n";
-                        break;
-                    }
-
-                    string roomName, deviceName;
+                    if (!controller.requireLogin()) break;
+                    string roomName = prompt("Enter room name: ");
+                    string deviceName = prompt("Enter device name: ");
                     int hour, minute;
-                    cout << "Enter room name: ";
-                    getline(cin, roomName);
-                    cout << "Enter device name: ";
-                    getline(cin, deviceName);
                     cout << "Enter time (HH MM): ";
                     cin >> hour >> minute;
                     cin.ignore();
-
-                    Device* device = currentUser->getRoom(roomName)->getDevicesByName(deviceName);
-                    if (device) {
-                        scheduler.addSchedule(device, Time(hour, minute));
-                        cout << "Device scheduled successfully at " 
-                             << setw(2) << setfill('0') << hour << ":" 
-                             << setw(2) << setfill('0') << minute << "!\n";
-                        notifications.sendAlert("Device " + deviceName + " scheduled");
-                        storage.saveSystem(&smartHome);
-                    } else {
-                        cout << "Device not found!\n";
+                    cmd = {CommandType::Schedule, {roomName, deviceName, to_string(hour), to_string(minute)}};
+                    break;
+                }
+                case 9: // Energy Report
+                    cmd = {CommandType::EnergyReport, {}};
+                    break;
+                case 10: // Notifications
+                    cmd = {CommandType::ViewAlerts, {}};
+                    break;
+                case 11: { // Find Devices
+                    if (!controller.requireLogin()) break;
+                    string typeToken = prompt("Device type (Light/Thermostat/Camera/DoorLock/AC or *): ");
+                    string statusFilter = prompt("Status (on/off/*): ");
+                    cmd = {CommandType::FindDevices, {typeToken, statusFilter}};
+                    if (typeToken != "*") {
+                        unique_ptr<Device> probe(createDevice(typeToken, "", "", ""));
+                        if (dynamic_cast<DoorLock*>(probe.get())) cmd.args.push_back(prompt("Lock (locked/unlocked/*): "));
                     }
                     break;
                 }
-                case 9: { // Energy Report
-                    energyMonitor.displayUsageReport();
+                case 12: // Live Dashboard
+                    controller.watch(1000);
+                    break;
+                case 13: { // Device History
+                    if (!controller.requireLogin()) break;
+                    string roomName = prompt("Enter room name: ");
+                    string deviceName = prompt("Enter device name: ");
+                    cmd = {CommandType::History, {roomName, deviceName, prompt("Hours to look back (default 24): ")}};
                     break;
                 }
-                case 10: { // Notifications
-                    notifications.viewAlerts();
+                case 14: // Memory Report
+                    cmd = {CommandType::Memory, {}};
+                    break;
+                case 15: { // Change Several Devices
+                    if (!controller.requireLogin()) break;
+                    cmd = {CommandType::Transaction, {}};
+                    cout << "Operations: on, off, level <value>, lock, unlock, record, stop. Empty room name to finish.\n";
+                    while (true) {
+                        string roomName = prompt("Enter room name: ");
+                        if (roomName.empty()) break;
+                        string deviceName = prompt("Enter device name: ");
+                        string op = prompt("Operation: ");
+                        cmd.args.insert(cmd.args.end(), {roomName, deviceName, op, op == "level" ? prompt("Value: ") : ""});
+                    }
                     break;
                 }
-                case 0: { // Exit
-                    storage.saveSystem(&smartHome);
-                    cout << "Goodbye!\n";
+                case 16: // Camera Activity
+                    cmd = {CommandType::Motion, {}};
+                    break;
+                case 17: // Command Latency
+                    cmd = {CommandType::Latency, {}};
+                    break;
+                case 0: // Exit
+                    controller.execute(cmd);
                     return 0;
-                }
                 default:
                     cout << "Invalid choice!\n";
             }
+            if (cmd.type != CommandType::Exit) controller.execute(cmd);
 
             // Check and run scheduled tasks
-            scheduler.checkAndRunSchedules();
+            controller.runSchedules();
             
         } catch (const exception& e) {
             cerr << "Error: " << e.what() << endl;
@@ -1307,5 +12258,3 @@ int main() {
     }
     return 0;
 }
-
-